@@ -145,12 +145,65 @@ ssize_t xdma_xfer_completion(void *cb_hndl, void *dev_hndl, int channel, bool wr
 
 #if 1 // 20230925 POOKY
 ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, bool write, u64 ep_addr,
-			 struct sg_table *sgt, bool dma_mapped, int timeout_ms, struct xdma_multi_read_write_ioctl *io);
+			 struct sg_table *sgt, bool dma_mapped, int timeout_ms, u32 *lens, unsigned int lens_nr);
 #else
 ssize_t xdma_multi_buffer_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
-			 struct sg_table *sgt, bool dma_mapped, int timeout_ms, struct xdma_multi_read_write_ioctl *io);
+			 struct sg_table *sgt, bool dma_mapped, int timeout_ms, u32 *lens, unsigned int lens_nr);
 #endif
 
+/*
+ * xdma_desc_set_create - build once the descriptor chain of a DMA mapped
+ *    sg table, in its own memory, for repeated transfers of the same buffers
+ *    returns NULL if the engine can't run it as one transfer
+ * xdma_desc_set_xfer_submit - blocking transfer of a descriptor set, lens[]
+ *    as for xdma_multi_buffer_xfer_submit()
+ * xdma_desc_set_destroy - free a descriptor set, not queued anymore
+ */
+struct xdma_desc_set *xdma_desc_set_create(struct xdma_engine *engine,
+					   struct sg_table *sgt);
+ssize_t xdma_desc_set_xfer_submit(struct xdma_engine *engine,
+				  struct xdma_desc_set *set, int timeout_ms,
+				  u32 *lens, unsigned int lens_nr);
+void xdma_desc_set_destroy(struct xdma_engine *engine,
+			   struct xdma_desc_set *set);
+
+/*
+ * xdma_cyclic_ring_alloc - allocate a cyclic ring of size entries of
+ *    buf_size bytes on an AXI-ST C2H engine, the engine is not touched yet,
+ *    see XDMA_CYCLIC_RING_BUF_MAX and XDMA_CYCLIC_RING_MAX_BYTES
+ * xdma_cyclic_ring_start/stop - run the engine over the ring, other
+ *    transfers on the engine fail with -EBUSY in between
+ * xdma_cyclic_ring_sync - account the entries the engine wrote meanwhile,
+ *    one register read, returns the entries available to consume
+ * xdma_cyclic_ring_peek - frame of the head entry and its length, NULL if
+ *    none is available as of the last sync
+ * xdma_cyclic_ring_advance - hand the head entry back to the engine,
+ *    false if the engine overwrote it meanwhile and the copy must be dropped
+ * xdma_cyclic_ring_wait - sleep until entries are available, timeout_ms 0
+ *    waits forever, returns the entries, 0 on timeout or < 0 on a signal
+ * xdma_cyclic_ring_free - free a stopped ring
+ */
+int xdma_cyclic_ring_alloc(struct xdma_engine *engine,
+			   struct xdma_cyclic_ring *ring, u32 size,
+			   u32 buf_size);
+void xdma_cyclic_ring_free(struct xdma_cyclic_ring *ring);
+int xdma_cyclic_ring_start(struct xdma_cyclic_ring *ring);
+void xdma_cyclic_ring_stop(struct xdma_cyclic_ring *ring);
+u32 xdma_cyclic_ring_sync(struct xdma_cyclic_ring *ring);
+void *xdma_cyclic_ring_peek(struct xdma_cyclic_ring *ring, u32 *len);
+bool xdma_cyclic_ring_advance(struct xdma_cyclic_ring *ring);
+int xdma_cyclic_ring_wait(struct xdma_cyclic_ring *ring,
+			  unsigned int timeout_ms);
+
+/*
+ * xdma_xfer_cancel_nowait - cancel the xdma_xfer_submit_nowait() requests
+ *    still queued on an engine whose completion handler is io_done
+ *    io_done is called with -ECANCELED for each of them
+ *    The caller must hold engine->desc_lock to keep blocking transfers out
+ */
+void xdma_xfer_cancel_nowait(struct xdma_engine *engine,
+			     void (*io_done)(unsigned long cb_hndl, int err));
+
 
 /////////////////////missing API////////////////////
 
@@ -412,6 +412,202 @@ int xdma_api_write_to_multi_buffers_with_fd(char *devname, int fd,
     return 0;
 }
 
+int xdma_api_register_buffers(int fd, char *buffer, uint64_t size, int *handle) {
+
+    struct xdma_buffer_registration_ioctl reg;
+
+    reg.buffer = (unsigned long)buffer;
+    reg.len = (unsigned long)size;
+    reg.handle = -1;
+
+    if(ioctl(fd, IOCTL_XDMA_REGISTER_BUFFERS, &reg) < 0) {
+        debug_printf("FAILURE: Could not register buffers %p(%ld), %d.\n", buffer, size, errno);
+        return -1;
+    }
+
+    *handle = reg.handle;
+
+    return 0;
+}
+
+int xdma_api_unregister_buffers(int fd, int handle) {
+
+    if(ioctl(fd, IOCTL_XDMA_UNREGISTER_BUFFERS, handle) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Burst transfer of buffers inside a region registered at base,
+ * the driver only gets their offsets.
+ */
+static int xdma_api_registered_multi_buffers_with_fd(int fd, int handle, char *base,
+                      struct xdma_multi_read_write_ioctl *bd, int *bytes, unsigned long cmd) {
+
+    struct xdma_multi_registered_ioctl io;
+    int bytes_done = 0;
+    int id;
+
+    io.handle = handle;
+    io.bd_num = bd->bd_num;
+    for(id = 0; id < bd->bd_num; id++) {
+        io.bd[id].offset = (unsigned long)(bd->bd[id].buffer - base);
+        io.bd[id].len = bd->bd[id].len;
+    }
+
+    bytes_done = (int)ioctl(fd, cmd, &io);
+
+    if (bytes_done < 0) {
+        *bytes = 0;
+        return -1;
+    }
+
+    for(id = 0; id < bd->bd_num; id++) {
+        bd->bd[id].len = io.bd[id].len;
+    }
+    bd->error = io.error;
+    bd->done = io.done;
+    *bytes = bytes_done;
+
+    return 0;
+}
+
+int xdma_api_read_to_registered_buffers_with_fd(int fd, int handle, char *base,
+                      struct xdma_multi_read_write_ioctl *bd, int *bytes_rcv) {
+
+    return xdma_api_registered_multi_buffers_with_fd(fd, handle, base, bd, bytes_rcv,
+                                                     IOCTL_XDMA_MULTI_READ_REGISTERED);
+}
+
+int xdma_api_write_from_registered_buffers_with_fd(int fd, int handle, char *base,
+                      struct xdma_multi_read_write_ioctl *bd, int *bytes_tr) {
+
+    return xdma_api_registered_multi_buffers_with_fd(fd, handle, base, bd, bytes_tr,
+                                                     IOCTL_XDMA_MULTI_WRITE_REGISTERED);
+}
+
+int xdma_api_get_multi_bd_max(int fd, int *bd_max) {
+
+    if(ioctl(fd, IOCTL_XDMA_MULTI_BD_MAX_GET, bd_max) < 0) {
+        *bd_max = MAX_BD_NUMBER;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Burst transfer of bd_num buffers with IOCTL_XDMA_MULTI_READ_V2/WRITE_V2,
+ * lens gets the completed length of each buffer.
+ */
+static int xdma_api_multi_buffers_v2(int fd, int handle,
+                      struct xdma_buffer_descriptor *bd, uint32_t bd_num,
+                      uint32_t *lens, int *bytes, unsigned long cmd) {
+
+    struct xdma_multi_read_write_ioctl_v2 io;
+    int bytes_done = 0;
+
+    io.version = XDMA_MULTI_IOCTL_VERSION;
+    io.bd_num = bd_num;
+    io.bd = (uint64_t)(uintptr_t)bd;
+    io.lens = (uint64_t)(uintptr_t)lens;
+    io.handle = handle;
+    io.error = 0;
+    io.done = 0;
+
+    bytes_done = (int)ioctl(fd, cmd, &io);
+
+    if (bytes_done < 0) {
+        *bytes = 0;
+        return -1;
+    }
+
+    *bytes = bytes_done;
+
+    return 0;
+}
+
+int xdma_api_read_to_multi_buffers_v2(int fd, int handle,
+                      struct xdma_buffer_descriptor *bd, uint32_t bd_num,
+                      uint32_t *lens, int *bytes_rcv) {
+
+    return xdma_api_multi_buffers_v2(fd, handle, bd, bd_num, lens, bytes_rcv,
+                                     IOCTL_XDMA_MULTI_READ_V2);
+}
+
+int xdma_api_write_from_multi_buffers_v2(int fd, int handle,
+                      struct xdma_buffer_descriptor *bd, uint32_t bd_num,
+                      uint32_t *lens, int *bytes_tr) {
+
+    return xdma_api_multi_buffers_v2(fd, handle, bd, bd_num, lens, bytes_tr,
+                                     IOCTL_XDMA_MULTI_WRITE_V2);
+}
+
+int xdma_api_ring_setup(int fd, uint32_t entries, int handle, int eventfd,
+                        struct xdma_ring_map *ring) {
+
+    struct xdma_ring_setup_ioctl setup;
+    void *mem;
+
+    memset(ring, 0, sizeof(struct xdma_ring_map));
+
+    setup.entries = entries;
+    setup.handle = handle;
+    setup.eventfd = eventfd;
+
+    if(ioctl(fd, IOCTL_XDMA_RING_SETUP, &setup) < 0) {
+        debug_printf("FAILURE: Could not set up ring(%u), %d.\n", entries, errno);
+        return -1;
+    }
+
+    mem = mmap(NULL, setup.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED) {
+        debug_printf("FAILURE: Could not map ring(%lu), %d.\n", setup.mmap_size, errno);
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->mem = mem;
+    ring->size = setup.mmap_size;
+    ring->hdr = (struct xdma_ring_header *)mem;
+    ring->sqes = (struct xdma_ring_sqe *)((char *)mem + XDMA_RING_SQES_OFFSET);
+    ring->cqes = (struct xdma_ring_cqe *)((char *)mem + XDMA_RING_CQES_OFFSET(entries));
+    ring->sq_mask = entries - 1;
+    ring->cq_mask = setup.cq_entries - 1;
+
+    return 0;
+}
+
+/* The driver frees the ring when fd is closed */
+void xdma_api_ring_release(struct xdma_ring_map *ring) {
+
+    if(ring->mem != NULL) {
+        munmap(ring->mem, ring->size);
+        ring->mem = NULL;
+    }
+}
+
+int xdma_api_ring_enter(struct xdma_ring_map *ring, uint32_t min_complete,
+                        int timeout_ms, uint32_t *completed) {
+
+    struct xdma_ring_enter_ioctl enter;
+
+    enter.min_complete = min_complete;
+    enter.timeout_ms = timeout_ms;
+
+    if(ioctl(ring->fd, IOCTL_XDMA_RING_ENTER, &enter) < 0) {
+        return -1;
+    }
+
+    if(completed != NULL) {
+        *completed = enter.completed;
+    }
+
+    return 0;
+}
+
 /* dma to device */
 int xdma_api_write_from_buffer(char *devname, char *buffer, 
                                uint64_t size, uint64_t *bytes_tr) {
@@ -41,4 +41,71 @@ int xdma_api_read_to_multi_buffers_with_fd(char *devname, int fd,
                       struct xdma_multi_read_write_ioctl *bd, int *bytes_rcv);
 int xdma_api_write_to_multi_buffers_with_fd(char *devname, int fd,  
                       struct xdma_multi_read_write_ioctl *bd, int *bytes_rcv);
+
+int xdma_api_register_buffers(int fd, char *buffer, uint64_t size, int *handle);
+int xdma_api_unregister_buffers(int fd, int handle);
+int xdma_api_read_to_registered_buffers_with_fd(int fd, int handle, char *base,
+                      struct xdma_multi_read_write_ioctl *bd, int *bytes_rcv);
+int xdma_api_write_from_registered_buffers_with_fd(int fd, int handle, char *base,
+                      struct xdma_multi_read_write_ioctl *bd, int *bytes_tr);
+
+/* Batches larger than MAX_BD_NUMBER, see IOCTL_XDMA_MULTI_READ_V2 */
+int xdma_api_get_multi_bd_max(int fd, int *bd_max);
+int xdma_api_read_to_multi_buffers_v2(int fd, int handle,
+                      struct xdma_buffer_descriptor *bd, uint32_t bd_num,
+                      uint32_t *lens, int *bytes_rcv);
+int xdma_api_write_from_multi_buffers_v2(int fd, int handle,
+                      struct xdma_buffer_descriptor *bd, uint32_t bd_num,
+                      uint32_t *lens, int *bytes_tr);
+
+/* Asynchronous rings, see IOCTL_XDMA_RING_SETUP */
+struct xdma_ring_map {
+    int fd;
+    void *mem;
+    size_t size;
+    struct xdma_ring_header *hdr;
+    struct xdma_ring_sqe *sqes;
+    struct xdma_ring_cqe *cqes;
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+    uint32_t sq_tail;       /* local copies, published by the helpers below */
+    uint32_t cq_head;
+};
+
+int xdma_api_ring_setup(int fd, uint32_t entries, int handle, int eventfd,
+                        struct xdma_ring_map *ring);
+void xdma_api_ring_release(struct xdma_ring_map *ring);
+int xdma_api_ring_enter(struct xdma_ring_map *ring, uint32_t min_complete,
+                        int timeout_ms, uint32_t *completed);
+
+static inline uint32_t xdma_ring_sq_space(struct xdma_ring_map *ring) {
+    uint32_t head = __atomic_load_n(&ring->hdr->sq_head, __ATOMIC_ACQUIRE);
+    return ring->hdr->sq_entries - (ring->sq_tail - head);
+}
+
+/* Next free SQ entry, visible to the driver after xdma_ring_sq_commit() */
+static inline struct xdma_ring_sqe *xdma_ring_next_sqe(struct xdma_ring_map *ring) {
+    if (xdma_ring_sq_space(ring) == 0) {
+        return NULL;
+    }
+    return &ring->sqes[ring->sq_tail++ & ring->sq_mask];
+}
+
+static inline void xdma_ring_sq_commit(struct xdma_ring_map *ring) {
+    __atomic_store_n(&ring->hdr->sq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+}
+
+/* Oldest completion not seen yet, NULL if there is none */
+static inline struct xdma_ring_cqe *xdma_ring_peek_cqe(struct xdma_ring_map *ring) {
+    uint32_t tail = __atomic_load_n(&ring->hdr->cq_tail, __ATOMIC_ACQUIRE);
+    if (ring->cq_head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[ring->cq_head & ring->cq_mask];
+}
+
+static inline void xdma_ring_cqe_seen(struct xdma_ring_map *ring) {
+    ring->cq_head++;
+    __atomic_store_n(&ring->hdr->cq_head, ring->cq_head, __ATOMIC_RELEASE);
+}
 #endif // __API_XDMA_H__
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "../xdma/tsn_shaper.h"
+
 #define TSN_QUEUE_COUNT 8
 #define MAX_TAS_SCHEDULES 20
 
@@ -49,6 +51,10 @@ struct api_tas_schedules {
   /* R  */ uint32_t supported_list_max;  // XXX: Should return MAX_TAS_SCHEDULES
 
   // Additional precomputed data goes here
+  uint64_t cycle_ns;  // oper cycle
+  struct tsn_recip cycle;  // For the cycle modulo
+  uint64_t slot_start_ns[MAX_TAS_SCHEDULES];  // oper slot offsets in the cycle
+  uint64_t next_open_ns[MAX_TAS_SCHEDULES][TSN_QUEUE_COUNT];  // slot start to the next slot opening the gate, UINT64_MAX if none
 };
 
 struct api_cbs_entry {
@@ -58,10 +64,8 @@ struct api_cbs_entry {
   int16_t hicredit;
   int16_t locredit;
 
-  // Note that fraction part should be enough if >= 32bit. But 48(16+32) is weird. So we use 64bit integer.
   // Additional data
-  timestamp_t last_update_time;
-  int64_t current_credit; // 16 high bits are integer, 48 low bits are fraction
+  struct tsn_cbs cbs;  // Fixed point credit, see tsn_shaper.h
 };
 
 struct api_cbs_configs {
@@ -15,10 +15,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 
 #include "xdma_common.h"
+#include "buffer_handler.h"
 #include "libxdma/api_xdma.h"
 
 /* Stack operation for Rx & Tx buffer management */
@@ -28,6 +33,20 @@ static reserved_buffer_stack_t reserved_buffer_stack;
 BUF_POINTER buffer_list[NUMBER_OF_BUFFER+NUMBER_OF_RESERVED_BUFFER];
 
 char *g_buffer = NULL;
+int buffer_length = DEF_BUFFER_LENGTH;
+
+/*
+ * The buffers are carved out of one arena, optionally backed by hugepages
+ * so that the driver maps it with a few DMA runs instead of one per 4 KiB
+ * page, and placed on the NUMA node of the XDMA device.
+ */
+#define BUFFER_ARENA_MPOL_PREFERRED (1)     // MPOL_PREFERRED of linux/mempolicy.h
+#define BUFFER_ARENA_MPOL_MF_MOVE   (1 << 1)
+
+static unsigned long buffer_arena_hugepage;     // 0: regular pages
+static int buffer_arena_node = -1;              // -1: no NUMA placement
+static size_t buffer_arena_size;
+static int buffer_arena_mapped;                 // mmap()ed, else posix_memalign()ed
 
 static buffer_stack_t* g_stackP = NULL;
 static reserved_buffer_stack_t* reserved_stack = NULL;
@@ -44,155 +63,235 @@ void relese_buffers(int count) {
 
 #else
     if(g_buffer != NULL) {
-        free(g_buffer);
+        if(buffer_arena_mapped) {
+            munmap(g_buffer, buffer_arena_size);
+        } else {
+            free(g_buffer);
+        }
+        g_buffer = NULL;
     }
 #endif
 
 }
 
+/*
+ * Per thread buffer caches (magazines): alloc and free work on a small
+ * stack owned by the calling thread, which is refilled from and flushed to
+ * the shared pool BUFFER_CACHE_BULK buffers at a time.
+ * The first MAX_BUFFER_CACHES threads get a cache, the others use the
+ * shared pool directly. Reserved buffers are never cached.
+ */
+#define MAX_BUFFER_CACHES (8)
+#define BUFFER_CACHE_SIZE (64)
+#define BUFFER_CACHE_BULK (BUFFER_CACHE_SIZE / 2)
+
+typedef struct buffer_cache {
+    void *elements[BUFFER_CACHE_SIZE];
+    int count;
+    unsigned long long hits;        // served without the shared pool
+    unsigned long long misses;      // refilled from or flushed to the shared pool
+} __ring_cache_aligned buffer_cache_t;
+
+static buffer_cache_t buffer_caches[MAX_BUFFER_CACHES];
+static int buffer_cache_cnt;
+/* Bumped on every initialize_buffer_allocation(), stale caches are claimed again */
+static int buffer_cache_generation;
+static __thread buffer_cache_t *tls_buffer_cache;
+static __thread int tls_buffer_cache_generation;
+
+static buffer_cache_t *buffer_cache_get() {
+
+    int id;
+
+    if (tls_buffer_cache_generation == buffer_cache_generation) {
+        return tls_buffer_cache;
+    }
+
+    id = __atomic_fetch_add(&buffer_cache_cnt, 1, __ATOMIC_RELAXED);
+    tls_buffer_cache = (id < MAX_BUFFER_CACHES) ? &buffer_caches[id] : NULL;
+    tls_buffer_cache_generation = buffer_cache_generation;
+
+    return tls_buffer_cache;
+}
+
+static void initialize_buffer_caches() {
+
+    memset(buffer_caches, 0, sizeof(buffer_caches));
+    buffer_cache_cnt = 0;
+    buffer_cache_generation++;
+}
+
 int isReservedStackEmpty() {
-    return (reserved_stack->top == -1);
+    return (mpmc_ring_count(&reserved_stack->ring) == 0);
 }
 
 int isReservedStackFull() {
-    return (reserved_stack->top == NUMBER_OF_RESERVED_BUFFER - 1);
+    return (mpmc_ring_count(&reserved_stack->ring) == NUMBER_OF_RESERVED_BUFFER);
 }
 
 BUF_POINTER get_reserved_tx_buffer() {
 
-    pthread_mutex_lock(&reserved_stack->mutex);
+    void *element;
 
-    if (isReservedStackEmpty()) {
+    if (mpmc_ring_dequeue_bulk(&reserved_stack->ring, &element, 1) == 0) {
 //        debug_printf("Stack is empty. Cannot reserved_buffer_pool_alloc.\n");
-        pthread_mutex_unlock(&reserved_stack->mutex);
         return EMPTY_ELEMENT;
     }
 
-    BUF_POINTER poppedElement = reserved_stack->elements[reserved_stack->top];
-    reserved_stack->top--;
-
-    pthread_mutex_unlock(&reserved_stack->mutex);
-
-    return poppedElement;
+    return (BUF_POINTER)element;
 }
 
 int isStackEmpty() {
-    return (g_stackP->top == -1);
+    return (mpmc_ring_count(&g_stackP->ring) == 0);
 }
 
 int isStackFull() {
-    return (g_stackP->top == NUMBER_OF_POOL_BUFFER - 1);
+    return (mpmc_ring_count(&g_stackP->ring) == NUMBER_OF_POOL_BUFFER);
 }
 
-int buffer_pool_free(BUF_POINTER element) {
-    if (element >= RESERVED_BUFFER_BASE ) {
-        pthread_mutex_lock(&reserved_stack->mutex);
-        element = (BUF_POINTER)((uint64_t)element & BUFFER_ADDRESS_MASK);
-        if (isReservedStackFull()) {
-            debug_printf("Stack is full. Cannot buffer_pool_free.\n");
-            pthread_mutex_unlock(&reserved_stack->mutex);
-            return -1;
-        }
+/* Return a buffer to the shared pool or the reserved stack */
+static int buffer_pool_put(BUF_POINTER element) {
 
-        reserved_stack->top++;
-        reserved_stack->elements[reserved_stack->top] = element;
+    void *masked = (void *)((uint64_t)element & BUFFER_ADDRESS_MASK);
+    mpmc_ring_t *ring;
 
-        pthread_mutex_unlock(&reserved_stack->mutex);
+    if (element >= RESERVED_BUFFER_BASE ) {
+        ring = &reserved_stack->ring;
     }
     else {
-        pthread_mutex_lock(&g_stackP->mutex);
-        element = (BUF_POINTER)((uint64_t)element & BUFFER_ADDRESS_MASK);
-        if (isStackFull()) {
+        ring = &g_stackP->ring;
+    }
+
+    if (mpmc_ring_enqueue_bulk(ring, &masked, 1) == 0) {
+        debug_printf("Stack is full. Cannot buffer_pool_free.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int buffer_pool_free(BUF_POINTER element) {
+
+    buffer_cache_t *cache;
+    int n;
+
+    if (element >= RESERVED_BUFFER_BASE || (cache = buffer_cache_get()) == NULL) {
+        return buffer_pool_put(element);
+    }
+
+    if (cache->count == BUFFER_CACHE_SIZE) {
+        cache->misses++;
+        /* flush the oldest ones, the recently freed are still cache hot */
+        n = mpmc_ring_enqueue_bulk(&g_stackP->ring, cache->elements, BUFFER_CACHE_BULK);
+        if (n == 0) {
             debug_printf("Stack is full. Cannot buffer_pool_free.\n");
-            pthread_mutex_unlock(&g_stackP->mutex);
             return -1;
         }
-
-        g_stackP->top++;
-        g_stackP->elements[g_stackP->top] = element;
-
-        pthread_mutex_unlock(&g_stackP->mutex);
+        memmove(cache->elements, &cache->elements[n], (cache->count - n) * sizeof(void *));
+        cache->count -= n;
+    } else {
+        cache->hits++;
     }
+    cache->elements[cache->count++] = (void *)((uint64_t)element & BUFFER_ADDRESS_MASK);
 
     return 0;
 }
 
 BUF_POINTER buffer_pool_alloc() {
-    pthread_mutex_lock(&g_stackP->mutex);
 
-    if (isStackEmpty()) {
-        debug_printf("Stack is empty. Cannot buffer_pool_alloc.\n");
-        pthread_mutex_unlock(&g_stackP->mutex);
-        return EMPTY_ELEMENT;
+    buffer_cache_t *cache = buffer_cache_get();
+    void *element;
+
+    if (cache == NULL) {
+        if (mpmc_ring_dequeue_bulk(&g_stackP->ring, &element, 1) == 0) {
+            debug_printf("Stack is empty. Cannot buffer_pool_alloc.\n");
+            return EMPTY_ELEMENT;
+        }
+        return (BUF_POINTER)element;
     }
 
-    BUF_POINTER poppedElement = g_stackP->elements[g_stackP->top];
-    g_stackP->top--;
+    if (cache->count == 0) {
+        cache->misses++;
+        cache->count = mpmc_ring_dequeue_bulk(&g_stackP->ring, cache->elements,
+                                              BUFFER_CACHE_BULK);
+        if (cache->count == 0) {
+            debug_printf("Stack is empty. Cannot buffer_pool_alloc.\n");
+            return EMPTY_ELEMENT;
+        }
+    } else {
+        cache->hits++;
+    }
+
+    return (BUF_POINTER)cache->elements[--cache->count];
+}
 
-    pthread_mutex_unlock(&g_stackP->mutex);
+int buffer_pool_free_bulk(struct xdma_buffer_descriptor *bd, int count) {
+
+    int cnt;
+
+    for(cnt = 0; cnt < count; cnt++) {
+        buffer_pool_free((BUF_POINTER)bd[cnt].buffer);
+    }
 
-    return poppedElement;
+    return 0;
 }
 
-int multi_buffer_pool_free(struct xdma_multi_read_write_ioctl *bd) {
-    pthread_mutex_lock(&reserved_stack->mutex);
-    pthread_mutex_lock(&g_stackP->mutex);
-    int cnt = 0;
+/* Take up to count buffers, returns how many were taken */
+int buffer_pool_alloc_bulk(struct xdma_buffer_descriptor *bd, int count) {
+
     BUF_POINTER element;
+    int cnt;
 
-    for(cnt = 0;cnt < bd->bd_num; cnt++) {
-        element = (BUF_POINTER)bd->bd[cnt].buffer;
-        element = (BUF_POINTER)((uint64_t)element & BUFFER_ADDRESS_MASK);
-        if (element >= RESERVED_BUFFER_BASE ) {
-            if (isReservedStackFull()) {
-                debug_printf("Stack is full. Cannot buffer_pool_free.\n");
-                continue;
-            }
-            reserved_stack->top++;
-            reserved_stack->elements[reserved_stack->top] = element;
-        }
-        else {
-            if (isStackFull()) {
-                debug_printf("Stack is full. Cannot buffer_pool_free.\n");
-                continue;
-            }
-            g_stackP->top++;
-            g_stackP->elements[g_stackP->top] = element;
+    for(cnt = 0; cnt < count; cnt++) {
+        element = buffer_pool_alloc();
+        if (element == EMPTY_ELEMENT) {
+            break;
         }
+        bd[cnt].buffer = element;
     }
-    pthread_mutex_unlock(&reserved_stack->mutex);
-    pthread_mutex_unlock(&g_stackP->mutex);
 
-    return 0;
+    return cnt;
 }
 
-int multi_buffer_pool_alloc(struct xdma_multi_read_write_ioctl *bd) {
+int multi_buffer_pool_free(struct xdma_multi_read_write_ioctl *bd) {
 
-    pthread_mutex_lock(&g_stackP->mutex);
-    int cnt;
+    return buffer_pool_free_bulk(bd->bd, bd->bd_num);
+}
+
+int multi_buffer_pool_alloc(struct xdma_multi_read_write_ioctl *bd) {
 
-    if (isStackEmpty()) {
-        bd->bd_num = 0;
-        debug_printf("Stack is empty. Cannot buffer_pool_alloc.\n");
-        pthread_mutex_unlock(&g_stackP->mutex);
+    bd->bd_num = buffer_pool_alloc_bulk(bd->bd, MAX_BD_NUMBER);
+    if (bd->bd_num == 0) {
         return -1;
     }
 
-#if 1
-    for(cnt=0; (cnt < MAX_BD_NUMBER) && (g_stackP->top >= 0); 
-                cnt++, g_stackP->top--) 
-#else
-    for(cnt=0; (cnt < 4) && (g_stackP->top >= 0); 
-                cnt++, g_stackP->top--) 
-#endif
-	{
-        bd->bd[cnt].buffer = g_stackP->elements[g_stackP->top];
+    return bd->bd_num;
+}
+
+/* A snapshot for the stats thread, the caches are read without their owners */
+void buffer_pool_get_stats(buffer_pool_stats_t *stats) {
+
+    int caches = buffer_cache_cnt;
+    int id;
+
+    if (caches > MAX_BUFFER_CACHES) {
+        caches = MAX_BUFFER_CACHES;
     }
-    bd->bd_num = cnt;
 
-    pthread_mutex_unlock(&g_stackP->mutex);
+    memset(stats, 0, sizeof(buffer_pool_stats_t));
+    if (g_stackP == NULL) {
+        return;
+    }
 
-    return cnt;
+    stats->free = mpmc_ring_count(&g_stackP->ring);
+    for (id = 0; id < caches; id++) {
+        stats->cached += buffer_caches[id].count;
+        stats->cache_hits += buffer_caches[id].hits;
+        stats->cache_misses += buffer_caches[id].misses;
+    }
+    if (stats->free + stats->cached < NUMBER_OF_BUFFER) {
+        stats->in_use = NUMBER_OF_BUFFER - stats->free - stats->cached;
+    }
 }
 
 void quickSort(BUF_POINTER arr[], int left, int right) {
@@ -229,11 +328,121 @@ void initialize_stacks() {
     g_stackP = &xdma_buffer_pool_stack;
     reserved_stack = &reserved_buffer_stack;
 
-    g_stackP->top = -1;
-    pthread_mutex_init(&g_stackP->mutex, NULL);
+    mpmc_ring_init(&g_stackP->ring, g_stackP->elements, NUMBER_OF_POOL_BUFFER);
+    mpmc_ring_init(&reserved_stack->ring, reserved_stack->elements, NUMBER_OF_RESERVED_BUFFER);
 
-    reserved_stack->top = -1;
-    pthread_mutex_init(&reserved_stack->mutex, NULL);
+    initialize_buffer_caches();
+}
+
+/* NUMA node of the PCIe device behind an XDMA character device, -1 if unknown */
+static int buffer_arena_device_node(const char *devname) {
+
+    char path[256];
+    char name[128];
+    FILE *fp;
+    int node = -1;
+
+    snprintf(name, sizeof(name), "%s", devname);
+    snprintf(path, sizeof(path), "/sys/class/xdma/%s/device/numa_node", basename(name));
+    fp = fopen(path, "r");
+    if(fp == NULL) {
+        return -1;
+    }
+    if(fscanf(fp, "%d", &node) != 1) {
+        node = -1;
+    }
+    fclose(fp);
+
+    return node;
+}
+
+/*
+ * Buffer size, hugepage size (0, 2 MiB or 1 GiB) and the device whose NUMA
+ * node the arena goes to, to be called before initialize_buffer_allocation().
+ */
+int buffer_pool_configure(int length, unsigned long hugepage, const char *devname) {
+
+    if((length < MIN_BUFFER_LENGTH) || (length > MAX_BUFFER_LENGTH_LIMIT) || (length & (length - 1))) {
+        printf("Buffer size %d is not a power of 2 in %d ~ %d.\n",
+               length, MIN_BUFFER_LENGTH, MAX_BUFFER_LENGTH_LIMIT);
+        return -1;
+    }
+    if((hugepage != 0) && (hugepage != (2UL << 20)) && (hugepage != (1UL << 30))) {
+        printf("Hugepage size %lu is not supported (0, 2M, 1G).\n", hugepage);
+        return -1;
+    }
+    /* Without hugepages the driver maps the buffers page by page */
+    if((hugepage == 0) && (length > BUFFER_ALIGNMENT)) {
+        printf("Buffer size %d needs hugepages.\n", length);
+        return -1;
+    }
+
+    buffer_length = length;
+    buffer_arena_hugepage = hugepage;
+    buffer_arena_node = (devname != NULL) ? buffer_arena_device_node(devname) : -1;
+
+    return 0;
+}
+
+static void buffer_arena_bind(void *arena, size_t size) {
+
+    unsigned long nodemask[4] = { 0 };
+
+    if((buffer_arena_node < 0) || (buffer_arena_node >= (int)(sizeof(nodemask) * 8))) {
+        return;
+    }
+
+    nodemask[buffer_arena_node / (sizeof(unsigned long) * 8)] =
+        1UL << (buffer_arena_node % (sizeof(unsigned long) * 8));
+    if(syscall(SYS_mbind, arena, size, BUFFER_ARENA_MPOL_PREFERRED, nodemask,
+               sizeof(nodemask) * 8, BUFFER_ARENA_MPOL_MF_MOVE)) {
+        printf("Could not place buffers on NUMA node %d\n", buffer_arena_node);
+    }
+}
+
+static int allocate_buffer_arena() {
+
+    size_t len = (size_t)(NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER) * MAX_BUFFER_LENGTH;
+    void *arena;
+
+    len = (len + BUFFER_ALIGNMENT - 1) & ~((size_t)BUFFER_ALIGNMENT - 1);
+    buffer_arena_mapped = 0;
+
+    if(buffer_arena_hugepage) {
+        buffer_arena_size = (len + buffer_arena_hugepage - 1) & ~(buffer_arena_hugepage - 1);
+        arena = mmap(NULL, buffer_arena_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                     ((__builtin_ctzl(buffer_arena_hugepage)) << MAP_HUGE_SHIFT), -1, 0);
+        if(arena != MAP_FAILED) {
+            buffer_arena_mapped = 1;
+            g_buffer = arena;
+        } else {
+            printf("No %lu KiB hugepages for %zu bytes, using regular pages\n",
+                   buffer_arena_hugepage >> 10, buffer_arena_size);
+            if(MAX_BUFFER_LENGTH > BUFFER_ALIGNMENT) {
+                return -1;
+            }
+        }
+    }
+
+    if(!buffer_arena_mapped) {
+        buffer_arena_size = len;
+        if(posix_memalign((void **)&g_buffer, BUFFER_ALIGNMENT /*alignment */, buffer_arena_size)) {
+            fprintf(stderr, "OOM %zu.\n", buffer_arena_size);
+            return -1;
+        }
+    }
+
+    /* before the first touch, which allocates the pages */
+    buffer_arena_bind(g_buffer, buffer_arena_size);
+    memset(g_buffer, 0, buffer_arena_size);
+
+    printf("Buffer arena: %zu bytes, %d byte buffers, %s pages, NUMA node %d\n",
+           buffer_arena_size, MAX_BUFFER_LENGTH,
+           buffer_arena_mapped ? ((buffer_arena_hugepage >> 20) == 2 ? "2M" : "1G") : "4K",
+           buffer_arena_node);
+
+    return 0;
 }
 
 int allocate_buffers() {
@@ -241,10 +450,7 @@ int allocate_buffers() {
     int id;
 
 #if 1
-    if(posix_memalign((void **)&g_buffer, BUFFER_ALIGNMENT /*alignment */, (NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER) * MAX_BUFFER_LENGTH)) {
-        fprintf(stderr, "OOM %u.\n", (NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER) * MAX_BUFFER_LENGTH);
-        pthread_mutex_destroy(&g_stackP->mutex);
-        pthread_mutex_destroy(&reserved_stack->mutex);
+    if(allocate_buffer_arena()) {
         return -1;
     }
 
@@ -261,8 +467,6 @@ int allocate_buffers() {
         if(posix_memalign((void **)&buffer, BUFFER_ALIGNMENT /*alignment */, MAX_BUFFER_LENGTH + BUFFER_ALIGNMENT)) {
             fprintf(stderr, "OOM %u.\n", MAX_BUFFER_LENGTH);
             relese_buffers(id);
-            pthread_mutex_destroy(&g_stackP->mutex);
-            pthread_mutex_destroy(&reserved_stack->mutex);
             return -1;
         }
         buffer_list[id] = buffer;
@@ -302,8 +506,6 @@ int initialize_buffer_allocation() {
         if(posix_memalign((void **)&buffer, BUFFER_ALIGNMENT /*alignment */, MAX_BUFFER_LENGTH + BUFFER_ALIGNMENT)) {
             fprintf(stderr, "OOM %u.\n", MAX_BUFFER_LENGTH);
             relese_buffers(id);
-            pthread_mutex_destroy(&g_stackP->mutex);
-            pthread_mutex_destroy(&reserved_stack->mutex);
             return -1;
         }
         buffer_list[id] = buffer;
@@ -325,10 +527,8 @@ int initialize_buffer_allocation() {
     RESERVED_BUFFER_BASE = buffer_list[NUMBER_OF_BUFFER];
 
     for(id = 0; id < (NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER); id++) {
-        if(buffer_pool_free(buffer_list[id])) {
+        if(buffer_pool_put(buffer_list[id])) {
             relese_buffers(id + 1);
-            pthread_mutex_destroy(&g_stackP->mutex);
-            pthread_mutex_destroy(&reserved_stack->mutex);
             return -1;
         }
     }
@@ -344,11 +544,44 @@ int initialize_buffer_allocation() {
     return 0;
 }
 
+/*
+ * Pin and map the whole pool in the driver once, burst transfers on fd
+ * can then pass the handle instead of having the buffers mapped per call.
+ */
+int buffer_pool_register(int fd) {
+
+    size_t len = ((size_t)(NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER) * MAX_BUFFER_LENGTH +
+                  BUFFER_ALIGNMENT - 1) & ~((size_t)BUFFER_ALIGNMENT - 1);
+    int handle;
+
+    if(len > XDMA_REGISTERED_BUFFER_MAX_LEN) {
+        printf("Buffer pool of %zu bytes over the %u byte registration limit, using per call mapping\n",
+               len, XDMA_REGISTERED_BUFFER_MAX_LEN);
+        return -1;
+    }
+    if(xdma_api_register_buffers(fd, g_buffer, len, &handle)) {
+        printf("Could not register %zu bytes of buffers (%s), using per call mapping\n",
+               len, strerror(errno));
+        return -1;
+    }
+
+    return handle;
+}
+
+void buffer_pool_unregister(int fd, int handle) {
+
+    if(handle >= 0) {
+        xdma_api_unregister_buffers(fd, handle);
+    }
+}
+
+BUF_POINTER buffer_pool_base() {
+    return g_buffer;
+}
+
 void buffer_release() {
 
     relese_buffers(NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER);
-    pthread_mutex_destroy(&g_stackP->mutex);
-    pthread_mutex_destroy(&reserved_stack->mutex);
 
     printf("Successfully release buffers(%u)\n", NUMBER_OF_BUFFER + NUMBER_OF_RESERVED_BUFFER);
 }
@@ -15,14 +15,29 @@
 #include "xdma_common.h"
 #include "../xdma/cdev_sgdma_part.h"
 
+typedef struct buffer_pool_stats {
+    unsigned long long free;            // in the shared pool
+    unsigned long long cached;          // in the per thread caches
+    unsigned long long in_use;
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+} buffer_pool_stats_t;
+
 void relese_buffers(int count);
 
 int buffer_pool_free(BUF_POINTER element);
 BUF_POINTER buffer_pool_alloc();
+int buffer_pool_configure(int length, unsigned long hugepage, const char *devname);
 int initialize_buffer_allocation();
 
 int multi_buffer_pool_alloc(struct xdma_multi_read_write_ioctl *bd);
 int multi_buffer_pool_free(struct xdma_multi_read_write_ioctl *bd);
+int buffer_pool_alloc_bulk(struct xdma_buffer_descriptor *bd, int count);
+int buffer_pool_free_bulk(struct xdma_buffer_descriptor *bd, int count);
+int buffer_pool_register(int fd);
+void buffer_pool_unregister(int fd, int handle);
+BUF_POINTER buffer_pool_base();
 void buffer_release();
+void buffer_pool_get_stats(buffer_pool_stats_t *stats);
 
 #endif     // __BUFFER_HANDLER_H__
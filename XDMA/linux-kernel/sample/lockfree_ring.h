@@ -0,0 +1,226 @@
+/*
+* TSNv1 XDMA :
+* -------------------------------------------------------------------------------
+# Copyrights (c) 2023 TSN Lab. All rights reserved.
+# Programmed by hounjoung@tsnlab.com
+#
+# Revision history
+# 2023-xx-xx    hounjoung   create this file.
+# $Id$
+*/
+
+#ifndef __LOCKFREE_RING_H__
+#define __LOCKFREE_RING_H__
+
+#include <stdint.h>
+
+#include "../xdma/cdev_sgdma_part.h"
+
+/*
+ * Lock free rings for the buffer pipeline.
+ * Sizes must be powers of 2, the indexes run freely and are masked on
+ * access, so a ring of size N holds N elements.
+ * The bulk functions move as many of the requested elements as possible
+ * and return how many were moved.
+ */
+
+#define RING_CACHE_LINE_SIZE (64)
+#define __ring_cache_aligned __attribute__((aligned(RING_CACHE_LINE_SIZE)))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ring_cpu_relax() __builtin_ia32_pause()
+#else
+#define ring_cpu_relax() do { } while (0)
+#endif
+
+/*
+ * Single producer / single consumer ring of buffer descriptors.
+ * Each side writes its own index only and keeps a cached copy of the
+ * other one, the shared line is read again when the copy says the ring
+ * is full (producer) or empty (consumer).
+ */
+typedef struct spsc_ring {
+    uint32_t size;
+    uint32_t mask;
+    struct xdma_buffer_descriptor *slots;
+
+    struct {
+        uint32_t head;          /* next slot to fill */
+        uint32_t tail_cache;
+    } prod __ring_cache_aligned;
+
+    struct {
+        uint32_t tail;          /* next slot to read */
+        uint32_t head_cache;
+    } cons __ring_cache_aligned;
+} __ring_cache_aligned spsc_ring_t;
+
+static inline void spsc_ring_init(spsc_ring_t *r, struct xdma_buffer_descriptor *slots,
+                                  uint32_t size) {
+    r->size = size;
+    r->mask = size - 1;
+    r->slots = slots;
+    r->prod.head = 0;
+    r->prod.tail_cache = 0;
+    r->cons.tail = 0;
+    r->cons.head_cache = 0;
+}
+
+static inline unsigned int spsc_ring_enqueue_bulk(spsc_ring_t *r,
+                                                  const struct xdma_buffer_descriptor *elems,
+                                                  unsigned int n) {
+    uint32_t head = r->prod.head;
+    uint32_t free = r->size - (head - r->prod.tail_cache);
+    unsigned int i;
+
+    if (free < n) {
+        /* pairs with the release in spsc_ring_dequeue_bulk() */
+        r->prod.tail_cache = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+        free = r->size - (head - r->prod.tail_cache);
+        if (n > free) {
+            n = free;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        r->slots[(head + i) & r->mask] = elems[i];
+    }
+    __atomic_store_n(&r->prod.head, head + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static inline unsigned int spsc_ring_dequeue_bulk(spsc_ring_t *r,
+                                                  struct xdma_buffer_descriptor *elems,
+                                                  unsigned int n) {
+    uint32_t tail = r->cons.tail;
+    uint32_t entries = r->cons.head_cache - tail;
+    unsigned int i;
+
+    if (entries < n) {
+        /* pairs with the release in spsc_ring_enqueue_bulk() */
+        r->cons.head_cache = __atomic_load_n(&r->prod.head, __ATOMIC_ACQUIRE);
+        entries = r->cons.head_cache - tail;
+        if (n > entries) {
+            n = entries;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        elems[i] = r->slots[(tail + i) & r->mask];
+    }
+    __atomic_store_n(&r->cons.tail, tail + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/* A snapshot, exact only when called by the producer or the consumer */
+static inline unsigned int spsc_ring_count(spsc_ring_t *r) {
+    uint32_t tail = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&r->prod.head, __ATOMIC_ACQUIRE) - tail;
+}
+
+/*
+ * Multi producer / multi consumer ring of pointers.
+ * A side reserves its slots by moving head with a CAS, copies them and
+ * then publishes them by moving tail once the sides that reserved before
+ * it have published theirs.
+ */
+typedef struct mpmc_ring {
+    uint32_t size;
+    uint32_t mask;
+    void **slots;
+
+    struct {
+        uint32_t head;          /* reserved */
+        uint32_t tail;          /* published */
+    } prod __ring_cache_aligned;
+
+    struct {
+        uint32_t head;
+        uint32_t tail;
+    } cons __ring_cache_aligned;
+} __ring_cache_aligned mpmc_ring_t;
+
+static inline void mpmc_ring_init(mpmc_ring_t *r, void **slots, uint32_t size) {
+    r->size = size;
+    r->mask = size - 1;
+    r->slots = slots;
+    r->prod.head = 0;
+    r->prod.tail = 0;
+    r->cons.head = 0;
+    r->cons.tail = 0;
+}
+
+static inline unsigned int mpmc_ring_enqueue_bulk(mpmc_ring_t *r, void * const *objs,
+                                                  unsigned int max) {
+    uint32_t head, next, free;
+    unsigned int i, n;
+
+    /* acquire keeps the cons.tail load below after the head load */
+    head = __atomic_load_n(&r->prod.head, __ATOMIC_ACQUIRE);
+    do {
+        free = r->size + __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE) - head;
+        n = (max > free) ? free : max;
+        if (n == 0) {
+            return 0;
+        }
+        next = head + n;
+    } while (!__atomic_compare_exchange_n(&r->prod.head, &head, next, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    for (i = 0; i < n; i++) {
+        r->slots[(head + i) & r->mask] = objs[i];
+    }
+
+    /* acquire chains the earlier producers' slots into our release */
+    while (__atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE) != head) {
+        ring_cpu_relax();
+    }
+    __atomic_store_n(&r->prod.tail, next, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static inline unsigned int mpmc_ring_dequeue_bulk(mpmc_ring_t *r, void **objs,
+                                                  unsigned int max) {
+    uint32_t head, next, entries;
+    unsigned int i, n;
+
+    head = __atomic_load_n(&r->cons.head, __ATOMIC_ACQUIRE);
+    do {
+        entries = __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE) - head;
+        n = (max > entries) ? entries : max;
+        if (n == 0) {
+            return 0;
+        }
+        next = head + n;
+    } while (!__atomic_compare_exchange_n(&r->cons.head, &head, next, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    for (i = 0; i < n; i++) {
+        objs[i] = r->slots[(head + i) & r->mask];
+    }
+
+    while (__atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE) != head) {
+        ring_cpu_relax();
+    }
+    __atomic_store_n(&r->cons.tail, next, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static inline unsigned int mpmc_ring_count(mpmc_ring_t *r) {
+    uint32_t tail = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE) - tail;
+}
+
+#endif     // __LOCKFREE_RING_H__
@@ -44,88 +44,55 @@ extern int parse_thread_run;
 extern stats_t tx_stats;
 
 void packet_dump(BUF_POINTER buffer, int length);
+void sender_kick();
 
 CircularParsedQueue_t g_parsed_queue;
 
 void initialize_p_queue(CircularParsedQueue_t * q) {
 
-    q->front = 0;
-    q->rear = -1;
-    q->count = 0;
-    pthread_mutex_init(&q->mutex, NULL);
+    spsc_ring_init(&q->ring, q->elements, NUMBER_OF_QUEUE);
 }
 
 int isParsedQueueEmpty(CircularParsedQueue_t * q) {
-    return (q->count == 0);
+    return (spsc_ring_count(&q->ring) == 0);
 }
 
 int isParsedQueueFull(CircularParsedQueue_t * q) {
-    return (q->count == NUMBER_OF_QUEUE);
+    return (spsc_ring_count(&q->ring) == NUMBER_OF_QUEUE);
 }
 
 int getParsedQueueCount(CircularParsedQueue_t * q) {
-    return q->count;
+    return spsc_ring_count(&q->ring);
 }
 
 int pbuffer_enqueue(CircularParsedQueue_t *q, struct xdma_buffer_descriptor element) {
-    pthread_mutex_lock(&q->mutex);
 
-    if (isParsedQueueFull(q)) {
+    if (spsc_ring_enqueue_bulk(&q->ring, &element, 1) == 0) {
         debug_printf("Parsed Queue is full. Cannot pbuffer_enqueue.\n");
-        pthread_mutex_unlock(&q->mutex);
         return -1;
     }
 
-    q->rear = (q->rear + 1) % NUMBER_OF_QUEUE;
-    q->elements[q->rear].buffer = element.buffer;
-    q->elements[q->rear].len = element.len;
-    q->count++;
-
-    pthread_mutex_unlock(&q->mutex);
-
     return 0;
 }
 
 int pbuffer_dequeue(CircularParsedQueue_t *q, struct xdma_buffer_descriptor *element) {
-    pthread_mutex_lock(&q->mutex);
 
-    if (isParsedQueueEmpty(q)) {
+    if (spsc_ring_dequeue_bulk(&q->ring, element, 1) == 0) {
         debug_printf("Parsed Queue is empty. Cannot pbuffer_dequeue.\n");
-        pthread_mutex_unlock(&q->mutex);
         return -1;
     }
 
-    element->buffer = q->elements[q->front].buffer;
-    element->len = q->elements[q->front].len;
-    q->front = (q->front + 1) % NUMBER_OF_QUEUE;
-    q->count--;
-
-    pthread_mutex_unlock(&q->mutex);
-
     return 0;
 }
 
 int pbuffer_multi_dequeue(CircularParsedQueue_t *q, struct xdma_multi_read_write_ioctl *bd) {
-    pthread_mutex_lock(&q->mutex);
-
-    int id;
-    for(id=0; id<MAX_BD_NUMBER; id++) {
-        if (isParsedQueueEmpty(q)) {
-            debug_printf("Parsed Queue is empty. Cannot pbuffer_dequeue.\n");
-            bd->bd_num = id;
-            pthread_mutex_unlock(&q->mutex);
-            return id;
-        }
-        bd->bd[id].buffer = q->elements[q->front].buffer;
-        bd->bd[id].len = q->elements[q->front].len;
-        q->front = (q->front + 1) % NUMBER_OF_QUEUE;
-        q->count--;
-    }
 
-    bd->bd_num = id;
-    pthread_mutex_unlock(&q->mutex);
+    bd->bd_num = spsc_ring_dequeue_bulk(&q->ring, bd->bd, MAX_BD_NUMBER);
+    if (bd->bd_num == 0) {
+        debug_printf("Parsed Queue is empty. Cannot pbuffer_dequeue.\n");
+    }
 
-    return id;
+    return bd->bd_num;
 }
 
 #include "packet.h"
@@ -291,13 +258,19 @@ void parser_in_normal_mode() {
     char *buffer;
     int status;
     struct xdma_buffer_descriptor bd;
+    struct xdma_buffer_descriptor rx_bd[MAX_BD_NUMBER];
+    int rx_num = 0;
+    int rx_id = 0;
 
     while (parse_thread_run) {
-        buffer = NULL;
-        buffer = xbuffer_dequeue();
-        if(buffer == NULL) {
-            continue;
+        if(rx_id == rx_num) {
+            rx_num = xbuffer_dequeue_bulk(rx_bd, MAX_BD_NUMBER);
+            rx_id = 0;
+            if(rx_num == 0) {
+                continue;
+            }
         }
+        buffer = rx_bd[rx_id++].buffer;
 
         status = parse_packet_with_bd((struct tsn_rx_buffer*)buffer, &bd);
         if(status == XST_FAILURE) {
@@ -318,6 +291,7 @@ void parser_in_normal_mode() {
             buffer_pool_free((BUF_POINTER)buffer);
             continue;
         }
+        sender_kick();
     }
 }
 
@@ -343,8 +317,6 @@ void* parse_thread(void* arg) {
     break;
     }
 
-    pthread_mutex_destroy(&g_parsed_queue.mutex);
-
     printf("<<< %s()\n", __func__);
 
     return NULL;
@@ -4,11 +4,8 @@
 #include "buffer_handler.h"
 
 typedef struct circular_parsed_queue{
+    spsc_ring_t ring;       // parser -> sender
     struct xdma_buffer_descriptor elements[NUMBER_OF_QUEUE];
-    int front;
-    int rear;
-    int count;
-    pthread_mutex_t mutex;
 } CircularParsedQueue_t;
 
 int pbuffer_multi_dequeue(CircularParsedQueue_t *queue, struct xdma_multi_read_write_ioctl *bd);
@@ -24,7 +24,7 @@
 #include "../libxdma/api_xdma.h"
 
 static CircularQueue_t g_queue;
-static CircularQueue_t* queue = NULL;
+static CircularQueue_t* queue = &g_queue;
 
 stats_t rx_stats;
 
@@ -33,101 +33,73 @@ extern int rx_thread_run;
 void initialize_queue(CircularQueue_t* p_queue) {
     queue = p_queue;
 
-    p_queue->front = 0;
-    p_queue->rear = -1;
-    p_queue->count = 0;
-    pthread_mutex_init(&p_queue->mutex, NULL);
+    spsc_ring_init(&p_queue->ring, p_queue->elements, NUMBER_OF_QUEUE);
 }
 
 int isQueueEmpty() {
-    return (queue->count == 0);
+    return (spsc_ring_count(&queue->ring) == 0);
 }
 
 int isQueueFull() {
-    return (queue->count == NUMBER_OF_QUEUE);
+    return (spsc_ring_count(&queue->ring) == NUMBER_OF_QUEUE);
 }
 
 int getQueueCount() {
-    return queue->count;
+    return spsc_ring_count(&queue->ring);
 }
 
 void xbuffer_enqueue(QueueElement element) {
-    pthread_mutex_lock(&queue->mutex);
 
-    if (isQueueFull(queue)) {
+    struct xdma_buffer_descriptor bd = { element, 0 };
+
+    if (spsc_ring_enqueue_bulk(&queue->ring, &bd, 1) == 0) {
         debug_printf("Queue is full. Cannot xbuffer_enqueue.\n");
-        pthread_mutex_unlock(&queue->mutex);
-        return;
     }
-
-    queue->rear = (queue->rear + 1) % NUMBER_OF_QUEUE;
-    queue->elements[queue->rear] = element;
-    queue->count++;
-
-    pthread_mutex_unlock(&queue->mutex);
 }
 
 QueueElement xbuffer_dequeue() {
-    pthread_mutex_lock(&queue->mutex);
 
-    if (isQueueEmpty(queue)) {
+    struct xdma_buffer_descriptor bd;
+
+    if (spsc_ring_dequeue_bulk(&queue->ring, &bd, 1) == 0) {
         debug_printf("Queue is empty. Cannot xbuffer_dequeue.\n");
-        pthread_mutex_unlock(&queue->mutex);
         return EMPTY_ELEMENT;
     }
 
-    QueueElement dequeuedElement = queue->elements[queue->front];
-    queue->front = (queue->front + 1) % NUMBER_OF_QUEUE;
-    queue->count--;
+    return bd.buffer;
+}
 
-    pthread_mutex_unlock(&queue->mutex);
+/* Returns how many of the count buffers were queued */
+int xbuffer_enqueue_bulk(struct xdma_buffer_descriptor *bd, int count) {
 
-    return dequeuedElement;
+    int cnt = spsc_ring_enqueue_bulk(&queue->ring, bd, count);
+
+    if (cnt < count) {
+        debug_printf("Queue is full. Cannot xbuffer_enqueue.\n");
+    }
+
+    return cnt;
 }
 
-void xbuffer_multi_enqueue(struct xdma_multi_read_write_ioctl *bd) {
-    pthread_mutex_lock(&queue->mutex);
-	int cnt;
-    QueueElement element;
-
-    for(cnt=0; cnt<bd->bd_num; cnt++) {
-		if (isQueueFull(queue)) {
-			debug_printf("Queue is full. Cannot xbuffer_enqueue.\n");
-			pthread_mutex_unlock(&queue->mutex);
-			return;
-		}
+int xbuffer_dequeue_bulk(struct xdma_buffer_descriptor *bd, int count) {
 
-        element = (QueueElement)bd->bd[cnt].buffer;
-		queue->rear = (queue->rear + 1) % NUMBER_OF_QUEUE;
-		queue->elements[queue->rear] = element;
-		queue->count++;
-	}
+    return spsc_ring_dequeue_bulk(&queue->ring, bd, count);
+}
+
+void xbuffer_multi_enqueue(struct xdma_multi_read_write_ioctl *bd) {
 
-    pthread_mutex_unlock(&queue->mutex);
+    xbuffer_enqueue_bulk(bd->bd, bd->bd_num);
 }
 
 int xbuffer_multi_dequeue(struct xdma_multi_read_write_ioctl *bd) {
-    pthread_mutex_lock(&queue->mutex);
-	int cnt;
 
-    if (isQueueEmpty()) {
-		bd->bd_num = 0;
+    bd->bd_num = xbuffer_dequeue_bulk(bd->bd, MAX_BD_NUMBER);
+    if (bd->bd_num == 0) {
         debug_printf("Queue is empty. Cannot xbuffer_dequeue.\n");
-        pthread_mutex_unlock(&queue->mutex);
         return -1;
     }
 
-    for(cnt=0; (cnt < MAX_BD_NUMBER) && (queue->count > 0); cnt++) {
-        bd->bd[cnt].buffer = queue->elements[queue->front];
-		queue->front = (queue->front + 1) % NUMBER_OF_QUEUE;
-		queue->count--;
-    }
-
-    bd->bd_num = cnt;
-
-    pthread_mutex_unlock(&queue->mutex);
-
-    return cnt;
+    return bd->bd_num;
 }
 
 void initialize_statistics(stats_t* p_stats) {
@@ -200,6 +172,139 @@ void packet_dump(BUF_POINTER buffer, int length) {
     }
 }
 
+#ifdef __RING_READ_WRITE__
+/*
+ * Keep up to XDMA_RING_ENTRIES empty buffers posted to the driver and
+ * hand over the filled ones, one syscall posts and reaps many buffers.
+ */
+static int receiver_in_ring_mode(int fd, int reg_handle) {
+
+    struct xdma_ring_map ring;
+    struct xdma_ring_sqe *sqe;
+    struct xdma_ring_cqe *cqe;
+    struct tsn_rx_buffer* rx;
+    BUF_POINTER base = buffer_pool_base();
+    BUF_POINTER buffer;
+    int bytes_rcv;
+
+    if(xdma_api_ring_setup(fd, XDMA_RING_ENTRIES, reg_handle, -1, &ring)) {
+        return -1;
+    }
+    printf("%s: %d entries\n", __func__, XDMA_RING_ENTRIES);
+
+    while (rx_thread_run) {
+        while(xdma_ring_sq_space(&ring) > 0) {
+            buffer = buffer_pool_alloc();
+            if(buffer == NULL) {
+                rx_stats.rxNoBuffer++;
+                break;
+            }
+            sqe = xdma_ring_next_sqe(&ring);
+            sqe->user_data = (uint64_t)(uintptr_t)buffer;
+            sqe->offset = (uint64_t)(buffer - base);
+            sqe->len = MAX_BUFFER_LENGTH;
+            sqe->flags = 0;
+        }
+        xdma_ring_sq_commit(&ring);
+
+        if(xdma_api_ring_enter(&ring, 1, XDMA_RING_WAIT_MS, NULL)) {
+            rx_stats.rxErrors++;
+            continue;
+        }
+
+        while((cqe = xdma_ring_peek_cqe(&ring)) != NULL) {
+            buffer = (BUF_POINTER)(uintptr_t)cqe->user_data;
+            rx = (struct tsn_rx_buffer*)buffer;
+            bytes_rcv = (cqe->res > 0) ? rx->metadata.frame_length : 0;
+            if(cqe->res < 0) {
+                rx_stats.rxErrors++;
+            }
+            xdma_ring_cqe_seen(&ring);
+
+            if(bytes_rcv == 0 || bytes_rcv > MAX_BUFFER_LENGTH) {
+                buffer_pool_free(buffer);
+                continue;
+            }
+            rx_stats.rxPackets++;
+            rx_stats.rxBytes = rx_stats.rxBytes + bytes_rcv;
+            xbuffer_enqueue((QueueElement)buffer);
+        }
+    }
+
+    /* Buffers still posted are cancelled when fd is closed */
+    xdma_api_ring_release(&ring);
+
+    return 0;
+}
+#endif
+
+#ifdef __BURST_READ_WRITE__
+/*
+ * Read up to XDMA_MULTI_BD_BATCH buffers per IOCTL_XDMA_MULTI_READ_V2,
+ * the driver writes back one length per buffer so the empty ones are
+ * returned to the pool without touching them.
+ */
+static int receiver_in_batch_mode(int fd, int reg_handle) {
+
+    struct xdma_buffer_descriptor bd[XDMA_MULTI_BD_BATCH];
+    uint32_t lens[XDMA_MULTI_BD_BATCH];
+    struct tsn_rx_buffer* rx;
+    int bd_max;
+    int bd_num;
+    int filled;
+    int queued;
+    int id;
+    int bytes_rcv;
+
+    if(xdma_api_get_multi_bd_max(fd, &bd_max) || bd_max <= MAX_BD_NUMBER) {
+        return -1;
+    }
+    if(bd_max > XDMA_MULTI_BD_BATCH) {
+        bd_max = XDMA_MULTI_BD_BATCH;
+    }
+    printf("%s: %d buffers per read\n", __func__, bd_max);
+
+    while (rx_thread_run) {
+        bd_num = buffer_pool_alloc_bulk(bd, bd_max);
+        if(bd_num <= 0) {
+            rx_stats.rxNoBuffer++;
+            continue;
+        }
+        for(id = 0; id < bd_num; id++) {
+            bd[id].len = (unsigned long) MAX_BUFFER_LENGTH;
+        }
+
+        if(xdma_api_read_to_multi_buffers_v2(fd, reg_handle, bd, bd_num,
+                                             lens, &bytes_rcv)) {
+            buffer_pool_free_bulk(bd, bd_num);
+            rx_stats.rxErrors++;
+            continue;
+        }
+
+        filled = 0;
+        for(id = 0; id < bd_num; id++) {
+            rx = (struct tsn_rx_buffer*)bd[id].buffer;
+            bytes_rcv = lens[id] ? rx->metadata.frame_length : 0;
+            if(bytes_rcv == 0 || bytes_rcv > MAX_BUFFER_LENGTH) {
+                buffer_pool_free((BUF_POINTER)bd[id].buffer);
+                continue;
+            }
+            rx_stats.rxPackets++;
+            rx_stats.rxBytes = rx_stats.rxBytes + bytes_rcv;
+            bd[filled].buffer = bd[id].buffer;
+            bd[filled].len = bytes_rcv;
+            filled++;
+        }
+        queued = xbuffer_enqueue_bulk(bd, filled);
+        if(queued < filled) {
+            buffer_pool_free_bulk(&bd[queued], filled - queued);
+        }
+    }
+
+    return 0;
+}
+#endif
+
 void receiver_in_normal_mode(char* devname, int fd, uint64_t size) {
 
 #ifdef __BURST_READ_WRITE__
@@ -210,12 +315,30 @@ void receiver_in_normal_mode(char* devname, int fd, uint64_t size) {
 	int max_pkt_cnt = 0;
 	unsigned long done_cnt;
 	unsigned long max_done = 0;
+	int reg_handle;
+	int rc;
 #else
     BUF_POINTER buffer;
 #endif
     int bytes_rcv;
 
+#ifdef __BURST_READ_WRITE__
+	reg_handle = buffer_pool_register(fd);
+#endif
     set_register(REG_TSN_CONTROL, 1);
+#ifdef __RING_READ_WRITE__
+    if(reg_handle >= 0 && receiver_in_ring_mode(fd, reg_handle) == 0) {
+        set_register(REG_TSN_CONTROL, 0);
+        return;
+    }
+#endif
+#ifdef __BURST_READ_WRITE__
+    if(receiver_in_batch_mode(fd, reg_handle) == 0) {
+        set_register(REG_TSN_CONTROL, 0);
+        buffer_pool_unregister(fd, reg_handle);
+        return;
+    }
+#endif
     while (rx_thread_run) {
 #ifdef __BURST_READ_WRITE__
 		done_cnt = 0;
@@ -236,8 +359,14 @@ void receiver_in_normal_mode(char* devname, int fd, uint64_t size) {
 		}
 		bd.done = done_cnt;
 
-        if(xdma_api_read_to_multi_buffers_with_fd(devname, fd, &bd, 
-                                           &bytes_rcv)) {
+		if(reg_handle >= 0) {
+			rc = xdma_api_read_to_registered_buffers_with_fd(fd, reg_handle,
+                                           buffer_pool_base(), &bd, &bytes_rcv);
+		} else {
+			rc = xdma_api_read_to_multi_buffers_with_fd(devname, fd, &bd,
+                                           &bytes_rcv);
+		}
+        if(rc) {
             multi_buffer_pool_free(&bd);
 			rx_stats.rxErrors++;
             continue;
@@ -324,6 +453,9 @@ void receiver_in_normal_mode(char* devname, int fd, uint64_t size) {
 #endif
     }
     set_register(REG_TSN_CONTROL, 0);
+#ifdef __BURST_READ_WRITE__
+	buffer_pool_unregister(fd, reg_handle);
+#endif
 }
 
 void receiver_in_loopback_mode(char* devname, int fd, char *fn, uint64_t size) {
@@ -470,8 +602,6 @@ void* receiver_thread(void* arg) {
     break;
     }
 
-    pthread_mutex_destroy(&g_queue.mutex);
-
     xdma_api_dev_close(fd);
     printf("<<< %s\n", __func__);
     return NULL;
@@ -25,6 +25,8 @@
 
 void xbuffer_enqueue(QueueElement element);
 QueueElement xbuffer_dequeue();
+int xbuffer_enqueue_bulk(struct xdma_buffer_descriptor *bd, int count);
+int xbuffer_dequeue_bulk(struct xdma_buffer_descriptor *bd, int count);
 int getQueueCount();
 
 void initialize_statistics(stats_t* p_stats);
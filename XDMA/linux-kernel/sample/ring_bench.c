@@ -0,0 +1,270 @@
+/*
+* TSNv1 XDMA :
+* -------------------------------------------------------------------------------
+# Copyrights (c) 2023 TSN Lab. All rights reserved.
+# Programmed by hounjoung@tsnlab.com
+#
+# Revision history
+# 2023-xx-xx    hounjoung   create this file.
+# $Id$
+*/
+
+/*
+ * Cost per buffer of the lock free rings in lockfree_ring.h against the
+ * mutex protected queue and stack they replaced.
+ *   spsc: one producer and one consumer thread, like receiver -> parser
+ *   pool: N threads allocating and freeing buffers, like the buffer pool
+ * Usage: ring-bench [operations] [pool threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "lockfree_ring.h"
+
+#define BENCH_QUEUE_SIZE (2048)
+#define BENCH_BULK (32)
+#define BENCH_MAX_THREADS (16)
+
+#define DEF_BENCH_OPS (10000000)
+#define DEF_BENCH_THREADS (3)
+
+/* The previous CircularQueue_t and buffer_stack_t */
+typedef struct mutex_queue {
+    struct xdma_buffer_descriptor elements[BENCH_QUEUE_SIZE];
+    int front;
+    int rear;
+    int count;
+    pthread_mutex_t mutex;
+} mutex_queue_t;
+
+typedef struct mutex_stack {
+    void *elements[BENCH_QUEUE_SIZE];
+    int top;
+    pthread_mutex_t mutex;
+} mutex_stack_t;
+
+static mutex_queue_t m_queue;
+static mutex_stack_t m_stack;
+static spsc_ring_t s_ring;
+static struct xdma_buffer_descriptor s_slots[BENCH_QUEUE_SIZE];
+static mpmc_ring_t p_ring;
+static void *p_slots[BENCH_QUEUE_SIZE];
+
+static long bench_ops = DEF_BENCH_OPS;
+static int bench_bulk;
+static volatile int bench_start;
+
+static int mutex_queue_enqueue(mutex_queue_t *q, struct xdma_buffer_descriptor *bd, int n) {
+    int cnt;
+
+    pthread_mutex_lock(&q->mutex);
+    for (cnt = 0; cnt < n && q->count < BENCH_QUEUE_SIZE; cnt++) {
+        q->rear = (q->rear + 1) % BENCH_QUEUE_SIZE;
+        q->elements[q->rear] = bd[cnt];
+        q->count++;
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    return cnt;
+}
+
+static int mutex_queue_dequeue(mutex_queue_t *q, struct xdma_buffer_descriptor *bd, int n) {
+    int cnt;
+
+    pthread_mutex_lock(&q->mutex);
+    for (cnt = 0; cnt < n && q->count > 0; cnt++) {
+        bd[cnt] = q->elements[q->front];
+        q->front = (q->front + 1) % BENCH_QUEUE_SIZE;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    return cnt;
+}
+
+static int mutex_stack_push(mutex_stack_t *s, void **objs, int n) {
+    int cnt;
+
+    pthread_mutex_lock(&s->mutex);
+    for (cnt = 0; cnt < n && s->top < BENCH_QUEUE_SIZE - 1; cnt++) {
+        s->elements[++s->top] = objs[cnt];
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return cnt;
+}
+
+static int mutex_stack_pop(mutex_stack_t *s, void **objs, int n) {
+    int cnt;
+
+    pthread_mutex_lock(&s->mutex);
+    for (cnt = 0; cnt < n && s->top >= 0; cnt++) {
+        objs[cnt] = s->elements[s->top--];
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return cnt;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wait_start(void) {
+    while (!__atomic_load_n(&bench_start, __ATOMIC_ACQUIRE)) {
+        ring_cpu_relax();
+    }
+}
+
+static void *spsc_producer(void *arg) {
+    int lockfree = (int)(intptr_t)arg;
+    struct xdma_buffer_descriptor bd[BENCH_BULK];
+    int n = bench_bulk ? BENCH_BULK : 1;
+    long sent = 0;
+    int id;
+
+    for (id = 0; id < BENCH_BULK; id++) {
+        bd[id].buffer = (char *)(uintptr_t)(id + 1);
+        bd[id].len = 0;
+    }
+
+    wait_start();
+    while (sent < bench_ops) {
+        if (n > bench_ops - sent) {
+            n = bench_ops - sent;
+        }
+        if (lockfree) {
+            sent += spsc_ring_enqueue_bulk(&s_ring, bd, n);
+        } else {
+            sent += mutex_queue_enqueue(&m_queue, bd, n);
+        }
+    }
+
+    return NULL;
+}
+
+static void *spsc_consumer(void *arg) {
+    int lockfree = (int)(intptr_t)arg;
+    struct xdma_buffer_descriptor bd[BENCH_BULK];
+    int n = bench_bulk ? BENCH_BULK : 1;
+    long received = 0;
+
+    wait_start();
+    while (received < bench_ops) {
+        if (lockfree) {
+            received += spsc_ring_dequeue_bulk(&s_ring, bd, n);
+        } else {
+            received += mutex_queue_dequeue(&m_queue, bd, n);
+        }
+    }
+
+    return NULL;
+}
+
+/* Each thread takes buffers from the pool and gives them back */
+static void *pool_worker(void *arg) {
+    int lockfree = (int)(intptr_t)arg;
+    void *objs[BENCH_BULK];
+    int n = bench_bulk ? BENCH_BULK : 1;
+    long done = 0;
+    int got;
+
+    wait_start();
+    while (done < bench_ops) {
+        if (lockfree) {
+            got = mpmc_ring_dequeue_bulk(&p_ring, objs, n);
+            mpmc_ring_enqueue_bulk(&p_ring, objs, got);
+        } else {
+            got = mutex_stack_pop(&m_stack, objs, n);
+            mutex_stack_push(&m_stack, objs, got);
+        }
+        done += got;
+    }
+
+    return NULL;
+}
+
+static void bench_init(void) {
+    void *obj;
+    int id;
+
+    m_queue.front = 0;
+    m_queue.rear = -1;
+    m_queue.count = 0;
+    spsc_ring_init(&s_ring, s_slots, BENCH_QUEUE_SIZE);
+
+    m_stack.top = -1;
+    mpmc_ring_init(&p_ring, p_slots, BENCH_QUEUE_SIZE);
+    for (id = 0; id < BENCH_QUEUE_SIZE; id++) {
+        obj = (void *)(uintptr_t)((id + 1) * 0x1000);
+        mutex_stack_push(&m_stack, &obj, 1);
+        mpmc_ring_enqueue_bulk(&p_ring, &obj, 1);
+    }
+}
+
+/* Returns ns per buffer moved through the queue or the pool */
+static double run(void *(*fn[])(void *), int threads, int lockfree, long total) {
+    pthread_t tid[BENCH_MAX_THREADS];
+    uint64_t start;
+    int id;
+
+    bench_init();
+    __atomic_store_n(&bench_start, 0, __ATOMIC_RELEASE);
+    for (id = 0; id < threads; id++) {
+        pthread_create(&tid[id], NULL, fn[id], (void *)(intptr_t)lockfree);
+    }
+
+    start = now_ns();
+    __atomic_store_n(&bench_start, 1, __ATOMIC_RELEASE);
+    for (id = 0; id < threads; id++) {
+        pthread_join(tid[id], NULL);
+    }
+
+    return (double)(now_ns() - start) / total;
+}
+
+int main(int argc, char *argv[]) {
+    void *(*spsc_fn[2])(void *) = { spsc_producer, spsc_consumer };
+    void *(*pool_fn[BENCH_MAX_THREADS])(void *);
+    int threads = DEF_BENCH_THREADS;
+    int id;
+
+    if (argc > 1) {
+        bench_ops = atol(argv[1]);
+    }
+    if (argc > 2) {
+        threads = atoi(argv[2]);
+    }
+    if (bench_ops <= 0 || threads <= 0 || threads > BENCH_MAX_THREADS) {
+        printf("Usage: %s [operations] [pool threads(1-%d)]\n", argv[0], BENCH_MAX_THREADS);
+        return 1;
+    }
+    for (id = 0; id < threads; id++) {
+        pool_fn[id] = pool_worker;
+    }
+
+    pthread_mutex_init(&m_queue.mutex, NULL);
+    pthread_mutex_init(&m_stack.mutex, NULL);
+
+    printf("%ld buffers, %d pool threads, bulk %d\n", bench_ops, threads, BENCH_BULK);
+    printf("%-24s %12s %12s\n", "", "mutex ns/op", "ring ns/op");
+    for (bench_bulk = 0; bench_bulk < 2; bench_bulk++) {
+        printf("%-24s %12.1f %12.1f\n", bench_bulk ? "spsc queue, bulk" : "spsc queue",
+               run(spsc_fn, 2, 0, bench_ops), run(spsc_fn, 2, 1, bench_ops));
+        printf("%-24s %12.1f %12.1f\n", bench_bulk ? "pool alloc+free, bulk" : "pool alloc+free",
+               run(pool_fn, threads, 0, bench_ops * threads),
+               run(pool_fn, threads, 1, bench_ops * threads));
+    }
+
+    pthread_mutex_destroy(&m_queue.mutex);
+    pthread_mutex_destroy(&m_stack.mutex);
+
+    return 0;
+}
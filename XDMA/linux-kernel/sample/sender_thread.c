@@ -18,6 +18,9 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 #include <sched.h>
 
 
@@ -40,7 +43,39 @@
 #include "parser_thread.h"
 
 /******************** Constant Definitions **********************************/
+/*
+ * TSN frames are handed to the driver in multi writes of up to
+ * MAX_BD_NUMBER frames. A batch is flushed when it is full, when its first
+ * frame has waited TX_BATCH_MAX_DELAY_NS or TX_BATCH_GATE_GUARD_NS before
+ * the end of the Qbv slot it was selected in, whichever comes first.
+ */
+#define TX_BATCH_MAX_DELAY_NS   (50000)
+#define TX_BATCH_GATE_GUARD_NS  (10000)
+
+typedef struct tx_batch {
+    struct xdma_multi_read_write_ioctl io;
+    int bd_num;
+    unsigned long done;
+    timestamp_t deadline;
+} tx_batch_t;
+
+/*
+ * Between eligible TX times the TSN sender sleeps on a timerfd instead of
+ * spinning on the sys count, the parser kicks it through an eventfd when
+ * it queues a frame. It wakes up TX_WAKEUP_MARGIN_NS early and polls the
+ * rest of the way, shorter sleeps are not worth the syscalls.
+ */
+#define TX_WAKEUP_MARGIN_NS     (20000)
+#define TX_SLEEP_MAX_NS         (100000000)
+#define TX_PTP_PERIOD           (1000000000 / 8)    // sys count
+
 stats_t tx_stats;
+tx_batch_stats_t tx_batch_stats;
+tx_sched_stats_t tx_sched_stats;
+
+static int tx_timer_fd = -1;
+static int tx_kick_fd = -1;
+static int tx_sleeping;
 
 char tx_devname[MAX_DEVICE_NAME];
 int tx_fd;
@@ -52,7 +87,7 @@ void packet_dump(BUF_POINTER buffer, int length);
 BUF_POINTER get_reserved_tx_buffer();
 
 static int enqueue(struct tsn_tx_buffer* tx);
-static struct tsn_tx_buffer* dequeue();
+static struct tsn_tx_buffer* dequeue(timestamp_t now);
 
 static int enqueue(struct tsn_tx_buffer* tx) {
 #ifndef DISABLE_TSN_QUEUE
@@ -68,8 +103,7 @@ static int enqueue(struct tsn_tx_buffer* tx) {
 #endif
 }
 
-static struct tsn_tx_buffer* dequeue() {
-    timestamp_t now = gptp_get_timestamp(get_sys_count());
+static struct tsn_tx_buffer* dequeue(timestamp_t now) {
     int queue_index = tsn_select_queue(now);
     if (queue_index < 0) {
         return NULL;
@@ -185,15 +219,23 @@ static void periodic_process_ptp()
     enqueue(buffer);
 }
 
-static void send_burst_packet(char* devname, int fd, int bd_num, unsigned long curr_done, struct xdma_multi_read_write_ioctl *io) {
+static int write_burst(char* devname, int fd, int reg_handle, struct xdma_multi_read_write_ioctl *io, int *bytes_tr) {
+
+	if(reg_handle >= 0) {
+		return xdma_api_write_from_registered_buffers_with_fd(fd, reg_handle,
+								   buffer_pool_base(), io, bytes_tr);
+	}
+	return xdma_api_write_to_multi_buffers_with_fd(devname, fd, io, bytes_tr);
+}
+
+static void send_burst_packet(char* devname, int fd, int reg_handle, int bd_num, unsigned long curr_done, struct xdma_multi_read_write_ioctl *io) {
 
 	int bytes_tr;
 	int id;
 
 	io->bd_num = bd_num;
 	io->done = curr_done;
-	if(xdma_api_write_to_multi_buffers_with_fd(devname, fd, io,
-								   &bytes_tr)) {
+	if(write_burst(devname, fd, reg_handle, io, &bytes_tr)) {
 		tx_stats.txErrors+=bd_num;
 		multi_buffer_pool_free(io);
 		return;
@@ -212,6 +254,126 @@ static void send_burst_packet(char* devname, int fd, int bd_num, unsigned long c
 	multi_buffer_pool_free(io);
 }
 
+static void tx_batch_flush(char* devname, int fd, int reg_handle, tx_batch_t *batch) {
+
+    if(batch->bd_num == 0) {
+        return;
+    }
+
+    tx_batch_stats.hist[batch->bd_num]++;
+    send_burst_packet(devname, fd, reg_handle, batch->bd_num, batch->done, &batch->io);
+    batch->bd_num = 0;
+    batch->done = 0;
+}
+
+/* Returns 1 when the batch is full */
+static int tx_batch_add(tx_batch_t *batch, struct tsn_tx_buffer* tx_buffer, timestamp_t now) {
+
+    timestamp_t gate_end;
+
+    if(batch->bd_num == 0) {
+        batch->deadline = now + TX_BATCH_MAX_DELAY_NS;
+        gate_end = tsn_get_gate_end(now);
+        if(gate_end != TSN_TIMESTAMP_MAX) {
+            gate_end = (gate_end > now + TX_BATCH_GATE_GUARD_NS) ? gate_end - TX_BATCH_GATE_GUARD_NS : now;
+            if(gate_end < batch->deadline) {
+                batch->deadline = gate_end;
+            }
+        }
+    }
+
+    batch->io.bd[batch->bd_num].buffer = (char *)tx_buffer;
+    batch->io.bd[batch->bd_num].len = (unsigned long)(tx_buffer->metadata.frame_length + sizeof(struct tx_metadata));
+    batch->done += batch->io.bd[batch->bd_num].len;
+    batch->bd_num++;
+
+    return (batch->bd_num >= MAX_BD_NUMBER);
+}
+
+/* Called by the parser after queueing a frame for the sender */
+void sender_kick() {
+
+    uint64_t one = 1;
+
+    // orders the parsed queue update before the tx_sleeping load
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&tx_sleeping, __ATOMIC_RELAXED) && tx_kick_fd >= 0) {
+        if(write(tx_kick_fd, &one, sizeof(one)) != sizeof(one)) {
+            debug_printf("%s - could not kick the sender\n", __func__);
+        }
+    }
+}
+
+static int sender_sleep_init() {
+
+    tx_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    tx_kick_fd = eventfd(0, EFD_NONBLOCK);
+    if(tx_timer_fd < 0 || tx_kick_fd < 0) {
+        printf("%s - no timerfd/eventfd, the sender keeps polling\n", __func__);
+        if(tx_timer_fd >= 0) {
+            close(tx_timer_fd);
+        }
+        if(tx_kick_fd >= 0) {
+            close(tx_kick_fd);
+        }
+        tx_timer_fd = tx_kick_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void sender_sleep_exit() {
+
+    if(tx_timer_fd >= 0) {
+        close(tx_timer_fd);
+        close(tx_kick_fd);
+        tx_timer_fd = tx_kick_fd = -1;
+    }
+}
+
+/* Sleep for ns or until the parser queues a frame */
+static void sender_sleep(uint64_t ns) {
+
+    struct itimerspec its;
+    struct pollfd fds[2];
+    struct timespec start, end;
+    uint64_t count;
+
+    if(tx_timer_fd < 0) {
+        return;
+    }
+    if(ns > TX_SLEEP_MAX_NS) {
+        ns = TX_SLEEP_MAX_NS;
+    }
+
+    __atomic_store_n(&tx_sleeping, 1, __ATOMIC_SEQ_CST);
+    // a frame queued before the flag was visible would not kick us
+    if(getParsedQueueCount(&g_parsed_queue) == 0) {
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+        timerfd_settime(tx_timer_fd, 0, &its, NULL);
+
+        fds[0].fd = tx_timer_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = tx_kick_fd;
+        fds[1].events = POLLIN;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        poll(fds, 2, -1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        tx_sched_stats.sleeps++;
+        tx_sched_stats.sleepNs += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    }
+    __atomic_store_n(&tx_sleeping, 0, __ATOMIC_RELAXED);
+
+    // the timer is rearmed by the next sleep, only the kick needs draining
+    if(read(tx_kick_fd, &count, sizeof(count)) == sizeof(count)) {
+        tx_sched_stats.kicks++;
+    }
+}
+
 int pbuffer_dequeue(CircularParsedQueue_t *q, struct xdma_buffer_descriptor *element);
 static void sender_in_tsn_mode(char* devname, int fd, uint64_t size) {
 
@@ -219,14 +381,18 @@ static void sender_in_tsn_mode(char* devname, int fd, uint64_t size) {
     int index;
     uint64_t last_timer = 0;
     struct xdma_buffer_descriptor bd;
-	struct xdma_multi_read_write_ioctl io;
-	int bd_num;
-	unsigned long curr_done;
+	tx_batch_t batch;
+	int reg_handle = buffer_pool_register(fd);
+
+	memset(&batch, 0, sizeof(tx_batch_t));
+	memset(&tx_batch_stats, 0, sizeof(tx_batch_stats_t));
+	memset(&tx_sched_stats, 0, sizeof(tx_sched_stats_t));
+	sender_sleep_init();
 
     while (tx_thread_run) {
         uint64_t now = get_sys_count();
         // Might need to be changed into get_timestamp from gPTP module
-        if ((now - last_timer) > (1000000000 / 8)) {
+        if ((now - last_timer) > TX_PTP_PERIOD) {
             periodic_process_ptp();
             last_timer = now;
         }
@@ -252,34 +418,116 @@ static void sender_in_tsn_mode(char* devname, int fd, uint64_t size) {
         }
 #ifndef DISABLE_TSN_QUEUE
         // Process TX
-		bd_num = 0;
-		curr_done = 0;
+        timestamp_t ts = gptp_get_timestamp(now);
         for (int i = 0; i < 20; i += 1) {
-            struct tsn_tx_buffer* tx_buffer = dequeue();
+            // The frames of a batch are all selected before its deadline
+            if (batch.bd_num && ts >= batch.deadline) {
+                tx_batch_stats.deadlineFlushes++;
+                tx_batch_flush(devname, fd, reg_handle, &batch);
+            }
+            struct tsn_tx_buffer* tx_buffer = dequeue(ts);
             if (tx_buffer == NULL) {
                 break;
             }
-			io.bd[bd_num].buffer = (char *)tx_buffer;
-            io.bd[bd_num].len = (unsigned long)(tx_buffer->metadata.frame_length + sizeof(struct tx_metadata));
-			curr_done += io.bd[bd_num].len;
-            bd_num++;
-//			if(bd_num >= MAX_BD_NUMBER) 
-			if(bd_num >= 1) 
-			{
-                send_burst_packet(devname, fd, bd_num, curr_done, &io);
-				bd_num = 0;
-				curr_done = 0;
-			}
+            if (tx_batch_add(&batch, tx_buffer, ts)) {
+                tx_batch_stats.fullFlushes++;
+                tx_batch_flush(devname, fd, reg_handle, &batch);
+            }
         }
 
-		if(bd_num) {
-            send_burst_packet(devname, fd, bd_num, curr_done, &io);
-		}
+        // Sleep until a queue becomes eligible, the batch or gPTP is due
+        if (getParsedQueueCount(&g_parsed_queue) == 0) {
+            timestamp_t wakeup = tsn_get_next_tx_time(ts);
+            timestamp_t ptp_due = gptp_get_timestamp(last_timer + TX_PTP_PERIOD);
+
+            if (batch.bd_num && batch.deadline < wakeup) {
+                wakeup = batch.deadline;
+            }
+            if (ptp_due < wakeup) {
+                wakeup = ptp_due;
+            }
+            if (wakeup > ts + TX_WAKEUP_MARGIN_NS) {
+                sender_sleep(wakeup - ts - TX_WAKEUP_MARGIN_NS);
+            }
+        }
 #endif
     }
+	tx_batch_flush(devname, fd, reg_handle, &batch);
+	sender_sleep_exit();
+	buffer_pool_unregister(fd, reg_handle);
 }
 
 
+#ifdef __RING_READ_WRITE__
+/*
+ * Post the parsed frames to the driver without waiting for each burst,
+ * sent frames are reaped from the completion queue.
+ */
+static int sender_in_ring_mode(int fd, int reg_handle) {
+
+    struct xdma_ring_map ring;
+    struct xdma_multi_read_write_ioctl bd;
+    struct xdma_ring_sqe *sqe;
+    struct xdma_ring_cqe *cqe;
+    BUF_POINTER base = buffer_pool_base();
+    BUF_POINTER buffer;
+    uint32_t inflight = 0;
+    uint32_t min_complete;
+    int posted;
+    int id;
+
+    if(xdma_api_ring_setup(fd, XDMA_RING_ENTRIES, reg_handle, -1, &ring)) {
+        return -1;
+    }
+    printf("%s: %d entries\n", __func__, XDMA_RING_ENTRIES);
+
+    while (tx_thread_run) {
+        posted = 0;
+        if(xdma_ring_sq_space(&ring) >= MAX_BD_NUMBER &&
+           pbuffer_multi_dequeue(&g_parsed_queue, &bd) > 0) {
+            for(id = 0; id < bd.bd_num; id++) {
+                sqe = xdma_ring_next_sqe(&ring);
+                sqe->user_data = (uint64_t)(uintptr_t)bd.bd[id].buffer;
+                sqe->offset = (uint64_t)(bd.bd[id].buffer - base);
+                sqe->len = bd.bd[id].len;
+                sqe->flags = 0;
+            }
+            xdma_ring_sq_commit(&ring);
+            posted = bd.bd_num;
+            inflight += posted;
+        }
+
+        if(inflight == 0) {
+            continue;
+        }
+
+        /* Only block when there is nothing new to post */
+        min_complete = (posted == 0 || xdma_ring_sq_space(&ring) < MAX_BD_NUMBER) ? 1 : 0;
+        if(xdma_api_ring_enter(&ring, min_complete, XDMA_RING_WAIT_MS, NULL)) {
+            continue;
+        }
+
+        while((cqe = xdma_ring_peek_cqe(&ring)) != NULL) {
+            buffer = (BUF_POINTER)(uintptr_t)cqe->user_data;
+            if(cqe->res > 0) {
+                tx_stats.txPackets++;
+                tx_stats.txBytes += cqe->res;
+            } else {
+                tx_stats.txErrors++;
+            }
+            xdma_ring_cqe_seen(&ring);
+            inflight--;
+            buffer_pool_free(buffer);
+        }
+    }
+
+    /* Frames still posted are cancelled when fd is closed */
+    xdma_api_ring_release(&ring);
+
+    return 0;
+}
+#endif
+
 static void sender_in_normal_mode(char* devname, int fd, uint64_t size) {
 
     struct xdma_multi_read_write_ioctl bd;
@@ -289,6 +537,13 @@ static void sender_in_normal_mode(char* devname, int fd, uint64_t size) {
     int id;
     unsigned long curr_done;
     unsigned long max_done = 0;
+    int reg_handle = buffer_pool_register(fd);
+
+#ifdef __RING_READ_WRITE__
+    if(reg_handle >= 0 && sender_in_ring_mode(fd, reg_handle) == 0) {
+        return;
+    }
+#endif
 
     while (tx_thread_run) {
         bd_num = 0;
@@ -306,8 +561,7 @@ static void sender_in_normal_mode(char* devname, int fd, uint64_t size) {
         }
         bd.done = curr_done;
 
-        if(xdma_api_write_to_multi_buffers_with_fd(devname, fd, &bd,
-                                           &bytes_tr)) {
+        if(write_burst(devname, fd, reg_handle, &bd, &bytes_tr)) {
             tx_stats.txErrors+=bd_num;
             multi_buffer_pool_free(&bd);
             continue;
@@ -334,6 +588,7 @@ static void sender_in_normal_mode(char* devname, int fd, uint64_t size) {
         }
         multi_buffer_pool_free(&bd);
     }
+    buffer_pool_unregister(fd, reg_handle);
 }
 
 void sender_in_loopback_mode(char* devname, int fd, char *fn, uint64_t size) {
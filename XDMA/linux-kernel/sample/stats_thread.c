@@ -18,6 +18,7 @@
 #include <sched.h>
 
 #include "xdma_common.h"
+#include "buffer_handler.h"
 
 #define MAX_COUNTERS            29
 
@@ -36,6 +37,17 @@ char* counter_name[MAX_COUNTERS] = {
     "txErrors",
     "txPps",
     "txbps",
+    "poolFree",
+    "poolCached",
+    "poolInUse",
+    "cacheHits",
+    "cacheMisses",
+    "txBatchFull",
+    "txBatchDeadline",
+    "txBatchSizes",
+    "txSleeps",
+    "txKicks",
+    "txSleepPct",
     NULL,
 };
 
@@ -52,6 +64,17 @@ enum {
     COUNTERS_TXERRORS,
     COUNTERS_TXPPS,
     COUNTERS_TXBPS,
+    COUNTERS_POOLFREE,
+    COUNTERS_POOLCACHED,
+    COUNTERS_POOLINUSE,
+    COUNTERS_CACHEHITS,
+    COUNTERS_CACHEMISSES,
+    COUNTERS_TXBATCHFULL,
+    COUNTERS_TXBATCHDEADLINE,
+    COUNTERS_TXBATCHSIZES,
+    COUNTERS_TXSLEEPS,
+    COUNTERS_TXKICKS,
+    COUNTERS_TXSLEEPPCT,
 
     COUNTERS_CNT,
 };
@@ -63,9 +86,14 @@ time_t  stopTime;
 
 extern stats_t rx_stats;
 extern stats_t tx_stats;
+extern tx_batch_stats_t tx_batch_stats;
+extern tx_sched_stats_t tx_sched_stats;
 
 stats_t cs;     /* total stats */
 stats_t os;     /* total stats */
+buffer_pool_stats_t ps;
+unsigned long long  txSleepPct;     /* of the last interval the TSN sender slept */
+unsigned long long  lastSleepNs;
 unsigned long long  currTv;
 unsigned long long  lastTv;
 
@@ -84,6 +112,10 @@ void calculate_stats()
     cs.txPps = ((tx_stats.txPackets - os.txPackets) * 1000000) / usec;
     cs.txbps = ((tx_stats.txBytes - os.txBytes) * 8000000) / usec;
     memcpy(&os, &cs, sizeof(stats_t));
+    buffer_pool_get_stats(&ps);
+
+    txSleepPct = ((tx_sched_stats.sleepNs - lastSleepNs) / 10) / usec;
+    lastSleepNs = tx_sched_stats.sleepNs;
 }
 
 void print_counter() {
@@ -113,6 +145,32 @@ void print_counter() {
     printf("%16llu\n", cs.txPps);
     printf("%20s", counter_name[COUNTERS_TXBPS]);
     printf("%16llu\n", cs.txbps);
+    printf("%20s", counter_name[COUNTERS_POOLFREE]);
+    printf("%16llu\n", ps.free);
+    printf("%20s", counter_name[COUNTERS_POOLCACHED]);
+    printf("%16llu\n", ps.cached);
+    printf("%20s", counter_name[COUNTERS_POOLINUSE]);
+    printf("%16llu\n", ps.in_use);
+    printf("%20s", counter_name[COUNTERS_CACHEHITS]);
+    printf("%16llu\n", ps.cache_hits);
+    printf("%20s", counter_name[COUNTERS_CACHEMISSES]);
+    printf("%16llu\n", ps.cache_misses);
+    printf("%20s", counter_name[COUNTERS_TXBATCHFULL]);
+    printf("%16llu\n", tx_batch_stats.fullFlushes);
+    printf("%20s", counter_name[COUNTERS_TXBATCHDEADLINE]);
+    printf("%16llu\n", tx_batch_stats.deadlineFlushes);
+    /* multi writes per batch size 1 ~ MAX_BD_NUMBER */
+    printf("%20s", counter_name[COUNTERS_TXBATCHSIZES]);
+    for(int id = 1; id <= MAX_BD_NUMBER; id++) {
+        printf(" %d:%llu", id, tx_batch_stats.hist[id]);
+    }
+    printf("\n");
+    printf("%20s", counter_name[COUNTERS_TXSLEEPS]);
+    printf("%16llu\n", tx_sched_stats.sleeps);
+    printf("%20s", counter_name[COUNTERS_TXKICKS]);
+    printf("%16llu\n", tx_sched_stats.kicks);
+    printf("%20s", counter_name[COUNTERS_TXSLEEPPCT]);
+    printf("%16llu\n", txSleepPct);
 
 }
 
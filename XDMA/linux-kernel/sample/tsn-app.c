@@ -19,6 +19,7 @@
 #include "platform_config.h"
 #include "xdma_common.h"
 #include "buffer_handler.h"
+#include "tsn.h"
 
 int watchStop = 1;
 int rx_thread_run = 1;
@@ -197,17 +198,22 @@ int process_main_setCmd(int argc, const char *argv[], menu_command_t *menu_tbl);
 
 menu_command_t  mainCommand_tbl[] = {
     { "run",  EXECUTION_ATTR,   process_main_runCmd, \
-        "   run -m <mode> -f <file name> -s <size>", \
+        "   run -m <mode> -f <file name> -s <size> -b <buffer size> -g <hugepage> -l <link speed>", \
         "   Run tsn test application with data szie in mode\n"
         "            <mode> default value: 0 (0: tsn, 1: normal, 2: loopback-integrity check, 3: performance)\n"
         "       <file name> default value: ./tests/data/datafile0_4K.bin(Binary file for test)\n"
-        "            <size> default value: 1024 (64 ~ 4096)"},
+        "            <size> default value: 1024 (64 ~ <buffer size>)\n"
+        "     <buffer size> default value: 4096 (power of 2, 2048 ~ 65536, above 4096 needs hugepages)\n"
+        "        <hugepage> default value: 0 (0: none, 2M, 1G)\n"
+        "      <link speed> default value: 100 (Mbps, 10 ~ 10000, for the Qav credits)"},
     { "tx",   EXECUTION_ATTR,   process_main_txCmd, \
-        "   tx -m <mode> -f <file name> -s <size>", \
+        "   tx -m <mode> -f <file name> -s <size> -b <buffer size> -g <hugepage>", \
         "   Run tx test application with data szie in mode\n"
         "            <mode> default value: 0 (0: tsn, 1: normal, 2: loopback-integrity check, 3: performance)\n"
         "       <file name> default value: ./sample/pint-udp-response-packet.dat(Binary file for test)\n"
-        "            <size> default value: 1508 (64 ~ 4096)"},
+        "            <size> default value: 1508 (64 ~ <buffer size>)\n"
+        "     <buffer size> default value: 4096 (power of 2, 2048 ~ 65536, above 4096 needs hugepages)\n"
+        "        <hugepage> default value: 0 (0: none, 2M, 1G)"},
     {"show",  EXECUTION_ATTR, process_main_showCmd, \
         "   show register [gen, rx, tx]\n", \
         "   Show XDMA resource"},
@@ -217,11 +223,30 @@ menu_command_t  mainCommand_tbl[] = {
     { 0,           EXECUTION_ATTR,   NULL, " ", " "}
 };
 
-#define MAIN_RUN_OPTION_STRING  "m:s:f:hv"
+/* "0", "2M" or "1G" */
+static int str2hugepage(const char *str, unsigned long *hugepage) {
+
+    if(strcmp(str, "0") == 0) {
+        *hugepage = 0;
+    } else if(strcasecmp(str, "2M") == 0) {
+        *hugepage = 2UL << 20;
+    } else if(strcasecmp(str, "1G") == 0) {
+        *hugepage = 1UL << 30;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+#define MAIN_RUN_OPTION_STRING  "m:s:f:b:g:l:hv"
 int process_main_runCmd(int argc, const char *argv[],
                             menu_command_t *menu_tbl) {
     int mode  = DEFAULT_RUN_MODE;
-    int DataSize = MAX_BUFFER_LENGTH;
+    int DataSize = DEF_BUFFER_LENGTH;
+    int BufferSize = DEF_BUFFER_LENGTH;
+    unsigned long HugepageSize = 0;
+    int LinkSpeed = TSN_DEF_LINK_SPEED;
     char InputFileName[256] = TEST_DATA_FILE_NAME;
     int argflag;
 
@@ -243,8 +268,26 @@ int process_main_runCmd(int argc, const char *argv[],
                 printf("Invalid parameter given or out of range for '-s'.");
                 return -1;
             }
-            if ((DataSize < 64) || (DataSize > MAX_BUFFER_LENGTH)) {
-                printf("DataSize %d is out of range.", DataSize);
+            break;
+        case 'b':
+            if (str2int(optarg, &BufferSize) != 0) {
+                printf("Invalid parameter given or out of range for '-b'.");
+                return -1;
+            }
+            break;
+        case 'g':
+            if (str2hugepage(optarg, &HugepageSize) != 0) {
+                printf("Invalid parameter given or out of range for '-g'.");
+                return -1;
+            }
+            break;
+        case 'l':
+            if (str2int(optarg, &LinkSpeed) != 0) {
+                printf("Invalid parameter given or out of range for '-l'.");
+                return -1;
+            }
+            if ((LinkSpeed < 10) || (LinkSpeed > 10000)) {
+                printf("Link speed %d is out of range.", LinkSpeed);
                 return -1;
             }
             break;
@@ -265,6 +308,15 @@ int process_main_runCmd(int argc, const char *argv[],
         }
     }
 
+    if (buffer_pool_configure(BufferSize, HugepageSize, DEF_RX_DEVICE_NAME)) {
+        return -1;
+    }
+    if ((DataSize < 64) || (DataSize > MAX_BUFFER_LENGTH)) {
+        printf("DataSize %d is out of range.", DataSize);
+        return -1;
+    }
+    tsn_set_link_speed(LinkSpeed);
+
     return tsn_app(mode, DataSize, InputFileName);
 }
 
@@ -312,11 +364,13 @@ int tx_app(int mode, int DataSize, char *InputFileName) {
     return 0;
 }
 
-#define MAIN_TX_OPTION_STRING  "m:s:f:hv"
+#define MAIN_TX_OPTION_STRING  "m:s:f:b:g:hv"
 int process_main_txCmd(int argc, const char *argv[],
                             menu_command_t *menu_tbl) {
     int mode  = RUN_MODE_DEBUG;
     int DataSize = 1508;
+    int BufferSize = DEF_BUFFER_LENGTH;
+    unsigned long HugepageSize = 0;
     char InputFileName[256] = "./sample/pint-udp-response-packet.dat"; /*TEST_DATA_FILE_NAME;*/
     int argflag;
 
@@ -338,8 +392,16 @@ int process_main_txCmd(int argc, const char *argv[],
                 printf("Invalid parameter given or out of range for '-s'.");
                 return -1;
             }
-            if ((DataSize < 64) || (DataSize > MAX_BUFFER_LENGTH)) {
-                printf("DataSize %d is out of range.", DataSize);
+            break;
+        case 'b':
+            if (str2int(optarg, &BufferSize) != 0) {
+                printf("Invalid parameter given or out of range for '-b'.");
+                return -1;
+            }
+            break;
+        case 'g':
+            if (str2hugepage(optarg, &HugepageSize) != 0) {
+                printf("Invalid parameter given or out of range for '-g'.");
                 return -1;
             }
             break;
@@ -361,6 +423,14 @@ int process_main_txCmd(int argc, const char *argv[],
         }
     }
 
+    if (buffer_pool_configure(BufferSize, HugepageSize, DEF_TX_DEVICE_NAME)) {
+        return -1;
+    }
+    if ((DataSize < 64) || (DataSize > MAX_BUFFER_LENGTH)) {
+        printf("DataSize %d is out of range.", DataSize);
+        return -1;
+    }
+
     return tx_app(mode, DataSize, InputFileName);
 }
 
@@ -9,15 +9,19 @@
 
 #define PRIO_QUEUE_COUNT (TSN_QUEUE_COUNT - 1)
 
-#define CONNECTION_SPEED 100000000  // 100 Mbps FIXME
-#define CBS_FRACTION_BITS 48
+#define NS_IN_1S 1000000000ULL    // The CBS slopes are credits/s
+#define ETH_MIN_FRAME_SIZE 60       // Without FCS
+#define ETH_GAP_SIZE (8 + 4 + 12)   // Preamble + SFD, FCS, IFG
 
 static struct tsn_tx_queues tx_queues;
 static struct api_tas_schedules tas_schedules;
 static struct api_cbs_configs cbs_configs;
+static uint32_t ps_per_byte = 8000000 / TSN_DEF_LINK_SPEED;
+static timestamp_t last_select_time;
 
 static void get_qbv_status(timestamp_t timestamp, bool* qbv_gates_open);
 static void get_qav_status(timestamp_t timestamp, bool* qav_enabled, int* qav_credits);
+static void update_gate_table();
 
 
 int tsn_init_queue() {
@@ -65,6 +69,7 @@ int tsn_init_configs() {
 
     tas_schedules.oper_cycle_time = tas_schedules.admin_cycle_time;
     tas_schedules.oper_cycle_time_extention = tas_schedules.admin_cycle_time_extention;
+    update_gate_table();
 
     // CBS config
     for (int i = 0; i < TSN_QUEUE_COUNT; i++) {
@@ -79,14 +84,30 @@ int tsn_init_configs() {
     cbs_configs.configs[0].sendslope = -90;
     cbs_configs.configs[0].idleslope = 10;
 
-    cbs_configs.configs[0].current_credit = (int64_t)0 << CBS_FRACTION_BITS;
-    cbs_configs.configs[0].last_update_time = gptp_get_timestamp(get_sys_count());
+    tsn_cbs_init(&cbs_configs.configs[0].cbs,
+                 cbs_configs.configs[0].idleslope, cbs_configs.configs[0].sendslope,
+                 cbs_configs.configs[0].hicredit, cbs_configs.configs[0].locredit,
+                 NS_IN_1S, gptp_get_timestamp(get_sys_count()));
 
     return 0;
 }
 
+void tsn_set_link_speed(uint32_t speed_mbps) {
+    ps_per_byte = tsn_ps_per_byte(speed_mbps);
+}
+
 int tsn_select_queue(timestamp_t timestamp) {
-    // TODO: Make it faster
+    last_select_time = timestamp;
+
+    // Nothing to send, skip the gate and credit calculation
+    int queued = 0;
+    for (int i = 0; i < TSN_QUEUE_COUNT; i++) {
+        queued += tx_queues.tx_queues[i].count;
+    }
+    if (queued == 0) {
+        return -1;
+    }
+
     // Check which queue is open (qbv)
     bool qbv_gates_open[TSN_QUEUE_COUNT] = {true,};
     get_qbv_status(timestamp, qbv_gates_open);  // TODO: implement
@@ -151,14 +172,99 @@ int tsn_select_queue(timestamp_t timestamp) {
     return -1;
 }
 
+// Precompute per oper slot and queue how far away the gate opens next
+static void update_gate_table() {
+    struct api_tas_schedules* s = &tas_schedules;
+    uint32_t length = s->oper_control_list_length;
+    uint64_t start = 0;
+
+    s->cycle_ns = s->oper_cycle_time * 1000000000ULL + s->oper_cycle_time_extention;
+    tsn_recip_init(&s->cycle, s->cycle_ns);
+    for (uint32_t i = 0; i < length; i++) {
+        s->slot_start_ns[i] = start;
+        start += s->oper_control_list[i].duration_ns;
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        for (int q = 0; q < TSN_QUEUE_COUNT; q++) {
+            s->next_open_ns[i][q] = TSN_TIMESTAMP_MAX;
+            for (uint32_t k = 1; k <= length; k++) {
+                uint32_t j = (i + k) % length;
+                if ((s->oper_control_list[j].gates_bit >> q) & 1) {
+                    s->next_open_ns[i][q] = s->slot_start_ns[j] - s->slot_start_ns[i] +
+                                            ((j <= i) ? s->cycle_ns : 0);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Earliest time >= timestamp at which the gate of the queue is open
+static timestamp_t get_gate_open_time(int queue_index, timestamp_t timestamp) {
+    if (tas_schedules.gate_enabled == false || tas_schedules.cycle_ns == 0) {
+        return timestamp;
+    }
+
+    uint64_t mod_time = tsn_tas_cycle_offset(timestamp, 0, &tas_schedules.cycle);
+    int index = tsn_tas_find_slot(tas_schedules.slot_start_ns, tas_schedules.oper_control_list_length, mod_time);
+
+    if ((tas_schedules.oper_control_list[index].gates_bit >> queue_index) & 1) {
+        return timestamp;
+    }
+    if (tas_schedules.next_open_ns[index][queue_index] == TSN_TIMESTAMP_MAX) {
+        return TSN_TIMESTAMP_MAX;
+    }
+
+    return timestamp - (mod_time - tas_schedules.slot_start_ns[index]) +
+           tas_schedules.next_open_ns[index][queue_index];
+}
+
+// Earliest time >= timestamp at which the credit of the queue is >= 0
+static timestamp_t get_credit_time(int queue_index, timestamp_t timestamp) {
+    struct api_cbs_entry* config = &cbs_configs.configs[queue_index];
+
+    if (config->is_enabled == false) {
+        return timestamp;
+    }
+    if (config->idleslope <= 0) {
+        return TSN_TIMESTAMP_MAX;
+    }
+
+    return (config->cbs.available_at > timestamp) ? config->cbs.available_at : timestamp;
+}
+
 timestamp_t tsn_get_next_tx_time(timestamp_t timestamp) {
-    // TODO: implement
-    // * Gets the next TX time for the given queue.
-    // * Next TX time will be the time which any of queue satisfying these:
-    // * - The queue must have at lease one packet
-    // * - Qbv slot is open for the queue if Qbv is enabled
-    // * - Qav credit >= 0 if CBS is enabled
-    return 0;
+    timestamp_t next_tx_time = TSN_TIMESTAMP_MAX;
+
+    for (int i = 0; i < TSN_QUEUE_COUNT; i++) {
+        if (tx_queues.tx_queues[i].count == 0) continue;
+
+        timestamp_t tx_time = get_credit_time(i, timestamp);
+        if (tx_time == TSN_TIMESTAMP_MAX) continue;
+        // The credit keeps growing while the gate is closed
+        tx_time = get_gate_open_time(i, tx_time);
+        if (tx_time < next_tx_time) {
+            next_tx_time = tx_time;
+        }
+    }
+
+    return next_tx_time;
+}
+
+timestamp_t tsn_get_gate_end(timestamp_t timestamp) {
+    if (tas_schedules.gate_enabled == false || tas_schedules.cycle_ns == 0) {
+        return TSN_TIMESTAMP_MAX;
+    }
+
+    uint64_t mod_time = tsn_tas_cycle_offset(timestamp, 0, &tas_schedules.cycle);
+    uint32_t index = tsn_tas_find_slot(tas_schedules.slot_start_ns, tas_schedules.oper_control_list_length, mod_time);
+
+    // Durations shorter than the cycle, the rest of the cycle is the last slot
+    uint64_t slot_end = (index + 1 < tas_schedules.oper_control_list_length) ?
+                        tas_schedules.slot_start_ns[index + 1] : tas_schedules.cycle_ns;
+
+    return timestamp + (slot_end - mod_time);
 }
 
 struct tsn_tx_buffer* tsn_queue_peek(int queue_index) {
@@ -186,26 +292,14 @@ struct tsn_tx_buffer* tsn_queue_dequeue(int queue_index) {
 
     // if Qav enabled queue, update credit based on the packet size
     if (cbs_configs.configs[queue_index].is_enabled) {
-        printf_debug("Dequeueing from Qav enabled queue %d\n", queue_index);
-        int packet_size_bits = result->metadata.frame_length * 8;
-        int sendslope = cbs_configs.configs[queue_index].sendslope;
-        int hicredit = cbs_configs.configs[queue_index].hicredit;
-        int locredit = cbs_configs.configs[queue_index].locredit;
-        int64_t current_credit = cbs_configs.configs[queue_index].current_credit;
-
-        int64_t delta_time_ns = packet_size_bits * 1000000000 / CONNECTION_SPEED;
-        int64_t delta_credit = (delta_time_ns * sendslope) * (((int64_t)1 << CBS_FRACTION_BITS) / 1000000000);
-        printf_debug("Delta is %lld, credit = %016llx\n", delta_credit, current_credit);
-
-        current_credit += delta_credit;
-        if (current_credit > (int64_t)hicredit << CBS_FRACTION_BITS) {
-            current_credit = (int64_t)hicredit << CBS_FRACTION_BITS;
-        } else if (current_credit < (int64_t)locredit << CBS_FRACTION_BITS) {
-            current_credit = (int64_t)locredit << CBS_FRACTION_BITS;
-        }
-
-        cbs_configs.configs[queue_index].current_credit = current_credit;
-        cbs_configs.configs[queue_index].last_update_time += delta_time_ns;
+        struct tsn_cbs* cbs = &cbs_configs.configs[queue_index].cbs;
+        // Starts on the wire once the previous frame of the queue is done
+        timestamp_t start = (last_select_time > cbs->last_update) ? last_select_time : cbs->last_update;
+
+        tsn_cbs_spend(cbs, start, tsn_bytes_to_ns(result->metadata.frame_length,
+                                                  ETH_MIN_FRAME_SIZE, ETH_GAP_SIZE, ps_per_byte));
+        printf_debug("Dequeueing from Qav enabled queue %d, credit = %lld\n",
+                     queue_index, (long long)tsn_cbs_credit_int(cbs, cbs->last_update));
     }
 
     return result;
@@ -236,7 +330,7 @@ int tsn_queue_enqueue(struct tsn_tx_buffer* tx_buffer, int queue_index) {
 
 static void get_qbv_status(timestamp_t timestamp, bool* qbv_gates_open) {
 
-    if (tas_schedules.gate_enabled == false) {
+    if (tas_schedules.gate_enabled == false || tas_schedules.cycle_ns == 0) {
         // Qbv is disabled
         // qbv_gates_open is already all true
         return;
@@ -244,76 +338,36 @@ static void get_qbv_status(timestamp_t timestamp, bool* qbv_gates_open) {
 
     // FIXME: Consider config change
 
-    // MOD the time
-    uint64_t cycle_time = tas_schedules.oper_cycle_time * 1000000000ULL + tas_schedules.oper_cycle_time_extention;
-    uint64_t mod_time = timestamp % cycle_time;
+    // Find the active schedule, the last slot lasts until the end of the cycle
+    uint64_t mod_time = tsn_tas_cycle_offset(timestamp, 0, &tas_schedules.cycle);
+    int index = tsn_tas_find_slot(tas_schedules.slot_start_ns, tas_schedules.oper_control_list_length, mod_time);
+    struct api_tas_entry* schedule = &(tas_schedules.oper_control_list[index]);
 
-    // TODO: Could make table for faster loop?
-
-    // Find the active schedule
-    for (int index = 0; index < tas_schedules.oper_control_list_length; index++) {
-        struct api_tas_entry* schedule = &(tas_schedules.oper_control_list[index]);
-        uint64_t gate_open_duration_ns = schedule->duration_ns;
-        if (mod_time >= gate_open_duration_ns) {
-            // This schedule is not active, Move onto next schedule
-            mod_time -= gate_open_duration_ns;
-            continue;
-        }
-
-        // This schedule is active
-        for (int i = 0; i < TSN_QUEUE_COUNT; i++) {
-            qbv_gates_open[i] = (schedule->gates_bit >> i) & 1;
-        }
-        printf_debug("Gates status: %d %d %d %d %d %d %d %d\n",
-                schedule->gates_bit >> 7 & 1,
-                schedule->gates_bit >> 6 & 1,
-                schedule->gates_bit >> 5 & 1,
-                schedule->gates_bit >> 4 & 1,
-                schedule->gates_bit >> 3 & 1,
-                schedule->gates_bit >> 2 & 1,
-                schedule->gates_bit >> 1 & 1,
-                schedule->gates_bit >> 0 & 1);
-        return;
+    for (int i = 0; i < TSN_QUEUE_COUNT; i++) {
+        qbv_gates_open[i] = (schedule->gates_bit >> i) & 1;
     }
-
-    printf_debug("Error: No active schedule found\n");
+    printf_debug("Gates status: %d %d %d %d %d %d %d %d\n",
+            schedule->gates_bit >> 7 & 1,
+            schedule->gates_bit >> 6 & 1,
+            schedule->gates_bit >> 5 & 1,
+            schedule->gates_bit >> 4 & 1,
+            schedule->gates_bit >> 3 & 1,
+            schedule->gates_bit >> 2 & 1,
+            schedule->gates_bit >> 1 & 1,
+            schedule->gates_bit >> 0 & 1);
 }
 
 static void get_qav_status(timestamp_t timestamp, bool* qav_enabled, int* qav_credits) {
     // TODO: To speed up, Could skip calculating credit on closed queue (Qbv)
     // But not implement that now.
 
-    // To avoid loss, lazy update the credit before it reaches >= 0
-    // But return the credit as it is
-
+    // The credit is a function of the time since the last spend, nothing to update
     for (int i = 0; i < TSN_QUEUE_COUNT; i++) {
         qav_enabled[i] = cbs_configs.configs[i].is_enabled;
         if (cbs_configs.configs[i].is_enabled == false) {
             continue;
         }
 
-        int64_t credit = cbs_configs.configs[i].current_credit;
-        if (timestamp < cbs_configs.configs[i].last_update_time) {
-            // Skip calculating due to sending is ongoing
-            printf_debug("Skip %d = %llx (%d)\n", i, credit, credit >> 48);
-        } else {
-            int64_t time_delta = timestamp - cbs_configs.configs[i].last_update_time;
-            int64_t delta = ((int64_t)cbs_configs.configs[i].idleslope) * time_delta * ((1LL << CBS_FRACTION_BITS) / 1000000000);
-
-            credit += delta;
-            if (credit > (int64_t)cbs_configs.configs[i].hicredit << CBS_FRACTION_BITS) {
-                credit = (int64_t)cbs_configs.configs[i].hicredit << CBS_FRACTION_BITS;
-            } else if (credit < (int64_t)cbs_configs.configs[i].locredit << CBS_FRACTION_BITS) {
-                credit = (int64_t)cbs_configs.configs[i].locredit << CBS_FRACTION_BITS;
-            }
-
-            if (credit >= 0) {
-                // Update the credit and last update time
-                cbs_configs.configs[i].last_update_time = timestamp;
-                cbs_configs.configs[i].current_credit = credit;
-            }
-        }
-
-        qav_credits[i] = credit >> CBS_FRACTION_BITS;
+        qav_credits[i] = tsn_cbs_credit_int(&cbs_configs.configs[i].cbs, timestamp);
     }
 }
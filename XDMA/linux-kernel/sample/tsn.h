@@ -7,6 +7,8 @@
 #include "api.h"
 
 #define TSN_QUEUE_SIZE 40
+#define TSN_TIMESTAMP_MAX ((timestamp_t)-1)
+#define TSN_DEF_LINK_SPEED 100  // Mbps
 
 
 // Ring queue
@@ -34,6 +36,12 @@ int tsn_init_queue();
  */
 int tsn_init_configs();
 
+/**
+ * Sets the link speed used for the Qav credits.
+ * @param speed_mbps The link speed in Mbps.
+ */
+void tsn_set_link_speed(uint32_t speed_mbps);
+
 /**
  * Selects the queue to use for the next packet.
  * @param tx_buffer The TSN TX buffer.
@@ -49,12 +57,20 @@ int tsn_select_queue(timestamp_t timestamp);
  * - Qbv slot is open for the queue if Qbv is enabled
  * - Qav credit >= 0 if CBS is enabled
  * XXX: Must be checked manually if new packet is inserted into the queues.
- * XXX: This function would be complicated.
  * @param timestamp The timestamp now.
- * @return The next TX time
+ * @return The next TX time, timestamp if a queue can send now.
+ *         TSN_TIMESTAMP_MAX if no queue will be able to send.
  */
 timestamp_t tsn_get_next_tx_time(timestamp_t timestamp);
 
+/**
+ * Gets the end of the Qbv slot active at the given time, frames selected
+ * in this slot must be handed to the hardware before it.
+ * @param timestamp The timestamp now.
+ * @return The end of the slot. TSN_TIMESTAMP_MAX if Qbv is disabled.
+ */
+timestamp_t tsn_get_gate_end(timestamp_t timestamp);
+
 /**
  * Peek the packet from the given queue.
  * @param queue_index The queue index. 0..7
@@ -1,15 +1,28 @@
 #ifndef __XDMA_COMMON_H__
 #define __XDMA_COMMON_H__
 
+#include "lockfree_ring.h"
+
 #define __BURST_READ_WRITE__
+#define __RING_READ_WRITE__     // Needs __BURST_READ_WRITE__, falls back to it
+
+#define XDMA_RING_ENTRIES (256)
+#define XDMA_RING_WAIT_MS (100)
+
+#define XDMA_MULTI_BD_BATCH (128)   // Frames per burst read, capped by the driver
 
 #define BUFFER_ALIGNMENT  (0x1000)
-#define MAX_BUFFER_LENGTH (0x1000)
+#define DEF_BUFFER_LENGTH (0x1000)
+#define MIN_BUFFER_LENGTH (0x800)
+#define MAX_BUFFER_LENGTH_LIMIT (0x10000)   // Above 0x1000 needs a hugepage arena
+/* Buffer size of the pool, a power of 2 set by buffer_pool_configure() */
+extern int buffer_length;
+#define MAX_BUFFER_LENGTH (buffer_length)
 //#define MAX_BUFFER_LENGTH (0x10000 * 16)
 //#define NUMBER_OF_BUFFER  (4096)    // (2048)
 #define NUMBER_OF_BUFFER  (2048)    // (2048)
 #define BUFFER_LUMP_SIZE  (MAX_BUFFER_LENGTH * NUMBER_OF_BUFFER)
-#define NUMBER_OF_POOL_BUFFER (NUMBER_OF_BUFFER + 1)
+#define NUMBER_OF_POOL_BUFFER (NUMBER_OF_BUFFER)    // Power of 2, see lockfree_ring.h
 #define NUMBER_OF_RESERVED_BUFFER (4)
 #define BUFFER_ADDRESS_MASK (~(MAX_BUFFER_LENGTH - 1))
 
@@ -18,25 +31,20 @@ typedef char *    BUF_POINTER;
 #define EMPTY_ELEMENT (NULL)
 
 typedef struct buffer_stack {
-    BUF_POINTER elements[NUMBER_OF_POOL_BUFFER];
-    int top;
-    pthread_mutex_t mutex;
+    mpmc_ring_t ring;
+    void *elements[NUMBER_OF_POOL_BUFFER];
 } buffer_stack_t;
 
 typedef struct reserved_buffer_stack {
-    BUF_POINTER elements[NUMBER_OF_RESERVED_BUFFER];
-    int top;
-    pthread_mutex_t mutex;
+    mpmc_ring_t ring;
+    void *elements[NUMBER_OF_RESERVED_BUFFER];
 } reserved_buffer_stack_t;
 
 #define NUMBER_OF_QUEUE  NUMBER_OF_BUFFER
 typedef char *    QueueElement;
 typedef struct circular_queue{
-    QueueElement elements[NUMBER_OF_QUEUE];
-    int front;
-    int rear;
-    int count;
-    pthread_mutex_t mutex;
+    spsc_ring_t ring;       // receiver -> parser (or sender in loopback mode)
+    struct xdma_buffer_descriptor elements[NUMBER_OF_QUEUE];
 } CircularQueue_t;
 
 typedef struct stats {
@@ -55,6 +63,20 @@ typedef struct stats {
 
 } stats_t;
 
+/* TSN TX batches, hist[n] counts the multi writes of n frames */
+typedef struct tx_batch_stats {
+    unsigned long long  hist[MAX_BD_NUMBER + 1];
+    unsigned long long  fullFlushes;        // MAX_BD_NUMBER frames
+    unsigned long long  deadlineFlushes;    // batching delay or gate slot end reached
+} tx_batch_stats_t;
+
+/* TSN sender sleeps between eligible TX times */
+typedef struct tx_sched_stats {
+    unsigned long long  sleeps;
+    unsigned long long  kicks;              // woken up by the parser
+    unsigned long long  sleepNs;
+} tx_sched_stats_t;
+
 #define MAX_DEVICE_NAME 20
 #define TEST_DATA_FILE_NAME "./tests/data/datafile0_4K.bin"
 #define TEST_DATA_SIZE 1024
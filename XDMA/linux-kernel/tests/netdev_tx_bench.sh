@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Compare TX packet rate and latency of the xdma network interface
+# for several TX descriptor ring sizes.
+# tx_ring_size=2 keeps a single frame in flight.
+#
+
+display_help() {
+	echo "$0 <interface> [peer ip] [packet count] [packet size] [ring sizes]"
+	echo "interface: xdma network interface, e.g. enp1s0"
+	echo "peer ip: optional, measure round trip latency with ping"
+	echo "packet count: frames sent by pktgen per run, default 1000000"
+	echo "packet size: frame size in bytes, default 64"
+	echo "ring sizes: quoted list of tx_ring_size values, default \"2 16 64 256\""
+	exit;
+}
+
+if [ "$#" -lt 1 ] || [ "$1" == "help" ]; then
+	display_help
+fi;
+
+ifname=$1
+peer=$2
+count=${3:-1000000}
+pkt_size=${4:-64}
+ring_sizes=${5:-"2 16 64 256"}
+pgdev=/proc/net/pktgen
+
+# Make sure only root can run our script
+if [[ $EUID -ne 0 ]]; then
+	echo "This script must be run as root" 1>&2
+	exit 1
+fi
+
+modprobe pktgen
+if [ ! -d $pgdev ]; then
+	echo "Error: pktgen is not available"
+	exit 1
+fi
+
+pgset() {
+	echo "$2" > $1
+}
+
+for ring_size in $ring_sizes; do
+	lsmod | grep -q xdma && rmmod xdma
+	insmod ../xdma/xdma.ko tx_ring_size=$ring_size
+	if [ $? -ne 0 ]; then
+		echo "Error: xdma driver did not load properly"
+		exit 1
+	fi
+	ip link set $ifname up
+	sleep 2
+
+	pgset $pgdev/kpktgend_0 "rem_device_all"
+	pgset $pgdev/kpktgend_0 "add_device $ifname"
+	pgset $pgdev/$ifname "count $count"
+	pgset $pgdev/$ifname "pkt_size $pkt_size"
+	pgset $pgdev/$ifname "delay 0"
+	pgset $pgdev/$ifname "dst_mac ff:ff:ff:ff:ff:ff"
+	pgset $pgdev/pgctrl "start"
+
+	pps=`grep -o -E "[0-9]+pps" $pgdev/$ifname | head -1`
+	echo "tx_ring_size=$ring_size size=$pkt_size: $pps"
+
+	if [ -n "$peer" ]; then
+		rtt=`ping -q -c 1000 -i 0.001 $peer | grep rtt`
+		echo "tx_ring_size=$ring_size latency: $rtt"
+	fi
+
+	pgset $pgdev/kpktgend_0 "rem_device_all"
+done
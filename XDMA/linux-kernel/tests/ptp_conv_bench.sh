@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# Measure the cost of the sysclock <-> timestamp conversions done by the
+# xdma driver for every transmitted frame.
+#
+
+display_help() {
+	echo "$0 [loops]"
+	echo "loops: conversions per direction, default 1000000"
+	exit;
+}
+
+if [ "$1" == "help" ]; then
+	display_help
+fi;
+
+loops=${1:-1000000}
+
+# Make sure only root can run our script
+if [[ $EUID -ne 0 ]]; then
+	echo "This script must be run as root" 1>&2
+	exit 1
+fi
+
+lsmod | grep -q xdma && rmmod xdma
+insmod ../xdma/xdma.ko ptp_bench_loops=$loops
+if [ $? -ne 0 ]; then
+	echo "Error: xdma driver did not load properly"
+	exit 1
+fi
+
+dmesg | grep "ptp bench" | tail -1
@@ -0,0 +1,67 @@
+#!/bin/sh
+
+##############################################################
+#
+# throughput of multi-MiB transfers for each xfer_queue_depth
+# (transfers a blocking request keeps queued on an engine)
+#
+##############################################################
+
+tool_path=../../tools
+param=/sys/module/xdma/parameters/xfer_queue_depth
+
+if [ $# -lt 3 ]; then
+	echo -ne "$0: <xid> <h2c channel> <c2h channel> [io min] [io max] "
+	echo "[count] [depths]"
+	echo -e "\t<xdma id>: xdma<N>"
+	echo -e "\th2c channel: H2C channel #, 0-based, >= 4 to skip H2C"
+	echo -e "\tc2h channel: C2H channel #, 0-based, >= 4 to skip C2H"
+	echo -e "\t[io min],[io max]: dma size in byte, io size start from"
+	echo -e "\t\tio_min, double each time until reaches io_max,"
+	echo -e "\t\tdefault 4MiB ~ 64MiB"
+	echo -e "\t[count]: transfers per size, default 16"
+	echo -e "\t[depths]: queue depths to compare, default \"1 2 3\""
+	exit 1
+fi
+
+xid=$1
+h2cno=$2
+c2hno=$3
+io_min=${4:-$((4 << 20))}
+io_max=${5:-$((64 << 20))}
+count=${6:-16}
+depths=${7:-"1 2 3"}
+
+if [ ! -w "$param" ]; then
+	echo "$param NOT writable, xdma module loaded? run as root?"
+	exit 1
+fi
+
+# bw <cmd> <size>, average MB/s reported by dma_to_device/dma_from_device
+bw() {
+	$1 -s $2 -c $count | grep "Average BW" | awk -F ", " '{print $2}'
+}
+
+saved=`cat $param`
+
+echo -e "size\tdepth\th2c MB/s\tc2h MB/s"
+sz=$io_min
+while [ "$sz" -le "$io_max" ]; do
+	for depth in $depths; do
+		echo $depth > $param
+
+		h2c="-"
+		c2h="-"
+		if [ "$h2cno" -lt 4 ]; then
+			h2c=`bw "$tool_path/dma_to_device -d /dev/${xid}_h2c_${h2cno}" $sz`
+		fi
+		if [ "$c2hno" -lt 4 ]; then
+			c2h=`bw "$tool_path/dma_from_device -d /dev/${xid}_c2h_${c2hno}" $sz`
+		fi
+		echo -e "$sz\t$depth\t$h2c\t$c2h"
+	done
+	sz=$(($sz * 2))
+done
+
+echo $saved > $param
+exit 0
@@ -0,0 +1,428 @@
+/*
+ * Conformance and speed test of the fixed point TSN shapers (tsn_shaper.h)
+ *
+ * Replays a traffic trace through one credit based shaper per traffic
+ * class, the trace is either read from a file, one frame per line:
+ *
+ *   <arrival ns> <traffic class> <bytes>
+ *
+ * or generated. Every decision is checked against a double precision model
+ * started from the same state, the free running models are compared at the
+ * end. Then the decisions are timed without the model.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../xdma/tsn_shaper.h"
+
+#define TC_COUNT 8
+#define ETH_MIN_FRAME_SIZE 60
+#define ETH_GAP_SIZE (8 + 4 + 12)
+
+#define START_TOLERANCE_NS 2
+#define RELATIVE_TOLERANCE 1e-3
+
+struct frame {
+  uint64_t arrival;
+  uint32_t tc;
+  uint32_t bytes;
+};
+
+/* Reference model, credits and credits/ns as doubles */
+struct ref_cbs {
+  double credit, hi_credit, lo_credit, idle_rate, send_rate;
+  double last_update, available_at;
+};
+
+static struct option const long_opts[] =
+{
+  {"trace", required_argument, NULL, 't'},
+  {"write", required_argument, NULL, 'w'},
+  {"count", required_argument, NULL, 'n'},
+  {"idleslope", required_argument, NULL, 'i'},
+  {"sendslope", required_argument, NULL, 's'},
+  {"hicredit", required_argument, NULL, 'H'},
+  {"locredit", required_argument, NULL, 'L'},
+  {"slope-ns", required_argument, NULL, 'u'},
+  {"link-speed", required_argument, NULL, 'l'},
+  {"help", no_argument, NULL, 'h'},
+  {0, 0, 0, 0}
+};
+
+static void usage(const char* name)
+{
+  int i = 0;
+  printf("%s\n\n", name);
+  printf("usage: %s [OPTIONS]\n\n", name);
+  printf("Replay a traffic trace through the TSN credit based shaper.\n\n");
+
+  printf("  -%c (--%s) trace file, lines of <arrival ns> <tc> <bytes>\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) write the generated trace to a file\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) frames to generate without a trace, default 1000000\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) idle slope, default 10\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) send slope, default -90\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) hi credit, default 10\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) lo credit, default -100\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) slopes are per this many ns, default 1000000000\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) Mbps, default 100\n", long_opts[i].val, long_opts[i].name); i++;
+  printf("  -%c (--%s) print usage help and exit\n", long_opts[i].val, long_opts[i].name); i++;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t* state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static size_t read_trace(const char* filename, struct frame** frames)
+{
+  FILE* fp = fopen(filename, "r");
+  size_t count = 0, size = 0;
+  char line[256];
+
+  if (fp == NULL) {
+    perror(filename);
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned long long arrival;
+    unsigned int tc, bytes;
+
+    if (line[0] == '#' || sscanf(line, "%llu %u %u", &arrival, &tc, &bytes) != 3)
+      continue;
+    if (count == size) {
+      size = size ? size * 2 : 4096;
+      *frames = realloc(*frames, size * sizeof(struct frame));
+    }
+    (*frames)[count].arrival = arrival;
+    (*frames)[count].tc = tc % TC_COUNT;
+    (*frames)[count].bytes = bytes;
+    count++;
+  }
+
+  fclose(fp);
+  return count;
+}
+
+/* Random classes and sizes, each class offered about twice what it may send */
+static size_t generate_trace(size_t count, double share, uint32_t ps_per_byte, struct frame** frames)
+{
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+  uint64_t arrival = 0;
+  /* Mean frame of 787 bytes on the wire, TC_COUNT classes share the arrivals */
+  uint64_t mean_gap = (uint64_t)(tsn_bytes_to_ns(787, ETH_MIN_FRAME_SIZE, ETH_GAP_SIZE, ps_per_byte) /
+                                 (share * 2 * TC_COUNT)) + 1;
+  size_t i;
+
+  *frames = malloc(count * sizeof(struct frame));
+  for (i = 0; i < count; i++) {
+    arrival += xorshift64(&seed) % (2 * mean_gap);
+    (*frames)[i].arrival = arrival;
+    (*frames)[i].tc = xorshift64(&seed) % TC_COUNT;
+    (*frames)[i].bytes = 60 + xorshift64(&seed) % (1514 - 60 + 1);
+  }
+
+  return count;
+}
+
+static void ref_init(struct ref_cbs* ref, const struct tsn_cbs* cbs)
+{
+  ref->credit = (double)cbs->credit / TSN_CBS_ONE;
+  ref->hi_credit = (double)cbs->hi_credit / TSN_CBS_ONE;
+  ref->lo_credit = (double)cbs->lo_credit / TSN_CBS_ONE;
+  ref->last_update = cbs->last_update;
+  ref->available_at = cbs->available_at;
+}
+
+static double ref_credit_at(const struct ref_cbs* ref, double at)
+{
+  double idle = (at > ref->last_update) ? at - ref->last_update : 0;
+  double credit = ref->credit + idle * ref->idle_rate;
+  double limit = (ref->credit > ref->hi_credit) ? ref->credit : ref->hi_credit;
+
+  return (credit < limit) ? credit : limit;
+}
+
+static void ref_spend(struct ref_cbs* ref, double at, double duration_ns)
+{
+  double credit = ref_credit_at(ref, at) + duration_ns * ref->send_rate;
+
+  ref->credit = (credit > ref->lo_credit) ? credit : ref->lo_credit;
+  ref->last_update = at + duration_ns;
+  ref->available_at = ref->last_update + ((ref->credit < 0) ? -ref->credit / ref->idle_rate : 0);
+}
+
+static uint64_t start_time(const struct frame* frame, uint64_t port_free, uint64_t available_at)
+{
+  uint64_t start = frame->arrival;
+
+  start = (start > port_free) ? start : port_free;
+  return (start > available_at) ? start : available_at;
+}
+
+/* Linear walk from slot 0, the driver did that before the lookup tables */
+static int walk_slot(const uint64_t* duration, uint64_t offset)
+{
+  int slot = 0;
+
+  while (offset >= duration[slot]) {
+    offset -= duration[slot];
+    slot++;
+  }
+  return slot;
+}
+
+/* Qbv slot of each frame in a TAS_SLOTS slot cycle, against the linear walk */
+#define TAS_SLOTS 20
+
+static uint64_t test_tas(const struct frame* frames, size_t count)
+{
+  uint64_t duration[TAS_SLOTS], slot_start[TAS_SLOTS + 1];
+  uint64_t seed = 1, cycle = 0, start = 1000, cycle_base = 1000, errors = 0, checksum = 0, begin;
+  double walk_ns, cursor_ns;
+  struct tsn_recip recip;
+  int slot, hint = 0;
+  size_t i;
+
+  for (slot = 0; slot < TAS_SLOTS; slot++) {
+    duration[slot] = 5000 + xorshift64(&seed) % 50000;
+    slot_start[slot] = cycle;
+    cycle += duration[slot];
+  }
+  slot_start[TAS_SLOTS] = cycle;
+  tsn_recip_init(&recip, cycle);
+
+  for (i = 0; i < count; i++) {
+    uint64_t x = xorshift64(&seed) >> (i % 64);
+    uint64_t t = frames[i].arrival + start;
+    uint64_t offset = tsn_tas_cursor_offset(&cycle_base, t, start, &recip);
+
+    if (tsn_recip_mod(&recip, x) != x % cycle) {
+      if (errors++ < 10)
+        fprintf(stderr, "%llu %% %llu: %llu\n", (unsigned long long)x, (unsigned long long)cycle,
+                (unsigned long long)tsn_recip_mod(&recip, x));
+    }
+    hint = tsn_tas_find_slot_from(slot_start, TAS_SLOTS, offset, hint);
+    if (offset != (t - start) % cycle || hint != walk_slot(duration, (t - start) % cycle)) {
+      if (errors++ < 10)
+        fprintf(stderr, "frame %zu: slot %d, walk %d\n", i, hint, walk_slot(duration, (t - start) % cycle));
+    }
+  }
+
+  begin = now_ns();
+  for (i = 0; i < count; i++)
+    checksum += walk_slot(duration, frames[i].arrival % cycle);
+  walk_ns = (double)(now_ns() - begin) / count;
+
+  cycle_base = start;
+  hint = 0;
+  begin = now_ns();
+  for (i = 0; i < count; i++) {
+    uint64_t offset = tsn_tas_cursor_offset(&cycle_base, frames[i].arrival + start, start, &recip);
+    hint = tsn_tas_find_slot_from(slot_start, TAS_SLOTS, offset, hint);
+    checksum -= hint;
+  }
+  cursor_ns = (double)(now_ns() - begin) / count;
+
+  printf("tas: %.2f ns/lookup, linear walk %.2f ns/lookup (%llu)\n", cursor_ns, walk_ns,
+         (unsigned long long)checksum);
+  return errors;
+}
+
+int main(int argc, char* argv[])
+{
+  int cmd_opt;
+  char* trace = NULL;
+  char* write_to = NULL;
+  size_t count = 1000000;
+  long long idle_slope = 10, send_slope = -90, hi_credit = 10, lo_credit = -100;
+  unsigned long long slope_ns = 1000000000ULL;
+  unsigned int link_speed = 100;
+  struct frame* frames = NULL;
+  struct tsn_cbs cbs[TC_COUNT];
+  struct ref_cbs step[TC_COUNT], free_run[TC_COUNT];
+  uint64_t port_free[TC_COUNT], ref_port_free[TC_COUNT];
+  uint64_t errors = 0, checksum = 0, begin, elapsed;
+  double max_start_error = 0, max_credit_error = 0, max_drift = 0;
+  uint32_t ps_per_byte;
+  size_t i;
+  int tc;
+
+  while ((cmd_opt = getopt_long(argc, argv, "t:w:n:i:s:H:L:u:l:h", long_opts, NULL)) != -1)
+  {
+    switch (cmd_opt)
+    {
+      case 't':
+        trace = optarg;
+        break;
+      case 'w':
+        write_to = optarg;
+        break;
+      case 'n':
+        count = strtoull(optarg, NULL, 0);
+        break;
+      case 'i':
+        idle_slope = strtoll(optarg, NULL, 0);
+        break;
+      case 's':
+        send_slope = strtoll(optarg, NULL, 0);
+        break;
+      case 'H':
+        hi_credit = strtoll(optarg, NULL, 0);
+        break;
+      case 'L':
+        lo_credit = strtoll(optarg, NULL, 0);
+        break;
+      case 'u':
+        slope_ns = strtoull(optarg, NULL, 0);
+        break;
+      case 'l':
+        link_speed = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+        exit(0);
+        break;
+    }
+  }
+
+  if (idle_slope <= 0 || send_slope >= 0 || slope_ns == 0 || link_speed == 0) {
+    fprintf(stderr, "idle slope must be > 0, send slope < 0, slope-ns and link speed > 0\n");
+    return 1;
+  }
+  ps_per_byte = tsn_ps_per_byte(link_speed);
+
+  if (trace != NULL) {
+    count = read_trace(trace, &frames);
+  } else {
+    count = generate_trace(count, (double)idle_slope / (idle_slope - send_slope), ps_per_byte, &frames);
+  }
+  if (count == 0) {
+    fprintf(stderr, "No frames to replay\n");
+    return 1;
+  }
+  if (write_to != NULL) {
+    FILE* fp = fopen(write_to, "w");
+    if (fp == NULL) {
+      perror(write_to);
+      return 1;
+    }
+    for (i = 0; i < count; i++)
+      fprintf(fp, "%llu %u %u\n", (unsigned long long)frames[i].arrival, frames[i].tc, frames[i].bytes);
+    fclose(fp);
+  }
+
+  /* Conformance, each class on its own port */
+  for (tc = 0; tc < TC_COUNT; tc++) {
+    tsn_cbs_init(&cbs[tc], idle_slope, send_slope, hi_credit, lo_credit, slope_ns, 0);
+    ref_init(&free_run[tc], &cbs[tc]);
+    free_run[tc].idle_rate = (double)idle_slope / slope_ns;
+    free_run[tc].send_rate = (double)send_slope / slope_ns;
+    port_free[tc] = ref_port_free[tc] = 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    const struct frame* frame = &frames[i];
+    struct tsn_cbs* c = &cbs[frame->tc];
+    struct ref_cbs* r = &step[frame->tc];
+    struct ref_cbs* f = &free_run[frame->tc];
+    uint64_t duration = tsn_bytes_to_ns(frame->bytes, ETH_MIN_FRAME_SIZE, ETH_GAP_SIZE, ps_per_byte);
+    uint64_t start = start_time(frame, port_free[frame->tc], c->available_at);
+    double ref_start, wait, error;
+
+    /* The model takes the same step from the same state */
+    ref_init(r, c);
+    r->idle_rate = f->idle_rate;
+    r->send_rate = f->send_rate;
+    r->available_at = c->last_update + ((r->credit < 0) ? -r->credit / r->idle_rate : 0);
+    ref_start = start_time(frame, port_free[frame->tc], 0);
+    ref_start = (ref_start > r->available_at) ? ref_start : r->available_at;
+
+    if (tsn_cbs_credit_at(c, start) < 0) {
+      if (errors++ < 10)
+        fprintf(stderr, "frame %zu: sent with credit %lld\n", i, (long long)tsn_cbs_credit_int(c, start));
+    }
+
+    /* Rounding the rates adds up over the idle time */
+    wait = ref_start - r->last_update;
+    error = (double)start - ref_start;
+    error = (error < 0) ? -error : error;
+    if (error > START_TOLERANCE_NS + RELATIVE_TOLERANCE * wait) {
+      if (errors++ < 10)
+        fprintf(stderr, "frame %zu: starts at %llu, model %.1f\n", i, (unsigned long long)start, ref_start);
+    }
+    if (error > max_start_error)
+      max_start_error = error;
+
+    tsn_cbs_spend(c, start, duration);
+    ref_spend(r, start, duration);
+    error = (double)c->credit / TSN_CBS_ONE - r->credit;
+    error = (error < 0) ? -error : error;
+    if (error > max_credit_error)
+      max_credit_error = error;
+    if (c->credit < c->lo_credit || c->credit > tsn_max64(c->hi_credit, 0)) {
+      if (errors++ < 10)
+        fprintf(stderr, "frame %zu: credit %lld out of bounds\n", i, (long long)tsn_cbs_credit_int(c, start));
+    }
+    port_free[frame->tc] = start + duration;
+
+    /* Free running model, drift relative to the time it ran */
+    ref_start = start_time(frame, ref_port_free[frame->tc], 0);
+    ref_start = (ref_start > f->available_at) ? ref_start : f->available_at;
+    ref_spend(f, ref_start, duration);
+    ref_port_free[frame->tc] = ref_start + duration;
+    error = ((double)port_free[frame->tc] - ref_port_free[frame->tc]) / (ref_port_free[frame->tc] + 1);
+    error = (error < 0) ? -error : error;
+    if (error > max_drift)
+      max_drift = error;
+  }
+
+  if (max_drift > RELATIVE_TOLERANCE) {
+    errors++;
+    fprintf(stderr, "drift %.0f ppm from the model\n", max_drift * 1e6);
+  }
+
+  printf("frames: %zu, errors: %llu\n", count, (unsigned long long)errors);
+  printf("max start error: %.1f ns, max credit error: %.3g, max drift: %.1f ppm\n",
+         max_start_error, max_credit_error, max_drift * 1e6);
+
+  /* Speed, the select time credit check and the spend of each frame */
+  for (tc = 0; tc < TC_COUNT; tc++) {
+    tsn_cbs_init(&cbs[tc], idle_slope, send_slope, hi_credit, lo_credit, slope_ns, 0);
+    port_free[tc] = 0;
+  }
+  begin = now_ns();
+  for (i = 0; i < count; i++) {
+    const struct frame* frame = &frames[i];
+    struct tsn_cbs* c = &cbs[frame->tc];
+    uint64_t start = start_time(frame, port_free[frame->tc], c->available_at);
+    uint64_t duration = tsn_bytes_to_ns(frame->bytes, ETH_MIN_FRAME_SIZE, ETH_GAP_SIZE, ps_per_byte);
+
+    checksum += tsn_cbs_credit_int(c, start) >= 0;
+    tsn_cbs_spend(c, start, duration);
+    port_free[frame->tc] = start + duration;
+  }
+  elapsed = now_ns() - begin;
+  printf("cbs: %.2f ns/decision (%llu)\n", (double)elapsed / count, (unsigned long long)checksum);
+
+  errors += test_tas(frames, count);
+
+  free(frames);
+  return errors ? 1 : 0;
+}
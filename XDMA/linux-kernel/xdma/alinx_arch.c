@@ -5,6 +5,8 @@
 #ifdef __linux__
 
 #include <linux/io.h>
+#include <linux/math64.h>
+#include <linux/version.h>
 
 u32 read32(void * addr) {
         return ioread32(addr);
@@ -47,6 +49,134 @@ sysclock_t alinx_get_sys_clock(struct pci_dev *pdev) {
         return clock;
 }
 
+/*
+ * Read the sysclock and re-anchor the estimation on it
+ * Must be called with cache->lock held
+ */
+static sysclock_t sysclock_cache_sync(struct sysclock_cache *cache) {
+        struct xdma_dev* xdev = cache->xdev;
+        u64 before, after, now_ns, elapsed_ns, rate, error_ns, age_ns;
+        sysclock_t predicted;
+        sysclock_t clock;
+
+        /* The read takes about 1us, assume the clock got latched in the middle */
+        before = ktime_get_ns();
+        clock = ((u64)read32(xdev->bar[0] + REG_SYS_CLOCK_HI) << 32) |
+                read32(xdev->bar[0] + REG_SYS_CLOCK_LO);
+        after = ktime_get_ns();
+        now_ns = before + (after - before) / 2;
+        atomic64_inc(&cache->mmio_reads);
+
+        write_seqcount_begin(&cache->seq);
+        elapsed_ns = now_ns - cache->anchor_ns;
+        if (cache->anchor_ns != 0 && elapsed_ns != 0) {
+                /* Error of the extrapolation, less the uncertainty of the read */
+                predicted = cache->anchor_clock + mul_u64_u64_shr(elapsed_ns, cache->rate, SYSCLOCK_CACHE_RATE_SHIFT);
+                error_ns = (clock > predicted ? clock - predicted : predicted - clock) * TICKS_SCALE;
+                error_ns = error_ns > (after - before) / 2 ? error_ns - (after - before) / 2 : 0;
+                /* Trust the extrapolation for as long as it stays within the bound */
+                age_ns = SYSCLOCK_CACHE_MAX_AGE_NS;
+                if (error_ns > 0 && elapsed_ns <= NSEC_PER_SEC) {
+                        age_ns = div64_u64(elapsed_ns * SYSCLOCK_CACHE_MAX_ERROR_NS, error_ns);
+                }
+                cache->max_age_ns = clamp_t(u64, age_ns, SYSCLOCK_CACHE_MIN_AGE_NS, SYSCLOCK_CACHE_MAX_AGE_NS);
+        }
+
+        /* Early syncs of the readers are too short to measure the rate */
+        elapsed_ns = now_ns - cache->rate_ns;
+        if (cache->rate_ns == 0 || elapsed_ns >= SYSCLOCK_CACHE_REFRESH_NS / 2) {
+                if (cache->rate_ns != 0 && elapsed_ns <= NSEC_PER_SEC) {
+                        rate = div64_u64((clock - cache->rate_clock) << SYSCLOCK_CACHE_RATE_SHIFT, elapsed_ns);
+                        /* Ignore the measurement if the clock was reset or the timer was late */
+                        if (rate > SYSCLOCK_CACHE_RATE_NOMINAL - SYSCLOCK_CACHE_RATE_TOLERANCE &&
+                            rate < SYSCLOCK_CACHE_RATE_NOMINAL + SYSCLOCK_CACHE_RATE_TOLERANCE) {
+                                cache->rate = rate;
+                        }
+                }
+                cache->rate_ns = now_ns;
+                cache->rate_clock = clock;
+        }
+        cache->anchor_ns = now_ns;
+        cache->anchor_clock = clock;
+        write_seqcount_end(&cache->seq);
+
+        return clock;
+}
+
+static enum hrtimer_restart sysclock_cache_refresh(struct hrtimer *timer) {
+        struct sysclock_cache *cache = container_of(timer, struct sysclock_cache, timer);
+        unsigned long flags;
+
+        spin_lock_irqsave(&cache->lock, flags);
+        sysclock_cache_sync(cache);
+        spin_unlock_irqrestore(&cache->lock, flags);
+
+        hrtimer_forward_now(timer, ns_to_ktime(SYSCLOCK_CACHE_REFRESH_NS));
+        return HRTIMER_RESTART;
+}
+
+/*
+ * Sysclock without a PCIe read in most cases, for the Tx path
+ * Falls back to reading the register if the anchor is too old to trust
+ * the extrapolation, e.g. when the timer got delayed or the last anchor
+ * found the extrapolation off by more than SYSCLOCK_CACHE_MAX_ERROR_NS.
+ * PTP clock operations must keep using alinx_get_sys_clock().
+ */
+sysclock_t alinx_get_sys_clock_cached(struct pci_dev *pdev) {
+        struct xdma_pci_dev *xpdev = dev_get_drvdata(&pdev->dev);
+        struct sysclock_cache *cache = &xpdev->xdev->sysclock_cache;
+        u64 age_ns, max_age_ns, rate;
+        sysclock_t anchor_clock, clock;
+        unsigned long flags;
+        unsigned int seq;
+
+        do {
+                seq = read_seqcount_begin(&cache->seq);
+                age_ns = ktime_get_ns() - cache->anchor_ns;
+                anchor_clock = cache->anchor_clock;
+                rate = cache->rate;
+                max_age_ns = cache->max_age_ns;
+        } while (read_seqcount_retry(&cache->seq, seq));
+
+        if (unlikely(age_ns > max_age_ns)) {
+                spin_lock_irqsave(&cache->lock, flags);
+                clock = sysclock_cache_sync(cache);
+                spin_unlock_irqrestore(&cache->lock, flags);
+                return clock;
+        }
+
+        atomic64_inc(&cache->cached_reads);
+        return anchor_clock + mul_u64_u64_shr(age_ns, rate, SYSCLOCK_CACHE_RATE_SHIFT);
+}
+
+void alinx_sysclock_cache_init(struct xdma_dev *xdev) {
+        struct sysclock_cache *cache = &xdev->sysclock_cache;
+        unsigned long flags;
+
+        memset(cache, 0, sizeof(struct sysclock_cache));
+        cache->xdev = xdev;
+        cache->rate = SYSCLOCK_CACHE_RATE_NOMINAL;
+        cache->max_age_ns = SYSCLOCK_CACHE_MAX_AGE_NS;
+        spin_lock_init(&cache->lock);
+        seqcount_spinlock_init(&cache->seq, &cache->lock);
+
+        spin_lock_irqsave(&cache->lock, flags);
+        sysclock_cache_sync(cache);
+        spin_unlock_irqrestore(&cache->lock, flags);
+
+#if KERNEL_VERSION(6, 15, 0) <= LINUX_VERSION_CODE
+        hrtimer_setup(&cache->timer, sysclock_cache_refresh, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+        hrtimer_init(&cache->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+        cache->timer.function = sysclock_cache_refresh;
+#endif
+        hrtimer_start(&cache->timer, ns_to_ktime(SYSCLOCK_CACHE_REFRESH_NS), HRTIMER_MODE_REL_SOFT);
+}
+
+void alinx_sysclock_cache_destroy(struct xdma_dev *xdev) {
+        hrtimer_cancel(&xdev->sysclock_cache.timer);
+}
+
 void alinx_set_cycle_1s(struct pci_dev *pdev, u32 cycle_1s) {
         struct xdma_dev* xdev = xdev_find_by_pdev(pdev);
         write32(cycle_1s, xdev->bar[0] + REG_CYCLE_1S);
@@ -75,6 +205,30 @@ timestamp_t alinx_read_tx_timestamp(struct pci_dev* pdev, int tx_id) {
         }
 }
 
+/*
+ * Read REG_TX_TIMESTAMP_COUNT and all TX timestamp registers at once
+ * tstamps[i] is the timestamp of tx_id i + 1
+ */
+u32 alinx_read_tx_timestamps(struct pci_dev *pdev, sysclock_t tstamps[TX_TIMESTAMP_REG_COUNT]) {
+        static const u32 regs[TX_TIMESTAMP_REG_COUNT] = {
+                REG_TX_TIMESTAMP1_HIGH,
+                REG_TX_TIMESTAMP2_HIGH,
+                REG_TX_TIMESTAMP3_HIGH,
+                REG_TX_TIMESTAMP4_HIGH,
+        };
+        struct xdma_dev* xdev = xdev_find_by_pdev(pdev);
+        u32 count = read32(xdev->bar[0] + REG_TX_TIMESTAMP_COUNT);
+        int i;
+
+        for (i = 0; i < TX_TIMESTAMP_REG_COUNT; i++) {
+                /* The LOW register follows the HIGH one */
+                tstamps[i] = ((sysclock_t)read32(xdev->bar[0] + regs[i]) << 32) |
+                        read32(xdev->bar[0] + regs[i] + 4);
+        }
+
+        return count;
+}
+
 static void add_u32_counter(u64* sum, u32 value) {
         /* Handle overflows of 32-bit counters */
         u32 diff = value - (u32)*sum;
@@ -11,8 +11,12 @@ typedef uint32_t u32
 
 #include <linux/pci.h>
 #include <linux/ptp_clock_kernel.h>
+#include <linux/seqlock.h>
+#include <linux/hrtimer.h>
 #include <net/pkt_sched.h>
 
+#include "tsn_shaper.h"
+
 #define REG_NEXT_PULSE_AT_HI 0x002c
 #define REG_NEXT_PULSE_AT_LO 0x0030
 #define REG_CYCLE_1S 0x0034
@@ -28,6 +32,7 @@ typedef uint32_t u32
 #define REG_TX_TIMESTAMP3_LOW 0x0334
 #define REG_TX_TIMESTAMP4_HIGH 0x0340
 #define REG_TX_TIMESTAMP4_LOW 0x0344
+#define TX_TIMESTAMP_REG_COUNT 4
 
 #define REG_TX_PACKETS 0x0200
 #define REG_TX_DROP_PACKETS 0x0220
@@ -39,7 +44,10 @@ typedef uint32_t u32
 #define RX_QUEUE_COUNT 1
 
 /* 125 MHz */
-#define TICKS_SCALE 8.0
+#define TICKS_SCALE 8
+/* Fixed point scales of ns per tick and ticks per ns, see alinx_ptp.c */
+#define TICKS_MULT_SHIFT 56
+#define TICKS_INV_MULT_SHIFT 56
 #define RESERVED_CYCLE 125000000
 
 #define HW_QUEUE_SIZE (128)
@@ -59,6 +67,18 @@ typedef uint32_t u32
 
 #define H2C_LATENCY_NS 30000 // TODO: Adjust this value dynamically
 
+/* Sysclock estimation, see alinx_get_sys_clock_cached() */
+#define SYSCLOCK_CACHE_REFRESH_NS 10000000 // 10ms
+#define SYSCLOCK_CACHE_MAX_AGE_NS (2 * SYSCLOCK_CACHE_REFRESH_NS)
+#define SYSCLOCK_CACHE_MIN_AGE_NS (SYSCLOCK_CACHE_REFRESH_NS / 20) // 500us
+#define SYSCLOCK_CACHE_MAX_ERROR_NS 1000 // Extrapolation error bound
+#define SYSCLOCK_CACHE_RATE_SHIFT 32
+#define SYSCLOCK_CACHE_RATE_NOMINAL ((1ULL << SYSCLOCK_CACHE_RATE_SHIFT) / TICKS_SCALE)
+#define SYSCLOCK_CACHE_RATE_TOLERANCE (SYSCLOCK_CACHE_RATE_NOMINAL / 1000) // 1000ppm
+
+/* Don't read the HW counters for the buffer tracker more often than this */
+#define BUFFER_TRACK_UPDATE_INTERVAL_NS 2000
+
 typedef u64 sysclock_t;
 typedef u64 timestamp_t;
 
@@ -67,9 +87,11 @@ struct ptp_device_data {
         struct ptp_clock *ptp_clock;
         struct ptp_clock_info ptp_info;
         struct xdma_dev *xdev;
-        double ticks_scale;
+        u64 mult;       /* ns per tick << TICKS_MULT_SHIFT */
+        u64 inv_mult;   /* ticks per ns << TICKS_INV_MULT_SHIFT */
         u64 offset;
         spinlock_t lock;
+        seqcount_spinlock_t seq;        /* Lets the conversions read mult, inv_mult and offset locklessly */
 #ifdef __LIBXDMA_DEBUG__
         u32 ptp_id;
 #endif
@@ -95,14 +117,22 @@ struct qbv_baked_prio_slot {
 
 struct qbv_baked_prio {
 	struct qbv_baked_prio_slot slots[MAX_QBV_SLOTS];
+	uint64_t slot_start_ns[MAX_QBV_SLOTS + 1]; // Prefix sums of the durations, [slot_count] is the cycle
 	size_t slot_count;
 };
 
 struct qbv_baked_config {
 	uint64_t cycle_ns;
+	struct tsn_recip cycle; // For the cycle modulo
 	struct qbv_baked_prio prios[TC_COUNT];
 };
 
+// Where the previous frames fell in the schedule, reset by bake_qos_config()
+struct qbv_cursor {
+	timestamp_t cycle_base;
+	int slot_id[TC_COUNT];
+};
+
 struct qav_state {
 	bool enabled;
 	int32_t idle_slope; // credits/ns
@@ -110,23 +140,53 @@ struct qav_state {
 	int32_t hi_credit;
 	int32_t lo_credit;
 
-	int32_t credit;
-	timestamp_t last_update;
-	timestamp_t available_at;
+	struct tsn_cbs cbs; // credit and available_at, set up by init_qav_state()
 };
 
 struct buffer_tracker {
 	uint64_t pending_packets;
 	uint64_t last_tx_count;
+	timestamp_t last_update;
+};
+
+/*
+ * Sysclock extrapolated from the host clock
+ * The anchor is refreshed by a timer, the rate is measured between two anchors
+ * at least half a refresh apart. Each anchor also measures how far the
+ * extrapolation got off, which shortens the age it may be trusted for.
+ */
+struct sysclock_cache {
+	struct xdma_dev *xdev;
+	struct hrtimer timer;
+	spinlock_t lock;
+	seqcount_spinlock_t seq;
+	u64 anchor_ns;          // ktime_get_ns() at anchor_clock
+	sysclock_t anchor_clock;
+	u64 rate;               // Ticks per ns << SYSCLOCK_CACHE_RATE_SHIFT
+	u64 rate_ns;            // Start of the rate measurement
+	sysclock_t rate_clock;
+	u64 max_age_ns;         // Extrapolation within SYSCLOCK_CACHE_MAX_ERROR_NS
+	atomic64_t mmio_reads;
+	atomic64_t cached_reads;
+};
+
+/* Written by tsn_fill_metadata() with tx_lock held */
+struct tsn_tc_stats {
+	uint64_t packets;
+	uint64_t rejected;
 };
 
 struct tsn_config {
 	struct qbv_config qbv;
 	struct qbv_baked_config qbv_baked;
+	struct qbv_cursor qbv_cursor;
 	struct qav_state qav[TC_COUNT];
 	struct buffer_tracker buffer_tracker;
 	timestamp_t queue_available_at[TSN_PRIO_COUNT];
 	timestamp_t total_available_at;
+	uint32_t link_speed; // Mbps, SPEED_*
+	uint32_t ps_per_byte; // Wire time of a byte at link_speed
+	struct tsn_tc_stats tc_stats[TC_COUNT];
 };
 
 u32 read32(void * addr);
@@ -134,9 +194,13 @@ void write32(u32 val, void * addr);
 
 void alinx_set_pulse_at(struct pci_dev *pdev, sysclock_t time);
 sysclock_t alinx_get_sys_clock(struct pci_dev *pdev);
+sysclock_t alinx_get_sys_clock_cached(struct pci_dev *pdev);
+void alinx_sysclock_cache_init(struct xdma_dev *xdev);
+void alinx_sysclock_cache_destroy(struct xdma_dev *xdev);
 void alinx_set_cycle_1s(struct pci_dev *pdev, u32 cycle_1s);
 u32 alinx_get_cycle_1s(struct pci_dev *pdev);
 timestamp_t alinx_read_tx_timestamp(struct pci_dev *pdev, int tx_id);
+u32 alinx_read_tx_timestamps(struct pci_dev *pdev, sysclock_t tstamps[TX_TIMESTAMP_REG_COUNT]);
 u64 alinx_get_tx_packets(struct pci_dev *pdev);
 u64 alinx_get_tx_drop_packets(struct pci_dev *pdev);
 u64 alinx_get_normal_timeout_packets(struct pci_dev *pdev);
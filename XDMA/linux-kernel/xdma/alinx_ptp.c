@@ -5,12 +5,28 @@
 #include "alinx_ptp.h"
 #include "alinx_arch.h"
 
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+
 #define NS_IN_1S 1000000000
 
-static timestamp_t alinx_get_timestamp(u64 sys_count, double ticks_scale, u64 offset) {
-        timestamp_t timestamp = ticks_scale * sys_count;
+static unsigned int ptp_bench_loops = 0;
+module_param(ptp_bench_loops, uint, 0444);
+MODULE_PARM_DESC(ptp_bench_loops, "Measure the clock conversion cost with this many conversions on probe, 0 to disable");
+
+/*
+ * The clock is modelled as timestamp = sys_count * ns_per_tick + offset.
+ * ns_per_tick and its inverse are kept in 64-bit fixed point, so that the
+ * conversions in the Tx path need neither the FPU nor a division.
+ */
+#define TICKS_MULT_DEFAULT ((u64)TICKS_SCALE << TICKS_MULT_SHIFT)
+
+static inline timestamp_t alinx_get_timestamp(u64 sys_count, u64 mult, u64 offset) {
+        return mul_u64_u64_shr(sys_count, mult, TICKS_MULT_SHIFT) + offset;
+}
 
-        return timestamp + offset;
+static inline sysclock_t alinx_get_sysclock(timestamp_t timestamp, u64 inv_mult, u64 offset) {
+        return mul_u64_u64_shr(timestamp - offset, inv_mult, TICKS_INV_MULT_SHIFT);
 }
 
 static void set_pulse_at(struct ptp_device_data *ptp_data, sysclock_t sys_count) {
@@ -18,9 +34,9 @@ static void set_pulse_at(struct ptp_device_data *ptp_data, sysclock_t sys_count)
         sysclock_t next_pulse_sysclock;
         struct xdma_dev *xdev = ptp_data->xdev;
 
-        current_ns = alinx_get_timestamp(sys_count, ptp_data->ticks_scale, ptp_data->offset);
+        current_ns = alinx_get_timestamp(sys_count, ptp_data->mult, ptp_data->offset);
         next_pulse_ns = current_ns - (current_ns % NS_IN_1S) + NS_IN_1S;
-        next_pulse_sysclock = ((double)(next_pulse_ns - ptp_data->offset) / ptp_data->ticks_scale);
+        next_pulse_sysclock = alinx_get_sysclock(next_pulse_ns, ptp_data->inv_mult, ptp_data->offset);
         xdma_debug("ptp%u: %s sys_count=%llu, current_ns=%llu, next_pulse_ns=%llu, next_pulse_sysclock=%llu",
                    ptp_data->ptp_id, __func__, sys_count, current_ns, next_pulse_ns, next_pulse_sysclock);
 
@@ -32,24 +48,39 @@ static void set_cycle_1s(struct ptp_device_data *ptp_data, u32 cycle_1s) {
         alinx_set_cycle_1s(ptp_data->xdev->pdev, cycle_1s);
 }
 
-static void set_ticks_scale(struct ptp_device_data *ptp_data, double ticks_scale) {
-        alinx_set_ticks_scale(ptp_data->xdev->pdev, ticks_scale);
+/* Must be called with lock held, inside a write section of seq */
+static void set_mult(struct ptp_device_data *ptp_data, u64 mult) {
+        ptp_data->mult = mult;
+        /* (1 << (TICKS_MULT_SHIFT + TICKS_INV_MULT_SHIFT)) / mult without overflowing */
+        ptp_data->inv_mult = mul_u64_u64_div_u64(1ULL << TICKS_MULT_SHIFT, 1ULL << TICKS_INV_MULT_SHIFT, mult);
 }
 
 sysclock_t alinx_timestamp_to_sysclock(struct pci_dev* pdev, timestamp_t timestamp) {
         struct xdma_pci_dev *xpdev = dev_get_drvdata(&pdev->dev);
         struct ptp_device_data* ptp_data = xpdev->ptp;
+        sysclock_t sysclock;
+        unsigned int seq;
 
-        return (timestamp - ptp_data->offset) / ptp_data->ticks_scale;
+        do {
+                seq = read_seqcount_begin(&ptp_data->seq);
+                sysclock = alinx_get_sysclock(timestamp, ptp_data->inv_mult, ptp_data->offset);
+        } while (read_seqcount_retry(&ptp_data->seq, seq));
+
+        return sysclock;
 }
 
 timestamp_t alinx_sysclock_to_timestamp(struct pci_dev* pdev, sysclock_t sysclock) {
         struct xdma_pci_dev *xpdev = dev_get_drvdata(&pdev->dev);
         struct ptp_device_data* ptp_data = xpdev->ptp;
+        timestamp_t timestamp;
+        unsigned int seq;
 
-        u64 offset = ptp_data->offset;
+        do {
+                seq = read_seqcount_begin(&ptp_data->seq);
+                timestamp = alinx_get_timestamp(sysclock, ptp_data->mult, ptp_data->offset);
+        } while (read_seqcount_retry(&ptp_data->seq, seq));
 
-        return alinx_get_timestamp(sysclock, ptp_data->ticks_scale, offset);
+        return timestamp;
 }
 
 timestamp_t alinx_get_rx_timestamp(struct pci_dev* pdev, sysclock_t sysclock) {
@@ -66,19 +97,38 @@ timestamp_t alinx_sysclock_to_txtstamp(struct pci_dev* pdev, sysclock_t sysclock
         return alinx_sysclock_to_timestamp(pdev, sysclock) + TX_ADJUST_NS;
 }
 
-double alinx_get_ticks_scale(struct pci_dev* pdev) {
-        struct xdma_pci_dev *xpdev = dev_get_drvdata(&pdev->dev);
-        struct ptp_device_data* ptp_data = xpdev->ptp;
+/*
+ * Report the cost of the conversions used by the Tx path,
+ * enabled by the ptp_bench_loops module parameter
+ */
+void alinx_ptp_bench(struct pci_dev* pdev) {
+        sysclock_t sysclock = alinx_get_sys_clock(pdev);
+        timestamp_t timestamp = alinx_sysclock_to_timestamp(pdev, sysclock);
+        u64 start, to_timestamp_ns, to_sysclock_ns;
+        u64 sink = 0;
+        unsigned int i;
+
+        if (ptp_bench_loops == 0) {
+                return;
+        }
 
-        return ptp_data->ticks_scale;
-}
+        start = ktime_get_ns();
+        for (i = 0; i < ptp_bench_loops; i++) {
+                sink += alinx_sysclock_to_timestamp(pdev, sysclock + i);
+        }
+        to_timestamp_ns = ktime_get_ns() - start;
 
-void alinx_set_ticks_scale(struct pci_dev* pdev, double ticks_scale) {
-        struct xdma_pci_dev *xpdev = dev_get_drvdata(&pdev->dev);
-        struct ptp_device_data* ptp_data = xpdev->ptp;
+        start = ktime_get_ns();
+        for (i = 0; i < ptp_bench_loops; i++) {
+                sink += alinx_timestamp_to_sysclock(pdev, timestamp + i);
+        }
+        to_sysclock_ns = ktime_get_ns() - start;
 
-        ptp_data->ticks_scale = ticks_scale;
-        alinx_set_cycle_1s(pdev, (double)NS_IN_1S / ptp_data->ticks_scale);
+        pr_info("ptp bench: %u loops, sysclock->timestamp %llu ps, timestamp->sysclock %llu ps per conversion (%llx)\n",
+                ptp_bench_loops,
+                div_u64(to_timestamp_ns * 1000, ptp_bench_loops),
+                div_u64(to_sysclock_ns * 1000, ptp_bench_loops),
+                sink);
 }
 
 static int alinx_ptp_gettimex(struct ptp_clock_info *ptp, struct timespec64 *ts,
@@ -98,7 +148,7 @@ static int alinx_ptp_gettimex(struct ptp_clock_info *ptp, struct timespec64 *ts,
         clock = alinx_get_sys_clock(ptp_data->xdev->pdev);
         ptp_read_system_postts(sts);
 
-        timestamp = alinx_get_timestamp(clock, ptp_data->ticks_scale, ptp_data->offset);
+        timestamp = alinx_get_timestamp(clock, ptp_data->mult, ptp_data->offset);
 
         ts->tv_sec = timestamp / NS_IN_1S;
         ts->tv_nsec = timestamp % NS_IN_1S;
@@ -126,14 +176,17 @@ static int alinx_ptp_settime(struct ptp_clock_info *ptp, const struct timespec64
         host_timestamp = (u64)ts->tv_sec * NS_IN_1S + ts->tv_nsec;
 
         spin_lock_irqsave(&ptp_data->lock, flags);
+        write_seqcount_begin(&ptp_data->seq);
 
-        ptp_data->ticks_scale = TICKS_SCALE;
+        set_mult(ptp_data, TICKS_MULT_DEFAULT);
 
         sys_clock = alinx_get_sys_clock(xdev->pdev);
-        hw_timestamp = alinx_get_timestamp(sys_clock, ptp_data->ticks_scale, ptp_data->offset);
+        hw_timestamp = alinx_get_timestamp(sys_clock, ptp_data->mult, ptp_data->offset);
 
         ptp_data->offset = host_timestamp - hw_timestamp;
 
+        write_seqcount_end(&ptp_data->seq);
+
         set_cycle_1s(ptp_data, RESERVED_CYCLE);
         set_pulse_at(ptp_data, sys_clock);
 
@@ -158,7 +211,9 @@ static int alinx_ptp_adjtime(struct ptp_clock_info *ptp, s64 delta)
         spin_lock_irqsave(&ptp_data->lock, flags);
 
         /* Adjust offset */
+        write_seqcount_begin(&ptp_data->seq);
         ptp_data->offset += delta;
+        write_seqcount_end(&ptp_data->seq);
 
         /* Set pulse_at */
         sys_clock = alinx_get_sys_clock(ptp_data->xdev->pdev);
@@ -174,8 +229,7 @@ static int alinx_ptp_adjtime(struct ptp_clock_info *ptp, s64 delta)
 static int alinx_ptp_adjfine(struct ptp_clock_info *ptp, long scaled_ppm)
 {
         u64 cur_timestamp, new_timestamp;
-        u64 sys_clock;
-        double diff;
+        u64 sys_clock, mult, diff;
         unsigned long flags;
         int is_negative = 0;
 
@@ -193,30 +247,34 @@ static int alinx_ptp_adjfine(struct ptp_clock_info *ptp, long scaled_ppm)
                 goto exit;
         }
 
-        cur_timestamp = alinx_get_timestamp(sys_clock, ptp_data->ticks_scale, ptp_data->offset);
+        cur_timestamp = alinx_get_timestamp(sys_clock, ptp_data->mult, ptp_data->offset);
 
         if (scaled_ppm < 0) {
                 is_negative = 1;
                 scaled_ppm = -scaled_ppm;
         }
 
-        /* Adjust ticks_scale */
-        diff = TICKS_SCALE * (double)scaled_ppm / (double)(1000000ULL << 16);
-        ptp_data->ticks_scale = TICKS_SCALE + (is_negative ? - diff : diff);
+        /* Adjust ns per tick */
+        diff = mul_u64_u64_div_u64(TICKS_MULT_DEFAULT, scaled_ppm, 1000000ULL << 16);
+        mult = is_negative ? TICKS_MULT_DEFAULT - diff : TICKS_MULT_DEFAULT + diff;
+
+        write_seqcount_begin(&ptp_data->seq);
+        set_mult(ptp_data, mult);
 
         /* Adjust offset */
-        new_timestamp = alinx_get_timestamp(sys_clock, ptp_data->ticks_scale, ptp_data->offset);
+        new_timestamp = alinx_get_timestamp(sys_clock, ptp_data->mult, ptp_data->offset);
         ptp_data->offset += (cur_timestamp - new_timestamp);
+        write_seqcount_end(&ptp_data->seq);
 
         /* Adjust cycle_1s */
-        set_ticks_scale(ptp_data, ptp_data->ticks_scale);
+        set_cycle_1s(ptp_data, mul_u64_u64_div_u64(NS_IN_1S, 1ULL << TICKS_MULT_SHIFT, ptp_data->mult));
 
         /* Set pulse_at */
         sys_clock = alinx_get_sys_clock(xdev->pdev);
         set_pulse_at(ptp_data, sys_clock);
 
-        xdma_debug("ptp%u: %s scaled_ppm=%ld, offset=%llu, ticks_scale:%lf",
-                   ptp_data->ptp_id, __func__, scaled_ppm, ptp_data->offset, ptp_data->ticks_scale);
+        xdma_debug("ptp%u: %s scaled_ppm=%ld, offset=%llu, mult=%llu",
+                   ptp_data->ptp_id, __func__, scaled_ppm, ptp_data->offset, ptp_data->mult);
 
 exit:
         spin_unlock_irqrestore(&ptp_data->lock, flags);
@@ -256,9 +314,10 @@ struct ptp_device_data *ptp_device_init(struct device *dev, struct xdma_dev *xde
         memset(ptp, 0, sizeof(struct ptp_device_data));
 
         ptp->ptp_info = ptp_clock_info_init();
-        ptp->ticks_scale = TICKS_SCALE;
+        set_mult(ptp, TICKS_MULT_DEFAULT);
 
         spin_lock_init(&ptp->lock);
+        seqcount_spinlock_init(&ptp->seq, &ptp->lock);
 
         ptp->xdev = xdev;
 
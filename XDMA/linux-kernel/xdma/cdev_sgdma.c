@@ -27,8 +27,11 @@
 #include <linux/wait.h>
 #include <linux/kthread.h>
 #include <linux/version.h>
+#include <linux/eventfd.h>
+#include <linux/vmalloc.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
 #include <linux/uio.h>
+#include <linux/jhash.h>
 #endif
 #include "libxdma_api.h"
 #include "xdma_cdev.h"
@@ -46,6 +49,44 @@ MODULE_PARM_DESC(c2h_timeout, "C2H sgdma timeout in seconds, default is 10 sec."
 
 extern struct kmem_cache *cdev_cache;
 static void char_sgdma_unmap_user_buf(struct xdma_io_cb *cb, bool write);
+static ssize_t char_sgdma_stream_read(struct xdma_cdev *xcdev,
+				      struct file *file, char __user *buf,
+				      size_t len, u32 __user *lens, u32 *frames);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+#define kvcalloc(n, size, flags) vzalloc((n) * (size))
+#endif
+
+/* Registered buffers stay pinned for a long time, keep them out of CMA/movable zones */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define xdma_pin_user_pages(start, nr_pages, write, pages) \
+	pin_user_pages_fast(start, nr_pages, \
+			    ((write) ? FOLL_WRITE : 0) | FOLL_LONGTERM, pages)
+#define xdma_unpin_user_page(page) unpin_user_page(page)
+#else
+#define xdma_pin_user_pages(start, nr_pages, write, pages) \
+	get_user_pages_fast(start, nr_pages, write, pages)
+#define xdma_unpin_user_page(page) put_page(page)
+#endif
+
+/*
+ * Physically contiguous pages of a registration (hugepages) are mapped as
+ * one run, bounded by what the DMA layer can map in one go.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+#define xdma_dma_run_max(dev) (dma_max_mapping_size(dev) >> PAGE_SHIFT)
+#else
+#define xdma_dma_run_max(dev) (1)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define xdma_eventfd_signal(ctx) eventfd_signal(ctx)
+#else
+#define xdma_eventfd_signal(ctx) eventfd_signal(ctx, 1)
+#endif
+
+/* How long closing a ring waits for its transfers before cancelling them */
+#define XDMA_RING_DRAIN_TIMEOUT_MS 100
 
 
 static void async_io_handler(unsigned long  cb_hndl, int err)
@@ -344,15 +385,27 @@ err_out:
 	return rv;
 }
 
-static int char_sgdma_multi_map_user_buf_to_sgl(struct xdma_io_cb *cb, bool write, struct xdma_multi_read_write_ioctl *io)
+static int char_sgdma_multi_map_user_buf_to_sgl(struct xdma_io_cb *cb, bool write,
+						struct xdma_buffer_descriptor *bd,
+						unsigned int bd_num)
 {
 	struct sg_table *sgt = &cb->sgt;
 	struct scatterlist *sg;
-	unsigned int pages_nr = io->bd_num;
+	unsigned int pages_nr = bd_num;
 	int i;
 	int id;
 	int rv;
 
+	/* one page is pinned per buffer, a buffer must not leave it */
+	for (i = 0; i < bd_num; i++) {
+		if (!bd[i].len ||
+		    bd[i].len > PAGE_SIZE - offset_in_page(bd[i].buffer)) {
+			pr_err("invalid bd %d, buffer 0x%p, len %lu.\n",
+			       i, bd[i].buffer, bd[i].len);
+			return -EINVAL;
+		}
+	}
+
 	if (sg_alloc_table(sgt, pages_nr, GFP_KERNEL)) {
 		pr_err("sgl OOM.\n");
 		return -ENOMEM;
@@ -366,7 +419,7 @@ static int char_sgdma_multi_map_user_buf_to_sgl(struct xdma_io_cb *cb, bool writ
 	}
 
     for(id=0; id<pages_nr; id++) {
-		rv = get_user_pages_fast((unsigned long)io->bd[id].buffer, 1, 1/* write */,
+		rv = get_user_pages_fast((unsigned long)bd[id].buffer, 1, 1/* write */,
 					(struct page **)&cb->pages[id]);
 		/* No pages were pinned */
 		if (rv < 0) {
@@ -396,9 +449,9 @@ static int char_sgdma_multi_map_user_buf_to_sgl(struct xdma_io_cb *cb, bool writ
 
 	sg = sgt->sgl;
 	for (i = 0; i < pages_nr; i++, sg = sg_next(sg)) {
-        unsigned int offset = offset_in_page((void __user *)io->bd[i].buffer);
+        unsigned int offset = offset_in_page((void __user *)bd[i].buffer);
 		flush_dcache_page(cb->pages[i]);
-		sg_set_page(sg, cb->pages[i], io->bd[i].len, offset);
+		sg_set_page(sg, cb->pages[i], bd[i].len, offset);
 	}
 
 	cb->pages_nr = pages_nr;
@@ -471,6 +524,14 @@ static ssize_t char_sgdma_write(struct file *file, const char __user *buf,
 static ssize_t char_sgdma_read(struct file *file, char __user *buf,
 				size_t count, loff_t *pos)
 {
+	struct xdma_cdev *xcdev = (struct xdma_cdev *)file->private_data;
+	u32 frames = 1;
+
+	/* one frame per read while a stream runs, see ioctl_do_stream_start() */
+	if (READ_ONCE(xcdev->stream))
+		return char_sgdma_stream_read(xcdev, file, buf, count, NULL,
+					      &frames);
+
 	return char_sgdma_read_write(file, buf, count, pos, 0);
 }
 
@@ -796,8 +857,10 @@ static int ioctl_do_burst_read_write(struct xdma_engine *engine,
                                      unsigned long arg, bool write)
 {
 	struct xdma_multi_read_write_ioctl io;
+	u32 lens[MAX_BD_NUMBER];
 	struct xdma_io_cb cb;
 	ssize_t res;
+	int i;
 	int rv;
 	unsigned long len =0;
 
@@ -819,20 +882,29 @@ static int ioctl_do_burst_read_write(struct xdma_engine *engine,
 		return -EINVAL;
 	}
 
+	if (io.bd_num <= 0 || io.bd_num > MAX_BD_NUMBER)
+		return -EINVAL;
+
 	memset(&cb, 0, sizeof(struct xdma_io_cb));
 	cb.buf = (char __user *)io.bd[0].buffer;
 	cb.len = len;
 	cb.ep_addr = 0;
 	cb.write = write;
-	rv = char_sgdma_multi_map_user_buf_to_sgl(&cb, write, &io);
+	rv = char_sgdma_multi_map_user_buf_to_sgl(&cb, write, io.bd, io.bd_num);
 	if (rv < 0)
 		return rv;
 
 	io.error = 0;
 	io.done = 0;
 
+	for (i = 0; i < io.bd_num; i++)
+		lens[i] = io.bd[i].len;
+
     res = xdma_multi_buffer_xfer_submit(engine, engine->channel, write, 0, &cb.sgt,
-                0,  write ? h2c_timeout * 1 : c2h_timeout * 1, &io);
+                0,  write ? h2c_timeout * 1 : c2h_timeout * 1, lens, io.bd_num);
+
+	for (i = 0; i < io.bd_num; i++)
+		io.bd[i].len = lens[i];
 
 	if (res < 0)
 		io.error = res;
@@ -853,6 +925,1267 @@ static int ioctl_do_burst_read_write(struct xdma_engine *engine,
 	return res;
 }
 
+/* Number of physically contiguous pages of reg from page first on */
+static unsigned int char_sgdma_page_run(struct device *dev,
+					struct xdma_registered_buffer *reg,
+					unsigned int first, unsigned int limit)
+{
+	unsigned long pfn = page_to_pfn(reg->pages[first]);
+	unsigned long run_max = xdma_dma_run_max(dev);
+	unsigned int run = 1;
+
+	while (first + run < limit && run < run_max &&
+	       page_to_pfn(reg->pages[first + run]) == pfn + run)
+		run++;
+
+	return run;
+}
+
+static void char_sgdma_desc_set_put(struct xdma_engine *engine,
+				    struct xdma_desc_set_entry *entry)
+{
+	xdma_desc_set_destroy(engine, entry->set);
+	kfree(entry->bd);
+	memset(entry, 0, sizeof(struct xdma_desc_set_entry));
+}
+
+static void char_sgdma_release_buffers(struct xdma_engine *engine,
+				       struct xdma_registered_buffer *reg,
+				       unsigned int mapped_nr)
+{
+	struct device *dev = &engine->xdev->pdev->dev;
+	unsigned int i;
+	unsigned int run;
+
+	dbg_tfr("%s, descriptor sets hit %llu, missed %llu.\n", engine->name,
+		reg->desc_set_hits, reg->desc_set_misses);
+	for (i = 0; i < XDMA_DESC_SET_CACHE; i++)
+		if (reg->desc_sets[i].set)
+			char_sgdma_desc_set_put(engine, &reg->desc_sets[i]);
+
+	/* the runs are found again the same way they were mapped */
+	for (i = 0; i < mapped_nr; i += run) {
+		run = char_sgdma_page_run(dev, reg, i, mapped_nr);
+		dma_unmap_page(dev, reg->dma_addrs[i], (size_t)run << PAGE_SHIFT,
+			       engine->dir);
+	}
+
+	for (i = 0; i < reg->pages_nr; i++) {
+		if (engine->dir == DMA_FROM_DEVICE)
+			set_page_dirty_lock(reg->pages[i]);
+		xdma_unpin_user_page(reg->pages[i]);
+	}
+
+	kvfree(reg->dma_addrs);
+	kvfree(reg->pages);
+	kfree(reg);
+}
+
+/*
+ * Registered buffers of handle, NULL if file did not register them. The
+ * reference keeps them mapped while a burst runs without reg_lock.
+ */
+static struct xdma_registered_buffer *
+char_sgdma_reg_get(struct xdma_cdev *xcdev, struct file *file, int handle)
+{
+	struct xdma_registered_buffer *reg;
+
+	mutex_lock(&xcdev->reg_lock);
+	reg = xcdev->reg_bufs[handle];
+	if (reg && reg->owner == file)
+		kref_get(&reg->ref);
+	else
+		reg = NULL;
+	mutex_unlock(&xcdev->reg_lock);
+
+	return reg;
+}
+
+static void char_sgdma_reg_idle(struct kref *ref)
+{
+	complete(&container_of(ref, struct xdma_registered_buffer, ref)->idle);
+}
+
+static void char_sgdma_reg_put(struct xdma_registered_buffer *reg)
+{
+	kref_put(&reg->ref, char_sgdma_reg_idle);
+}
+
+static int char_sgdma_unregister_buffers(struct xdma_cdev *xcdev,
+					 struct file *file, int handle)
+{
+	struct xdma_registered_buffer *reg;
+
+	if (handle < 0 || handle >= MAX_REGISTERED_BUFFERS)
+		return -EINVAL;
+
+	mutex_lock(&xcdev->reg_lock);
+	reg = xcdev->reg_bufs[handle];
+	if (!reg || reg->owner != file) {
+		mutex_unlock(&xcdev->reg_lock);
+		return -EINVAL;
+	}
+	if (xcdev->ring && xcdev->ring->reg == reg) {
+		mutex_unlock(&xcdev->reg_lock);
+		return -EBUSY;
+	}
+	xcdev->reg_bufs[handle] = NULL;
+	mutex_unlock(&xcdev->reg_lock);
+
+	/* waits for the burst transfers using the buffers to finish */
+	char_sgdma_reg_put(reg);
+	wait_for_completion(&reg->idle);
+
+	char_sgdma_release_buffers(xcdev->engine, reg, reg->pages_nr);
+
+	return 0;
+}
+
+/*
+ * Pin and map a user region once so that burst transfers from/to it
+ * don't need to allocate, pin and map anything.
+ */
+static int ioctl_do_register_buffers(struct xdma_cdev *xcdev,
+				     struct file *file, unsigned long arg)
+{
+	struct xdma_engine *engine = xcdev->engine;
+	struct device *dev = &xcdev->xdev->pdev->dev;
+	struct xdma_buffer_registration_ioctl io;
+	struct xdma_registered_buffer *reg;
+	unsigned int pages_nr;
+	unsigned int mapped_nr = 0;
+	int handle;
+	int rv;
+
+	if (copy_from_user(&io, (struct xdma_buffer_registration_ioctl __user *)arg,
+			   sizeof(struct xdma_buffer_registration_ioctl))) {
+		dbg_tfr("%s failed to copy from user space 0x%lx\n",
+			engine->name, arg);
+		return -EFAULT;
+	}
+
+	if (!io.len || !PAGE_ALIGNED(io.buffer) || !PAGE_ALIGNED(io.len) ||
+	    io.len > XDMA_REGISTERED_BUFFER_MAX_LEN) {
+		pr_err("%s, invalid buffer 0x%lx,%lu.\n", engine->name,
+		       io.buffer, io.len);
+		return -EINVAL;
+	}
+	pages_nr = io.len >> PAGE_SHIFT;
+
+	reg = kzalloc(sizeof(struct xdma_registered_buffer), GFP_KERNEL);
+	if (!reg)
+		return -ENOMEM;
+
+	/* up to 64K pages, the arrays may not be physically contiguous */
+	reg->pages = kvcalloc(pages_nr, sizeof(struct page *), GFP_KERNEL);
+	reg->dma_addrs = kvcalloc(pages_nr, sizeof(dma_addr_t), GFP_KERNEL);
+	if (!reg->pages || !reg->dma_addrs) {
+		pr_err("pages OOM.\n");
+		rv = -ENOMEM;
+		goto err_out;
+	}
+
+	/* only C2H writes to the pages, H2C may use read-only memory */
+	rv = xdma_pin_user_pages(io.buffer, pages_nr,
+				 engine->dir == DMA_FROM_DEVICE, reg->pages);
+	if (rv < 0) {
+		pr_err("unable to pin down %u user pages, %d.\n",
+			pages_nr, rv);
+		goto err_out;
+	}
+	reg->pages_nr = rv;
+	if (rv != pages_nr) {
+		pr_err("unable to pin down all %u user pages, %d.\n",
+			pages_nr, rv);
+		rv = -EFAULT;
+		goto err_out;
+	}
+
+	while (mapped_nr < pages_nr) {
+		unsigned int run = char_sgdma_page_run(dev, reg, mapped_nr,
+						       pages_nr);
+		dma_addr_t addr = dma_map_page(dev, reg->pages[mapped_nr], 0,
+					       (size_t)run << PAGE_SHIFT,
+					       engine->dir);
+		unsigned int i;
+
+		if (dma_mapping_error(dev, addr)) {
+			pr_err("unable to map user pages %u,%u.\n", mapped_nr,
+			       run);
+			rv = -EIO;
+			goto err_out;
+		}
+		for (i = 0; i < run; i++)
+			reg->dma_addrs[mapped_nr + i] = addr + ((dma_addr_t)i << PAGE_SHIFT);
+		mapped_nr += run;
+	}
+
+	reg->owner = file;
+	reg->buffer = io.buffer;
+	reg->len = io.len;
+	kref_init(&reg->ref);
+	init_completion(&reg->idle);
+
+	mutex_lock(&xcdev->reg_lock);
+	for (handle = 0; handle < MAX_REGISTERED_BUFFERS; handle++) {
+		if (!xcdev->reg_bufs[handle])
+			break;
+	}
+	if (handle == MAX_REGISTERED_BUFFERS) {
+		mutex_unlock(&xcdev->reg_lock);
+		rv = -ENOSPC;
+		goto err_out;
+	}
+	xcdev->reg_bufs[handle] = reg;
+	mutex_unlock(&xcdev->reg_lock);
+
+	dbg_tfr("%s, registered 0x%lx,%lu as %d.\n", engine->name, io.buffer,
+		io.len, handle);
+
+	if (put_user(handle, &((struct xdma_buffer_registration_ioctl __user *)arg)->handle)) {
+		char_sgdma_unregister_buffers(xcdev, file, handle);
+		return -EFAULT;
+	}
+
+	return 0;
+
+err_out:
+	char_sgdma_release_buffers(engine, reg, mapped_nr);
+	return rv;
+}
+
+static int ioctl_do_unregister_buffers(struct xdma_cdev *xcdev,
+				       struct file *file, unsigned long arg)
+{
+	return char_sgdma_unregister_buffers(xcdev, file, (int)arg);
+}
+
+/*
+ * DMA address of len bytes at offset of a registered region. A buffer may
+ * cross page boundaries only where the pages were mapped contiguously,
+ * e.g. inside a hugepage.
+ */
+static int char_sgdma_registered_dma_addr(struct xdma_registered_buffer *reg,
+					  unsigned long offset,
+					  unsigned long len, dma_addr_t *addr)
+{
+	unsigned long first, last, i;
+
+	if (!len || offset >= reg->len || len > reg->len - offset)
+		return -EINVAL;
+
+	first = offset >> PAGE_SHIFT;
+	last = (offset + len - 1) >> PAGE_SHIFT;
+	for (i = first + 1; i <= last; i++) {
+		if (reg->dma_addrs[i] != reg->dma_addrs[first] +
+					 ((dma_addr_t)(i - first) << PAGE_SHIFT))
+			return -EINVAL;
+	}
+
+	*addr = reg->dma_addrs[first] + offset_in_page(offset);
+
+	return 0;
+}
+
+/* Point sg at len bytes at offset of a registered region */
+static int char_sgdma_registered_sg_set(struct xdma_engine *engine,
+					struct xdma_registered_buffer *reg,
+					struct scatterlist *sg,
+					unsigned long offset, unsigned long len,
+					bool write)
+{
+	struct device *dev = &engine->xdev->pdev->dev;
+	dma_addr_t addr;
+
+	if (char_sgdma_registered_dma_addr(reg, offset, len, &addr))
+		return -EINVAL;
+
+	if (write)
+		dma_sync_single_for_device(dev, addr, len, DMA_TO_DEVICE);
+	sg_dma_address(sg) = addr;
+	sg_dma_len(sg) = len;
+
+	return 0;
+}
+
+/*
+ * Descriptor set of the buffers bd[] of a registered region, built by the
+ * first burst over them and reused while the same offsets and lengths come
+ * again, the least recently used of XDMA_DESC_SET_CACHE sets is replaced.
+ * NULL if there is none, the burst then builds its descriptors in the ring.
+ * Called with xcdev->reg_lock held, the set is not replaced until
+ * char_sgdma_desc_set_done().
+ */
+static struct xdma_desc_set_entry *
+char_sgdma_desc_set_get(struct xdma_engine *engine,
+			struct xdma_registered_buffer *reg,
+			const struct xdma_registered_buffer_descriptor *bd,
+			unsigned int bd_num)
+{
+	struct xdma_desc_set_entry *entry;
+	struct xdma_desc_set_entry *victim = NULL;
+	struct xdma_registered_buffer_descriptor *keys;
+	struct scatterlist *sgl, *sg;
+	struct xdma_desc_set *set = NULL;
+	struct sg_table sgt;
+	dma_addr_t *addrs;
+	u32 hash = jhash(bd, bd_num * sizeof(*bd), 0);
+	unsigned int i;
+
+	for (i = 0; i < XDMA_DESC_SET_CACHE; i++) {
+		entry = &reg->desc_sets[i];
+		if (entry->set && entry->hash == hash &&
+		    entry->bd_num == bd_num &&
+		    !memcmp(entry->bd, bd, bd_num * sizeof(*bd))) {
+			entry->last_use = ++reg->desc_set_clock;
+			entry->users++;
+			reg->desc_set_hits++;
+			return entry;
+		}
+		if (entry->users)
+			continue;
+		if (!victim || (victim->set &&
+		    (!entry->set || entry->last_use < victim->last_use)))
+			victim = entry;
+	}
+	reg->desc_set_misses++;
+	if (!victim)
+		return NULL;
+
+	keys = kmalloc(bd_num * (sizeof(*keys) + sizeof(*addrs)), GFP_KERNEL);
+	sgl = kmalloc_array(bd_num, sizeof(*sgl), GFP_KERNEL);
+	if (!keys || !sgl)
+		goto out_free;
+	addrs = (dma_addr_t *)(keys + bd_num);
+
+	sg_init_table(sgl, bd_num);
+	for (i = 0, sg = sgl; i < bd_num; i++, sg = sg_next(sg)) {
+		if (char_sgdma_registered_dma_addr(reg, bd[i].offset, bd[i].len,
+						   &addrs[i]))
+			goto out_free;
+		sg_dma_address(sg) = addrs[i];
+		sg_dma_len(sg) = bd[i].len;
+	}
+	sgt.sgl = sgl;
+	sgt.nents = bd_num;
+	sgt.orig_nents = bd_num;
+
+	set = xdma_desc_set_create(engine, &sgt);
+	if (!set)
+		goto out_free;
+	kfree(sgl);
+
+	if (victim->set)
+		char_sgdma_desc_set_put(engine, victim);
+	memcpy(keys, bd, bd_num * sizeof(*bd));
+	victim->set = set;
+	victim->bd = keys;
+	victim->addrs = addrs;
+	victim->bd_num = bd_num;
+	victim->hash = hash;
+	victim->last_use = ++reg->desc_set_clock;
+	victim->users = 1;
+
+	return victim;
+
+out_free:
+	kfree(sgl);
+	kfree(keys);
+	return NULL;
+}
+
+static void char_sgdma_desc_set_done(struct xdma_cdev *xcdev,
+				     struct xdma_desc_set_entry *entry)
+{
+	mutex_lock(&xcdev->reg_lock);
+	entry->users--;
+	mutex_unlock(&xcdev->reg_lock);
+}
+
+/* Burst over a cached descriptor set, lens[] as for the other bursts */
+static ssize_t char_sgdma_desc_set_submit(struct xdma_engine *engine,
+					  struct xdma_desc_set_entry *entry,
+					  bool write, u32 *lens)
+{
+	struct device *dev = &engine->xdev->pdev->dev;
+	ssize_t res;
+	unsigned int i;
+
+	if (write) {
+		for (i = 0; i < entry->bd_num; i++)
+			dma_sync_single_for_device(dev, entry->addrs[i],
+						   entry->bd[i].len,
+						   DMA_TO_DEVICE);
+	}
+
+	res = xdma_desc_set_xfer_submit(engine, entry->set,
+				write ? h2c_timeout * 1 : c2h_timeout * 1,
+				lens, entry->bd_num);
+
+	if (!write) {
+		for (i = 0; i < entry->bd_num; i++)
+			dma_sync_single_for_cpu(dev, entry->addrs[i],
+						entry->bd[i].len,
+						DMA_FROM_DEVICE);
+	}
+
+	return res;
+}
+
+/*
+ * Same as ioctl_do_burst_read_write() with buffers given as offsets in
+ * a registered region, the scatterlist is built from the saved DMA addresses.
+ */
+static int ioctl_do_registered_burst_read_write(struct xdma_cdev *xcdev,
+						struct file *file,
+						unsigned long arg, bool write)
+{
+	struct xdma_engine *engine = xcdev->engine;
+	struct device *dev = &xcdev->xdev->pdev->dev;
+	struct xdma_multi_registered_ioctl io;
+	u32 lens[MAX_BD_NUMBER];
+	struct scatterlist sgl[MAX_BD_NUMBER];
+	struct xdma_registered_buffer *reg;
+	struct xdma_desc_set_entry *entry;
+	struct scatterlist *sg;
+	struct sg_table sgt;
+	ssize_t res;
+	int i;
+	int rv;
+
+	if (copy_from_user(&io, (struct xdma_multi_registered_ioctl __user *)arg,
+			   sizeof(struct xdma_multi_registered_ioctl))) {
+		dbg_tfr("%s failed to copy from user space 0x%lx\n",
+			engine->name, arg);
+		return -EFAULT;
+	}
+
+	dbg_tfr("%s, W %d, handle %d, bd_num %d\n", engine->name, write,
+		io.handle, io.bd_num);
+
+	if ((write && engine->dir != DMA_TO_DEVICE) ||
+	    (!write && engine->dir != DMA_FROM_DEVICE)) {
+		pr_err("r/w mismatch. W %d, dir %d.\n", write, engine->dir);
+		return -EINVAL;
+	}
+
+	if (io.bd_num <= 0 || io.bd_num > MAX_BD_NUMBER ||
+	    io.handle < 0 || io.handle >= MAX_REGISTERED_BUFFERS)
+		return -EINVAL;
+
+	reg = char_sgdma_reg_get(xcdev, file, io.handle);
+	if (!reg)
+		return -EINVAL;
+
+	io.error = 0;
+	io.done = 0;
+
+	mutex_lock(&xcdev->reg_lock);
+	entry = char_sgdma_desc_set_get(engine, reg, io.bd, io.bd_num);
+	mutex_unlock(&xcdev->reg_lock);
+	if (entry) {
+		for (i = 0; i < io.bd_num; i++)
+			lens[i] = io.bd[i].len;
+		res = char_sgdma_desc_set_submit(engine, entry, write, lens);
+		char_sgdma_desc_set_done(xcdev, entry);
+		for (i = 0; i < io.bd_num; i++)
+			io.bd[i].len = lens[i];
+		goto out_copy;
+	}
+
+	sg_init_table(sgl, io.bd_num);
+	for (i = 0, sg = sgl; i < io.bd_num; i++, sg = sg_next(sg)) {
+		rv = char_sgdma_registered_sg_set(engine, reg, sg, io.bd[i].offset,
+						  io.bd[i].len, write);
+		if (rv < 0) {
+			pr_err("%s, invalid bd %d, offset 0x%lx, len %lu.\n",
+			       engine->name, i, io.bd[i].offset, io.bd[i].len);
+			goto out_put;
+		}
+		lens[i] = io.bd[i].len;
+	}
+	sgt.sgl = sgl;
+	sgt.nents = io.bd_num;
+	sgt.orig_nents = io.bd_num;
+
+	res = xdma_multi_buffer_xfer_submit(engine, engine->channel, write, 0, &sgt,
+				1, write ? h2c_timeout * 1 : c2h_timeout * 1,
+				lens, io.bd_num);
+
+	for (i = 0, sg = sgl; i < io.bd_num; i++, sg = sg_next(sg)) {
+		if (!write)
+			dma_sync_single_for_cpu(dev, sg_dma_address(sg),
+						io.bd[i].len, DMA_FROM_DEVICE);
+		io.bd[i].len = lens[i];
+	}
+
+out_copy:
+	char_sgdma_reg_put(reg);
+	if (res < 0)
+		io.error = res;
+	else
+		io.done = res;
+
+	if (copy_to_user((struct xdma_multi_registered_ioctl __user *)arg, &io,
+			 sizeof(struct xdma_multi_registered_ioctl))) {
+		dbg_tfr("%s failed to copy to user space 0x%lx, %ld\n",
+			engine->name, arg, res);
+		return -EFAULT;
+	}
+
+	return res;
+
+out_put:
+	char_sgdma_reg_put(reg);
+	return rv;
+}
+
+/* A burst must fit the descriptor ring, it is split where the ring wraps */
+static inline unsigned int xdma_multi_bd_max(struct xdma_engine *engine)
+{
+	return min_t(unsigned int, engine->desc_max, MAX_BD_NUMBER_V2);
+}
+
+static int ioctl_do_multi_bd_max_get(struct xdma_engine *engine,
+				     unsigned long arg)
+{
+	if (!engine) {
+		pr_err("Invalid DMA engine\n");
+		return -EINVAL;
+	}
+
+	dbg_perf("IOCTL_XDMA_MULTI_BD_MAX_GET\n");
+	return put_user(xdma_multi_bd_max(engine), (int __user *)arg);
+}
+
+/*
+ * Burst transfer with the descriptors and the completion lengths kept in
+ * user arrays, only struct xdma_multi_read_write_ioctl_v2 is copied.
+ */
+static int ioctl_do_burst_read_write_v2(struct xdma_cdev *xcdev,
+					struct file *file,
+					unsigned long arg, bool write)
+{
+	struct xdma_engine *engine = xcdev->engine;
+	struct device *dev = &xcdev->xdev->pdev->dev;
+	struct xdma_multi_read_write_ioctl_v2 io;
+	struct xdma_buffer_descriptor *bd = NULL;
+	struct xdma_registered_buffer *reg = NULL;
+	struct xdma_registered_buffer_descriptor *keys = NULL;
+	struct xdma_desc_set_entry *entry;
+	struct scatterlist *sgl = NULL;
+	struct scatterlist *sg;
+	struct xdma_io_cb cb;
+	struct sg_table sgt;
+	u32 *lens = NULL;
+	ssize_t res;
+	int i;
+	int rv;
+
+	if (copy_from_user(&io, (struct xdma_multi_read_write_ioctl_v2 __user *)arg,
+			   sizeof(struct xdma_multi_read_write_ioctl_v2))) {
+		dbg_tfr("%s failed to copy from user space 0x%lx\n",
+			engine->name, arg);
+		return -EFAULT;
+	}
+
+	dbg_tfr("%s, W %d, handle %d, bd_num %u\n", engine->name, write,
+		io.handle, io.bd_num);
+
+	if (io.version != XDMA_MULTI_IOCTL_VERSION)
+		return -EINVAL;
+
+	if ((write && engine->dir != DMA_TO_DEVICE) ||
+	    (!write && engine->dir != DMA_FROM_DEVICE)) {
+		pr_err("r/w mismatch. W %d, dir %d.\n", write, engine->dir);
+		return -EINVAL;
+	}
+
+	if (!io.bd_num || io.bd_num > xdma_multi_bd_max(engine) ||
+	    io.handle >= MAX_REGISTERED_BUFFERS)
+		return -EINVAL;
+
+	bd = kmalloc_array(io.bd_num, sizeof(*bd), GFP_KERNEL);
+	lens = kmalloc_array(io.bd_num, sizeof(*lens), GFP_KERNEL);
+	if (!bd || !lens) {
+		rv = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(bd, (void __user *)(uintptr_t)io.bd,
+			   io.bd_num * sizeof(*bd))) {
+		rv = -EFAULT;
+		goto out_free;
+	}
+
+	for (i = 0; i < io.bd_num; i++)
+		lens[i] = bd[i].len;
+
+	if (io.handle < 0) {
+		memset(&cb, 0, sizeof(struct xdma_io_cb));
+		cb.buf = (char __user *)bd[0].buffer;
+		for (i = 0; i < io.bd_num; i++)
+			cb.len += bd[i].len;
+		cb.write = write;
+		rv = char_sgdma_multi_map_user_buf_to_sgl(&cb, write, bd, io.bd_num);
+		if (rv < 0)
+			goto out_free;
+
+		res = xdma_multi_buffer_xfer_submit(engine, engine->channel, write, 0,
+					&cb.sgt, 0,
+					write ? h2c_timeout * 1 : c2h_timeout * 1,
+					lens, io.bd_num);
+
+		char_sgdma_unmap_user_buf(&cb, write);
+	} else {
+		sgl = kmalloc_array(io.bd_num, sizeof(*sgl), GFP_KERNEL);
+		keys = kmalloc_array(io.bd_num, sizeof(*keys), GFP_KERNEL);
+		if (!sgl || !keys) {
+			rv = -ENOMEM;
+			goto out_free;
+		}
+
+		reg = char_sgdma_reg_get(xcdev, file, io.handle);
+		if (!reg) {
+			rv = -EINVAL;
+			goto out_free;
+		}
+
+		for (i = 0; i < io.bd_num; i++) {
+			keys[i].offset = (unsigned long)bd[i].buffer - reg->buffer;
+			keys[i].len = bd[i].len;
+		}
+		mutex_lock(&xcdev->reg_lock);
+		entry = char_sgdma_desc_set_get(engine, reg, keys, io.bd_num);
+		mutex_unlock(&xcdev->reg_lock);
+		if (entry) {
+			res = char_sgdma_desc_set_submit(engine, entry, write,
+							 lens);
+			char_sgdma_desc_set_done(xcdev, entry);
+			char_sgdma_reg_put(reg);
+			goto out_result;
+		}
+
+		sg_init_table(sgl, io.bd_num);
+		for (i = 0, sg = sgl; i < io.bd_num; i++, sg = sg_next(sg)) {
+			unsigned long offset = (unsigned long)bd[i].buffer - reg->buffer;
+
+			rv = char_sgdma_registered_sg_set(engine, reg, sg, offset,
+							  bd[i].len, write);
+			if (rv < 0) {
+				char_sgdma_reg_put(reg);
+				pr_err("%s, invalid bd %d, buffer 0x%p, len %lu.\n",
+				       engine->name, i, bd[i].buffer, bd[i].len);
+				goto out_free;
+			}
+		}
+		sgt.sgl = sgl;
+		sgt.nents = io.bd_num;
+		sgt.orig_nents = io.bd_num;
+
+		res = xdma_multi_buffer_xfer_submit(engine, engine->channel, write, 0,
+					&sgt, 1,
+					write ? h2c_timeout * 1 : c2h_timeout * 1,
+					lens, io.bd_num);
+
+		if (!write) {
+			for (i = 0, sg = sgl; i < io.bd_num; i++, sg = sg_next(sg))
+				dma_sync_single_for_cpu(dev, sg_dma_address(sg),
+							sg_dma_len(sg),
+							DMA_FROM_DEVICE);
+		}
+		char_sgdma_reg_put(reg);
+	}
+
+out_result:
+	io.error = res < 0 ? res : 0;
+	io.done = res < 0 ? 0 : res;
+
+	if (copy_to_user((void __user *)(uintptr_t)io.lens, lens,
+			 io.bd_num * sizeof(*lens)) ||
+	    copy_to_user((struct xdma_multi_read_write_ioctl_v2 __user *)arg, &io,
+			 sizeof(struct xdma_multi_read_write_ioctl_v2))) {
+		dbg_tfr("%s failed to copy to user space 0x%lx, %ld\n",
+			engine->name, arg, res);
+		rv = -EFAULT;
+		goto out_free;
+	}
+
+	rv = res;
+
+out_free:
+	kfree(keys);
+	kfree(sgl);
+	kfree(lens);
+	kfree(bd);
+	return rv;
+}
+
+static inline u32 xdma_ring_cq_ready(struct xdma_ring *ring)
+{
+	return READ_ONCE(ring->cq_tail) - READ_ONCE(ring->hdr->cq_head);
+}
+
+/* Post the result of a slot to the CQ and free the slot */
+static void xdma_ring_complete(struct xdma_ring_slot *slot, long res)
+{
+	struct xdma_ring *ring = slot->ring;
+	struct xdma_ring_cqe *cqe;
+	unsigned long flags;
+	u32 tail;
+
+	spin_lock_irqsave(&ring->cq_lock, flags);
+	tail = ring->cq_tail;
+	if (tail - READ_ONCE(ring->hdr->cq_head) < ring->cq_entries) {
+		cqe = &ring->cqes[tail & (ring->cq_entries - 1)];
+		cqe->user_data = slot->user_data;
+		cqe->res = res;
+		cqe->flags = 0;
+		ring->cq_tail = tail + 1;
+		smp_store_release(&ring->hdr->cq_tail, tail + 1);
+	} else {
+		/* the application moved cq_head forward by itself */
+		ring->hdr->cq_overflow++;
+	}
+	ring->free_slots[ring->free_nr++] = slot - ring->slots;
+	ring->inflight--;
+	spin_unlock_irqrestore(&ring->cq_lock, flags);
+
+	wake_up(&ring->wq);
+	if (ring->eventfd)
+		xdma_eventfd_signal(ring->eventfd);
+}
+
+/* Called by libxdma with the engine lock held */
+static void xdma_ring_io_done(unsigned long cb_hndl, int err)
+{
+	struct xdma_io_cb *cb = (struct xdma_io_cb *)cb_hndl;
+	struct xdma_ring_slot *slot = (struct xdma_ring_slot *)cb->private;
+	struct xdma_cdev *xcdev = slot->ring->xcdev;
+	ssize_t res = err;
+
+	slot->done = true;
+	if (!err) {
+		res = xdma_xfer_completion((void *)cb, xcdev->xdev,
+				xcdev->engine->channel, cb->write, 0,
+				&slot->sgt, 1, 0);
+		if (!cb->write)
+			dma_sync_single_for_cpu(&xcdev->xdev->pdev->dev,
+						slot->addr, slot->len,
+						DMA_FROM_DEVICE);
+	}
+
+	xdma_ring_complete(slot, res);
+}
+
+/*
+ * Queue the SQ entries posted since the last call on the engine.
+ * Stops early when there would be no room left in the CQ for the
+ * transfers in flight. Returns the number of consumed SQ entries.
+ */
+static int xdma_ring_submit(struct xdma_ring *ring)
+{
+	struct xdma_cdev *xcdev = ring->xcdev;
+	struct xdma_engine *engine = xcdev->engine;
+	struct device *dev = &xcdev->xdev->pdev->dev;
+	struct xdma_registered_buffer *reg = ring->reg;
+	bool write = engine->dir == DMA_TO_DEVICE;
+	u32 mask = ring->sq_entries - 1;
+	int submitted = 0;
+	u32 head, tail;
+
+	/* keep out the blocking transfers of this engine */
+	mutex_lock(&engine->desc_lock);
+
+	head = ring->sq_head;
+	tail = smp_load_acquire(&ring->hdr->sq_tail);
+	if (tail - head > ring->sq_entries) {
+		mutex_unlock(&engine->desc_lock);
+		pr_err("%s, invalid sq_tail %u, head %u.\n", engine->name,
+		       tail, head);
+		return -EINVAL;
+	}
+
+	while (head != tail) {
+		struct xdma_ring_sqe *sqe = &ring->sqes[head & mask];
+		struct xdma_ring_slot *slot;
+		unsigned long flags;
+		u64 offset;
+		u32 len;
+		ssize_t rv;
+
+		spin_lock_irqsave(&ring->cq_lock, flags);
+		if (!ring->free_nr ||
+		    ring->inflight + xdma_ring_cq_ready(ring) >= ring->cq_entries) {
+			spin_unlock_irqrestore(&ring->cq_lock, flags);
+			break;
+		}
+		slot = &ring->slots[ring->free_slots[--ring->free_nr]];
+		ring->inflight++;
+		spin_unlock_irqrestore(&ring->cq_lock, flags);
+
+		/* the application may rewrite the entry, read it once */
+		slot->user_data = READ_ONCE(sqe->user_data);
+		offset = READ_ONCE(sqe->offset);
+		len = READ_ONCE(sqe->len);
+		slot->len = len;
+		slot->done = false;
+		head++;
+		submitted++;
+
+		if (char_sgdma_registered_dma_addr(reg, offset, len,
+						   &slot->addr)) {
+			xdma_ring_complete(slot, -EINVAL);
+			continue;
+		}
+
+		if (write)
+			dma_sync_single_for_device(dev, slot->addr, len,
+						   DMA_TO_DEVICE);
+
+		sg_init_table(&slot->sg, 1);
+		sg_dma_address(&slot->sg) = slot->addr;
+		sg_dma_len(&slot->sg) = len;
+		slot->sgt.sgl = &slot->sg;
+		slot->sgt.nents = 1;
+		slot->sgt.orig_nents = 1;
+
+		memset(&slot->cb, 0, sizeof(struct xdma_io_cb));
+		slot->cb.private = slot;
+		slot->cb.len = len;
+		slot->cb.write = write;
+		slot->cb.io_done = xdma_ring_io_done;
+
+		rv = xdma_xfer_submit_nowait(&slot->cb, xcdev->xdev,
+					     engine->channel, write, 0,
+					     &slot->sgt, 1, 0);
+		/* some failures are reported through io_done already */
+		if (rv != -EIOCBQUEUED && !slot->done)
+			xdma_ring_complete(slot, rv < 0 ? rv : -EIO);
+	}
+
+	ring->sq_head = head;
+	smp_store_release(&ring->hdr->sq_head, head);
+
+	mutex_unlock(&engine->desc_lock);
+
+	if (submitted && engine->cmplthp)
+		xdma_kthread_wakeup(engine->cmplthp);
+
+	return submitted;
+}
+
+static void xdma_ring_free(struct xdma_ring *ring)
+{
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+	vfree(ring->hdr);
+	kfree(ring->free_slots);
+	kfree(ring->slots);
+	kfree(ring);
+}
+
+static void xdma_ring_destroy(struct xdma_cdev *xcdev, struct file *file)
+{
+	struct xdma_engine *engine = xcdev->engine;
+	struct xdma_ring *ring;
+
+	mutex_lock(&xcdev->reg_lock);
+	ring = xcdev->ring;
+	if (!ring || ring->owner != file) {
+		mutex_unlock(&xcdev->reg_lock);
+		return;
+	}
+	mutex_lock(&xcdev->ring_lock);
+	xcdev->ring = NULL;
+	mutex_unlock(&xcdev->ring_lock);
+	mutex_unlock(&xcdev->reg_lock);
+
+	/* C2H transfers only finish when frames arrive, don't wait for long */
+	wait_event_timeout(ring->wq, !READ_ONCE(ring->inflight),
+			   msecs_to_jiffies(XDMA_RING_DRAIN_TIMEOUT_MS));
+	if (READ_ONCE(ring->inflight)) {
+		mutex_lock(&engine->desc_lock);
+		xdma_xfer_cancel_nowait(engine, xdma_ring_io_done);
+		mutex_unlock(&engine->desc_lock);
+	}
+
+	xdma_ring_free(ring);
+}
+
+static int ioctl_do_ring_setup(struct xdma_cdev *xcdev, struct file *file,
+			       unsigned long arg)
+{
+	struct xdma_engine *engine = xcdev->engine;
+	struct xdma_ring_setup_ioctl io;
+	struct xdma_registered_buffer *reg;
+	struct xdma_ring *ring;
+	u32 i;
+	int rv;
+
+	if (copy_from_user(&io, (struct xdma_ring_setup_ioctl __user *)arg,
+			   sizeof(struct xdma_ring_setup_ioctl))) {
+		dbg_tfr("%s failed to copy from user space 0x%lx\n",
+			engine->name, arg);
+		return -EFAULT;
+	}
+
+	if (!io.entries || !is_power_of_2(io.entries) ||
+	    io.entries > XDMA_RING_ENTRIES_MAX ||
+	    io.handle < 0 || io.handle >= MAX_REGISTERED_BUFFERS) {
+		pr_err("%s, invalid ring, entries %u, handle %d.\n",
+		       engine->name, io.entries, io.handle);
+		return -EINVAL;
+	}
+
+	ring = kzalloc(sizeof(struct xdma_ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->owner = file;
+	ring->xcdev = xcdev;
+	ring->sq_entries = io.entries;
+	ring->cq_entries = io.entries * 2;
+	ring->mem_size = XDMA_RING_CQES_OFFSET(ring->sq_entries) +
+			 ring->cq_entries * sizeof(struct xdma_ring_cqe);
+	spin_lock_init(&ring->cq_lock);
+	init_waitqueue_head(&ring->wq);
+
+	ring->hdr = vmalloc_user(ring->mem_size);
+	ring->slots = kcalloc(ring->sq_entries, sizeof(struct xdma_ring_slot),
+			      GFP_KERNEL);
+	ring->free_slots = kcalloc(ring->sq_entries, sizeof(u32), GFP_KERNEL);
+	if (!ring->hdr || !ring->slots || !ring->free_slots) {
+		pr_err("ring OOM.\n");
+		rv = -ENOMEM;
+		goto err_out;
+	}
+	ring->sqes = (void *)ring->hdr + XDMA_RING_SQES_OFFSET;
+	ring->cqes = (void *)ring->hdr + XDMA_RING_CQES_OFFSET(ring->sq_entries);
+	ring->hdr->sq_entries = ring->sq_entries;
+	ring->hdr->cq_entries = ring->cq_entries;
+
+	for (i = 0; i < ring->sq_entries; i++) {
+		ring->slots[i].ring = ring;
+		ring->free_slots[i] = i;
+	}
+	ring->free_nr = ring->sq_entries;
+
+	if (io.eventfd >= 0) {
+		ring->eventfd = eventfd_ctx_fdget(io.eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			rv = PTR_ERR(ring->eventfd);
+			ring->eventfd = NULL;
+			goto err_out;
+		}
+	}
+
+	mutex_lock(&xcdev->reg_lock);
+	reg = xcdev->reg_bufs[io.handle];
+	if (!reg || reg->owner != file) {
+		rv = -EINVAL;
+		goto err_unlock;
+	}
+	if (xcdev->ring) {
+		rv = -EBUSY;
+		goto err_unlock;
+	}
+	ring->reg = reg;
+	mutex_lock(&xcdev->ring_lock);
+	xcdev->ring = ring;
+	mutex_unlock(&xcdev->ring_lock);
+	mutex_unlock(&xcdev->reg_lock);
+
+	io.cq_entries = ring->cq_entries;
+	io.mmap_size = ring->mem_size;
+	if (copy_to_user((struct xdma_ring_setup_ioctl __user *)arg, &io,
+			 sizeof(struct xdma_ring_setup_ioctl))) {
+		/* the ring goes away on close */
+		return -EFAULT;
+	}
+
+	dbg_tfr("%s, ring %u/%u entries on buffers %d.\n", engine->name,
+		ring->sq_entries, ring->cq_entries, io.handle);
+
+	return 0;
+
+err_unlock:
+	mutex_unlock(&xcdev->reg_lock);
+err_out:
+	xdma_ring_free(ring);
+	return rv;
+}
+
+/*
+ * The ring of this file, NULL if another file owns it. Takes ring_lock and
+ * not reg_lock, mmap holds mmap_lock which registration takes under reg_lock.
+ * Only the release of its owner frees the ring, so the owner may keep using
+ * it after the unlock.
+ */
+static struct xdma_ring *xdma_ring_get(struct xdma_cdev *xcdev,
+				       struct file *file)
+{
+	struct xdma_ring *ring;
+
+	mutex_lock(&xcdev->ring_lock);
+	ring = xcdev->ring;
+	if (ring && ring->owner != file)
+		ring = NULL;
+	mutex_unlock(&xcdev->ring_lock);
+
+	return ring;
+}
+
+/* Doorbell: submit the new SQ entries, then wait for completions if asked */
+static int ioctl_do_ring_enter(struct xdma_cdev *xcdev, struct file *file,
+			       unsigned long arg)
+{
+	struct xdma_ring *ring = xdma_ring_get(xcdev, file);
+	struct xdma_ring_enter_ioctl io;
+	u32 min_complete;
+	long wait;
+	int submitted;
+
+	if (!ring)
+		return -EINVAL;
+
+	if (copy_from_user(&io, (struct xdma_ring_enter_ioctl __user *)arg,
+			   sizeof(struct xdma_ring_enter_ioctl)))
+		return -EFAULT;
+
+	submitted = xdma_ring_submit(ring);
+	if (submitted < 0)
+		return submitted;
+
+	min_complete = min(io.min_complete, ring->cq_entries);
+	if (min_complete) {
+		if (io.timeout_ms > 0)
+			wait = wait_event_interruptible_timeout(ring->wq,
+					xdma_ring_cq_ready(ring) >= min_complete,
+					msecs_to_jiffies(io.timeout_ms));
+		else
+			wait = wait_event_interruptible(ring->wq,
+					xdma_ring_cq_ready(ring) >= min_complete);
+		if (wait < 0)
+			return wait;
+	}
+
+	io.submitted = submitted;
+	io.completed = xdma_ring_cq_ready(ring);
+	if (copy_to_user((struct xdma_ring_enter_ioctl __user *)arg, &io,
+			 sizeof(struct xdma_ring_enter_ioctl)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Stop and free the stream of this file, its counters go to io if given */
+static int char_sgdma_stream_stop(struct xdma_cdev *xcdev, struct file *file,
+				  struct xdma_stream_ioctl *io)
+{
+	struct xdma_stream *stream;
+
+	/* a reader holds the lock for one read timeout at most */
+	mutex_lock(&xcdev->stream_lock);
+	stream = xcdev->stream;
+	if (!stream || stream->owner != file) {
+		mutex_unlock(&xcdev->stream_lock);
+		return -EINVAL;
+	}
+	xcdev->stream = NULL;
+	mutex_unlock(&xcdev->stream_lock);
+
+	xdma_cyclic_ring_stop(&stream->ring);
+	if (io) {
+		io->entries = stream->ring.size;
+		io->buf_size = stream->ring.buf_size;
+		io->timeout_ms = stream->timeout_ms;
+		io->frames = stream->ring.frames;
+		io->overruns = stream->ring.overruns;
+		io->errors = stream->ring.errors;
+	}
+	xdma_cyclic_ring_free(&stream->ring);
+	kfree(stream);
+
+	return 0;
+}
+
+static int ioctl_do_stream_start(struct xdma_cdev *xcdev, struct file *file,
+				 unsigned long arg)
+{
+	struct xdma_engine *engine = xcdev->engine;
+	struct xdma_stream_ioctl io;
+	struct xdma_stream *stream;
+	int rv;
+
+	if (copy_from_user(&io, (struct xdma_stream_ioctl __user *)arg,
+			   sizeof(struct xdma_stream_ioctl))) {
+		dbg_tfr("%s failed to copy from user space 0x%lx\n",
+			engine->name, arg);
+		return -EFAULT;
+	}
+
+	if (!io.entries)
+		io.entries = XDMA_STREAM_ENTRIES_DEFAULT;
+	if (!io.buf_size)
+		io.buf_size = XDMA_STREAM_BUF_SIZE_DEFAULT;
+	if (!is_power_of_2(io.entries) || io.entries > XDMA_CYCLIC_RING_MAX) {
+		pr_err("%s, invalid stream, entries %u.\n", engine->name,
+		       io.entries);
+		return -EINVAL;
+	}
+
+	stream = kzalloc(sizeof(struct xdma_stream), GFP_KERNEL);
+	if (!stream)
+		return -ENOMEM;
+	stream->owner = file;
+	stream->timeout_ms = io.timeout_ms ? io.timeout_ms : c2h_timeout * 1000;
+
+	rv = xdma_cyclic_ring_alloc(engine, &stream->ring, io.entries,
+				    io.buf_size);
+	if (rv < 0) {
+		kfree(stream);
+		return rv;
+	}
+
+	mutex_lock(&xcdev->stream_lock);
+	if (xcdev->stream) {
+		rv = -EBUSY;
+		goto err_unlock;
+	}
+	/* other transfers on the engine fail with -EBUSY from now on */
+	rv = xdma_cyclic_ring_start(&stream->ring);
+	if (rv < 0)
+		goto err_unlock;
+	xcdev->stream = stream;
+	mutex_unlock(&xcdev->stream_lock);
+
+	dbg_tfr("%s, stream of %u x %u bytes.\n", engine->name, io.entries,
+		io.buf_size);
+
+	return 0;
+
+err_unlock:
+	mutex_unlock(&xcdev->stream_lock);
+	xdma_cyclic_ring_free(&stream->ring);
+	kfree(stream);
+	return rv;
+}
+
+static int ioctl_do_stream_stop(struct xdma_cdev *xcdev, struct file *file,
+				unsigned long arg)
+{
+	struct xdma_stream_ioctl io;
+	int rv;
+
+	memset(&io, 0, sizeof(struct xdma_stream_ioctl));
+	rv = char_sgdma_stream_stop(xcdev, file, &io);
+	if (rv < 0)
+		return rv;
+
+	if (copy_to_user((struct xdma_stream_ioctl __user *)arg, &io,
+			 sizeof(struct xdma_stream_ioctl)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Wait for the first frame, then copy the frames available back to back.
+ * A first frame longer than len is cut, the ones after it that don't fit
+ * are left for the next read. 0 if nothing arrived within the timeout.
+ */
+static ssize_t char_sgdma_stream_read(struct xdma_cdev *xcdev,
+				      struct file *file, char __user *buf,
+				      size_t len, u32 __user *lens, u32 *frames)
+{
+	struct xdma_stream *stream;
+	struct xdma_cyclic_ring *ring;
+	u32 max = *frames, n = 0, flen;
+	size_t done = 0;
+	void *data;
+	int rv;
+
+	*frames = 0;
+	if (!len || !max)
+		return 0;
+
+	if (mutex_lock_interruptible(&xcdev->stream_lock))
+		return -ERESTARTSYS;
+	stream = xcdev->stream;
+	if (!stream || stream->owner != file) {
+		rv = -EINVAL;
+		goto unlock;
+	}
+	ring = &stream->ring;
+
+	if (file->f_flags & O_NONBLOCK)
+		rv = xdma_cyclic_ring_sync(ring) ? 1 : -EAGAIN;
+	else
+		rv = xdma_cyclic_ring_wait(ring, stream->timeout_ms);
+	if (rv <= 0)
+		goto unlock;
+
+	while (n < max && (data = xdma_cyclic_ring_peek(ring, &flen))) {
+		if (n && done + flen > len)
+			break;
+		flen = min_t(size_t, flen, len - done);
+		/* the frame stays in the ring */
+		if (copy_to_user(buf + done, data, flen) ||
+		    (lens && put_user(flen, lens + n))) {
+			rv = -EFAULT;
+			break;
+		}
+		/* overwritten during the copy, the next frame takes its place */
+		if (!xdma_cyclic_ring_advance(ring))
+			continue;
+		done += flen;
+		n++;
+	}
+	*frames = n;
+
+unlock:
+	mutex_unlock(&xcdev->stream_lock);
+
+	/* as long as some frames are copied, return the count */
+	return (done || rv >= 0) ? done : rv;
+}
+
+static int ioctl_do_stream_read(struct xdma_cdev *xcdev, struct file *file,
+				unsigned long arg)
+{
+	struct xdma_stream_read_ioctl io;
+	ssize_t res;
+
+	if (copy_from_user(&io, (struct xdma_stream_read_ioctl __user *)arg,
+			   sizeof(struct xdma_stream_read_ioctl)))
+		return -EFAULT;
+
+	res = char_sgdma_stream_read(xcdev, file,
+				     (char __user *)(uintptr_t)io.buf, io.len,
+				     (u32 __user *)(uintptr_t)io.lens,
+				     &io.frames);
+	if (res < 0)
+		return res;
+
+	if (copy_to_user((struct xdma_stream_read_ioctl __user *)arg, &io,
+			 sizeof(struct xdma_stream_read_ioctl)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int char_sgdma_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct xdma_cdev *xcdev = (struct xdma_cdev *)file->private_data;
+	struct xdma_ring *ring = xdma_ring_get(xcdev, file);
+
+	if (!ring || vma->vm_pgoff)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->hdr, 0);
+}
+
 static int ioctl_do_aperture_dma(struct xdma_engine *engine, unsigned long arg,
 				bool write)
 {
@@ -960,6 +2293,42 @@ static long char_sgdma_ioctl(struct file *file, unsigned int cmd,
 	case IOCTL_XDMA_MULTI_WRITE:
 		rv = ioctl_do_burst_read_write(engine, arg, 1);
 		break;
+	case IOCTL_XDMA_REGISTER_BUFFERS:
+		rv = ioctl_do_register_buffers(xcdev, file, arg);
+		break;
+	case IOCTL_XDMA_UNREGISTER_BUFFERS:
+		rv = ioctl_do_unregister_buffers(xcdev, file, arg);
+		break;
+	case IOCTL_XDMA_MULTI_READ_REGISTERED:
+		rv = ioctl_do_registered_burst_read_write(xcdev, file, arg, 0);
+		break;
+	case IOCTL_XDMA_MULTI_WRITE_REGISTERED:
+		rv = ioctl_do_registered_burst_read_write(xcdev, file, arg, 1);
+		break;
+	case IOCTL_XDMA_MULTI_BD_MAX_GET:
+		rv = ioctl_do_multi_bd_max_get(engine, arg);
+		break;
+	case IOCTL_XDMA_MULTI_READ_V2:
+		rv = ioctl_do_burst_read_write_v2(xcdev, file, arg, 0);
+		break;
+	case IOCTL_XDMA_MULTI_WRITE_V2:
+		rv = ioctl_do_burst_read_write_v2(xcdev, file, arg, 1);
+		break;
+	case IOCTL_XDMA_RING_SETUP:
+		rv = ioctl_do_ring_setup(xcdev, file, arg);
+		break;
+	case IOCTL_XDMA_RING_ENTER:
+		rv = ioctl_do_ring_enter(xcdev, file, arg);
+		break;
+	case IOCTL_XDMA_STREAM_START:
+		rv = ioctl_do_stream_start(xcdev, file, arg);
+		break;
+	case IOCTL_XDMA_STREAM_STOP:
+		rv = ioctl_do_stream_stop(xcdev, file, arg);
+		break;
+	case IOCTL_XDMA_STREAM_READ:
+		rv = ioctl_do_stream_read(xcdev, file, arg);
+		break;
 	default:
 		dbg_perf("Unsupported operation\n");
 		rv = -EINVAL;
@@ -994,6 +2363,7 @@ static int char_sgdma_close(struct inode *inode, struct file *file)
 {
 	struct xdma_cdev *xcdev = (struct xdma_cdev *)file->private_data;
 	struct xdma_engine *engine;
+	int handle;
 	int rv;
 
 	rv = xcdev_check(__func__, xcdev, 1);
@@ -1002,6 +2372,11 @@ static int char_sgdma_close(struct inode *inode, struct file *file)
 
 	engine = xcdev->engine;
 
+	char_sgdma_stream_stop(xcdev, file, NULL);
+	xdma_ring_destroy(xcdev, file);
+	for (handle = 0; handle < MAX_REGISTERED_BUFFERS; handle++)
+		char_sgdma_unregister_buffers(xcdev, file, handle);
+
 	if (engine->streaming && engine->dir == DMA_FROM_DEVICE)
 		engine->device_open = 0;
 
@@ -1025,6 +2400,7 @@ static const struct file_operations sgdma_fops = {
 #endif
 	.unlocked_ioctl = char_sgdma_ioctl,
 	.llseek = char_sgdma_llseek,
+	.mmap = char_sgdma_mmap,
 };
 
 void cdev_sgdma_init(struct xdma_cdev *xcdev)
@@ -1,6 +1,12 @@
 #ifndef __CDEV_SGDMA_PART_H__
 #define __CDEV_SGDMA_PART_H__
 
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
 #define MAX_BD_NUMBER (8)
 struct xdma_buffer_descriptor {
     char * buffer;
@@ -17,4 +23,154 @@ struct xdma_multi_read_write_ioctl {
 #define IOCTL_XDMA_MULTI_READ   _IOW('q', 19, struct xdma_multi_read_write_ioctl *)
 #define IOCTL_XDMA_MULTI_WRITE  _IOW('q', 20, struct xdma_multi_read_write_ioctl *)
 
+/*
+ * Versioned burst transfer: the descriptors stay in user memory and only
+ * this header is copied per call. bd_num may go up to the value returned
+ * by IOCTL_XDMA_MULTI_BD_MAX_GET, bounded by the engine descriptor ring.
+ * The length of each completed buffer is written back to lens[]
+ * (0 for the buffers that were not filled).
+ * With handle >= 0 the buffers must lie in that registered region and
+ * are not pinned again, with handle < 0 they are pinned for the call.
+ */
+#define XDMA_MULTI_IOCTL_VERSION (2)
+#define MAX_BD_NUMBER_V2 (1024)
+
+struct xdma_multi_read_write_ioctl_v2 {
+    uint32_t version;   /* XDMA_MULTI_IOCTL_VERSION */
+    uint32_t bd_num;
+    uint64_t bd;        /* user pointer to struct xdma_buffer_descriptor[bd_num] */
+    uint64_t lens;      /* user pointer to uint32_t[bd_num] */
+    int32_t handle;     /* registered region or -1 */
+    int32_t error;
+    uint64_t done;
+};
+
+#define IOCTL_XDMA_MULTI_BD_MAX_GET _IOR('q', 27, int)
+#define IOCTL_XDMA_MULTI_READ_V2    _IOW('q', 28, struct xdma_multi_read_write_ioctl_v2 *)
+#define IOCTL_XDMA_MULTI_WRITE_V2   _IOW('q', 29, struct xdma_multi_read_write_ioctl_v2 *)
+
+/*
+ * Registered buffers: a user region pinned and DMA mapped once, burst
+ * transfers then refer to buffers by their offset in the region.
+ * A buffer must not cross a page boundary, except inside a hugepage
+ * (physically contiguous pages are mapped as one DMA run).
+ * The driver keeps the descriptors of the last few bursts of a region,
+ * a burst over the same offsets and lengths again reuses them.
+ */
+#define MAX_REGISTERED_BUFFERS (4)
+/* Covers the sample buffer pool at its largest buffer length */
+#define XDMA_REGISTERED_BUFFER_MAX_LEN (256 << 20)
+
+struct xdma_buffer_registration_ioctl {
+    unsigned long buffer;   /* page aligned */
+    unsigned long len;      /* multiple of the page size */
+    int handle;             /* returned by the driver */
+};
+
+struct xdma_registered_buffer_descriptor {
+    unsigned long offset;
+    unsigned long len;
+};
+
+struct xdma_multi_registered_ioctl {
+    int handle;
+    int bd_num;
+    int error;
+    unsigned long done;
+    struct xdma_registered_buffer_descriptor bd[MAX_BD_NUMBER];
+};
+
+#define IOCTL_XDMA_REGISTER_BUFFERS       _IOW('q', 21, struct xdma_buffer_registration_ioctl *)
+#define IOCTL_XDMA_UNREGISTER_BUFFERS     _IOW('q', 22, int)
+#define IOCTL_XDMA_MULTI_READ_REGISTERED  _IOW('q', 23, struct xdma_multi_registered_ioctl *)
+#define IOCTL_XDMA_MULTI_WRITE_REGISTERED _IOW('q', 24, struct xdma_multi_registered_ioctl *)
+
+/*
+ * Asynchronous rings: the application posts buffers of its registered
+ * region to the submission queue (SQ) and reaps them from the completion
+ * queue (CQ), both mapped at offset 0 of the SGDMA device.
+ * IOCTL_XDMA_RING_ENTER submits the new SQ entries and optionally waits
+ * for completions, an eventfd can be signalled on every completion.
+ */
+#define XDMA_RING_ENTRIES_MAX (1024)
+
+struct xdma_ring_header {
+    uint32_t sq_head;       /* advanced by the driver */
+    uint32_t sq_tail;       /* advanced by the application */
+    uint32_t sq_entries;
+    uint32_t sq_pad[13];
+    uint32_t cq_head;       /* advanced by the application */
+    uint32_t cq_tail;       /* advanced by the driver */
+    uint32_t cq_entries;
+    uint32_t cq_overflow;
+    uint32_t cq_pad[12];
+};
+
+struct xdma_ring_sqe {
+    uint64_t user_data;     /* returned in the completion */
+    uint64_t offset;        /* in the registered buffers */
+    uint32_t len;
+    uint32_t flags;
+};
+
+struct xdma_ring_cqe {
+    uint64_t user_data;
+    int32_t res;            /* bytes transferred or -errno */
+    uint32_t flags;
+};
+
+#define XDMA_RING_SQES_OFFSET (sizeof(struct xdma_ring_header))
+#define XDMA_RING_CQES_OFFSET(sq_entries) \
+    (XDMA_RING_SQES_OFFSET + (sq_entries) * sizeof(struct xdma_ring_sqe))
+
+struct xdma_ring_setup_ioctl {
+    uint32_t entries;       /* SQ entries, power of 2, the CQ gets twice as many */
+    int32_t handle;         /* registered buffers the SQ entries point into */
+    int32_t eventfd;        /* -1 for none */
+    uint32_t cq_entries;    /* set by the driver */
+    uint64_t mmap_size;     /* set by the driver */
+};
+
+struct xdma_ring_enter_ioctl {
+    uint32_t min_complete;  /* wait until this many completions are ready */
+    int32_t timeout_ms;     /* for min_complete, <= 0 waits forever */
+    uint32_t submitted;     /* set by the driver */
+    uint32_t completed;     /* ready completions, set by the driver */
+};
+
+#define IOCTL_XDMA_RING_SETUP   _IOW('q', 25, struct xdma_ring_setup_ioctl *)
+#define IOCTL_XDMA_RING_ENTER   _IOW('q', 26, struct xdma_ring_enter_ioctl *)
+
+/*
+ * Cyclic C2H streaming (AXI-ST C2H only): IOCTL_XDMA_STREAM_START runs the
+ * engine over a fixed ring of kernel buffers, one frame each, without
+ * stopping it between frames. read() then returns one frame per call and
+ * IOCTL_XDMA_STREAM_READ copies several back to back. Frames the reader
+ * falls too far behind on are dropped and counted as overruns.
+ */
+#define XDMA_STREAM_ENTRIES_DEFAULT (256)
+#define XDMA_STREAM_BUF_SIZE_DEFAULT (0x1000)
+
+struct xdma_stream_ioctl {
+    uint32_t entries;       /* power of 2 up to 1024, 0 for the default */
+    uint32_t buf_size;      /* bytes per frame up to 8 pages, 0 for the default,
+                               32 MiB for all entries at most */
+    uint32_t timeout_ms;    /* reads wait at most this long, 0 for c2h_timeout */
+    uint32_t reserved;
+    uint64_t frames;        /* received, set by the driver */
+    uint64_t overruns;      /* dropped, the reader fell behind */
+    uint64_t errors;        /* dropped, longer than buf_size or bad writeback */
+};
+
+struct xdma_stream_read_ioctl {
+    uint64_t buf;           /* user pointer, frames copied back to back */
+    uint64_t lens;          /* user pointer to uint32_t[frames] */
+    uint32_t len;           /* size of buf */
+    uint32_t frames;        /* max frames, set to the frames copied */
+};
+
+#define IOCTL_XDMA_STREAM_START _IOW('q', 30, struct xdma_stream_ioctl *)
+#define IOCTL_XDMA_STREAM_STOP  _IOW('q', 31, struct xdma_stream_ioctl *)
+#define IOCTL_XDMA_STREAM_READ  _IOW('q', 32, struct xdma_stream_read_ioctl *)
+
 #endif /* __CDEV_SGDMA_PART_H__ */
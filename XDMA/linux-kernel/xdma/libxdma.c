@@ -26,7 +26,9 @@
 #include <linux/errno.h>
 #include <linux/sched.h>
 #include <linux/vmalloc.h>
-#include <linux/ptp_classify.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
 
 #include "libxdma.h"
 #include "libxdma_api.h"
@@ -50,6 +52,26 @@ static unsigned int poll_mode;
 module_param(poll_mode, uint, 0644);
 MODULE_PARM_DESC(poll_mode, "Set 1 for hw polling, default is 0 (interrupts)");
 
+static unsigned int adaptive_poll;
+module_param(adaptive_poll, uint, 0644);
+MODULE_PARM_DESC(adaptive_poll,
+	"Set 1 to poll completions of busy engines and use interrupts otherwise, default is 0");
+
+static unsigned int adaptive_poll_rate = 20000;
+module_param(adaptive_poll_rate, uint, 0644);
+MODULE_PARM_DESC(adaptive_poll_rate,
+	"Completions per second from which an engine polls, default is 20000");
+
+static unsigned int adaptive_poll_spin_us = 50;
+module_param(adaptive_poll_spin_us, uint, 0644);
+MODULE_PARM_DESC(adaptive_poll_spin_us,
+	"Time to poll for a completion before waiting for the interrupt, default is 50");
+
+static unsigned int xfer_queue_depth = 2;
+module_param(xfer_queue_depth, uint, 0644);
+MODULE_PARM_DESC(xfer_queue_depth,
+	"Transfers a blocking request keeps queued on an engine, 1 to 4, default is 2");
+
 static unsigned int interrupt_mode;
 module_param(interrupt_mode, uint, 0644);
 MODULE_PARM_DESC(interrupt_mode, "0 - Auto , 1 - MSI, 2 - Legacy, 3 - MSI-x");
@@ -123,7 +145,8 @@ static inline int xdev_list_add(struct xdma_dev *xdev)
 		xdev->idx = 0;
 		if (poll_mode) {
 			int rv = xdma_threads_create(xdev->h2c_channel_max +
-					xdev->c2h_channel_max);
+					xdev->c2h_channel_max,
+					dev_to_node(&xdev->pdev->dev));
 			if (rv < 0) {
 				mutex_unlock(&xdev_mutex);
 				return rv;
@@ -565,6 +588,9 @@ static int xdma_engine_stop(struct xdma_engine *engine)
 	} else {
 		w |= (u32)XDMA_CTRL_IE_DESC_STOPPED;
 		w |= (u32)XDMA_CTRL_IE_DESC_COMPLETED;
+		/* writeback for polling, next to the interrupts */
+		if (engine->poll_mode_addr_virt)
+			w |= (u32)XDMA_CTRL_POLL_MODE_WB;
 	}
 
 	dbg_tfr("Stopping SG DMA %s engine; writing 0x%08x to 0x%p.\n",
@@ -610,6 +636,9 @@ static int engine_start_mode_config(struct xdma_engine *engine)
 	} else {
 		w |= (u32)XDMA_CTRL_IE_DESC_STOPPED;
 		w |= (u32)XDMA_CTRL_IE_DESC_COMPLETED;
+		/* writeback for polling, next to the interrupts */
+		if (engine->poll_mode_addr_virt)
+			w |= (u32)XDMA_CTRL_POLL_MODE_WB;
 	}
 
 	/* set non-incremental addressing mode */
@@ -718,6 +747,11 @@ static struct xdma_transfer *engine_start(struct xdma_engine *engine)
 	/* initialize number of descriptors of dequeued transfers */
 	engine->desc_dequeued = 0;
 
+	/* the writeback counts the descriptors of this run only */
+	if (engine->poll_mode_addr_virt)
+		((struct xdma_poll_wb *)engine->poll_mode_addr_virt)
+			->completed_desc_count = 0;
+
 	/* write lower 32-bit of bus address of transfer first descriptor */
 	w = cpu_to_le32(PCI_DMA_L(transfer->desc_bus));
 	dbg_tfr("iowrite32(0x%08x to 0x%p) (first_desc_lo)\n", w,
@@ -801,6 +835,10 @@ static struct xdma_transfer *engine_transfer_completion(
 		return NULL;
 	}
 
+	/* the ring slots of transfers cancelled behind it are free now */
+	engine->desc_used -= transfer->desc_held;
+	transfer->desc_held = 0;
+
 	/* synchronous I/O? */
 	/* awake task on transfer's wait queue */
 	xlx_wake_up(&transfer->wq);
@@ -1206,6 +1244,16 @@ static void engine_service_work(struct work_struct *work)
 	/* lock the engine */
 	spin_lock_irqsave(&engine->lock, flags);
 
+	/*
+	 * A cyclic ring has no transfer to service, its reader consumes the
+	 * results and re-enables the interrupt, see xdma_cyclic_ring_wait()
+	 */
+	if (engine->cyclic_ring) {
+		engine->cyclic_ring->irqs++;
+		wake_up_interruptible(&engine->cyclic_ring->wq);
+		goto unlock;
+	}
+
 	dbg_tfr("engine_service() for %s engine %p\n", engine->name, engine);
 	rv = engine_service(engine, 0);
 	if (rv < 0) {
@@ -1325,6 +1373,263 @@ int engine_service_poll(struct xdma_engine *engine,
 	return rv;
 }
 
+/*
+ * engine_service_drain() - service the completed transfers of a polled engine
+ * Unlike engine_service_poll() this does not wait, it returns 1 if the
+ * writeback covered the transfer at the head of the queue, and all the
+ * transfers it covers were serviced, 0 if there was nothing to do.
+ */
+int engine_service_drain(struct xdma_engine *engine)
+{
+	struct xdma_poll_wb *wb = (struct xdma_poll_wb *)engine->poll_mode_addr_virt;
+	struct xdma_transfer *transfer;
+	unsigned long flags;
+	u32 desc_wb = READ_ONCE(wb->completed_desc_count);
+	int rv = 0;
+
+	if (!desc_wb)
+		return 0;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (!list_empty(&engine->transfer_list)) {
+		transfer = list_first_entry(&engine->transfer_list,
+					    struct xdma_transfer, entry);
+		if ((desc_wb & WB_ERR_MASK) ||
+		    (desc_wb & WB_COUNT_MASK) >= transfer->desc_cmpl_th) {
+			wb->completed_desc_count = 0;
+			rv = engine_service(engine, desc_wb);
+			if (rv < 0)
+				pr_err("%s: Failed to service engine\n",
+				       engine->name);
+			else
+				rv = 1;
+		}
+	}
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return rv;
+}
+
+static inline bool engine_adaptive(struct xdma_engine *engine)
+{
+	return adaptive_poll && !poll_mode && engine->poll_mode_addr_virt;
+}
+
+static void engine_irq_mask(struct xdma_engine *engine, bool enable)
+{
+	if (enable)
+		write_register(engine->interrupt_enable_mask_value,
+			&engine->regs->interrupt_enable_mask_w1s,
+			(unsigned long)(&engine->regs->interrupt_enable_mask_w1s) -
+				(unsigned long)(&engine->regs));
+	else
+		write_register(engine->interrupt_enable_mask_value,
+			&engine->regs->interrupt_enable_mask_w1c,
+			(unsigned long)(&engine->regs->interrupt_enable_mask_w1c) -
+				(unsigned long)(&engine->regs));
+}
+
+static void engine_adaptive_switch(struct xdma_engine *engine, bool polling,
+				   u64 now)
+{
+	struct xdma_adaptive *adaptive = &engine->adaptive;
+
+	if (adaptive->polling) {
+		adaptive->poll_ns += now - adaptive->mode_since;
+		adaptive->to_irq++;
+	} else {
+		adaptive->irq_ns += now - adaptive->mode_since;
+		adaptive->to_poll++;
+	}
+	adaptive->mode_since = now;
+	adaptive->polling = polling;
+
+	/* Back to interrupts once the blocking traffic stops */
+	if (polling)
+		schedule_delayed_work(&adaptive->decay,
+				      nsecs_to_jiffies(XDMA_ADAPTIVE_WINDOW_NS));
+
+	dbg_tfr("%s switched to %s\n", engine->name,
+		polling ? "polling" : "interrupts");
+}
+
+/* Switch modes once a window is over */
+static void engine_adaptive_window(struct xdma_engine *engine, u64 now)
+{
+	struct xdma_adaptive *adaptive = &engine->adaptive;
+	u64 elapsed = now - adaptive->window_start;
+	u64 rate;
+
+	if (elapsed < XDMA_ADAPTIVE_WINDOW_NS)
+		return;
+
+	rate = div64_u64((u64)adaptive->window_cmpl * NSEC_PER_SEC, elapsed);
+	adaptive->window_cmpl = 0;
+	adaptive->window_start = now;
+
+	/* Half the rate back to interrupts, not to flip on every window */
+	if (!adaptive->polling && rate >= adaptive_poll_rate)
+		engine_adaptive_switch(engine, true, now);
+	else if (adaptive->polling && rate < adaptive_poll_rate / 2)
+		engine_adaptive_switch(engine, false, now);
+}
+
+/* Count a completion of a blocking transfer */
+static void engine_adaptive_account(struct xdma_engine *engine)
+{
+	engine->adaptive.window_cmpl++;
+	engine_adaptive_window(engine, ktime_get_ns());
+}
+
+/*
+ * Only blocking transfers count completions, so without them no window
+ * would end: close the windows from here while polling.
+ */
+static void engine_adaptive_decay(struct work_struct *work)
+{
+	struct xdma_engine *engine = container_of(to_delayed_work(work),
+				struct xdma_engine, adaptive.decay);
+	bool polling = true;
+
+	/* A blocking transfer in progress accounts for itself */
+	if (mutex_trylock(&engine->desc_lock)) {
+		engine_adaptive_window(engine, ktime_get_ns());
+		polling = engine->adaptive.polling;
+		mutex_unlock(&engine->desc_lock);
+	}
+
+	if (polling)
+		schedule_delayed_work(&engine->adaptive.decay,
+				      nsecs_to_jiffies(XDMA_ADAPTIVE_WINDOW_NS));
+}
+
+/*
+ * Unmask the interrupt after spinning. Once the polled completions stopped
+ * the engine, drop the status they latched rather than take an interrupt
+ * for them; a running engine keeps it for its next transfers.
+ */
+static void engine_adaptive_unmask(struct xdma_engine *engine)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (!engine->running)
+		engine_status_read(engine, 1, 0);
+	engine_irq_mask(engine, true);
+	spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+/* Service the transfer if the writeback shows it completed */
+static bool engine_adaptive_check(struct xdma_engine *engine,
+				  struct xdma_transfer *xfer)
+{
+	struct xdma_poll_wb *wb = (struct xdma_poll_wb *)engine->poll_mode_addr_virt;
+	u32 desc_wb = READ_ONCE(wb->completed_desc_count);
+	unsigned long flags;
+
+	if (!(desc_wb & WB_ERR_MASK) &&
+	    (desc_wb & WB_COUNT_MASK) < xfer->desc_cmpl_th)
+		return false;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	/* The interrupt may have been first */
+	if (xfer->state == TRANSFER_STATE_SUBMITTED) {
+		wb->completed_desc_count = 0;
+		if (engine_service(engine, desc_wb) < 0)
+			pr_err("%s: Failed to service polled engine\n",
+			       engine->name);
+	}
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return true;
+}
+
+/*
+ * Busy-poll for up to adaptive_poll_spin_us, true if the transfer is done.
+ * The interrupt is masked only while spinning, the nowait, ring and queued
+ * transfers of the engine still get theirs.
+ */
+static bool engine_adaptive_spin(struct xdma_engine *engine,
+				 struct xdma_transfer *xfer)
+{
+	u64 end = ktime_get_ns() + (u64)adaptive_poll_spin_us * NSEC_PER_USEC;
+
+	engine_irq_mask(engine, false);
+	do {
+		if (READ_ONCE(xfer->state) != TRANSFER_STATE_SUBMITTED ||
+		    engine_adaptive_check(engine, xfer)) {
+			engine->adaptive.spin_hits++;
+			engine_adaptive_unmask(engine);
+			return true;
+		}
+		cpu_relax();
+	} while (ktime_get_ns() < end);
+
+	engine->adaptive.spin_misses++;
+	engine_adaptive_unmask(engine);
+	/* Completed before the unmask, the interrupt may not come */
+	return engine_adaptive_check(engine, xfer);
+}
+
+/*
+ * transfer_wait() - wait for a queued transfer to leave the submitted state
+ * Busy-polls first if the engine is in the polling mode of adaptive_poll.
+ * Called with engine->desc_lock held.
+ */
+static void transfer_wait(struct xdma_engine *engine, struct xdma_transfer *xfer,
+			  int timeout_ms)
+{
+	bool adaptive = engine_adaptive(engine);
+
+	if (!adaptive || !engine->adaptive.polling ||
+	    !engine_adaptive_spin(engine, xfer)) {
+		if (timeout_ms > 0)
+			xlx_wait_event_interruptible_timeout(xfer->wq,
+				(xfer->state != TRANSFER_STATE_SUBMITTED),
+				msecs_to_jiffies(timeout_ms));
+		else
+			xlx_wait_event_interruptible(xfer->wq,
+				(xfer->state != TRANSFER_STATE_SUBMITTED));
+	}
+
+	if (adaptive && xfer->state == TRANSFER_STATE_COMPLETED)
+		engine_adaptive_account(engine);
+}
+
+static ssize_t engine_adaptive_show(struct xdma_engine *engine, char *buf,
+				    size_t size)
+{
+	struct xdma_adaptive *adaptive = &engine->adaptive;
+	u64 current_ns = ktime_get_ns() - adaptive->mode_since;
+	u64 poll_ns = adaptive->poll_ns + (adaptive->polling ? current_ns : 0);
+	u64 irq_ns = adaptive->irq_ns + (adaptive->polling ? 0 : current_ns);
+
+	return scnprintf(buf, size,
+		"%s %s to_poll %llu to_irq %llu poll_ms %llu irq_ms %llu spin_hits %llu spin_misses %llu\n",
+		engine->name, adaptive->polling ? "poll" : "irq",
+		adaptive->to_poll, adaptive->to_irq,
+		div_u64(poll_ns, NSEC_PER_MSEC), div_u64(irq_ns, NSEC_PER_MSEC),
+		adaptive->spin_hits, adaptive->spin_misses);
+}
+
+/* One line per engine, for the xdma_adaptive_poll sysfs file */
+ssize_t xdma_adaptive_show(struct xdma_dev *xdev, char *buf, size_t size)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < xdev->h2c_channel_max; i++)
+		if (xdev->engine_h2c[i].magic == MAGIC_ENGINE)
+			len += engine_adaptive_show(&xdev->engine_h2c[i],
+						    buf + len, size - len);
+	for (i = 0; i < xdev->c2h_channel_max; i++)
+		if (xdev->engine_c2h[i].magic == MAGIC_ENGINE)
+			len += engine_adaptive_show(&xdev->engine_c2h[i],
+						    buf + len, size - len);
+
+	return len;
+}
+
 static irqreturn_t user_irq_service(int irq, struct xdma_user_irq *user_irq)
 {
 	unsigned long flags;
@@ -1347,51 +1652,6 @@ static irqreturn_t user_irq_service(int irq, struct xdma_user_irq *user_irq)
 	return IRQ_HANDLED;
 }
 
-static bool filter_rx_timestamp(struct xdma_private* priv, struct sk_buff* skb) {
-	u8 msg_type;
-	u16 eth_type;
-	uint8_t* payload;
-	struct ptp_header* ptp;
-	struct ethhdr* eth;
-	struct tsn_vlan_hdr* vlan;
-	int rx_filter = priv->tstamp_config.rx_filter;
-	if (rx_filter == HWTSTAMP_FILTER_NONE) {
-		return false;
-	} else if (rx_filter == HWTSTAMP_FILTER_ALL) {
-		return true;
-	}
-
-	payload = skb->data;
-	eth = (struct ethhdr*)payload;
-	payload += sizeof(*eth);
-	eth_type = ntohs(eth->h_proto);
-	if (eth_type == ETH_P_8021Q) {
-		vlan = (struct tsn_vlan_hdr*)payload;
-		eth_type = vlan->pid;
-		payload += sizeof(*vlan);
-	}
-
-	if (eth_type != ETH_P_1588) {
-		return false;
-	}
-
-	ptp = (struct ptp_header*)payload;
-	msg_type = ptp->tsmt & 0xF;
-	switch (rx_filter) {
-	case HWTSTAMP_FILTER_PTP_V2_EVENT:
-	case HWTSTAMP_FILTER_PTP_V2_L2_EVENT:
-		return true;
-	case HWTSTAMP_FILTER_PTP_V2_SYNC:
-	case HWTSTAMP_FILTER_PTP_V2_L2_SYNC:
-		return msg_type == PTP_MSGTYPE_SYNC;
-	case HWTSTAMP_FILTER_PTP_V2_DELAY_REQ:
-	case HWTSTAMP_FILTER_PTP_V2_L2_DELAY_REQ:
-		return msg_type == PTP_MSGTYPE_DELAY_REQ;
-	default:
-		return false;
-	}
-}
-
 /*
  * xdma_isr() - Interrupt handler
  *
@@ -1401,16 +1661,11 @@ static irqreturn_t xdma_isr(int irq, void *dev_id)
 {
 	u32 ch_irq;
 	u32 mask;
-	int skb_len;
-	unsigned long flag;
 	struct interrupt_regs *irq_regs;
 	struct net_device *ndev;
-	struct sk_buff *skb;
 	struct xdma_dev *xdev;
 	struct xdma_engine *engine;
 	struct xdma_private *priv;
-	struct xdma_result *result;
-	struct rx_buffer *rx_buffer;
 
 	dbg_irq("(irq=%d, dev 0x%p) <<<< ISR.\n", irq, dev_id);
 	if (!dev_id) {
@@ -1451,53 +1706,15 @@ static irqreturn_t xdma_isr(int irq, void *dev_id)
 	if (mask) {
 		dbg_info("xdma_isr c2h");
 		engine = &xdev->engine_c2h[0];
-		result = priv->res;
-		rx_buffer = (struct rx_buffer*)priv->rx_buffer;
 
-#ifdef __LIBXDMA_DEBUG__
-		assert_eq(rx_buffer->metadata.frame_length, result->length - RX_METADATA_SIZE);
-#endif
-		spin_lock_irqsave(&priv->rx_lock, flag);
 		engine_status_read(engine, 1, 0);
-		// skb_len = rx_buffer->metadata.frame_length - CRC_LEN;
-		skb_len = result->length - RX_METADATA_SIZE - CRC_LEN;
-		if (skb_len < 0) {
-			iowrite32(DMA_ENGINE_STOP, &engine->regs->control);
-			channel_interrupts_enable(engine->xdev, engine->irq_bitmask);
-			iowrite32(DMA_ENGINE_START, &engine->regs->control);
-			spin_unlock_irqrestore(&priv->rx_lock, flag);
-			pr_err("Invalid skb_len\n");
-			return IRQ_NONE;
-		}
-		skb = dev_alloc_skb(skb_len);
-		if (!skb) {
-			iowrite32(DMA_ENGINE_STOP, &engine->regs->control);
-			channel_interrupts_enable(engine->xdev, engine->irq_bitmask);
-			iowrite32(DMA_ENGINE_START, &engine->regs->control);
-			spin_unlock_irqrestore(&priv->rx_lock, flag);
-			pr_err("Failed to allocate skb\n");
-			return IRQ_NONE;
-		}
-		memcpy(
-			skb_put(skb, skb_len),
-			priv->rx_buffer + RX_METADATA_SIZE,
-			skb_len);
-		if (filter_rx_timestamp(priv, skb)) {
-			skb_hwtstamps(skb)->hwtstamp = alinx_get_rx_timestamp(xdev->pdev, rx_buffer->metadata.timestamp);
-		}
-		skb->dev = ndev;
-		skb->protocol = eth_type_trans(skb, ndev);
 
-		/* Transfer the skb to the Linux network stack */
-		netif_rx(skb);
+		u64_stats_update_begin(&priv->irq_stats.syncp);
+		priv->irq_stats.c2h++;
+		u64_stats_update_end(&priv->irq_stats.syncp);
 
-		/* Stop the engine */
-		iowrite32(DMA_ENGINE_STOP, &engine->regs->control);
-
-		/* Start the engine */
-		channel_interrupts_enable(engine->xdev, engine->irq_bitmask);
-		iowrite32(DMA_ENGINE_START, &engine->regs->control);
-		spin_unlock_irqrestore(&priv->rx_lock, flag);
+		/* The C2H interrupt stays disabled until xdma_netdev_poll() drains the ring */
+		napi_schedule(&priv->napi);
 	}
 
 	mask = ch_irq & xdev->mask_irq_h2c;
@@ -1507,13 +1724,13 @@ static irqreturn_t xdma_isr(int irq, void *dev_id)
 
 		engine_status_read(engine, 1, 0);
 
-		/* Free last resource */
-		dma_unmap_single(&xdev->pdev->dev, priv->tx_dma_addr, priv->tx_skb->len, DMA_TO_DEVICE);
-		dev_kfree_skb_any(priv->tx_skb);
-		priv->tx_skb = NULL;
+		u64_stats_update_begin(&priv->irq_stats.syncp);
+		priv->irq_stats.h2c++;
+		u64_stats_update_end(&priv->irq_stats.syncp);
+
+		/* Free sent frames and submit the ones queued meanwhile */
+		xdma_tx_ring_clean(priv);
 
-		iowrite32(DMA_ENGINE_STOP, &engine->regs->control);
-		netif_wake_queue(ndev);
 		channel_interrupts_enable(engine->xdev, engine->irq_bitmask);
 	}
 	xdev->irq_count++;
@@ -2533,6 +2750,14 @@ static int transfer_queue(struct xdma_engine *engine,
 		goto shutdown;
 	}
 
+	/* the engine runs over a cyclic ring until xdma_cyclic_ring_stop() */
+	if (engine->cyclic_ring) {
+		dbg_tfr("engine %s cyclic, transfer 0x%p not queued.\n",
+			engine->name, transfer);
+		rv = -EBUSY;
+		goto shutdown;
+	}
+
 	/* mark the transfer as submitted */
 	transfer->state = TRANSFER_STATE_SUBMITTED;
 	/* add transfer to the tail of the engine transfer queue */
@@ -2657,6 +2882,8 @@ static int engine_destroy(struct xdma_dev *xdev, struct xdma_engine *engine)
 	if (poll_mode)
 		xdma_thread_remove_work(engine);
 
+	cancel_delayed_work_sync(&engine->adaptive.decay);
+
 	/* Release memory use for descriptor writebacks */
 	engine_free_resource(engine);
 
@@ -2784,15 +3011,16 @@ static int engine_init_regs(struct xdma_engine *engine)
 	reg_value |= XDMA_CTRL_IE_READ_ERROR;
 	reg_value |= XDMA_CTRL_IE_DESC_ERROR;
 
-	/* if using polled mode, configure writeback address */
-	if (poll_mode) {
+	/* if using polled or adaptive mode, configure writeback address */
+	if (engine->poll_mode_addr_virt) {
 		rv = engine_writeback_setup(engine);
 		if (rv) {
 			dbg_init("%s descr writeback setup failed.\n",
 				 engine->name);
 			goto fail_wb;
 		}
-	} else {
+	}
+	if (!poll_mode) {
 		/* enable the relevant completion interrupts */
 		reg_value |= XDMA_CTRL_IE_DESC_STOPPED;
 		reg_value |= XDMA_CTRL_IE_DESC_COMPLETED;
@@ -2838,7 +3066,7 @@ static int engine_alloc_resource(struct xdma_engine *engine)
 		goto err_out;
 	}
 
-	if (poll_mode) {
+	if (poll_mode || adaptive_poll) {
 		engine->poll_mode_addr_virt =
 			dma_alloc_coherent(&xdev->pdev->dev,
 					   sizeof(struct xdma_poll_wb),
@@ -2916,6 +3144,10 @@ static int engine_init(struct xdma_engine *engine, struct xdma_dev *xdev,
 	/* initialize the deferred work for transfer completion */
 	INIT_WORK(&engine->work, engine_service_work);
 
+	INIT_DELAYED_WORK(&engine->adaptive.decay, engine_adaptive_decay);
+	engine->adaptive.window_start = ktime_get_ns();
+	engine->adaptive.mode_since = engine->adaptive.window_start;
+
 	if (dir == DMA_TO_DEVICE)
 		xdev->mask_irq_h2c |= engine->irq_bitmask;
 	else
@@ -2930,9 +3162,6 @@ static int engine_init(struct xdma_engine *engine, struct xdma_dev *xdev,
 	if (rv)
 		return rv;
 
-	if (poll_mode)
-		xdma_thread_add_work(engine);
-
 	return 0;
 }
 
@@ -2991,42 +3220,19 @@ static int transfer_build(struct xdma_engine *engine,
 	return 0;
 }
 
-static int transfer_init(struct xdma_engine *engine,
-			struct xdma_request_cb *req, struct xdma_transfer *xfer)
+/*
+ * transfer_chain_build() - link and fill desc_max descriptors at
+ * xfer->desc_virt from the next software descriptors of req, the last one
+ * stops the engine
+ */
+static void transfer_chain_build(struct xdma_engine *engine,
+				 struct xdma_request_cb *req,
+				 struct xdma_transfer *xfer,
+				 unsigned int desc_max)
 {
-	unsigned int desc_max = min_t(unsigned int,
-				req->sw_desc_cnt - req->sw_desc_idx,
-				engine->desc_max);
 	int i = 0;
 	int last = 0;
 	u32 control;
-	unsigned long flags;
-
-	memset(xfer, 0, sizeof(*xfer));
-
-	/* lock the engine state */
-	spin_lock_irqsave(&engine->lock, flags);
-	/* initialize wait queue */
-#if HAS_SWAKE_UP
-	init_swait_queue_head(&xfer->wq);
-#else
-	init_waitqueue_head(&xfer->wq);
-#endif
-
-	/* remember direction of transfer */
-	xfer->dir = engine->dir;
-	xfer->desc_virt = engine->desc + engine->desc_idx;
-	xfer->res_virt = engine->cyclic_result + engine->desc_idx;
-	xfer->desc_bus = engine->desc_bus +
-			(sizeof(struct xdma_desc) * engine->desc_idx);
-	xfer->res_bus = engine->cyclic_result_bus +
-			(sizeof(struct xdma_result) * engine->desc_idx);
-	xfer->desc_index = engine->desc_idx;
-
-	/* Need to handle desc_used >= engine->desc_max */
-
-	if ((engine->desc_idx + desc_max) >= engine->desc_max)
-		desc_max = engine->desc_max - engine->desc_idx;
 
 	transfer_desc_init(xfer, desc_max);
 
@@ -3053,8 +3259,6 @@ static int transfer_init(struct xdma_engine *engine,
     }
 
 	xfer->desc_num = desc_max;
-	engine->desc_idx = (engine->desc_idx + desc_max) % engine->desc_max;
-	engine->desc_used += desc_max;
 
 	/* fill in adjacent numbers */
 	for (i = 0; i < xfer->desc_num; i++) {
@@ -3064,6 +3268,79 @@ static int transfer_init(struct xdma_engine *engine,
 		dbg_desc("set next adj at index %d to %u\n", i, next_adj);
 		xdma_desc_adjacent(xfer->desc_virt + i, next_adj);
 	}
+}
+
+/* Take descriptors of the engine ring, -EBUSY if they are in use */
+static int engine_desc_get(struct xdma_engine *engine, unsigned int desc_num)
+{
+	unsigned long flags;
+	int rv = 0;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (engine->desc_used + desc_num > engine->desc_max)
+		rv = -EBUSY;
+	else
+		engine->desc_used += desc_num;
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return rv;
+}
+
+/* Give back descriptors of the engine ring taken by transfer_init() */
+static void engine_desc_put(struct xdma_engine *engine, unsigned int desc_num)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	engine->desc_used -= desc_num;
+	spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+static int transfer_init(struct xdma_engine *engine,
+			struct xdma_request_cb *req, struct xdma_transfer *xfer,
+			unsigned int desc_limit, bool reserved)
+{
+	unsigned int desc_max = min_t(unsigned int,
+				req->sw_desc_cnt - req->sw_desc_idx,
+				desc_limit);
+	unsigned long flags;
+
+	memset(xfer, 0, sizeof(*xfer));
+
+	/* lock the engine state */
+	spin_lock_irqsave(&engine->lock, flags);
+	/* initialize wait queue */
+#if HAS_SWAKE_UP
+	init_swait_queue_head(&xfer->wq);
+#else
+	init_waitqueue_head(&xfer->wq);
+#endif
+
+	/* remember direction of transfer */
+	xfer->dir = engine->dir;
+	xfer->desc_virt = engine->desc + engine->desc_idx;
+	xfer->res_virt = engine->cyclic_result + engine->desc_idx;
+	xfer->desc_bus = engine->desc_bus +
+			(sizeof(struct xdma_desc) * engine->desc_idx);
+	xfer->res_bus = engine->cyclic_result_bus +
+			(sizeof(struct xdma_result) * engine->desc_idx);
+	xfer->desc_index = engine->desc_idx;
+
+	if ((engine->desc_idx + desc_max) >= engine->desc_max)
+		desc_max = engine->desc_max - engine->desc_idx;
+
+	/* nowait and blocking transfers share the descriptor ring */
+	if (!reserved) {
+		if (engine->desc_used + desc_max > engine->desc_max) {
+			spin_unlock_irqrestore(&engine->lock, flags);
+			return -EBUSY;
+		}
+		engine->desc_used += desc_max;
+	}
+
+	transfer_chain_build(engine, req, xfer, desc_max);
+
+	engine->desc_idx = (engine->desc_idx + desc_max) % engine->desc_max;
 
 	spin_unlock_irqrestore(&engine->lock, flags);
 	return 0;
@@ -3282,7 +3559,15 @@ ssize_t xdma_xfer_aperture(struct xdma_engine *engine, bool write, u64 ep_addr,
 		spin_lock_irqsave(&engine->lock, flags);
 
 		desc_idx = engine->desc_idx;
-		desc_max = engine->desc_max;
+		/* up to the end of the ring or the descriptors still in use */
+		desc_max = min_t(unsigned int, engine->desc_max,
+				 desc_idx + engine->desc_max - engine->desc_used);
+		if (desc_max == desc_idx) {
+			spin_unlock_irqrestore(&engine->lock, flags);
+			mutex_unlock(&engine->desc_lock);
+			rv = -EBUSY;
+			goto unmap_sgl;
+		}
 
 		xfer->desc_virt = desc_virt = engine->desc + desc_idx;
 		xfer->res_virt = engine->cyclic_result + desc_idx;
@@ -3372,7 +3657,8 @@ ssize_t xdma_xfer_aperture(struct xdma_engine *engine, bool write, u64 ep_addr,
 			xdma_desc_adjacent(xfer->desc_virt + i, next_adj);
 		}
 
-		engine->desc_idx = (engine->desc_idx + desc_cnt) % desc_max;
+		engine->desc_idx = (engine->desc_idx + desc_cnt) %
+				   engine->desc_max;
 		spin_unlock_irqrestore(&engine->lock, flags);
 
 		/* last transfer for the given request? */
@@ -3395,13 +3681,7 @@ ssize_t xdma_xfer_aperture(struct xdma_engine *engine, bool write, u64 ep_addr,
 		if (engine->cmplthp)
 			xdma_kthread_wakeup(engine->cmplthp);
 
-		if (timeout_ms > 0)
-			xlx_wait_event_interruptible_timeout(xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED),
-				msecs_to_jiffies(timeout_ms));
-		else
-			xlx_wait_event_interruptible(xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED));
+		transfer_wait(engine, xfer, timeout_ms);
 
 		spin_lock_irqsave(&engine->lock, flags);
 
@@ -3456,7 +3736,7 @@ ssize_t xdma_xfer_aperture(struct xdma_engine *engine, bool write, u64 ep_addr,
 			break;
 		}
 
-		engine->desc_used -= xfer->desc_num;
+		engine_desc_put(engine, xfer->desc_num);
 		transfer_destroy(xdev, xfer);
 
 		if (rv < 0) {
@@ -3479,12 +3759,123 @@ unmap_sgl:
 	return done ? done : rv;
 }
 
+/*
+ * Number of transfers a blocking request keeps queued, see xfer_queue_depth.
+ * The engine stops at the end of each transfer and the completion handler
+ * restarts it on the next queued one, so it does not wait for the submitter
+ * to build the next descriptor set. A request that fits in one transfer
+ * needs no more, nor does C2H streaming with EOP flush, which ends the
+ * request on the first EOP, or with credits, given for all used descriptors.
+ */
+static unsigned int transfer_queue_depth(struct xdma_engine *engine,
+					 struct xdma_request_cb *req)
+{
+	if (req->sw_desc_cnt <= engine->desc_max)
+		return 1;
+	if (engine->streaming && engine->dir == DMA_FROM_DEVICE &&
+	    (engine->eop_flush || enable_st_c2h_credit))
+		return 1;
+	return clamp_t(unsigned int, xfer_queue_depth, 1,
+		       XDMA_TRANSFER_QUEUE_MAX);
+}
+
+/*
+ * transfer_submit() - build the next transfer of a request and queue it
+ * Each of the depth queued transfers takes at most desc_limit descriptors
+ * so that they all fit in the descriptor ring.
+ * Called with engine->desc_lock held.
+ *
+ * @return number of descriptors queued, < 0 on failure
+ */
+static int transfer_submit(struct xdma_engine *engine,
+			   struct xdma_request_cb *req,
+			   struct xdma_transfer *xfer, unsigned int desc_limit,
+			   bool dma_mapped)
+{
+	int rv;
+
+	/* build transfer */
+	rv = transfer_init(engine, req, xfer, desc_limit, false);
+	if (rv < 0)
+		return rv;
+
+	if (!dma_mapped)
+		xfer->flags = XFER_FLAG_NEED_UNMAP;
+
+	/* last transfer for the given request? */
+	if (req->sw_desc_idx == req->sw_desc_cnt) {
+		xfer->last_in_request = 1;
+		xfer->sgt = req->sgt;
+	}
+
+	dbg_tfr("xfer, %u, ep 0x%llx, sg %u/%u.\n", xfer->len, req->ep_addr,
+		req->sw_desc_idx, req->sw_desc_cnt);
+
+#ifdef __LIBXDMA_DEBUG__
+	transfer_dump(xfer);
+#endif
+
+	rv = transfer_queue(engine, xfer);
+	if (rv < 0) {
+		pr_info("unable to submit %s, %d.\n", engine->name, rv);
+		engine_desc_put(engine, xfer->desc_num);
+		transfer_destroy(engine->xdev, xfer);
+		return rv;
+	}
+
+	if (engine->cmplthp)
+		xdma_kthread_wakeup(engine->cmplthp);
+
+	return xfer->desc_num;
+}
+
+/*
+ * transfer_cancel() - take the transfers queued after a failed one off the
+ * engine, stopping it if it already runs one of them
+ * Called with engine->desc_lock held.
+ */
+static void transfer_cancel(struct xdma_engine *engine,
+			    struct xdma_request_cb *req, unsigned int first,
+			    unsigned int count, unsigned int depth)
+{
+	struct xdma_transfer *xfer;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	for (i = 0; i < count; i++) {
+		xfer = &req->tfer[(first + i) % depth];
+		if (xfer->state != TRANSFER_STATE_SUBMITTED)
+			continue;
+
+		if (engine->running &&
+		    list_first_entry(&engine->transfer_list,
+				     struct xdma_transfer, entry) == xfer) {
+			if (xdma_engine_stop(engine) < 0)
+				pr_err("Failed to stop engine\n");
+		}
+		list_del(&xfer->entry);
+		xfer->state = TRANSFER_STATE_ABORTED;
+	}
+	/* restart on what others queued meanwhile */
+	if (engine_service_resume(engine) < 0)
+		pr_err("Failed to resume engine\n");
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	for (i = 0; i < count; i++) {
+		xfer = &req->tfer[(first + i) % depth];
+		engine_desc_put(engine, xfer->desc_num);
+		transfer_destroy(engine->xdev, xfer);
+	}
+}
+
 ssize_t xdma_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
 			 struct sg_table *sgt, bool dma_mapped, int timeout_ms)
 {
 	struct xdma_dev *xdev = (struct xdma_dev *)dev_hndl;
 	struct xdma_engine *engine;
 	int rv = 0, tfer_idx = 0, i;
+	unsigned int depth, desc_limit, queued = 0;
 	ssize_t done = 0;
 	struct scatterlist *sg = sgt->sgl;
 	int nents;
@@ -3563,54 +3954,34 @@ ssize_t xdma_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
 
 	sg = sgt->sgl;
 	nents = req->sw_desc_cnt;
+	depth = transfer_queue_depth(engine, req);
+	desc_limit = engine->desc_max / depth;
 	mutex_lock(&engine->desc_lock);
 
-	while (nents) {
+	while (nents || queued) {
 		unsigned long flags;
 		struct xdma_transfer *xfer;
 
-		/* build transfer */
-		rv = transfer_init(engine, req, &req->tfer[0]);
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			goto unmap_sgl;
-		}
-		xfer = &req->tfer[0];
-
-		if (!dma_mapped)
-			xfer->flags = XFER_FLAG_NEED_UNMAP;
-
-		/* last transfer for the given request? */
-		nents -= xfer->desc_num;
-		if (!nents) {
-			xfer->last_in_request = 1;
-			xfer->sgt = sgt;
-		}
-
-		dbg_tfr("xfer, %u, ep 0x%llx, done %lu, sg %u/%u.\n", xfer->len,
-			req->ep_addr, done, req->sw_desc_idx, req->sw_desc_cnt);
-
-#ifdef __LIBXDMA_DEBUG__
-		transfer_dump(xfer);
-#endif
-
-		rv = transfer_queue(engine, xfer);
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			pr_info("unable to submit %s, %d.\n", engine->name, rv);
-			goto unmap_sgl;
+		/* queue the next transfers while the engine runs the first */
+		while (nents && queued < depth) {
+			xfer = &req->tfer[(tfer_idx + queued) % depth];
+			rv = transfer_submit(engine, req, xfer, desc_limit,
+					     dma_mapped);
+			/* nowait transfers hold the ring, wait for ours first */
+			if (rv == -EBUSY && queued) {
+				rv = 0;
+				break;
+			}
+			if (rv < 0)
+				break;
+			nents -= rv;
+			queued++;
 		}
+		if (rv < 0)
+			break;
 
-		if (engine->cmplthp)
-			xdma_kthread_wakeup(engine->cmplthp);
-
-		if (timeout_ms > 0)
-			xlx_wait_event_interruptible_timeout(xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED),
-				msecs_to_jiffies(timeout_ms));
-		else
-			xlx_wait_event_interruptible(xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED));
+		xfer = &req->tfer[tfer_idx % depth];
+		transfer_wait(engine, xfer, timeout_ms);
 
 		spin_lock_irqsave(&engine->lock, flags);
 
@@ -3676,19 +4047,21 @@ ssize_t xdma_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
 			break;
 		}
 
-		engine->desc_used -= xfer->desc_num;
+		engine_desc_put(engine, xfer->desc_num);
 		transfer_destroy(xdev, xfer);
 
 		/* use multiple transfers per request if we could not fit
 		 * all data within single descriptor chain.
 		 */
 		tfer_idx++;
+		queued--;
 
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			goto unmap_sgl;
-		}
+		if (rv < 0)
+			break;
 	} /* while (sg) */
+
+	if (queued)
+		transfer_cancel(engine, req, tfer_idx, queued, depth);
 	mutex_unlock(&engine->desc_lock);
 
 unmap_sgl:
@@ -3704,11 +4077,18 @@ unmap_sgl:
 	return done ? done : rv;
 }
 
+/*
+ * lens[] gets one entry per buffer of sgt, for C2H streaming the writeback
+ * length of the buffers completed, possibly over several transfers when
+ * the batch wraps around the descriptor ring.
+ */
 ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, bool write, u64 ep_addr,
-			 struct sg_table *sgt, bool dma_mapped, int timeout_ms, struct xdma_multi_read_write_ioctl *io)
+			 struct sg_table *sgt, bool dma_mapped, int timeout_ms, u32 *lens, unsigned int lens_nr)
 {
 	struct xdma_dev *xdev;
 	int rv = 0, tfer_idx = 0, i;
+	unsigned int cmpl_idx = 0;
+	unsigned int depth, desc_limit, queued = 0;
 	ssize_t done = 0;
 	struct scatterlist *sg = sgt->sgl;
 	int nents;
@@ -3721,12 +4101,20 @@ ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, b
 		return -EBUSY;
 	}
 
-	nents = pci_map_sg(xdev->pdev, sg, sgt->orig_nents, dir);
-	if (!nents) {
-		pr_info("map sgl failed, sgt 0x%p.\n", sgt);
-		return -EIO;
+	if (!dma_mapped) {
+		nents = pci_map_sg(xdev->pdev, sg, sgt->orig_nents, dir);
+		if (!nents) {
+			pr_info("map sgl failed, sgt 0x%p.\n", sgt);
+			return -EIO;
+		}
+		sgt->nents = nents;
+	} else {
+		if (!sgt->nents) {
+			pr_err("sg table has invalid number of entries 0x%p.\n",
+			       sgt);
+			return -EIO;
+		}
 	}
-	sgt->nents = nents;
 
 	req = xdma_init_request(sgt, ep_addr);
 	if (!req) {
@@ -3739,54 +4127,34 @@ ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, b
 
 	sg = sgt->sgl;
 	nents = req->sw_desc_cnt;
+	depth = transfer_queue_depth(engine, req);
+	desc_limit = engine->desc_max / depth;
 	mutex_lock(&engine->desc_lock);
 
-	while (nents) {
+	while (nents || queued) {
 		unsigned long flags;
 		struct xdma_transfer *xfer;
 
-		/* build transfer */
-		rv = transfer_init(engine, req, &req->tfer[0]);
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			goto unmap_sgl;
-		}
-		xfer = &req->tfer[0];
-
-		if (!dma_mapped)
-			xfer->flags = XFER_FLAG_NEED_UNMAP;
-
-		/* last transfer for the given request? */
-		nents -= xfer->desc_num;
-		if (!nents) {
-			xfer->last_in_request = 1;
-			xfer->sgt = sgt;
-		}
-
-		dbg_tfr("xfer, %u, ep 0x%llx, done %lu, sg %u/%u.\n", xfer->len,
-			req->ep_addr, done, req->sw_desc_idx, req->sw_desc_cnt);
-
-#ifdef __LIBXDMA_DEBUG__
-		transfer_dump(xfer);
-#endif
-
-		rv = transfer_queue(engine, xfer);
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			pr_info("unable to submit %s, %d.\n", engine->name, rv);
-			goto unmap_sgl;
+		/* queue the next transfers while the engine runs the first */
+		while (nents && queued < depth) {
+			xfer = &req->tfer[(tfer_idx + queued) % depth];
+			rv = transfer_submit(engine, req, xfer, desc_limit,
+					     dma_mapped);
+			/* nowait transfers hold the ring, wait for ours first */
+			if (rv == -EBUSY && queued) {
+				rv = 0;
+				break;
+			}
+			if (rv < 0)
+				break;
+			nents -= rv;
+			queued++;
 		}
+		if (rv < 0)
+			break;
 
-		if (engine->cmplthp)
-			xdma_kthread_wakeup(engine->cmplthp);
-
-		if (timeout_ms > 0)
-			xlx_wait_event_interruptible_timeout(xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED),
-				msecs_to_jiffies(timeout_ms));
-		else
-			xlx_wait_event_interruptible(xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED));
+		xfer = &req->tfer[tfer_idx % depth];
+		transfer_wait(engine, xfer, timeout_ms);
 
 		spin_lock_irqsave(&engine->lock, flags);
 
@@ -3806,7 +4174,8 @@ ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, b
 
 				for (i = 0; i < xfer->desc_cmpl; i++) {
 					done += result[i].length;
-					io->bd[i].len = result[i].length;
+					if (cmpl_idx < lens_nr)
+						lens[cmpl_idx++] = result[i].length;
 				}
 
 				/* finish the whole request */
@@ -3837,6 +4206,9 @@ ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, b
 				if (rv < 0)
 					pr_err("Failed to stop engine\n");
 			}
+			/* go on with the next transfer, if kept queued */
+			if (queued > 1 && engine_service_resume(engine) < 0)
+				pr_err("Failed to resume engine\n");
 			spin_unlock_irqrestore(&engine->lock, flags);
 
 #ifdef __LIBXDMA_DEBUG__
@@ -3851,32 +4223,38 @@ ssize_t xdma_multi_buffer_xfer_submit(struct xdma_engine *engine, int channel, b
 				rv = 0;
 					for (i = 0; i < xfer->desc_cmpl; i++) {
 						done += result[i].length;
-						io->bd[i].len = result[i].length;
-					}
-					for (i = xfer->desc_cmpl; i < io->bd_num; i++) {
-						io->bd[i].len = 0;
+						if (cmpl_idx < lens_nr)
+							lens[cmpl_idx++] = result[i].length;
 					}
 				}
 			}
 			break;
 		}
 
-		engine->desc_used -= xfer->desc_num;
+		engine_desc_put(engine, xfer->desc_num);
 		transfer_destroy(xdev, xfer);
 
 		/* use multiple transfers per request if we could not fit
 		 * all data within single descriptor chain.
 		 */
 		tfer_idx++;
+		queued--;
 
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			goto unmap_sgl;
-		}
+		if (rv < 0)
+			break;
 	} /* while (sg) */
+
+	if (queued)
+		transfer_cancel(engine, req, tfer_idx, queued, depth);
 	mutex_unlock(&engine->desc_lock);
 
 unmap_sgl:
+	/* buffers left unfilled */
+	if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
+		while (cmpl_idx < lens_nr)
+			lens[cmpl_idx++] = 0;
+	}
+
 	if (!dma_mapped && sgt->nents) {
 		pci_unmap_sg(xdev->pdev, sgt->sgl, sgt->orig_nents, dir);
 		sgt->nents = 0;
@@ -3889,6 +4267,525 @@ unmap_sgl:
 	return done ? done : rv;
 }
 
+void xdma_desc_set_destroy(struct xdma_engine *engine,
+			   struct xdma_desc_set *set)
+{
+	struct device *dev = &engine->xdev->pdev->dev;
+	struct xdma_transfer *xfer = &set->xfer;
+
+	if (xfer->res_virt)
+		dma_free_coherent(dev, set->desc_nr * sizeof(struct xdma_result),
+				  xfer->res_virt, xfer->res_bus);
+	if (xfer->desc_virt)
+		dma_free_coherent(dev, set->desc_nr * sizeof(struct xdma_desc),
+				  xfer->desc_virt, xfer->desc_bus);
+	kfree(set);
+}
+
+/*
+ * Build the descriptors of a DMA mapped sg table once, in coherent memory of
+ * their own so that the set stays valid while the ring moves on. NULL if it
+ * takes more descriptors than the ring, or with C2H credits, which
+ * engine_start() gives for the descriptors used in the ring.
+ */
+struct xdma_desc_set *xdma_desc_set_create(struct xdma_engine *engine,
+					   struct sg_table *sgt)
+{
+	struct device *dev = &engine->xdev->pdev->dev;
+	bool st_c2h = engine->streaming && engine->dir == DMA_FROM_DEVICE;
+	struct xdma_request_cb *req;
+	struct xdma_desc_set *set = NULL;
+	struct xdma_transfer *xfer;
+
+	if (st_c2h && enable_st_c2h_credit)
+		return NULL;
+
+	req = xdma_init_request(sgt, 0);
+	if (!req)
+		return NULL;
+	if (!req->sw_desc_cnt || req->sw_desc_cnt > engine->desc_max)
+		goto free_req;
+
+	set = kzalloc(sizeof(struct xdma_desc_set), GFP_KERNEL);
+	if (!set)
+		goto free_req;
+	set->desc_nr = req->sw_desc_cnt;
+
+	xfer = &set->xfer;
+	xfer->desc_virt = dma_alloc_coherent(dev,
+				set->desc_nr * sizeof(struct xdma_desc),
+				&xfer->desc_bus, GFP_KERNEL);
+	if (!xfer->desc_virt)
+		goto free_set;
+	if (st_c2h) {
+		xfer->res_virt = dma_alloc_coherent(dev,
+				set->desc_nr * sizeof(struct xdma_result),
+				&xfer->res_bus, GFP_KERNEL);
+		if (!xfer->res_virt)
+			goto free_set;
+	}
+
+	xfer->dir = engine->dir;
+	transfer_chain_build(engine, req, xfer, set->desc_nr);
+	xdma_request_free(req);
+
+	return set;
+
+free_set:
+	xdma_desc_set_destroy(engine, set);
+	set = NULL;
+free_req:
+	xdma_request_free(req);
+	return set;
+}
+
+/*
+ * Same as xdma_multi_buffer_xfer_submit() for a descriptor set, nothing is
+ * built or allocated, only the C2H streaming results are cleared.
+ */
+ssize_t xdma_desc_set_xfer_submit(struct xdma_engine *engine,
+				  struct xdma_desc_set *set, int timeout_ms,
+				  u32 *lens, unsigned int lens_nr)
+{
+	struct xdma_transfer *xfer = &set->xfer;
+	bool st_c2h = engine->streaming && engine->dir == DMA_FROM_DEVICE;
+	unsigned int cmpl_idx = 0;
+	unsigned long flags;
+	ssize_t done = 0;
+	int rv, i;
+
+	if (xdma_device_flag_check(engine->xdev, XDEV_FLAG_OFFLINE)) {
+		pr_info("xdev 0x%p, offline.\n", engine->xdev);
+		return -EBUSY;
+	}
+
+	mutex_lock(&engine->desc_lock);
+
+#if HAS_SWAKE_UP
+	init_swait_queue_head(&xfer->wq);
+#else
+	init_waitqueue_head(&xfer->wq);
+#endif
+	xfer->desc_cmpl = 0;
+	xfer->flags = 0;
+	if (st_c2h)
+		memset(xfer->res_virt, 0,
+		       xfer->desc_num * sizeof(struct xdma_result));
+
+	rv = transfer_queue(engine, xfer);
+	if (rv < 0) {
+		pr_info("unable to submit %s, %d.\n", engine->name, rv);
+		goto unlock;
+	}
+
+	if (engine->cmplthp)
+		xdma_kthread_wakeup(engine->cmplthp);
+
+	transfer_wait(engine, xfer, timeout_ms);
+
+	spin_lock_irqsave(&engine->lock, flags);
+
+	switch (xfer->state) {
+	case TRANSFER_STATE_COMPLETED:
+		spin_unlock_irqrestore(&engine->lock, flags);
+
+		/* For C2H streaming use writeback results */
+		if (st_c2h) {
+			struct xdma_result *result = xfer->res_virt;
+
+			for (i = 0; i < xfer->desc_cmpl; i++) {
+				done += result[i].length;
+				if (cmpl_idx < lens_nr)
+					lens[cmpl_idx++] = result[i].length;
+			}
+		} else
+			done = xfer->len;
+		break;
+	case TRANSFER_STATE_FAILED:
+		pr_info("xfer 0x%p,%u, failed.\n", xfer, xfer->len);
+		spin_unlock_irqrestore(&engine->lock, flags);
+		rv = -EIO;
+		break;
+	default:
+		/* transfer can still be in-flight */
+		rv = transfer_abort(engine, xfer);
+		if (rv < 0) {
+			pr_err("Failed to stop engine\n");
+		} else if (rv == 0) {
+			rv = xdma_engine_stop(engine);
+			if (rv < 0)
+				pr_err("Failed to stop engine\n");
+		}
+		spin_unlock_irqrestore(&engine->lock, flags);
+
+		/* C2H streaming that received nothing is not an error */
+		rv = (st_c2h && !xfer->desc_cmpl) ? 0 : -ERESTARTSYS;
+		break;
+	}
+
+unlock:
+	mutex_unlock(&engine->desc_lock);
+
+	/* buffers left unfilled */
+	if (st_c2h) {
+		while (cmpl_idx < lens_nr)
+			lens[cmpl_idx++] = 0;
+	}
+
+	return done ? done : rv;
+}
+
+void xdma_cyclic_ring_free(struct xdma_cyclic_ring *ring)
+{
+	struct device *dev = &ring->engine->xdev->pdev->dev;
+	unsigned int order = get_order(ring->buf_size);
+	u32 i;
+
+	if (ring->pages) {
+		for (i = 0; i < ring->size; i++) {
+			if (!ring->pages[i])
+				continue;
+			dma_unmap_page(dev, ring->buf_bus[i],
+				       PAGE_SIZE << order, DMA_FROM_DEVICE);
+			__free_pages(ring->pages[i], order);
+		}
+	}
+	kfree(ring->pages);
+	kfree(ring->buf_bus);
+	if (ring->res)
+		dma_free_coherent(dev, ring->size * sizeof(struct xdma_result),
+				  ring->res, ring->res_bus);
+	if (ring->desc)
+		dma_free_coherent(dev, ring->size * sizeof(struct xdma_desc),
+				  ring->desc, ring->desc_bus);
+	ring->pages = NULL;
+	ring->buf_bus = NULL;
+	ring->res = NULL;
+	ring->desc = NULL;
+}
+
+/*
+ * The buffers are streaming mappings on the node of the device, the host
+ * only reads them between xdma_cyclic_ring_peek() and _advance().
+ * In AXI-ST C2H mode the source address of a descriptor carries the bus
+ * address of its writeback result. Every descriptor reports completion,
+ * none stops the engine, the last one links back to the first.
+ */
+int xdma_cyclic_ring_alloc(struct xdma_engine *engine,
+			   struct xdma_cyclic_ring *ring, u32 size,
+			   u32 buf_size)
+{
+	struct device *dev = &engine->xdev->pdev->dev;
+	unsigned int order;
+	dma_addr_t next;
+	u32 i;
+
+	if (!engine->streaming || engine->dir != DMA_FROM_DEVICE) {
+		pr_info("%s, cyclic ring needs an AXI-ST C2H engine.\n",
+			engine->name);
+		return -EINVAL;
+	}
+	/* credits are given per transfer in engine_start() */
+	if (enable_st_c2h_credit)
+		return -EINVAL;
+	if (size < 4 || size > XDMA_CYCLIC_RING_MAX || !is_power_of_2(size) ||
+	    !buf_size || buf_size > desc_blen_max ||
+	    buf_size > XDMA_CYCLIC_RING_BUF_MAX ||
+	    (u64)size * (PAGE_SIZE << get_order(buf_size)) >
+	    XDMA_CYCLIC_RING_MAX_BYTES)
+		return -EINVAL;
+
+	memset(ring, 0, sizeof(struct xdma_cyclic_ring));
+	ring->engine = engine;
+	ring->size = size;
+	ring->buf_size = buf_size;
+	init_waitqueue_head(&ring->wq);
+	order = get_order(buf_size);
+
+	ring->desc = dma_alloc_coherent(dev, size * sizeof(struct xdma_desc),
+					&ring->desc_bus, GFP_KERNEL);
+	ring->res = dma_alloc_coherent(dev, size * sizeof(struct xdma_result),
+				       &ring->res_bus, GFP_KERNEL);
+	ring->pages = kcalloc(size, sizeof(struct page *), GFP_KERNEL);
+	ring->buf_bus = kcalloc(size, sizeof(dma_addr_t), GFP_KERNEL);
+	if (!ring->desc || !ring->res || !ring->pages || !ring->buf_bus)
+		goto err_out;
+
+	for (i = 0; i < size; i++) {
+		ring->pages[i] = alloc_pages_node(dev_to_node(dev),
+						  GFP_KERNEL | __GFP_NOWARN,
+						  order);
+		if (!ring->pages[i])
+			goto err_out;
+		ring->buf_bus[i] = dma_map_page(dev, ring->pages[i], 0,
+						PAGE_SIZE << order,
+						DMA_FROM_DEVICE);
+		if (dma_mapping_error(dev, ring->buf_bus[i])) {
+			__free_pages(ring->pages[i], order);
+			ring->pages[i] = NULL;
+			goto err_out;
+		}
+
+		xdma_desc_set(ring->desc + i, ring->buf_bus[i],
+			      ring->res_bus + i * sizeof(struct xdma_result),
+			      buf_size, DMA_FROM_DEVICE);
+		next = ring->desc_bus +
+		       ((i + 1) & (size - 1)) * sizeof(struct xdma_desc);
+		xdma_desc_link(ring->desc + i, ring->desc + ((i + 1) & (size - 1)),
+			       next);
+		xdma_desc_control_set(ring->desc + i,
+				      XDMA_DESC_EOP | XDMA_DESC_COMPLETED);
+	}
+
+	dbg_init("%s, cyclic ring %u x %u bytes.\n", engine->name, size,
+		 buf_size);
+
+	return 0;
+
+err_out:
+	pr_err("%s, cyclic ring %u x %u OOM.\n", engine->name, size, buf_size);
+	xdma_cyclic_ring_free(ring);
+	return -ENOMEM;
+}
+
+int xdma_cyclic_ring_start(struct xdma_cyclic_ring *ring)
+{
+	struct xdma_engine *engine = ring->engine;
+	unsigned long flags;
+	u32 w;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (engine->running || engine->cyclic_ring ||
+	    !list_empty(&engine->transfer_list)) {
+		spin_unlock_irqrestore(&engine->lock, flags);
+		pr_info("%s busy, cyclic ring not started.\n", engine->name);
+		return -EBUSY;
+	}
+
+	memset(ring->res, 0, ring->size * sizeof(struct xdma_result));
+	ring->head = 0;
+	ring->avail = 0;
+	ring->partial = false;
+	/* Results and descriptors must be visible before the engine runs */
+	wmb();
+
+	/* the completed descriptor count restarts with the run bit */
+	w = cpu_to_le32(PCI_DMA_L(ring->desc_bus));
+	write_register(w, &engine->sgdma_regs->first_desc_lo,
+		       (unsigned long)(&engine->sgdma_regs->first_desc_lo) -
+			       (unsigned long)(&engine->sgdma_regs));
+	w = cpu_to_le32(PCI_DMA_H(ring->desc_bus));
+	write_register(w, &engine->sgdma_regs->first_desc_hi,
+		       (unsigned long)(&engine->sgdma_regs->first_desc_hi) -
+			       (unsigned long)(&engine->sgdma_regs));
+	write_register(0, &engine->sgdma_regs->first_desc_adjacent,
+		       (unsigned long)(&engine->sgdma_regs->first_desc_adjacent) -
+			       (unsigned long)(&engine->sgdma_regs));
+
+	/* Completion interrupts regardless of poll_mode, for the readers */
+	w = (u32)XDMA_CTRL_RUN_STOP;
+	w |= (u32)XDMA_CTRL_IE_READ_ERROR;
+	w |= (u32)XDMA_CTRL_IE_DESC_ERROR;
+	w |= (u32)XDMA_CTRL_IE_DESC_ALIGN_MISMATCH;
+	w |= (u32)XDMA_CTRL_IE_MAGIC_STOPPED;
+	w |= (u32)XDMA_CTRL_IE_DESC_STOPPED;
+	w |= (u32)XDMA_CTRL_IE_DESC_COMPLETED;
+	write_register(w, &engine->regs->control,
+		       (unsigned long)(&engine->regs->control) -
+			       (unsigned long)(&engine->regs));
+
+	engine->running = 1;
+	engine->cyclic_ring = ring;
+	ring->running = true;
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	dbg_tfr("%s, cyclic ring started.\n", engine->name);
+
+	return 0;
+}
+
+void xdma_cyclic_ring_stop(struct xdma_cyclic_ring *ring)
+{
+	struct xdma_engine *engine = ring->engine;
+	unsigned long flags;
+	int i;
+
+	if (!ring->running)
+		return;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	xdma_engine_stop(engine);
+	engine->cyclic_ring = NULL;
+	ring->running = false;
+	spin_unlock_irqrestore(&engine->lock, flags);
+	wake_up_interruptible(&ring->wq);
+
+	/* a frame in flight still lands in its buffer */
+	for (i = 0; i < 100; i++) {
+		if (!(read_register(&engine->regs->status) & XDMA_STAT_BUSY))
+			break;
+		udelay(10);
+	}
+	if (i == 100)
+		pr_warn("%s still busy after the cyclic ring stopped.\n",
+			engine->name);
+	/* clear the status the ring left behind */
+	engine_status_read(engine, 1, 0);
+
+	dbg_tfr("%s, cyclic ring stopped, %llu frames, %llu overruns.\n",
+		engine->name, ring->frames, ring->overruns);
+}
+
+/*
+ * One register read for a batch of entries. An engine more than
+ * size - XDMA_CYCLIC_RING_SLACK entries ahead may overwrite the entries
+ * the host is about to copy, so they are skipped and counted as overruns.
+ * The results of the entries counted are visible by then, the writebacks
+ * can't pass the completion of the register read.
+ */
+u32 xdma_cyclic_ring_sync(struct xdma_cyclic_ring *ring)
+{
+	u32 done, lag, keep;
+
+	done = read_register(&ring->engine->regs->completed_desc_count);
+	lag = done - ring->head;
+	keep = ring->size - XDMA_CYCLIC_RING_SLACK(ring);
+	if (unlikely(lag > keep)) {
+		ring->overruns += lag - keep;
+		ring->head = done - keep;
+		/* the entry dropped at the new head may be a frame's tail */
+		ring->partial = false;
+		lag = keep;
+	}
+	ring->avail = lag;
+
+	return lag;
+}
+
+static void cyclic_ring_entry_release(struct xdma_cyclic_ring *ring)
+{
+	struct device *dev = &ring->engine->xdev->pdev->dev;
+	u32 i = ring->head & (ring->size - 1);
+
+	/* the frame may have been read, give the whole entry back */
+	dma_sync_single_for_device(dev, ring->buf_bus[i], ring->buf_size,
+				   DMA_FROM_DEVICE);
+	ring->res[i].status = 0;
+	ring->res[i].length = 0;
+	ring->head++;
+	ring->avail--;
+}
+
+/*
+ * Frames longer than an entry continue in the next one without EOP,
+ * they are dropped whole.
+ */
+void *xdma_cyclic_ring_peek(struct xdma_cyclic_ring *ring, u32 *len)
+{
+	struct device *dev = &ring->engine->xdev->pdev->dev;
+	struct xdma_result *res;
+	u32 i, status;
+
+	while (ring->avail) {
+		i = ring->head & (ring->size - 1);
+		res = ring->res + i;
+		status = le32_to_cpu(READ_ONCE(res->status));
+		/* Read the result before the frame */
+		dma_rmb();
+
+		if ((status >> 16) != C2H_WB || !(status & RX_STATUS_EOP) ||
+		    ring->partial) {
+			ring->errors++;
+			ring->partial = (status >> 16) == C2H_WB &&
+					!(status & RX_STATUS_EOP);
+			cyclic_ring_entry_release(ring);
+			continue;
+		}
+
+		*len = min(le32_to_cpu(res->length), ring->buf_size);
+		dma_sync_single_for_cpu(dev, ring->buf_bus[i], *len,
+					DMA_FROM_DEVICE);
+		return page_address(ring->pages[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * The slack of the last sync does not bound a slow copy, check that the
+ * engine did not get back to the entry meanwhile. If it did, the copy is
+ * counted as an overrun and the ring synced again.
+ */
+bool xdma_cyclic_ring_advance(struct xdma_cyclic_ring *ring)
+{
+	bool lapped;
+	u32 done;
+
+	/* the copy is done before the count is read */
+	rmb();
+	done = read_register(&ring->engine->regs->completed_desc_count);
+	lapped = done - ring->head >= ring->size;
+	cyclic_ring_entry_release(ring);
+	if (unlikely(lapped)) {
+		ring->overruns++;
+		ring->partial = false;
+		xdma_cyclic_ring_sync(ring);
+		return false;
+	}
+	ring->frames++;
+
+	return true;
+}
+
+/*
+ * The engine interrupt stays masked while the ring holds entries, it is
+ * re-enabled here once the ring is empty. Only MSI-X vectors reach
+ * engine_service_work() per engine, otherwise the ring is polled every
+ * jiffy.
+ */
+int xdma_cyclic_ring_wait(struct xdma_cyclic_ring *ring,
+			  unsigned int timeout_ms)
+{
+	struct xdma_engine *engine = ring->engine;
+	bool msix = engine->xdev->msix_enabled;
+	unsigned long end = jiffies + msecs_to_jiffies(timeout_ms);
+	unsigned int irqs;
+	long left, rv;
+	u32 avail;
+
+	for (;;) {
+		avail = xdma_cyclic_ring_sync(ring);
+		if (avail)
+			return avail;
+
+		irqs = READ_ONCE(ring->irqs);
+		/* completions from now on raise the interrupt again */
+		read_register(&engine->regs->status_rc);
+		avail = xdma_cyclic_ring_sync(ring);
+		if (avail)
+			return avail;
+		if (msix)
+			engine_irq_mask(engine, true);
+
+		if (timeout_ms) {
+			left = (long)(end - jiffies);
+			if (left <= 0)
+				return 0;
+		} else
+			left = MAX_SCHEDULE_TIMEOUT;
+		if (!msix)
+			left = 1;
+
+		rv = wait_event_interruptible_timeout(ring->wq,
+				READ_ONCE(ring->irqs) != irqs ||
+				!READ_ONCE(ring->running), left);
+		if (rv < 0)
+			return rv;
+		if (!READ_ONCE(ring->running))
+			return 0;
+	}
+}
+
 ssize_t xdma_xfer_completion(void *cb_hndl, void *dev_hndl, int channel,
 			bool write, u64 ep_addr, struct sg_table *sgt,
 			bool dma_mapped, int timeout_ms)
@@ -3989,6 +4886,7 @@ ssize_t xdma_xfer_completion(void *cb_hndl, void *dev_hndl, int channel,
 		}
 
 		transfer_destroy(xdev, xfer);
+		/* from io_done, engine->lock is held */
 		engine->desc_used -= xfer->desc_num;
 
 		tfer_idx++;
@@ -4099,6 +4997,29 @@ ssize_t xdma_xfer_submit_nowait(void *cb_hndl, void *dev_hndl, int channel,
 	dbg_tfr("%s, len %u sg cnt %u.\n",
 		engine->name, req->total_len, req->sw_desc_cnt);
 
+	/*
+	 * Take the descriptors of all transfers at once, a request failing
+	 * halfway would leave the transfers queued before it without a
+	 * completion.
+	 */
+	rv = engine_desc_get(engine, req->sw_desc_cnt);
+	if (rv < 0) {
+		pr_info("%s, %u descriptors in use.\n", engine->name,
+			engine->desc_used);
+
+		if (!dma_mapped && sgt->nents) {
+			pci_unmap_sg(xdev->pdev, sgt->sgl,
+					sgt->orig_nents, dir);
+			sgt->nents = 0;
+		}
+
+		/* Transfer failed return BUSY */
+		if (cb->io_done)
+			cb->io_done((unsigned long)cb, -EBUSY);
+
+		goto rel_req;
+	}
+
 	sg = sgt->sgl;
 	nents = req->sw_desc_cnt;
 	while (nents) {
@@ -4108,22 +5029,7 @@ ssize_t xdma_xfer_submit_nowait(void *cb_hndl, void *dev_hndl, int channel,
 		/* one transfer at a time */
 		xfer = &req->tfer[tfer_idx];
 		/* build transfer */
-		rv = transfer_init(engine, req, xfer);
-		if (rv < 0) {
-			pr_info("transfer_init failed\n");
-
-			if (!dma_mapped && sgt->nents) {
-				pci_unmap_sg(xdev->pdev, sgt->sgl,
-						sgt->orig_nents, dir);
-				sgt->nents = 0;
-			}
-
-			/* Transfer failed return BUSY */
-			if (cb->io_done)
-				cb->io_done((unsigned long)cb, -EBUSY);
-
-			goto rel_req;
-		}
+		transfer_init(engine, req, xfer, engine->desc_max, true);
 
 		xfer->cb = cb;
 
@@ -4148,6 +5054,7 @@ ssize_t xdma_xfer_submit_nowait(void *cb_hndl, void *dev_hndl, int channel,
 		rv = transfer_queue(engine, xfer);
 		if (rv < 0) {
 			pr_info("unable to submit %s, %d.\n", engine->name, rv);
+			engine_desc_put(engine, xfer->desc_num + nents);
 			goto unmap_sgl;
 		}
 
@@ -4172,6 +5079,53 @@ rel_req:
 	return rv;
 }
 
+void xdma_xfer_cancel_nowait(struct xdma_engine *engine,
+			     void (*io_done)(unsigned long cb_hndl, int err))
+{
+	struct xdma_transfer *xfer, *tmp, *prev = NULL;
+	struct xdma_request_cb *req;
+	struct xdma_io_cb *cb;
+	unsigned long flags;
+	int rv;
+
+	spin_lock_irqsave(&engine->lock, flags);
+
+	rv = xdma_engine_stop(engine);
+	if (rv < 0)
+		pr_err("Failed to stop engine\n");
+
+	list_for_each_entry_safe(xfer, tmp, &engine->transfer_list, entry) {
+		cb = xfer->cb;
+		if (!cb || cb->io_done != io_done) {
+			prev = xfer;
+			continue;
+		}
+
+		list_del(&xfer->entry);
+		xfer->state = TRANSFER_STATE_ABORTED;
+		/*
+		 * The ring slots behind a transfer left in the queue are only
+		 * free once it completes, see engine_transfer_completion().
+		 */
+		if (prev)
+			prev->desc_held += xfer->desc_num + xfer->desc_held;
+		else
+			engine->desc_used -= xfer->desc_num + xfer->desc_held;
+		transfer_destroy(engine->xdev, xfer);
+
+		if (xfer->last_in_request) {
+			req = cb->req;
+			cb->io_done((unsigned long)cb, -ECANCELED);
+			xdma_request_free(req);
+		}
+	}
+
+	/* restart the engine for anything else left in the queue */
+	engine_service_resume(engine);
+
+	spin_unlock_irqrestore(&engine->lock, flags);
+}
+
 int xdma_performance_submit(struct xdma_dev *xdev, struct xdma_engine *engine)
 {
 	u32 max_consistent_size = XDMA_PERF_NUM_DESC * 32 * 1024; /* 4MB */
@@ -4680,6 +5634,18 @@ void *xdma_device_open(const char *mname, struct pci_dev *pdev, int *user_max,
 	if (rv < 0)
 		goto err_msix;
 
+	/* After irq_setup(), the threads follow the MSI-X vector affinity */
+	if (poll_mode) {
+		int i;
+
+		for (i = 0; i < xdev->h2c_channel_max; i++)
+			if (xdev->engine_h2c[i].magic == MAGIC_ENGINE)
+				xdma_thread_add_work(&xdev->engine_h2c[i]);
+		for (i = 0; i < xdev->c2h_channel_max; i++)
+			if (xdev->engine_c2h[i].magic == MAGIC_ENGINE)
+				xdma_thread_add_work(&xdev->engine_c2h[i]);
+	}
+
 	/* Flush writes */
 	read_interrupts(xdev);
 
@@ -4689,6 +5655,7 @@ void *xdma_device_open(const char *mname, struct pci_dev *pdev, int *user_max,
 
 	// Initialise TSN QoS
 	tsn_init_configs(pdev);
+	alinx_sysclock_cache_init(xdev);
 
 	xdma_device_flag_clear(xdev, XDEV_FLAG_OFFLINE);
 	return (void *)xdev;
@@ -4738,6 +5705,7 @@ void xdma_device_close(struct pci_dev *pdev, void *dev_hndl)
 	irq_teardown(xdev);
 	disable_msi_msix(xdev, pdev);
 
+	alinx_sysclock_cache_destroy(xdev);
 	remove_engines(xdev);
 	unmap_bars(xdev, pdev);
 
@@ -80,6 +80,9 @@
 /* Use this definition to poll several times between calls to schedule */
 #define NUM_POLLS_PER_SCHED 100
 
+/* Completion rate of the adaptive mode is measured over this window */
+#define XDMA_ADAPTIVE_WINDOW_NS (10 * NSEC_PER_MSEC)
+
 #define XDMA_CHANNEL_NUM_MAX (4)
 /*
  * interrupts per engine, rad2_vul.sv:237
@@ -98,6 +101,9 @@
 #define XDMA_ENGINE_XFER_MAX_DESC		0x800
 #define XDMA_ENGINE_CREDIT_XFER_MAX_DESC	0x3FF
 
+/* maximum number of transfers of a blocking request queued on an engine */
+#define XDMA_TRANSFER_QUEUE_MAX			4
+
 /* maximum size of a single DMA transfer descriptor */
 #define XDMA_DESC_BLEN_BITS	28
 //#define XDMA_DESC_BLEN_MAX	((1 << (XDMA_DESC_BLEN_BITS)) - 1)
@@ -406,6 +412,27 @@ struct xdma_poll_wb {
 	u32 reserved_1[7];
 } __packed;
 
+/*
+ * Adaptive interrupt/poll mode of an engine (adaptive_poll=1): interrupts
+ * while the completion rate is low, bounded busy-polling of the descriptor
+ * writeback above adaptive_poll_rate. Updated under engine->desc_lock.
+ */
+struct xdma_adaptive {
+	u8 polling;		/* else interrupts */
+	struct delayed_work decay;	/* ends the windows without traffic */
+	u32 window_cmpl;	/* completions in the current window */
+	u64 window_start;	/* ns */
+	u64 mode_since;		/* ns, start of the current mode */
+
+	/* statistics, see the xdma_adaptive_poll sysfs file */
+	u64 to_poll;		/* switches to polling */
+	u64 to_irq;		/* switches to interrupts */
+	u64 poll_ns;		/* time polling, without the current mode */
+	u64 irq_ns;
+	u64 spin_hits;		/* completions found by polling */
+	u64 spin_misses;	/* spin budget ran out, waited for the interrupt */
+};
+
 
 /**
  * Descriptor for a single contiguous memory block transfer.
@@ -456,6 +483,7 @@ struct xdma_transfer {
 	int desc_adjacent;		/* adjacent descriptors at desc_bus */
 	int desc_num;			/* number of descriptors in transfer */
 	int desc_index;			/* index for 1st desc. in transfer */
+	int desc_held;			/* of cancelled transfers behind it */
 	int desc_cmpl;			/* completed descriptors */
 	int desc_cmpl_th;		/* completed descriptor threshold */
 	enum dma_data_direction dir;
@@ -474,6 +502,51 @@ struct xdma_transfer {
 	struct xdma_io_cb *cb;
 };
 
+/*
+ * Descriptor chain built once by xdma_desc_set_create() outside the engine
+ * ring, the engine does not write it so it is submitted again as is
+ */
+struct xdma_desc_set {
+	struct xdma_transfer xfer;	/* desc_virt, res_virt are the set's */
+	unsigned int desc_nr;		/* descriptors allocated */
+};
+
+/*
+ * Cyclic AXI-ST C2H ring: the descriptors are linked in a loop without a
+ * stop bit, so the engine is started once and keeps writing the fixed
+ * buffers, one frame per entry. The host consumes the writeback results
+ * in order and copies the frames out, the buffers never leave the ring.
+ * head counts the consumed entries, the completed descriptor count of
+ * the engine those written since the start, see xdma_cyclic_ring_sync().
+ */
+#define XDMA_CYCLIC_RING_MAX		1024
+/* Entries are single allocations, kept below the costly page order */
+#define XDMA_CYCLIC_RING_BUF_MAX	(PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
+#define XDMA_CYCLIC_RING_MAX_BYTES	(32 << 20)
+/* Entries the engine may get ahead of the host before it counts overruns */
+#define XDMA_CYCLIC_RING_SLACK(ring)	((ring)->size / 4)
+
+struct xdma_cyclic_ring {
+	struct xdma_engine *engine;
+	struct xdma_desc *desc;
+	dma_addr_t desc_bus;
+	struct xdma_result *res;
+	dma_addr_t res_bus;
+	struct page **pages;
+	dma_addr_t *buf_bus;
+	u32 size;			/* entries, power of 2 */
+	u32 buf_size;			/* bytes per entry */
+	u32 head;			/* next entry to consume */
+	u32 avail;			/* written entries, as of the last sync */
+	bool partial;			/* dropping a frame longer than an entry */
+	bool running;
+	unsigned int irqs;		/* engine interrupts, wakes wq */
+	wait_queue_head_t wq;
+	u64 frames;
+	u64 overruns;			/* entries overwritten before consumed */
+	u64 errors;			/* bad writeback results and long frames */
+};
+
 struct xdma_request_cb {
 	struct sg_table *sgt;
 	u64 ep_addr;
@@ -486,8 +559,11 @@ struct xdma_request_cb {
 	unsigned int sg_idx;
 	unsigned int sg_offset;
 
-	/* Use two transfers in case single request needs to be split */
-	struct xdma_transfer tfer[2];
+	/*
+	 * A request too large for one transfer is split, blocking requests
+	 * keep up to XDMA_TRANSFER_QUEUE_MAX of them queued on the engine
+	 */
+	struct xdma_transfer tfer[XDMA_TRANSFER_QUEUE_MAX];
 
 	struct xdma_io_cb *cb;
 
@@ -534,12 +610,14 @@ struct xdma_engine {
 	/* Members applicable to AXI-ST C2H (cyclic) transfers */
 	struct xdma_result *cyclic_result;
 	dma_addr_t cyclic_result_bus;	/* bus addr for transfer */
+	struct xdma_cyclic_ring *cyclic_ring;	/* owns the engine if set */
 	u8 *perf_buf_virt;
 	dma_addr_t perf_buf_bus; /* bus address */
 
 	/* Members associated with polled mode support */
 	u8 *poll_mode_addr_virt;	/* virt addr for descriptor writeback */
 	dma_addr_t poll_mode_bus;	/* bus addr for descriptor writeback */
+	struct xdma_adaptive adaptive;
 
 	/* Members associated with interrupt mode support */
 #if	HAS_SWAKE_UP
@@ -596,6 +674,7 @@ struct xdma_dev {
 	struct pci_dev *pdev;	/* pci device struct from probe() */
 	struct net_device *ndev; /* net device struct from probe() */
 	struct tsn_config tsn_config;
+	struct sysclock_cache sysclock_cache;
 	int idx;		/* dev index */
 
 	const char *mod_name;		/* name of module owning the dev */
@@ -700,6 +779,8 @@ void get_perf_stats(struct xdma_engine *engine);
 
 int engine_addrmode_set(struct xdma_engine *engine, unsigned long arg);
 int engine_service_poll(struct xdma_engine *engine, u32 expected_desc_count);
+int engine_service_drain(struct xdma_engine *engine);
+ssize_t xdma_adaptive_show(struct xdma_dev *xdev, char *buf, size_t size);
 
 ssize_t xdma_xfer_aperture(struct xdma_engine *engine, bool write, u64 ep_addr,
 			unsigned int aperture, struct sg_table *sgt,
@@ -1,4 +1,6 @@
 #include <linux/if_ether.h>
+#include <linux/ethtool.h>
+#include <linux/module.h>
 #include <linux/string.h>
 
 #include "alinx_ptp.h"
@@ -8,6 +10,26 @@
 #include "tsn.h"
 
 #define NS_IN_1S 1000000000
+#define PS_IN_1NS 1000
+
+static unsigned int link_speed = SPEED_1000;
+module_param(link_speed, uint, 0444);
+MODULE_PARM_DESC(link_speed, "Initial link speed in Mbps used by the TSN scheduler, can be changed by ethtool -s");
+
+struct tsn_link_speed {
+	uint32_t speed; // Mbps
+	uint32_t ps_per_byte;
+};
+
+// Precomputed, so that bytes_to_ns() never divides by the link speed
+static const struct tsn_link_speed tsn_link_speeds[] = {
+	{ SPEED_10, 800000 },
+	{ SPEED_100, 80000 },
+	{ SPEED_1000, 8000 },
+	{ SPEED_2500, 3200 },
+	{ SPEED_5000, 1600 },
+	{ SPEED_10000, 800 },
+};
 
 #define TSN_ALWAYS_OPEN(from) (from - 1) /* For both timestamp and sysclock */
 
@@ -19,14 +41,16 @@ struct timestamps {
 };
 
 static bool is_gptp_packet(const uint8_t* payload);
+static enum tsn_prio tsn_get_queue_prio(struct sk_buff* skb, uint8_t vlan_prio);
 static void bake_qos_config(struct tsn_config* config);
-static uint64_t bytes_to_ns(uint64_t bytes);
+static uint64_t bytes_to_ns(const struct tsn_config* tsn_config, uint64_t bytes);
+static void init_qav_state(struct qav_state* qav);
 static void spend_qav_credit(struct tsn_config* tsn_config, timestamp_t at, uint8_t tc_id, uint64_t bytes);
-static bool get_timestamps(struct timestamps* timestamps, const struct tsn_config* tsn_config, timestamp_t from, uint8_t tc_id, uint64_t bytes, bool consider_delay);
+static bool get_timestamps(struct timestamps* timestamps, struct tsn_config* tsn_config, timestamp_t from, uint8_t tc_id, uint64_t bytes, bool consider_delay);
 
 // HW Buffer tracker
 static bool append_buffer_track(struct buffer_tracker* buffer_tracker);
-static void update_buffer_track(struct pci_dev* pdev);
+static void update_buffer_track(struct pci_dev* pdev, timestamp_t now);
 
 static inline uint8_t tsn_get_mqprio_tc(struct net_device* ndev, uint8_t prio) {
 	if (netdev_get_num_tc(ndev) == 0) {
@@ -37,14 +61,16 @@ static inline uint8_t tsn_get_mqprio_tc(struct net_device* ndev, uint8_t prio) {
 }
 
 static uint8_t tsn_get_vlan_prio(struct tsn_config* tsn_config, struct sk_buff* skb) {
-	struct tx_buffer* tx_buf = (struct tx_buffer*)skb->data;
-	struct ethhdr* eth = (struct ethhdr*)(tx_buf->data);
+	struct ethhdr* eth = (struct ethhdr*)(skb->data);
 	uint16_t eth_type = ntohs(eth->h_proto);
 	if (eth_type == ETH_P_8021Q) {
-		struct tsn_vlan_hdr* vlan = (struct tsn_vlan_hdr*)(tx_buf->data + ETH_HLEN - ETH_TLEN);  // eth->h_proto == vlan->pid
+		struct tsn_vlan_hdr* vlan = (struct tsn_vlan_hdr*)(skb->data + ETH_HLEN - ETH_TLEN);  // eth->h_proto == vlan->pid
 		return vlan->pcp;
 	}
-	//XXX: Or you can use skb->priority;
+	// Untagged frames use the socket priority, e.g. SO_PRIORITY
+	if (skb->priority < TSN_PRIO_COUNT) {
+		return skb->priority;
+	}
 	return 0;
 }
 
@@ -59,6 +85,33 @@ static bool is_gptp_packet(const uint8_t* payload) {
 	return eth_type == ETH_P_1588;
 }
 
+static enum tsn_prio tsn_get_queue_prio(struct sk_buff* skb, uint8_t vlan_prio) {
+	if (is_gptp_packet(skb->data)) {
+		return TSN_PRIO_GPTP;
+	} else if (vlan_prio > 0) {
+		return TSN_PRIO_VLAN;
+	}
+	return TSN_PRIO_BE;
+}
+
+/**
+ * Select the TX queue of a frame, so that each hardware queue priority gets its own qdisc
+ * and a full best effort queue doesn't hold back gPTP/VLAN frames
+ * @param tsn_config: TSN configuration
+ * @param skb: The frame to be sent, the Ethernet header must be in the linear part
+ * @return: One of enum tsn_tx_queue
+ */
+u16 tsn_select_queue(struct tsn_config* tsn_config, struct sk_buff* skb) {
+	switch (tsn_get_queue_prio(skb, tsn_get_vlan_prio(tsn_config, skb))) {
+	case TSN_PRIO_GPTP:
+		return TSN_TX_QUEUE_GPTP;
+	case TSN_PRIO_VLAN:
+		return TSN_TX_QUEUE_VLAN;
+	default:
+		return TSN_TX_QUEUE_BE;
+	}
+}
+
 static inline sysclock_t tsn_timestamp_to_sysclock(struct pci_dev* pdev, timestamp_t timestamp) {
 	return alinx_timestamp_to_sysclock(pdev, timestamp - TX_ADJUST_NS) - PHY_DELAY_CLOCKS;
 }
@@ -67,41 +120,33 @@ static inline sysclock_t tsn_timestamp_to_sysclock(struct pci_dev* pdev, timesta
  * Fill in the time related metadata of a frame
  * @param tsn_config: TSN configuration
  * @param now: Current time
- * @param tx_buf: The frame to be sent
+ * @param skb: The frame to be sent, the Ethernet header must be in the linear part
+ * @param metadata: The metadata sent in front of the frame
  * @return: true if the frame reserves timestamps, false is for drop
  */
-bool tsn_fill_metadata(struct pci_dev* pdev, timestamp_t now, struct sk_buff* skb) {
+bool tsn_fill_metadata(struct pci_dev* pdev, timestamp_t now, struct sk_buff* skb, struct tx_metadata* metadata) {
 	uint8_t vlan_prio, tc_id;
 	uint64_t duration_ns;
 	bool is_gptp, consider_delay;
 	timestamp_t from, free_at;
 	enum tsn_prio queue_prio;
 	struct timestamps timestamps;
-	struct tx_buffer* tx_buf = (struct tx_buffer*)skb->data;
-	struct tx_metadata* metadata = (struct tx_metadata*)&tx_buf->metadata;
 	struct xdma_dev* xdev = xdev_find_by_pdev(pdev);
 	struct tsn_config* tsn_config = &xdev->tsn_config;
 	struct buffer_tracker* buffer_tracker = &tsn_config->buffer_tracker;
 	struct xdma_private* priv = netdev_priv(xdev->ndev);
 
-	update_buffer_track(pdev);
+	update_buffer_track(pdev, now);
 
 	vlan_prio = tsn_get_vlan_prio(tsn_config, skb);
 	tc_id = tsn_get_mqprio_tc(xdev->ndev, vlan_prio);
-	is_gptp = is_gptp_packet(tx_buf->data);
-
-	if (is_gptp) {
-		queue_prio = TSN_PRIO_GPTP;
-	} else if (vlan_prio > 0) {
-		queue_prio = TSN_PRIO_VLAN;
-	} else {
-		queue_prio = TSN_PRIO_BE;
-	}
+	queue_prio = tsn_get_queue_prio(skb, vlan_prio);
+	is_gptp = (queue_prio == TSN_PRIO_GPTP);
 	consider_delay = (queue_prio != TSN_PRIO_BE);
 
 	from = now + H2C_LATENCY_NS;
 
-	duration_ns = bytes_to_ns(metadata->frame_length);
+	duration_ns = bytes_to_ns(tsn_config, metadata->frame_length);
 
 	if (tsn_config->qbv.enabled == false && tsn_config->qav[tc_id].enabled == false) {
 		// Don't care. Just fill in the metadata
@@ -109,17 +154,19 @@ bool tsn_fill_metadata(struct pci_dev* pdev, timestamp_t now, struct sk_buff* sk
 		timestamps.to = timestamps.from + _DEFAULT_TO_MARGIN_;
 		metadata->fail_policy = TSN_FAIL_POLICY_DROP;
 	} else {
-		if (tsn_config->qav[tc_id].enabled == true && tsn_config->qav[tc_id].available_at > from) {
-			from = tsn_config->qav[tc_id].available_at;
+		if (tsn_config->qav[tc_id].enabled == true && tsn_config->qav[tc_id].cbs.available_at > from) {
+			from = tsn_config->qav[tc_id].cbs.available_at;
 		}
 		if (consider_delay) {
 			// Check if queue is available
 			if (buffer_tracker->pending_packets >= TSN_QUEUE_SIZE) {
+				tsn_config->tc_stats[tc_id].rejected += 1;
 				return false;
 			}
 		} else {
 			// Best effort
 			if (buffer_tracker->pending_packets >= BE_QUEUE_SIZE) {
+				tsn_config->tc_stats[tc_id].rejected += 1;
 				return false;
 			}
 			from = max(from, tsn_config->total_available_at);
@@ -159,9 +206,11 @@ bool tsn_fill_metadata(struct pci_dev* pdev, timestamp_t now, struct sk_buff* sk
 	if (append_buffer_track(buffer_tracker) == false) {
 		// HW queue is full. Drop the frame
 		// Mostly, this won't happen because we already checked the queue size
+		tsn_config->tc_stats[tc_id].rejected += 1;
 		return false;
 	}
 
+	tsn_config->tc_stats[tc_id].packets += 1;
 	return true;
 }
 
@@ -170,6 +219,11 @@ void tsn_init_configs(struct pci_dev* pdev) {
 	struct tsn_config* config = &xdev->tsn_config;
 	memset(config, 0, sizeof(struct tsn_config));
 
+	if (tsn_set_link_speed(pdev, link_speed) < 0) {
+		pr_warn("Unsupported link speed %u Mbps, assuming %u Mbps\n", link_speed, SPEED_1000);
+		tsn_set_link_speed(pdev, SPEED_1000);
+	}
+
 	// Example Qbv configuration
 	if (false) {
 		config->qbv.enabled = true;
@@ -189,6 +243,7 @@ void tsn_init_configs(struct pci_dev* pdev) {
 		config->qav[0].lo_credit = -1000000;
 		config->qav[0].idle_slope = 10;
 		config->qav[0].send_slope = -90;
+		init_qav_state(&config->qav[0]);
 	}
 
 	bake_qos_config(config);
@@ -255,52 +310,77 @@ static void bake_qos_config(struct tsn_config* config) {
 			prio->slot_count += 1;
 		}
 	}
+
+	// Lookup tables for get_timestamps()
+	for (tc_id = 0; tc_id < TC_COUNT; tc_id += 1) {
+		struct qbv_baked_prio* prio = &baked->prios[tc_id];
+		prio->slot_start_ns[0] = 0;
+		for (slot_id = 0; slot_id < prio->slot_count; slot_id += 1) {
+			prio->slot_start_ns[slot_id + 1] = prio->slot_start_ns[slot_id] + prio->slots[slot_id].duration_ns;
+		}
+		config->qbv_cursor.slot_id[tc_id] = 0;
+	}
+	tsn_recip_init(&baked->cycle, baked->cycle_ns);
+	config->qbv_cursor.cycle_base = config->qbv.start;
+}
+
+/**
+ * Time on the wire of a frame, including preamble, FCS and interpacket gap
+ * @param tsn_config: TSN configuration
+ * @param bytes: Size of the frame without FCS
+ */
+static uint64_t bytes_to_ns(const struct tsn_config* tsn_config, uint64_t bytes) {
+	return tsn_bytes_to_ns(bytes, ETH_ZLEN, ETHERNET_GAP_SIZE, tsn_config->ps_per_byte);
+}
+
+/**
+ * Set the link speed the frames are scheduled for
+ * @param pdev: PCI device
+ * @param speed: Link speed in Mbps, SPEED_*
+ * @return: 0 on success, -EINVAL if the speed is not supported
+ */
+int tsn_set_link_speed(struct pci_dev* pdev, uint32_t speed) {
+	int i;
+	struct xdma_dev* xdev = xdev_find_by_pdev(pdev);
+	struct tsn_config* config = &xdev->tsn_config;
+
+	for (i = 0; i < ARRAY_SIZE(tsn_link_speeds); i++) {
+		if (tsn_link_speeds[i].speed == speed) {
+			config->link_speed = speed;
+			config->ps_per_byte = tsn_link_speeds[i].ps_per_byte;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
 }
 
-static uint64_t bytes_to_ns(uint64_t bytes) {
-	// TODO: Get link speed
-	uint64_t link_speed = 1000000000; // Assume 1Gbps
-	return max(bytes, (uint64_t)ETH_ZLEN) * 8 * NS_IN_1S / link_speed;
+uint32_t tsn_get_link_speed(struct pci_dev* pdev) {
+	struct xdma_dev* xdev = xdev_find_by_pdev(pdev);
+
+	return xdev->tsn_config.link_speed;
+}
+
+// The slopes are in credits/ns
+static void init_qav_state(struct qav_state* qav) {
+	tsn_cbs_init(&qav->cbs, qav->idle_slope, qav->send_slope, qav->hi_credit, qav->lo_credit, 1, 0);
 }
 
 static void spend_qav_credit(struct tsn_config* tsn_config, timestamp_t at, uint8_t tc_id, uint64_t bytes) {
-	uint64_t elapsed_from_last_update, sending_duration;
-	double earned_credit, spending_credit;
-	timestamp_t send_end;
 	struct qav_state* qav = &tsn_config->qav[tc_id];
 
 	if (qav->enabled == false) {
 		return;
 	}
 
-	if (at < qav->last_update || at < qav->available_at) {
+	if (at < qav->cbs.last_update || at < qav->cbs.available_at) {
 		// Invalid
 		pr_err("Invalid timestamp Qav spending");
 		return;
 	}
 
-	elapsed_from_last_update = at - qav->last_update;
-	earned_credit = (double)elapsed_from_last_update * qav->idle_slope;
-	qav->credit += earned_credit;
-	if (qav->credit > qav->hi_credit) {
-		qav->credit = qav->hi_credit;
-	}
-
-	sending_duration = bytes_to_ns(bytes);
-	spending_credit = (double)sending_duration * qav->send_slope;
-	qav->credit += spending_credit;
-	if (qav->credit < qav->lo_credit) {
-		qav->credit = qav->lo_credit;
-	}
-
-	// Calulate next available time
-	send_end = at + sending_duration;
-	qav->last_update = send_end;
-	if (qav->credit < 0) {
-		qav->available_at = send_end + -(qav->credit / qav->idle_slope);
-	} else {
-		qav->available_at = send_end;
-	}
+	// Fixed point, see tsn_shaper.h. This runs for every frame.
+	tsn_cbs_spend(&qav->cbs, at, bytes_to_ns(tsn_config, bytes));
 }
 
 /**
@@ -313,12 +393,13 @@ static void spend_qav_credit(struct tsn_config* tsn_config, timestamp_t at, uint
  * @param consider_delay: If true, calculate delay_from and delay_to
  * @return: true if the frame reserves timestamps, false is for drop
  */
-static bool get_timestamps(struct timestamps* timestamps, const struct tsn_config* tsn_config, timestamp_t from, uint8_t tc_id, uint64_t bytes, bool consider_delay) {
+static bool get_timestamps(struct timestamps* timestamps, struct tsn_config* tsn_config, timestamp_t from, uint8_t tc_id, uint64_t bytes, bool consider_delay) {
 	int slot_id, slot_count;
 	uint64_t sending_duration, remainder;
 	const struct qbv_baked_config* baked;
 	const struct qbv_baked_prio* baked_prio;
 	const struct qbv_config* qbv = &tsn_config->qbv;
+	struct qbv_cursor* cursor = &tsn_config->qbv_cursor;
 	memset(timestamps, 0, sizeof(struct timestamps));
 
 	if (qbv->enabled == false) {
@@ -333,13 +414,11 @@ static bool get_timestamps(struct timestamps* timestamps, const struct tsn_confi
 
 	baked = &tsn_config->qbv_baked;
 	baked_prio = &baked->prios[tc_id];
-	sending_duration = bytes_to_ns(bytes);
+	sending_duration = bytes_to_ns(tsn_config, bytes);
 
 	// TODO: Need to check if the slot is big enough to fit the frame. But, That is a user fault. Don't mind for now
 	// But we still have to check if the first current slot's remaining time is enough to fit the frame
 
-	remainder = (from - qbv->start) % baked->cycle_ns;
-	slot_id = 0;
 	slot_count = baked_prio->slot_count;
 
 	// Check if tc_id is always open or always closed
@@ -357,10 +436,11 @@ static bool get_timestamps(struct timestamps* timestamps, const struct tsn_confi
 		return true;
 	}
 
-	while (remainder > baked_prio->slots[slot_id].duration_ns) {
-		remainder -= baked_prio->slots[slot_id].duration_ns;
-		slot_id += 1;
-	}
+	// Constant time regardless of the schedule size, see tsn_shaper.h
+	remainder = tsn_tas_cursor_offset(&cursor->cycle_base, from, qbv->start, &baked->cycle);
+	slot_id = tsn_tas_find_slot_from(baked_prio->slot_start_ns, slot_count, remainder, cursor->slot_id[tc_id]);
+	cursor->slot_id[tc_id] = slot_id;
+	remainder -= baked_prio->slot_start_ns[slot_id];
 
 	// 1. "from"
 	if (baked_prio->slots[slot_id].opened) {
@@ -432,7 +512,7 @@ static bool append_buffer_track(struct buffer_tracker* buffer_tracker) {
 	return true;
 }
 
-static void update_buffer_track(struct pci_dev* pdev) {
+static void update_buffer_track(struct pci_dev* pdev, timestamp_t now) {
 	struct xdma_dev* xdev = xdev_find_by_pdev(pdev);
 	struct buffer_tracker* buffer_tracker = &xdev->tsn_config.buffer_tracker;
 	u64 tx_count, pop_count;
@@ -442,6 +522,12 @@ static void update_buffer_track(struct pci_dev* pdev) {
 		return;
 	}
 
+	if (now >= buffer_tracker->last_update && now - buffer_tracker->last_update < BUFFER_TRACK_UPDATE_INTERVAL_NS) {
+		// The hardware can't have popped much since the last read, e.g. on retries from a busy queue
+		return;
+	}
+	buffer_tracker->last_update = now;
+
 	tx_count = alinx_get_tx_packets(pdev) + alinx_get_total_tx_drop_packets(pdev);
 	pop_count = tx_count - buffer_tracker->last_tx_count;
 	buffer_tracker->last_tx_count = tx_count;
@@ -501,6 +587,7 @@ int tsn_set_qav(struct pci_dev* pdev, struct tc_cbs_qopt_offload* offload) {
 	config->qav[offload->queue].lo_credit = offload->locredit;
 	config->qav[offload->queue].idle_slope = offload->idleslope;
 	config->qav[offload->queue].send_slope = offload->sendslope;
+	init_qav_state(&config->qav[offload->queue]);
 
 	bake_qos_config(config);
 
@@ -24,6 +24,13 @@ enum tsn_prio {
 	TSN_PRIO_BE = 7,
 };
 
+/* TX queues of the netdev, one per hardware queue priority */
+enum tsn_tx_queue {
+	TSN_TX_QUEUE_GPTP = 0,
+	TSN_TX_QUEUE_VLAN = 1,
+	TSN_TX_QUEUE_BE = 2,
+};
+
 enum tsn_fail_policy {
 	TSN_FAIL_POLICY_DROP = 0,
 	TSN_FAIL_POLICY_RETRY = 1,
@@ -36,8 +43,14 @@ struct tsn_vlan_hdr {
 	uint16_t vid:12;
 } __attribute__((packed, scalar_storage_order("big-endian")));
 
-bool tsn_fill_metadata(struct pci_dev* pdev, timestamp_t now, struct sk_buff* skb);
+struct tx_metadata;
+struct tsn_config;
+
+bool tsn_fill_metadata(struct pci_dev* pdev, timestamp_t now, struct sk_buff* skb, struct tx_metadata* metadata);
 void tsn_init_configs(struct pci_dev* config);
+u16 tsn_select_queue(struct tsn_config* tsn_config, struct sk_buff* skb);
+int tsn_set_link_speed(struct pci_dev* pdev, uint32_t speed);
+uint32_t tsn_get_link_speed(struct pci_dev* pdev);
 
 int tsn_set_mqprio(struct pci_dev* pdev, struct tc_mqprio_qopt_offload* offload);
 int tsn_set_qav(struct pci_dev* pdev, struct tc_cbs_qopt_offload* offload);
@@ -0,0 +1,232 @@
+#ifndef __TSN_SHAPER_H__
+#define __TSN_SHAPER_H__
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+#else
+#include <stdint.h>
+#endif
+
+/* 64 bit divisions, which 32 bit kernels only provide as functions */
+#ifdef __KERNEL__
+#define tsn_div_u64(a, b) div64_u64(a, b)
+#define tsn_div_s64(a, b) div64_s64(a, b)
+#else
+static inline uint64_t tsn_div_u64(uint64_t a, uint64_t b) {
+	return a / b;
+}
+
+static inline int64_t tsn_div_s64(int64_t a, int64_t b) {
+	return a / b;
+}
+#endif
+
+/*
+ * Division by a divisor fixed at configuration time, a multiply by the
+ * reciprocal floor((2^64 - 1) / divisor) instead of a 64 bit division.
+ * The estimated quotient is at most 1 too small, so one correction is enough.
+ */
+struct tsn_recip {
+	uint64_t divisor;
+	uint64_t multiplier;
+};
+
+static inline void tsn_recip_init(struct tsn_recip* recip, uint64_t divisor) {
+	recip->divisor = divisor;
+	recip->multiplier = divisor ? tsn_div_u64((uint64_t)-1, divisor) : 0;
+}
+
+static inline uint64_t tsn_recip_div(const struct tsn_recip* recip, uint64_t x) {
+#ifdef __SIZEOF_INT128__
+	uint64_t q = (uint64_t)(((unsigned __int128)x * recip->multiplier) >> 64);
+
+	return (x - q * recip->divisor >= recip->divisor) ? q + 1 : q;
+#else
+	return tsn_div_u64(x, recip->divisor);
+#endif
+}
+
+static inline uint64_t tsn_recip_mod(const struct tsn_recip* recip, uint64_t x) {
+	return x - tsn_recip_div(recip, x) * recip->divisor;
+}
+
+/*
+ * Fixed point credit based shaper (Qav) and time aware shaper (Qbv)
+ * calculations, shared by the driver (tsn.c) and the sample application.
+ * No floating point and no allocation, the per frame functions only
+ * multiply, add and clamp. Divisions are done at configuration time, or
+ * by a reciprocal computed then (struct tsn_recip).
+ *
+ * Credits keep TSN_CBS_FRAC_BITS fraction bits, the slopes are given per
+ * slope_ns nanoseconds (1 for credits/ns, 1000000000 for credits/s) and
+ * converted once to fixed point credits per ns. Credits and slopes are
+ * limited to +/-TSN_CBS_CREDIT_MAX so that no product overflows 64 bits.
+ */
+#define TSN_CBS_FRAC_BITS 36
+#define TSN_CBS_ONE ((int64_t)1 << TSN_CBS_FRAC_BITS)
+#define TSN_CBS_CREDIT_MAX ((int64_t)1 << 24)
+
+struct tsn_cbs {
+	int64_t credit;		/* at last_update */
+	int64_t hi_credit;
+	int64_t lo_credit;
+	int64_t idle_rate;	/* credits/ns, > 0 */
+	int64_t send_rate;	/* credits/ns, < 0 */
+	uint64_t idle_cap_ns;	/* idling longer than this saturates at hi_credit */
+	uint64_t send_cap_ns;	/* sending longer than this saturates at lo_credit */
+	struct tsn_recip idle_recip;	/* of idle_rate */
+	uint64_t last_update;
+	uint64_t available_at;	/* credit >= 0 from then on */
+};
+
+static inline int64_t tsn_min64(int64_t a, int64_t b) {
+	return a < b ? a : b;
+}
+
+static inline int64_t tsn_max64(int64_t a, int64_t b) {
+	return a > b ? a : b;
+}
+
+static inline uint64_t tsn_umin64(uint64_t a, uint64_t b) {
+	return a < b ? a : b;
+}
+
+static inline void tsn_cbs_init(struct tsn_cbs* cbs, int64_t idle_slope, int64_t send_slope,
+				int64_t hi_credit, int64_t lo_credit, uint64_t slope_ns, uint64_t now) {
+	int64_t range;
+
+	hi_credit = tsn_max64(tsn_min64(hi_credit, TSN_CBS_CREDIT_MAX), -TSN_CBS_CREDIT_MAX);
+	lo_credit = tsn_max64(tsn_min64(lo_credit, TSN_CBS_CREDIT_MAX), -TSN_CBS_CREDIT_MAX);
+	idle_slope = tsn_max64(tsn_min64(idle_slope, TSN_CBS_CREDIT_MAX), -TSN_CBS_CREDIT_MAX);
+	send_slope = tsn_max64(tsn_min64(send_slope, TSN_CBS_CREDIT_MAX), -TSN_CBS_CREDIT_MAX);
+	cbs->hi_credit = hi_credit * TSN_CBS_ONE;
+	cbs->lo_credit = lo_credit * TSN_CBS_ONE;
+	/* Rounded to nearest, 10 credits/s is still within 0.1% */
+	cbs->idle_rate = tsn_max64(tsn_div_s64(idle_slope * TSN_CBS_ONE + (int64_t)(slope_ns / 2), (int64_t)slope_ns), 1);
+	cbs->send_rate = tsn_min64(tsn_div_s64(send_slope * TSN_CBS_ONE - (int64_t)(slope_ns / 2), (int64_t)slope_ns), -1);
+	tsn_recip_init(&cbs->idle_recip, cbs->idle_rate);
+
+	/* Bounds the products below, the clamps make longer times pointless */
+	range = tsn_max64(cbs->hi_credit - cbs->lo_credit, 0);
+	cbs->idle_cap_ns = tsn_div_s64(range, cbs->idle_rate) + 1;
+	cbs->send_cap_ns = tsn_div_s64(range, -cbs->send_rate) + 1;
+
+	cbs->credit = 0;
+	cbs->last_update = now;
+	cbs->available_at = now;
+}
+
+/* Credit at time at, idling since the last update */
+static inline int64_t tsn_cbs_credit_at(const struct tsn_cbs* cbs, uint64_t at) {
+	uint64_t idle = (at > cbs->last_update) ? at - cbs->last_update : 0;
+
+	idle = tsn_umin64(idle, cbs->idle_cap_ns);
+	return tsn_min64(cbs->credit + (int64_t)idle * cbs->idle_rate, tsn_max64(cbs->credit, cbs->hi_credit));
+}
+
+/* Idle time needed to bring credit back to 0 */
+static inline uint64_t tsn_cbs_recover_ns(const struct tsn_cbs* cbs, int64_t credit) {
+	int64_t deficit = tsn_max64(-credit, 0);
+
+	return tsn_recip_div(&cbs->idle_recip, deficit + cbs->idle_rate - 1);
+}
+
+/* Send for duration_ns from at, at must not be before available_at */
+static inline void tsn_cbs_spend(struct tsn_cbs* cbs, uint64_t at, uint64_t duration_ns) {
+	int64_t credit = tsn_cbs_credit_at(cbs, at);
+
+	credit += (int64_t)tsn_umin64(duration_ns, cbs->send_cap_ns) * cbs->send_rate;
+	cbs->credit = tsn_max64(credit, cbs->lo_credit);
+	cbs->last_update = at + duration_ns;
+	cbs->available_at = cbs->last_update + tsn_cbs_recover_ns(cbs, cbs->credit);
+}
+
+/* Integer part of the credit at time at */
+static inline int64_t tsn_cbs_credit_int(const struct tsn_cbs* cbs, uint64_t at) {
+	return tsn_cbs_credit_at(cbs, at) >> TSN_CBS_FRAC_BITS;
+}
+
+/*
+ * Wire time of a frame: padded to the minimum Ethernet frame and followed
+ * by preamble, SFD and IFG (gap_bytes), at ps_per_byte picoseconds a byte.
+ */
+#define TSN_PS_IN_1NS 1000
+
+static inline uint32_t tsn_ps_per_byte(uint32_t speed_mbps) {
+	return 8000000 / speed_mbps;
+}
+
+static inline uint64_t tsn_bytes_to_ns(uint64_t bytes, uint64_t min_bytes, uint64_t gap_bytes,
+				       uint32_t ps_per_byte) {
+	uint64_t wire_bytes = ((bytes > min_bytes) ? bytes : min_bytes) + gap_bytes;
+
+	wire_bytes = wire_bytes * ps_per_byte + TSN_PS_IN_1NS - 1;
+#ifdef __KERNEL__
+	return div_u64(wire_bytes, TSN_PS_IN_1NS);
+#else
+	return wire_bytes / TSN_PS_IN_1NS;
+#endif
+}
+
+/*
+ * Qbv: position of t in a cycle starting at start, and the slot holding an
+ * offset given the start offsets of the slots (slot_start[0] == 0).
+ */
+static inline uint64_t tsn_tas_cycle_offset(uint64_t t, uint64_t start, const struct tsn_recip* cycle) {
+	return tsn_recip_mod(cycle, t - start);
+}
+
+/*
+ * Same with a cursor on the start of the cycle of the previous call, frames
+ * mostly fall into that cycle or the next one. cycle_base starts at start.
+ */
+static inline uint64_t tsn_tas_cursor_offset(uint64_t* cycle_base, uint64_t t, uint64_t start,
+					     const struct tsn_recip* cycle) {
+	uint64_t offset = t - *cycle_base;
+
+	if (t >= *cycle_base && offset < cycle->divisor) {
+		return offset;
+	}
+	if (t >= *cycle_base && offset - cycle->divisor < cycle->divisor) {
+		*cycle_base += cycle->divisor;
+		return offset - cycle->divisor;
+	}
+
+	offset = tsn_tas_cycle_offset(t, start, cycle);
+	*cycle_base = t - offset;
+	return offset;
+}
+
+static inline int tsn_tas_find_slot(const uint64_t* slot_start, int count, uint64_t offset) {
+	const uint64_t* base = slot_start;
+	int n = count;
+
+	/* Binary search without a data dependent branch */
+	while (n > 1) {
+		int half = n / 2;
+		base = (base[half] <= offset) ? base + half : base;
+		n -= half;
+	}
+
+	return base - slot_start;
+}
+
+/*
+ * Same, trying the slot of the previous call and the one after it first.
+ * slot_start[count] must hold the cycle time.
+ */
+static inline int tsn_tas_find_slot_from(const uint64_t* slot_start, int count, uint64_t offset, int hint) {
+	if (hint < count && slot_start[hint] <= offset) {
+		if (offset < slot_start[hint + 1]) {
+			return hint;
+		}
+		if (hint + 1 < count && offset < slot_start[hint + 2]) {
+			return hint + 1;
+		}
+	}
+
+	return tsn_tas_find_slot(slot_start, count, offset);
+}
+
+#endif /* __TSN_SHAPER_H__ */
@@ -20,6 +20,7 @@
 #define pr_fmt(fmt)     KBUILD_MODNAME ":%s: " fmt, __func__
 
 #include "xdma_cdev.h"
+#include "xdma_thread.h"
 
 static struct class *g_xdma_class;
 
@@ -91,6 +92,29 @@ ssize_t xdma_dev_instance_show(struct device *dev,
 static DEVICE_ATTR_RO(xdma_dev_instance);
 #endif
 
+/* Interrupt/poll mode of each engine, see adaptive_poll in libxdma.c */
+static ssize_t xdma_adaptive_poll_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct xdma_pci_dev *xpdev =
+		(struct xdma_pci_dev *)dev_get_drvdata(dev);
+
+	return xdma_adaptive_show(xpdev->xdev, buf, PAGE_SIZE);
+}
+
+static DEVICE_ATTR_RO(xdma_adaptive_poll);
+
+/* Placement and load of the poll_mode completion threads */
+static ssize_t xdma_cmpl_threads_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	return xdma_threads_show(buf, PAGE_SIZE);
+}
+
+static DEVICE_ATTR_RO(xdma_cmpl_threads);
+
 static int config_kobject(struct xdma_cdev *xcdev, enum cdev_type type)
 {
 	int rv = -EINVAL;
@@ -287,6 +311,9 @@ static int create_xcdev(struct xdma_pci_dev *xpdev, struct xdma_cdev *xcdev,
 	dev_t dev;
 
 	spin_lock_init(&xcdev->lock);
+	mutex_init(&xcdev->reg_lock);
+	mutex_init(&xcdev->ring_lock);
+	mutex_init(&xcdev->stream_lock);
 	/* new instance? */
 	if (!xpdev->major) {
 		/* allocate a dynamically allocated char device node */
@@ -389,6 +416,8 @@ void xpdev_destroy_interfaces(struct xdma_pci_dev *xpdev)
 #ifdef __XDMA_SYSFS__
 	device_remove_file(&xpdev->pdev->dev, &dev_attr_xdma_dev_instance);
 #endif
+	device_remove_file(&xpdev->pdev->dev, &dev_attr_xdma_adaptive_poll);
+	device_remove_file(&xpdev->pdev->dev, &dev_attr_xdma_cmpl_threads);
 
 	if (xpdev_flag_test(xpdev, XDF_CDEV_SG)) {
 		/* iterate over channels */
@@ -593,6 +622,20 @@ int xpdev_create_interfaces(struct xdma_pci_dev *xpdev)
 	}
 #endif
 
+	rv = device_create_file(&xpdev->pdev->dev,
+				&dev_attr_xdma_adaptive_poll);
+	if (rv) {
+		pr_err("Failed to create adaptive poll file\n");
+		goto fail;
+	}
+
+	rv = device_create_file(&xpdev->pdev->dev,
+				&dev_attr_xdma_cmpl_threads);
+	if (rv) {
+		pr_err("Failed to create cmpl threads file\n");
+		goto fail;
+	}
+
 	return 0;
 
 fail:
@@ -224,6 +224,8 @@ static const struct net_device_ops xdma_netdev_ops = {
 	.ndo_open = xdma_netdev_open,
 	.ndo_stop = xdma_netdev_close,
 	.ndo_start_xmit = xdma_netdev_start_xmit,
+	.ndo_select_queue = xdma_netdev_select_queue,
+	.ndo_get_stats64 = xdma_netdev_get_stats64,
 	.ndo_setup_tc = xdma_netdev_setup_tc,
 	.ndo_eth_ioctl = xdma_netdev_ioctl,
 };
@@ -252,8 +254,47 @@ static int xdma_ethtool_get_ts_info(struct net_device * ndev, struct ethtool_ts_
 	return 0;
 }
 
+/*
+ * The PHY is not visible to the driver, so the link speed is whatever the
+ * TSN scheduler is configured for (link_speed module parameter or ethtool -s)
+ */
+static int xdma_ethtool_get_link_ksettings(struct net_device *ndev, struct ethtool_link_ksettings *cmd) {
+	struct xdma_private *priv = netdev_priv(ndev);
+
+	ethtool_link_ksettings_zero_link_mode(cmd, supported);
+	ethtool_link_ksettings_zero_link_mode(cmd, advertising);
+	cmd->base.speed = tsn_get_link_speed(priv->pdev);
+	cmd->base.duplex = DUPLEX_FULL;
+	cmd->base.autoneg = AUTONEG_DISABLE;
+	cmd->base.port = PORT_OTHER;
+
+	return 0;
+}
+
+static int xdma_ethtool_set_link_ksettings(struct net_device *ndev, const struct ethtool_link_ksettings *cmd) {
+	struct xdma_private *priv = netdev_priv(ndev);
+	unsigned long flags;
+	int ret;
+
+	if (cmd->base.autoneg == AUTONEG_ENABLE || cmd->base.duplex != DUPLEX_FULL) {
+		return -EINVAL;
+	}
+
+	/* tsn_config is used by the Tx path */
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	ret = tsn_set_link_speed(priv->pdev, cmd->base.speed);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	return ret;
+}
+
 static const struct ethtool_ops xdma_ethtool_ops = {
 	.get_ts_info = xdma_ethtool_get_ts_info,
+	.get_link_ksettings = xdma_ethtool_get_link_ksettings,
+	.set_link_ksettings = xdma_ethtool_set_link_ksettings,
+	.get_sset_count = xdma_ethtool_get_sset_count,
+	.get_strings = xdma_ethtool_get_strings,
+	.get_ethtool_stats = xdma_ethtool_get_stats,
 };
 
 static int probe_one(struct pci_dev *pdev, const struct pci_device_id *id)
@@ -370,6 +411,9 @@ static int probe_one(struct pci_dev *pdev, const struct pci_device_id *id)
 	/* Set up the network interface */
 	ndev->netdev_ops = &xdma_netdev_ops;
 	ndev->ethtool_ops = &xdma_ethtool_ops;
+	/* Fragments are chained as extra descriptors, see xdma_tx_ring_map_skb() */
+	ndev->features |= NETIF_F_SG;
+	ndev->hw_features |= NETIF_F_SG;
 	SET_NETDEV_DEV(ndev, &pdev->dev);
 	priv = netdev_priv(ndev);
 	memset(priv, 0, sizeof(struct xdma_private));
@@ -379,67 +423,40 @@ static int probe_one(struct pci_dev *pdev, const struct pci_device_id *id)
 	priv->rx_engine = &xdev->engine_c2h[0];
 	priv->tx_engine = &xdev->engine_h2c[0];
 
-	priv->tx_desc = dma_alloc_coherent(
-				&pdev->dev,
-				sizeof(struct xdma_desc),
-				&priv->tx_bus_addr,
-				GFP_KERNEL);
-	if (!priv->tx_desc) {
-		pr_err("dma_alloc_coherent failed\n");
+	rv = xdma_tx_ring_alloc(priv);
+	if (rv) {
 		free_netdev(ndev);
-		rv = -ENOMEM;
 		goto err_out;
 	}
 
-	priv->rx_desc = dma_alloc_coherent(
-				&pdev->dev,
-				sizeof(struct xdma_desc),
-				&priv->rx_bus_addr,
-				GFP_KERNEL);
-	if (!priv->rx_desc) {
-		pr_err("dma_alloc_coherent failed\n");
+	rv = xdma_rx_ring_alloc(priv);
+	if (rv) {
+		xdma_tx_ring_free(priv);
 		free_netdev(ndev);
-		rv = -ENOMEM;
 		goto err_out;
 	}
 
-	priv->res = kmalloc(sizeof(struct xdma_result), GFP_KERNEL);
-	if (!priv->res) {
-		pr_err("res kmalloc failed\n");
-		free_netdev(ndev);
-		rv = -ENOMEM;
-		goto err_out;
-	}
+#if KERNEL_VERSION(6, 1, 0) <= LINUX_VERSION_CODE
+	netif_napi_add_weight(ndev, &priv->napi, xdma_netdev_poll, XDMA_NAPI_WEIGHT);
+#else
+	netif_napi_add(ndev, &priv->napi, xdma_netdev_poll, XDMA_NAPI_WEIGHT);
+#endif
 
 	spin_lock_init(&priv->tx_lock);
-	spin_lock_init(&priv->rx_lock);
+	xdma_stats_init(priv);
 
 	/* Set the MAC address */
 	get_mac_address(mac_addr, xdev);
 	memcpy(ndev->dev_addr, mac_addr, ETH_ALEN);
 
-	priv->rx_buffer = kmalloc(XDMA_BUFFER_SIZE, GFP_KERNEL);
-	if (!priv->rx_buffer) {
-		pr_err("Rx_buffer kmalloc failed\n");
-		free_netdev(ndev);
-		rv = -ENOMEM;
-		goto err_out;
-	}
-
-	priv->rx_dma_addr = dma_map_single(&pdev->dev, priv->rx_buffer, XDMA_BUFFER_SIZE, DMA_FROM_DEVICE);
-	if (unlikely(dma_mapping_error(&pdev->dev, priv->rx_dma_addr))) {
-		pr_err("dma_map_single failed\n");
-		kfree(priv->rx_buffer);
-		free_netdev(ndev);
-		rv = -ENOMEM;
-		goto err_out;
-	}
-
-	/* Tx works for each timestamp id */
-	INIT_WORK(&priv->tx_work[1], xdma_tx_work1);
-	INIT_WORK(&priv->tx_work[2], xdma_tx_work2);
-	INIT_WORK(&priv->tx_work[3], xdma_tx_work3);
-	INIT_WORK(&priv->tx_work[4], xdma_tx_work4);
+	/* A single timer serves all pending Tx timestamps */
+	spin_lock_init(&priv->tstamp_lock);
+#if KERNEL_VERSION(6, 15, 0) <= LINUX_VERSION_CODE
+	hrtimer_setup(&priv->tstamp_timer, xdma_tstamp_poll, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+	hrtimer_init(&priv->tstamp_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	priv->tstamp_timer.function = xdma_tstamp_poll;
+#endif
 
 	ptp_data = ptp_device_init(&pdev->dev, xdev);
 	if (!ptp_data) {
@@ -451,11 +468,14 @@ static int probe_one(struct pci_dev *pdev, const struct pci_device_id *id)
 
 	ptp_data->xdev = xpdev->xdev;
 	xpdev->ptp = ptp_data;
+	alinx_ptp_bench(pdev);
 
 	rv = register_netdev(ndev);
 	if (rv < 0) {
+		netif_napi_del(&priv->napi);
+		xdma_tx_ring_free(priv);
+		xdma_rx_ring_free(priv);
 		free_netdev(ndev);
-		kfree(priv->rx_buffer);
 		pr_err("register_netdev failed\n");
 		goto err_out;
 	}
@@ -495,11 +515,10 @@ static void remove_one(struct pci_dev *pdev)
 	priv = netdev_priv(ndev);
 	xdev = xpdev->xdev;
 	ptp_data = xpdev->ptp;
-	dma_free_coherent(&pdev->dev, sizeof(struct xdma_desc), priv->tx_desc, priv->tx_bus_addr);
-	dma_free_coherent(&pdev->dev, sizeof(struct xdma_desc), priv->rx_desc, priv->rx_bus_addr);
-	kfree(priv->rx_buffer);
-	kfree(priv->res);
 	unregister_netdev(ndev);
+	netif_napi_del(&priv->napi);
+	xdma_tx_ring_free(priv);
+	xdma_rx_ring_free(priv);
 	ptp_device_destroy(ptp_data);
 	free_netdev(ndev);
 	xpdev_free(xpdev);
@@ -45,8 +45,11 @@
 #include <linux/version.h>
 #include <linux/uio.h>
 #include <linux/spinlock_types.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
 
 #include "libxdma.h"
+#include "cdev_sgdma_part.h"
 #include "xdma_thread.h"
 #include "alinx_ptp.h"
 
@@ -66,6 +69,77 @@ extern unsigned int desc_blen_max;
 extern unsigned int h2c_timeout;
 extern unsigned int c2h_timeout;
 
+/* Descriptor sets kept per registered region */
+#define XDMA_DESC_SET_CACHE	4
+
+/* Descriptor set of a burst, found again by the offset and length of its buffers */
+struct xdma_desc_set_entry {
+	struct xdma_desc_set *set;
+	struct xdma_registered_buffer_descriptor *bd;
+	dma_addr_t *addrs;		/* of each buffer, to sync them */
+	unsigned int bd_num;
+	unsigned int users;		/* bursts submitting it, not evicted */
+	u32 hash;
+	u64 last_use;
+};
+
+/* User region pinned and DMA mapped by IOCTL_XDMA_REGISTER_BUFFERS */
+struct xdma_registered_buffer {
+	struct file *owner;		/* released when this file is closed */
+	struct kref ref;		/* of reg_bufs[] and of each burst */
+	struct completion idle;		/* the last reference was put */
+	unsigned long buffer;
+	unsigned long len;
+	unsigned int pages_nr;
+	struct page **pages;
+	dma_addr_t *dma_addrs;
+	struct xdma_desc_set_entry desc_sets[XDMA_DESC_SET_CACHE];
+	u64 desc_set_clock;
+	u64 desc_set_hits;
+	u64 desc_set_misses;
+};
+
+/* Per request state of an asynchronous ring */
+struct xdma_ring_slot {
+	struct xdma_ring *ring;
+	struct xdma_io_cb cb;
+	struct scatterlist sg;
+	struct sg_table sgt;
+	dma_addr_t addr;
+	u64 user_data;
+	u32 len;
+	bool done;
+};
+
+/* Submission/completion rings set up by IOCTL_XDMA_RING_SETUP */
+struct xdma_ring {
+	struct file *owner;		/* destroyed when this file is closed */
+	struct xdma_cdev *xcdev;
+	struct xdma_registered_buffer *reg;
+	struct xdma_ring_header *hdr;	/* start of the mapping */
+	struct xdma_ring_sqe *sqes;
+	struct xdma_ring_cqe *cqes;
+	size_t mem_size;
+	u32 sq_entries;
+	u32 cq_entries;
+	u32 sq_head;			/* only trusted copies, the */
+	u32 cq_tail;			/* application can write hdr */
+	spinlock_t cq_lock;		/* protects cq_tail, inflight and free slots */
+	u32 inflight;
+	u32 free_nr;
+	u32 *free_slots;
+	struct xdma_ring_slot *slots;
+	wait_queue_head_t wq;
+	struct eventfd_ctx *eventfd;
+};
+
+/* Cyclic C2H stream set up by IOCTL_XDMA_STREAM_START */
+struct xdma_stream {
+	struct file *owner;		/* stopped when this file is closed */
+	struct xdma_cyclic_ring ring;
+	unsigned int timeout_ms;
+};
+
 struct xdma_cdev {
 	unsigned long magic;		/* structure ID for sanity checks */
 	struct xdma_pci_dev *xpdev;
@@ -78,6 +152,12 @@ struct xdma_cdev {
 	struct xdma_user_irq *user_irq;	/* IRQ value, if needed */
 	struct device *sys_device;	/* sysfs device */
 	spinlock_t lock;
+	struct mutex reg_lock;		/* protects reg_bufs and their desc_sets */
+	struct xdma_registered_buffer *reg_bufs[MAX_REGISTERED_BUFFERS];
+	struct mutex ring_lock;		/* with reg_lock, protects ring */
+	struct xdma_ring *ring;
+	struct mutex stream_lock;	/* protects stream, held by its readers */
+	struct xdma_stream *stream;
 };
 
 /* XDMA PCIe device specific book-keeping */
@@ -2,6 +2,7 @@
 #include <net/pkt_cls.h>
 #include <net/flow_offload.h>
 #include <linux/skbuff.h>
+#include <linux/ptp_classify.h>
 
 #include "xdma_netdev.h"
 #include "xdma_mod.h"
@@ -9,77 +10,1003 @@
 #include "libxdma.h"
 #include "tsn.h"
 #include "alinx_arch.h"
+#include "alinx_ptp.h"
 
 #define LOWER_29_BITS ((1ULL << 29) - 1)
 #define TX_WORK_OVERFLOW_MARGIN 100
 
-static void tx_desc_set(struct xdma_desc *desc, dma_addr_t addr, u32 len)
-{
-        u32 control_field;
-        u32 control;
+static unsigned int tx_ring_size = XDMA_TX_RING_SIZE_DEFAULT;
+module_param(tx_ring_size, uint, 0444);
+MODULE_PARM_DESC(tx_ring_size, "Number of TX descriptors, power of 2 (2 - one frame in flight)");
+
+static unsigned int rx_ring_size = XDMA_RX_RING_SIZE_DEFAULT;
+module_param(rx_ring_size, uint, 0444);
+MODULE_PARM_DESC(rx_ring_size, "Number of pre-posted RX descriptors, power of 2");
 
-        desc->control = cpu_to_le32(DESC_MAGIC);
-        control_field = XDMA_DESC_STOPPED;
-        control_field |= XDMA_DESC_EOP;
-        control_field |= XDMA_DESC_COMPLETED;
-        control = le32_to_cpu(desc->control & ~(LS_BYTE_MASK));
-        control |= control_field;
-        desc->control = cpu_to_le32(control);
+static bool rx_cyclic;
+module_param(rx_cyclic, bool, 0444);
+MODULE_PARM_DESC(rx_cyclic, "Run the C2H engine over a fixed ring of rx_ring_size buffers without restarts, frames are copied out");
 
+/*
+ * Only the last descriptor of a frame gets XDMA_DESC_EOP, and only the
+ * last descriptor of a chain handed to the engine gets
+ * XDMA_DESC_STOPPED | XDMA_DESC_COMPLETED, see xdma_tx_ring_kick()
+ */
+static void tx_desc_set(struct xdma_desc *desc, dma_addr_t addr, u32 len, bool eop)
+{
+        desc->control = cpu_to_le32(DESC_MAGIC | (eop ? XDMA_DESC_EOP : 0));
         desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(addr));
         desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(addr));
         desc->bytes = cpu_to_le32(len);
 }
 
-void rx_desc_set(struct xdma_desc *desc, dma_addr_t addr, u32 len)
+static inline u32 xdma_tx_ring_used(const struct xdma_tx_ring *ring)
+{
+        return ring->head - ring->tail;
+}
+
+static inline u32 xdma_tx_ring_free_slots(const struct xdma_tx_ring *ring)
+{
+        return ring->size - xdma_tx_ring_used(ring);
+}
+
+/* A TX queue is stopped once fewer slots than this are free */
+static inline u32 xdma_tx_queue_stop_threshold(const struct xdma_tx_ring *ring, u16 queue)
+{
+        if (queue == TSN_TX_QUEUE_BE)
+                return ring->max_desc + XDMA_TX_RING_TSN_RESERVE(ring);
+        return ring->max_desc;
+}
+
+/* and woken again once this many slots are free */
+static inline u32 xdma_tx_queue_wake_threshold(const struct xdma_tx_ring *ring, u16 queue)
+{
+        return min(ring->size, xdma_tx_queue_stop_threshold(ring, queue) + ring->size / 8);
+}
+
+static inline void xdma_tx_stats_inc(struct xdma_tx_queue_stats *stats, u64 *counter)
+{
+        u64_stats_update_begin(&stats->syncp);
+        (*counter)++;
+        u64_stats_update_end(&stats->syncp);
+}
+
+/* The error paths before the ring is touched run without tx_lock */
+static void xdma_tx_stats_drop(struct xdma_private *priv, struct xdma_tx_queue_stats *stats)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&priv->tx_lock, flags);
+        xdma_tx_stats_inc(stats, &stats->dropped);
+        spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+/* Must be called with tx_lock held */
+static void xdma_tx_queues_update(struct xdma_private *priv)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        struct netdev_queue *txq;
+        u32 free = xdma_tx_ring_free_slots(ring);
+        u16 queue;
+
+        for (queue = 0; queue < priv->ndev->real_num_tx_queues; queue++) {
+                txq = netdev_get_tx_queue(priv->ndev, queue);
+                if (netif_tx_queue_stopped(txq)) {
+                        if (netif_running(priv->ndev) &&
+                            free >= xdma_tx_queue_wake_threshold(ring, queue))
+                                netif_tx_wake_queue(txq);
+                } else if (free < xdma_tx_queue_stop_threshold(ring, queue)) {
+                        netif_tx_stop_queue(txq);
+                        xdma_tx_stats_inc(&priv->tx_stats[queue], &priv->tx_stats[queue].stopped);
+                }
+        }
+}
+
+int xdma_tx_ring_alloc(struct xdma_private *priv)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        struct device *dev = &priv->pdev->dev;
+        dma_addr_t next;
+        u32 i;
+
+        ring->size = clamp_t(u32, tx_ring_size, XDMA_TX_RING_SIZE_MIN, XDMA_TX_RING_SIZE_MAX);
+        ring->size = roundup_pow_of_two(ring->size);
+        /* Frames with more fragments than this get linearized */
+        ring->max_desc = min_t(u32, ring->size, XDMA_TX_DESC_PER_FRAME_MAX);
+
+        ring->desc = dma_alloc_coherent(dev, ring->size * sizeof(struct xdma_desc),
+                                        &ring->desc_bus, GFP_KERNEL);
+        ring->meta = dma_alloc_coherent(dev, ring->size * sizeof(struct tx_metadata),
+                                        &ring->meta_bus, GFP_KERNEL);
+        ring->slots = kcalloc(ring->size, sizeof(struct xdma_tx_slot), GFP_KERNEL);
+        if (!ring->desc || !ring->meta || !ring->slots) {
+                pr_err("tx ring allocation failed\n");
+                xdma_tx_ring_free(priv);
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < ring->size; i++) {
+                next = ring->desc_bus + ((i + 1) & (ring->size - 1)) * sizeof(struct xdma_desc);
+                ring->desc[i].next_lo = cpu_to_le32(PCI_DMA_L(next));
+                ring->desc[i].next_hi = cpu_to_le32(PCI_DMA_H(next));
+        }
+
+        ring->head = 0;
+        ring->hw_head = 0;
+        ring->tail = 0;
+        ring->busy = false;
+
+        pr_info("tx ring: %u descriptors\n", ring->size);
+
+        return 0;
+}
+
+static void xdma_tx_slot_unmap(struct xdma_private *priv, struct xdma_tx_slot *slot)
+{
+        switch (slot->type) {
+        case XDMA_TX_SLOT_SINGLE:
+                dma_unmap_single(&priv->pdev->dev, slot->dma_addr, slot->len, DMA_TO_DEVICE);
+                break;
+        case XDMA_TX_SLOT_PAGE:
+                dma_unmap_page(&priv->pdev->dev, slot->dma_addr, slot->len, DMA_TO_DEVICE);
+                break;
+        default:
+                /* The metadata lives in the coherent area of the ring */
+                break;
+        }
+        slot->type = XDMA_TX_SLOT_METADATA;
+}
+
+static void xdma_tx_slot_release(struct xdma_private *priv, struct xdma_tx_slot *slot)
+{
+        xdma_tx_slot_unmap(priv, slot);
+        if (slot->skb) {
+                dev_kfree_skb_any(slot->skb);
+                slot->skb = NULL;
+        }
+}
+
+/* Must be called with the engine stopped */
+static void xdma_tx_ring_drain(struct xdma_private *priv)
 {
-        u32 control_field;
-        u32 control;
+        struct xdma_tx_ring *ring = &priv->tx_ring;
 
-        desc->control = cpu_to_le32(DESC_MAGIC);
-        control_field = XDMA_DESC_STOPPED;
-        control_field |= XDMA_DESC_EOP;
-        control_field |= XDMA_DESC_COMPLETED;
-        control = le32_to_cpu(desc->control & ~(LS_BYTE_MASK));
-        control |= control_field;
-        desc->control = cpu_to_le32(control);
+        while (ring->tail != ring->head) {
+                xdma_tx_slot_release(priv, &ring->slots[ring->tail & (ring->size - 1)]);
+                ring->tail++;
+        }
+        ring->hw_head = ring->head;
+        ring->busy = false;
+}
+
+void xdma_tx_ring_free(struct xdma_private *priv)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        struct device *dev = &priv->pdev->dev;
 
+        if (ring->slots)
+                xdma_tx_ring_drain(priv);
+        kfree(ring->slots);
+        if (ring->meta)
+                dma_free_coherent(dev, ring->size * sizeof(struct tx_metadata), ring->meta, ring->meta_bus);
+        if (ring->desc)
+                dma_free_coherent(dev, ring->size * sizeof(struct xdma_desc), ring->desc, ring->desc_bus);
+        ring->slots = NULL;
+        ring->meta = NULL;
+        ring->desc = NULL;
+}
+
+/*
+ * Map the linear part and the page fragments of a frame behind its
+ * metadata descriptor. Nothing is left mapped on failure.
+ * Must be called with tx_lock held.
+ */
+static int xdma_tx_ring_map_skb(struct xdma_private *priv, struct sk_buff *skb)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        struct device *dev = &priv->pdev->dev;
+        struct xdma_tx_slot *slot;
+        const skb_frag_t *frag;
+        u32 index = ring->head + 1;
+        u32 nr_frags = skb_shinfo(skb)->nr_frags;
+        dma_addr_t dma_addr;
+        u32 i, len;
+
+        len = skb_headlen(skb);
+        dma_addr = dma_map_single(dev, skb->data, len, DMA_TO_DEVICE);
+        if (unlikely(dma_mapping_error(dev, dma_addr)))
+                return -ENOMEM;
+
+        slot = &ring->slots[index & (ring->size - 1)];
+        slot->type = XDMA_TX_SLOT_SINGLE;
+        slot->dma_addr = dma_addr;
+        slot->len = len;
+        tx_desc_set(&ring->desc[index & (ring->size - 1)], dma_addr, len, nr_frags == 0);
+        index++;
+
+        for (i = 0; i < nr_frags; i++) {
+                frag = &skb_shinfo(skb)->frags[i];
+                len = skb_frag_size(frag);
+                dma_addr = skb_frag_dma_map(dev, frag, 0, len, DMA_TO_DEVICE);
+                if (unlikely(dma_mapping_error(dev, dma_addr)))
+                        goto err_unmap;
+
+                slot = &ring->slots[index & (ring->size - 1)];
+                slot->type = XDMA_TX_SLOT_PAGE;
+                slot->dma_addr = dma_addr;
+                slot->len = len;
+                tx_desc_set(&ring->desc[index & (ring->size - 1)], dma_addr, len, i == nr_frags - 1);
+                index++;
+        }
+
+        return 0;
+
+err_unmap:
+        while (--index != ring->head)
+                xdma_tx_slot_unmap(priv, &ring->slots[index & (ring->size - 1)]);
+        return -ENOMEM;
+}
+
+/* Undo xdma_tx_ring_map_skb() of a frame that is not queued after all */
+static void xdma_tx_ring_unmap_skb(struct xdma_private *priv, struct sk_buff *skb)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        u32 index;
+
+        for (index = ring->head + 1; index != ring->head + skb_shinfo(skb)->nr_frags + 2; index++)
+                xdma_tx_slot_unmap(priv, &ring->slots[index & (ring->size - 1)]);
+}
+
+/*
+ * Hand every filled but not yet submitted descriptor to the engine as
+ * one chain. The engine can't be extended while it is running, so the
+ * frames queued meanwhile are submitted by xdma_tx_ring_clean().
+ * Must be called with tx_lock held.
+ */
+static void xdma_tx_ring_kick(struct xdma_private *priv)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        struct xdma_dev *xdev = priv->xdev;
+        struct xdma_desc *last;
+        dma_addr_t first;
+        u32 w;
+
+        if (ring->busy || ring->hw_head == ring->head)
+                return;
+
+        first = ring->desc_bus + (ring->hw_head & (ring->size - 1)) * sizeof(struct xdma_desc);
+        last = &ring->desc[(ring->head - 1) & (ring->size - 1)];
+        last->control |= cpu_to_le32(XDMA_DESC_STOPPED | XDMA_DESC_COMPLETED);
+
+        /* Descriptors must be visible before the engine fetches them */
+        wmb();
+
+        w = cpu_to_le32(PCI_DMA_L(first));
+        iowrite32(w, xdev->bar[1] + DESC_REG_LO);
+
+        w = cpu_to_le32(PCI_DMA_H(first));
+        iowrite32(w, xdev->bar[1] + DESC_REG_HI);
+        iowrite32(0, xdev->bar[1] + DESC_REG_HI + 4);
+
+        iowrite32(DMA_ENGINE_START, &priv->tx_engine->regs->control);
+
+        ring->hw_head = ring->head;
+        ring->busy = true;
+}
+
+void xdma_tx_ring_clean(struct xdma_private *priv)
+{
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        unsigned long flags;
+        u32 completed, in_hw;
+
+        spin_lock_irqsave(&priv->tx_lock, flags);
+
+        in_hw = ring->hw_head - ring->tail;
+        /* The counter restarts from 0 on every rising edge of the run bit */
+        completed = ioread32(&priv->tx_engine->regs->completed_desc_count);
+        completed = min(completed, in_hw);
+
+        while (completed--) {
+                xdma_tx_slot_release(priv, &ring->slots[ring->tail & (ring->size - 1)]);
+                ring->tail++;
+        }
+
+        if (ring->tail == ring->hw_head) {
+                /* The whole chain is done */
+                iowrite32(DMA_ENGINE_STOP, &priv->tx_engine->regs->control);
+                ring->busy = false;
+                xdma_tx_ring_kick(priv);
+        }
+
+        xdma_tx_queues_update(priv);
+
+        spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+/*
+ * In AXI-ST C2H mode the source address carries the bus address of
+ * the writeback result of the descriptor
+ */
+static void rx_desc_set(struct xdma_desc *desc, dma_addr_t res_addr, dma_addr_t addr, u32 len)
+{
+        desc->control = cpu_to_le32(DESC_MAGIC | XDMA_DESC_EOP | XDMA_DESC_COMPLETED);
+        desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(res_addr));
+        desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(res_addr));
         desc->dst_addr_lo = cpu_to_le32(PCI_DMA_L(addr));
         desc->dst_addr_hi = cpu_to_le32(PCI_DMA_H(addr));
         desc->bytes = cpu_to_le32(len);
 }
 
+static inline bool xdma_rx_cyclic(const struct xdma_private *priv)
+{
+        return priv->rx_cyclic.desc != NULL;
+}
+
+static inline bool xdma_rx_result_ready(const struct xdma_result *res)
+{
+        return (le32_to_cpu(READ_ONCE(res->status)) >> XDMA_RX_RESULT_MAGIC_SHIFT) == C2H_WB;
+}
+
+int xdma_rx_ring_alloc(struct xdma_private *priv)
+{
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        struct device *dev = &priv->pdev->dev;
+        struct page_pool_params pp_params = { 0 };
+        dma_addr_t next;
+        u32 i;
+
+        BUILD_BUG_ON(XDMA_RX_HEADROOM + XDMA_BUFFER_SIZE +
+                     SKB_DATA_ALIGN(sizeof(struct skb_shared_info)) > XDMA_RX_TRUESIZE);
+        BUILD_BUG_ON(XDMA_RX_RING_SIZE_MAX > XDMA_CYCLIC_RING_MAX);
+
+        ring->size = clamp_t(u32, rx_ring_size, XDMA_RX_REFILL_BATCH, XDMA_RX_RING_SIZE_MAX);
+        ring->size = roundup_pow_of_two(ring->size);
+
+        if (rx_cyclic) {
+                if (!xdma_cyclic_ring_alloc(priv->rx_engine, &priv->rx_cyclic,
+                                            ring->size, XDMA_BUFFER_SIZE)) {
+                        pr_info("rx cyclic ring: %u descriptors\n", ring->size);
+                        return 0;
+                }
+                pr_warn("rx cyclic ring unavailable, falling back to the page pool ring\n");
+        }
+
+        pp_params.flags = PP_FLAG_DMA_MAP | PP_FLAG_DMA_SYNC_DEV;
+        pp_params.order = 0;
+        pp_params.pool_size = ring->size;
+        pp_params.nid = dev_to_node(dev);
+        pp_params.dev = dev;
+        pp_params.dma_dir = DMA_FROM_DEVICE;
+        pp_params.offset = XDMA_RX_HEADROOM;
+        pp_params.max_len = XDMA_BUFFER_SIZE;
+
+        ring->page_pool = page_pool_create(&pp_params);
+        if (IS_ERR(ring->page_pool)) {
+                pr_err("page_pool_create failed\n");
+                ring->page_pool = NULL;
+                return -ENOMEM;
+        }
+
+        ring->desc = dma_alloc_coherent(dev, ring->size * sizeof(struct xdma_desc),
+                                        &ring->desc_bus, GFP_KERNEL);
+        ring->res = dma_alloc_coherent(dev, ring->size * sizeof(struct xdma_result),
+                                       &ring->res_bus, GFP_KERNEL);
+        ring->pages = kcalloc(ring->size, sizeof(struct page *), GFP_KERNEL);
+        if (!ring->desc || !ring->res || !ring->pages) {
+                pr_err("rx ring allocation failed\n");
+                xdma_rx_ring_free(priv);
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < ring->size; i++) {
+                next = ring->desc_bus + ((i + 1) & (ring->size - 1)) * sizeof(struct xdma_desc);
+                ring->desc[i].next_lo = cpu_to_le32(PCI_DMA_L(next));
+                ring->desc[i].next_hi = cpu_to_le32(PCI_DMA_H(next));
+        }
+
+        pr_info("rx ring: %u descriptors\n", ring->size);
+
+        return 0;
+}
+
+void xdma_rx_ring_free(struct xdma_private *priv)
+{
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        struct device *dev = &priv->pdev->dev;
+        u32 i;
+
+        if (xdma_rx_cyclic(priv))
+                xdma_cyclic_ring_free(&priv->rx_cyclic);
+
+        if (ring->pages) {
+                for (i = 0; i < ring->size; i++) {
+                        if (ring->pages[i])
+                                page_pool_put_full_page(ring->page_pool, ring->pages[i], false);
+                }
+        }
+        kfree(ring->pages);
+        if (ring->page_pool)
+                page_pool_destroy(ring->page_pool);
+        if (ring->res)
+                dma_free_coherent(dev, ring->size * sizeof(struct xdma_result), ring->res, ring->res_bus);
+        if (ring->desc)
+                dma_free_coherent(dev, ring->size * sizeof(struct xdma_desc), ring->desc, ring->desc_bus);
+
+        ring->pages = NULL;
+        ring->page_pool = NULL;
+        ring->res = NULL;
+        ring->desc = NULL;
+}
+
+/*
+ * Hand a consumed slot back to the engine side of the ring.
+ * The slot keeps its page if the frame was dropped, otherwise
+ * a fresh page is taken from the page pool.
+ */
+static bool xdma_rx_slot_arm(struct xdma_private *priv, u32 index)
+{
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        u32 i = index & (ring->size - 1);
+        dma_addr_t dma_addr;
+
+        if (ring->pages[i]) {
+                dma_addr = page_pool_get_dma_addr(ring->pages[i]) + XDMA_RX_HEADROOM;
+                dma_sync_single_for_device(&priv->pdev->dev, dma_addr, XDMA_BUFFER_SIZE, DMA_FROM_DEVICE);
+        } else {
+                ring->pages[i] = page_pool_dev_alloc_pages(ring->page_pool);
+                if (unlikely(!ring->pages[i]))
+                        return false;
+                dma_addr = page_pool_get_dma_addr(ring->pages[i]) + XDMA_RX_HEADROOM;
+        }
+
+        ring->res[i].status = 0;
+        ring->res[i].length = 0;
+        rx_desc_set(&ring->desc[i], ring->res_bus + i * sizeof(struct xdma_result),
+                    dma_addr, XDMA_BUFFER_SIZE);
+
+        return true;
+}
+
+/*
+ * Re-arm consumed slots. Slots are re-armed in batches, unless the
+ * engine is starving for descriptors.
+ */
+static void xdma_rx_ring_refill(struct xdma_private *priv)
+{
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        u32 pending = ring->tail + ring->size - ring->refill;
+
+        if (pending < XDMA_RX_REFILL_BATCH && (ring->busy || ring->refill != ring->hw_tail))
+                return;
+
+        while (ring->refill != ring->tail + ring->size) {
+                if (!xdma_rx_slot_arm(priv, ring->refill)) {
+                        /* Out of pages, retry on the next poll */
+                        u64_stats_update_begin(&priv->rx_stats.syncp);
+                        priv->rx_stats.alloc_failed++;
+                        u64_stats_update_end(&priv->rx_stats.syncp);
+                        break;
+                }
+                ring->refill++;
+        }
+}
+
+/*
+ * Hand every re-armed slot to the C2H engine as one chain.
+ * The engine can't be extended while it is running.
+ */
+static void xdma_rx_ring_kick(struct xdma_private *priv)
+{
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        struct xdma_engine *engine = priv->rx_engine;
+        struct xdma_desc *last;
+        dma_addr_t first;
+
+        if (ring->busy || ring->refill == ring->hw_tail)
+                return;
+
+        first = ring->desc_bus + (ring->hw_tail & (ring->size - 1)) * sizeof(struct xdma_desc);
+        last = &ring->desc[(ring->refill - 1) & (ring->size - 1)];
+        last->control |= cpu_to_le32(XDMA_DESC_STOPPED);
+
+        /* Descriptors must be visible before the engine fetches them */
+        wmb();
+
+        iowrite32(cpu_to_le32(PCI_DMA_L(first)), &engine->sgdma_regs->first_desc_lo);
+        iowrite32(cpu_to_le32(PCI_DMA_H(first)), &engine->sgdma_regs->first_desc_hi);
+        iowrite32(0, &engine->sgdma_regs->first_desc_adjacent);
+
+        iowrite32(DMA_ENGINE_START, &engine->regs->control);
+
+        ring->hw_tail = ring->refill;
+        ring->busy = true;
+}
+
+static bool filter_rx_timestamp(struct xdma_private* priv, struct sk_buff* skb) {
+        u8 msg_type;
+        u16 eth_type;
+        uint8_t* payload;
+        struct ptp_header* ptp;
+        struct ethhdr* eth;
+        struct tsn_vlan_hdr* vlan;
+        int rx_filter = priv->tstamp_config.rx_filter;
+        if (rx_filter == HWTSTAMP_FILTER_NONE) {
+                return false;
+        } else if (rx_filter == HWTSTAMP_FILTER_ALL) {
+                return true;
+        }
+
+        payload = skb->data;
+        eth = (struct ethhdr*)payload;
+        payload += sizeof(*eth);
+        eth_type = ntohs(eth->h_proto);
+        if (eth_type == ETH_P_8021Q) {
+                vlan = (struct tsn_vlan_hdr*)payload;
+                eth_type = vlan->pid;
+                payload += sizeof(*vlan);
+        }
+
+        if (eth_type != ETH_P_1588) {
+                return false;
+        }
+
+        ptp = (struct ptp_header*)payload;
+        msg_type = ptp->tsmt & 0xF;
+        switch (rx_filter) {
+        case HWTSTAMP_FILTER_PTP_V2_EVENT:
+        case HWTSTAMP_FILTER_PTP_V2_L2_EVENT:
+                return true;
+        case HWTSTAMP_FILTER_PTP_V2_SYNC:
+        case HWTSTAMP_FILTER_PTP_V2_L2_SYNC:
+                return msg_type == PTP_MSGTYPE_SYNC;
+        case HWTSTAMP_FILTER_PTP_V2_DELAY_REQ:
+        case HWTSTAMP_FILTER_PTP_V2_L2_DELAY_REQ:
+                return msg_type == PTP_MSGTYPE_DELAY_REQ;
+        default:
+                return false;
+        }
+}
+
+/* Timestamp and count a received frame, then hand it to the stack */
+static void xdma_rx_deliver(struct xdma_private *priv, struct sk_buff *skb, sysclock_t timestamp)
+{
+        u32 len = skb->len;
+
+        if (filter_rx_timestamp(priv, skb)) {
+                skb_hwtstamps(skb)->hwtstamp = alinx_get_rx_timestamp(priv->pdev, timestamp);
+        }
+        skb->protocol = eth_type_trans(skb, priv->ndev);
+
+        u64_stats_update_begin(&priv->rx_stats.syncp);
+        priv->rx_stats.packets++;
+        priv->rx_stats.bytes += len;
+        u64_stats_update_end(&priv->rx_stats.syncp);
+
+        napi_gro_receive(&priv->napi, skb);
+}
+
+/* Build an skb around the page of the slot, without copying the frame */
+static void xdma_rx_frame(struct xdma_private *priv, u32 index, u32 length)
+{
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        struct rx_buffer *rx_buffer;
+        struct sk_buff *skb;
+        struct page *page;
+        sysclock_t timestamp;
+        u32 i = index & (ring->size - 1);
+        void *va;
+        int skb_len;
+
+        skb_len = length - RX_METADATA_SIZE - CRC_LEN;
+        if (skb_len < 0 || length > XDMA_BUFFER_SIZE) {
+                pr_err("Invalid skb_len\n");
+                u64_stats_update_begin(&priv->rx_stats.syncp);
+                priv->rx_stats.length_errors++;
+                u64_stats_update_end(&priv->rx_stats.syncp);
+                return;
+        }
+
+        page = ring->pages[i];
+        va = page_address(page);
+        dma_sync_single_for_cpu(&priv->pdev->dev,
+                                page_pool_get_dma_addr(page) + XDMA_RX_HEADROOM,
+                                length, DMA_FROM_DEVICE);
+
+        /* Parse the metadata in place before the headroom is taken by the skb */
+        rx_buffer = (struct rx_buffer *)(va + XDMA_RX_HEADROOM);
+        timestamp = rx_buffer->metadata.timestamp;
+
+        skb = napi_build_skb(va, XDMA_RX_TRUESIZE);
+        if (unlikely(!skb)) {
+                /* The page stays in the slot and gets re-armed */
+                u64_stats_update_begin(&priv->rx_stats.syncp);
+                priv->rx_stats.dropped++;
+                u64_stats_update_end(&priv->rx_stats.syncp);
+                return;
+        }
+        ring->pages[i] = NULL;
+        skb_mark_for_recycle(skb);
+        skb_reserve(skb, XDMA_RX_HEADROOM + RX_METADATA_SIZE);
+        skb_put(skb, skb_len);
+
+        xdma_rx_deliver(priv, skb, timestamp);
+}
+
+/* rx_cyclic=1: the buffer stays in the ring, the frame is copied out */
+static struct sk_buff *xdma_rx_frame_copy(struct xdma_private *priv, void *data, u32 length,
+                                          sysclock_t *timestamp)
+{
+        struct rx_buffer *rx_buffer = data;
+        struct sk_buff *skb;
+        int skb_len;
+
+        skb_len = length - RX_METADATA_SIZE - CRC_LEN;
+        if (skb_len < 0 || length > XDMA_BUFFER_SIZE) {
+                u64_stats_update_begin(&priv->rx_stats.syncp);
+                priv->rx_stats.length_errors++;
+                u64_stats_update_end(&priv->rx_stats.syncp);
+                return NULL;
+        }
+
+        skb = napi_alloc_skb(&priv->napi, skb_len);
+        if (unlikely(!skb)) {
+                u64_stats_update_begin(&priv->rx_stats.syncp);
+                priv->rx_stats.dropped++;
+                u64_stats_update_end(&priv->rx_stats.syncp);
+                return NULL;
+        }
+        skb_put_data(skb, data + RX_METADATA_SIZE, skb_len);
+        *timestamp = rx_buffer->metadata.timestamp;
+
+        return skb;
+}
+
+/*
+ * rx_cyclic=1: the engine never stops. The entries counted by one register
+ * read are received and each one goes back to the engine after its copy,
+ * which is dropped if the engine overwrote the entry meanwhile.
+ */
+static int xdma_netdev_poll_cyclic(struct xdma_private *priv, int budget)
+{
+        struct xdma_cyclic_ring *ring = &priv->rx_cyclic;
+        struct xdma_engine *engine = priv->rx_engine;
+        u64 overruns = ring->overruns;
+        u64 errors = ring->errors;
+        struct sk_buff *skb;
+        sysclock_t timestamp;
+        void *data;
+        u32 len;
+        int done = 0;
+
+        /* Completions after this point raise the interrupt again once it is unmasked */
+        ioread32(&engine->regs->status_rc);
+        xdma_cyclic_ring_sync(ring);
+
+        while (done < budget && (data = xdma_cyclic_ring_peek(ring, &len))) {
+                skb = xdma_rx_frame_copy(priv, data, len, &timestamp);
+                if (xdma_cyclic_ring_advance(ring)) {
+                        if (skb)
+                                xdma_rx_deliver(priv, skb, timestamp);
+                } else if (skb) {
+                        dev_kfree_skb_any(skb);
+                }
+                done++;
+        }
+
+        if (ring->overruns != overruns || ring->errors != errors) {
+                u64_stats_update_begin(&priv->rx_stats.syncp);
+                priv->rx_stats.overruns += ring->overruns - overruns;
+                priv->rx_stats.length_errors += ring->errors - errors;
+                u64_stats_update_end(&priv->rx_stats.syncp);
+        }
+
+        if (done < budget && napi_complete_done(&priv->napi, done)) {
+                channel_interrupts_enable(priv->xdev, engine->irq_bitmask);
+        }
+
+        return done;
+}
+
+int xdma_netdev_poll(struct napi_struct *napi, int budget)
+{
+        struct xdma_private *priv = container_of(napi, struct xdma_private, napi);
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        struct xdma_engine *engine = priv->rx_engine;
+        struct xdma_result *res;
+        int done = 0;
+
+        if (xdma_rx_cyclic(priv))
+                return xdma_netdev_poll_cyclic(priv, budget);
+
+        /* Completions after this point raise the interrupt again once it is unmasked */
+        ioread32(&engine->regs->status_rc);
+
+        while (done < budget && ring->tail != ring->hw_tail) {
+                res = &ring->res[ring->tail & (ring->size - 1)];
+                if (!xdma_rx_result_ready(res))
+                        break;
+                /* Read the result before the frame */
+                dma_rmb();
+
+                xdma_rx_frame(priv, ring->tail, le32_to_cpu(res->length));
+                res->status = 0;
+                ring->tail++;
+                done++;
+
+                if (ring->tail == ring->hw_tail) {
+                        /* The engine stopped at the end of the chain */
+                        iowrite32(DMA_ENGINE_STOP, &engine->regs->control);
+                        ring->busy = false;
+                }
+        }
+
+        xdma_rx_ring_refill(priv);
+        xdma_rx_ring_kick(priv);
+
+        /* Out of pages and nothing posted, no interrupt would come to retry */
+        if (unlikely(!ring->busy))
+                return budget;
+
+        if (done < budget && napi_complete_done(napi, done)) {
+                channel_interrupts_enable(priv->xdev, engine->irq_bitmask);
+        }
+
+        return done;
+}
+
+/*
+ * Queue a frame waiting for its TX timestamp, see xdma_tstamp_poll()
+ * Returns false if too many timestamps of this id are pending
+ */
+static bool xdma_tstamp_queue(struct xdma_private *priv, u8 tstamp_id, struct sk_buff *skb,
+                              sysclock_t start_after, sysclock_t wait_until)
+{
+        struct xdma_tstamp_fifo *fifo;
+        struct xdma_tstamp_entry *entry;
+        unsigned long flags;
+
+        if (tstamp_id == TSN_TIMESTAMP_ID_NONE || tstamp_id >= TSN_TIMESTAMP_ID_MAX) {
+                pr_err("Invalid timestamp ID\n");
+                return false;
+        }
+        fifo = &priv->tstamp_fifo[tstamp_id];
+
+        spin_lock_irqsave(&priv->tstamp_lock, flags);
+        if (fifo->head - fifo->tail >= XDMA_TSTAMP_FIFO_SIZE) {
+                priv->tstamp_skipped++;
+                spin_unlock_irqrestore(&priv->tstamp_lock, flags);
+                return false;
+        }
+
+        entry = &fifo->entries[fifo->head & (XDMA_TSTAMP_FIFO_SIZE - 1)];
+        entry->skb = skb_get(skb);
+        entry->start_after = start_after;
+        entry->wait_until = wait_until;
+        fifo->head++;
+
+        /* See xdma_tstamp_poll() for restarting a running timer */
+        if (!hrtimer_is_queued(&priv->tstamp_timer)) {
+                hrtimer_start(&priv->tstamp_timer, ns_to_ktime(XDMA_TSTAMP_POLL_NS),
+                              HRTIMER_MODE_REL_SOFT);
+        }
+        spin_unlock_irqrestore(&priv->tstamp_lock, flags);
+
+        return true;
+}
+
+/*
+ * Match the latched timestamp of one id against its pending frames
+ * Must be called with tstamp_lock held
+ */
+static void xdma_tstamp_match(struct xdma_private *priv, struct xdma_tstamp_fifo *fifo,
+                              sysclock_t tx_tstamp, sysclock_t now, bool overwritten,
+                              struct sk_buff_head *done)
+{
+        struct skb_shared_hwtstamps *shhwtstamps;
+        struct xdma_tstamp_entry *entry;
+        bool updated = (tx_tstamp != fifo->last_tstamp);
+        u32 candidates = 0;
+        u32 i;
+
+        /*
+         * Reading and writing the TX timestamp registers are not atomic,
+         * so a value far from now is only partially updated. Try again next time.
+         */
+        if (updated && now - tx_tstamp > TX_TSTAMP_UPDATE_THRESHOLD) {
+                updated = false;
+        }
+
+        /*
+         * A register was written more than once since the last poll. If more
+         * than one pending frame of this id could own the value, don't guess.
+         */
+        if (updated && overwritten) {
+                for (i = fifo->tail; i != fifo->head; i++) {
+                        entry = &fifo->entries[i & (XDMA_TSTAMP_FIFO_SIZE - 1)];
+                        if (tx_tstamp + TX_WORK_OVERFLOW_MARGIN >= entry->start_after)
+                                candidates++;
+                }
+        }
+        if (candidates > 1) {
+                while (fifo->tail != fifo->head) {
+                        entry = &fifo->entries[fifo->tail & (XDMA_TSTAMP_FIFO_SIZE - 1)];
+                        if (tx_tstamp + TX_WORK_OVERFLOW_MARGIN < entry->start_after)
+                                break;
+                        priv->tstamp_skipped++;
+                        dev_kfree_skb_any(entry->skb);
+                        entry->skb = NULL;
+                        fifo->tail++;
+                }
+                fifo->last_tstamp = tx_tstamp;
+                updated = false;
+        }
+
+        while (fifo->tail != fifo->head) {
+                entry = &fifo->entries[fifo->tail & (XDMA_TSTAMP_FIFO_SIZE - 1)];
+
+                if (updated && tx_tstamp + TX_WORK_OVERFLOW_MARGIN >= entry->start_after) {
+                        /* Frames sent before this one lost their timestamp, it got overwritten */
+                        if (tx_tstamp > entry->wait_until + TX_WORK_OVERFLOW_MARGIN) {
+                                goto skip;
+                        }
+                        shhwtstamps = skb_hwtstamps(entry->skb);
+                        memset(shhwtstamps, 0, sizeof(*shhwtstamps));
+                        shhwtstamps->hwtstamp = ns_to_ktime(alinx_sysclock_to_txtstamp(priv->pdev, tx_tstamp));
+                        __skb_queue_tail(done, entry->skb);
+                        entry->skb = NULL;
+                        fifo->last_tstamp = tx_tstamp;
+                        fifo->tail++;
+                        /* One register value belongs to one frame */
+                        updated = false;
+                        continue;
+                }
+
+                if (now < entry->wait_until + TX_TSTAMP_UPDATE_THRESHOLD) {
+                        /* The frame might have not been sent yet */
+                        break;
+                }
+                /* Not updated for too long, the frame might have been dropped */
+skip:
+                priv->tstamp_skipped++;
+                dev_kfree_skb_any(entry->skb);
+                entry->skb = NULL;
+                fifo->tail++;
+        }
+}
+
+enum hrtimer_restart xdma_tstamp_poll(struct hrtimer *timer)
+{
+        struct xdma_private *priv = container_of(timer, struct xdma_private, tstamp_timer);
+        sysclock_t tstamps[TX_TIMESTAMP_REG_COUNT];
+        struct skb_shared_hwtstamps shhwtstamps;
+        struct sk_buff_head done;
+        struct sk_buff *skb;
+        enum hrtimer_restart ret = HRTIMER_NORESTART;
+        bool pending = false;
+        bool overwritten;
+        unsigned long flags;
+        sysclock_t now;
+        u32 count, changed = 0;
+        u16 tstamp_id;
+
+        __skb_queue_head_init(&done);
+
+        /* Read everything in one go, then match without touching the device */
+        now = alinx_get_sys_clock_cached(priv->pdev);
+        count = alinx_read_tx_timestamps(priv->pdev, tstamps);
+
+        spin_lock_irqsave(&priv->tstamp_lock, flags);
+        /* More timestamps latched than registers changed: some got overwritten */
+        for (tstamp_id = 1; tstamp_id < TSN_TIMESTAMP_ID_MAX; tstamp_id++) {
+                if (tstamps[tstamp_id - 1] != priv->tstamp_fifo[tstamp_id].last_tstamp)
+                        changed++;
+        }
+        overwritten = (count - priv->tstamp_count > changed);
+        priv->tstamp_count = count;
+
+        for (tstamp_id = 1; tstamp_id < TSN_TIMESTAMP_ID_MAX; tstamp_id++) {
+                struct xdma_tstamp_fifo *fifo = &priv->tstamp_fifo[tstamp_id];
+
+                if (fifo->tail == fifo->head) {
+                        /* Keep up with the register so that stale values never match */
+                        fifo->last_tstamp = tstamps[tstamp_id - 1];
+                        continue;
+                }
+                xdma_tstamp_match(priv, fifo, tstamps[tstamp_id - 1], now, overwritten, &done);
+                pending |= (fifo->tail != fifo->head);
+        }
+        /* xdma_tstamp_queue() might have started the timer meanwhile */
+        if (pending && !hrtimer_is_queued(timer)) {
+                hrtimer_forward_now(timer, ns_to_ktime(XDMA_TSTAMP_POLL_NS));
+                ret = HRTIMER_RESTART;
+        }
+        spin_unlock_irqrestore(&priv->tstamp_lock, flags);
+
+        /* skb_tstamp_tx() clones the skb, so report outside of the lock */
+        while ((skb = __skb_dequeue(&done)) != NULL) {
+                shhwtstamps = *skb_hwtstamps(skb);
+                skb_tstamp_tx(skb, &shhwtstamps);
+                dev_kfree_skb_any(skb);
+        }
+
+        return ret;
+}
+
+/* Drop every pending timestamp, the timer must not be running */
+void xdma_tstamp_flush(struct xdma_private *priv)
+{
+        struct xdma_tstamp_fifo *fifo;
+        unsigned long flags;
+        u16 tstamp_id;
+
+        spin_lock_irqsave(&priv->tstamp_lock, flags);
+        for (tstamp_id = 0; tstamp_id < TSN_TIMESTAMP_ID_MAX; tstamp_id++) {
+                fifo = &priv->tstamp_fifo[tstamp_id];
+                while (fifo->tail != fifo->head) {
+                        dev_kfree_skb_any(fifo->entries[fifo->tail & (XDMA_TSTAMP_FIFO_SIZE - 1)].skb);
+                        fifo->entries[fifo->tail & (XDMA_TSTAMP_FIFO_SIZE - 1)].skb = NULL;
+                        fifo->tail++;
+                }
+        }
+        spin_unlock_irqrestore(&priv->tstamp_lock, flags);
+}
+
+/* Take the current registers and count as seen, see xdma_tstamp_poll() */
+static void xdma_tstamp_reset(struct xdma_private *priv)
+{
+        sysclock_t tstamps[TX_TIMESTAMP_REG_COUNT];
+        unsigned long flags;
+        u32 count;
+        u16 tstamp_id;
+
+        count = alinx_read_tx_timestamps(priv->pdev, tstamps);
+
+        spin_lock_irqsave(&priv->tstamp_lock, flags);
+        priv->tstamp_count = count;
+        for (tstamp_id = 1; tstamp_id < TSN_TIMESTAMP_ID_MAX; tstamp_id++)
+                priv->tstamp_fifo[tstamp_id].last_tstamp = tstamps[tstamp_id - 1];
+        spin_unlock_irqrestore(&priv->tstamp_lock, flags);
+}
+
 int xdma_netdev_open(struct net_device *ndev)
 {
         struct xdma_private *priv = netdev_priv(ndev);
-        dma_addr_t dma_addr;
-        u32 lo, hi;
-        unsigned long flag;
+        struct xdma_rx_ring *ring = &priv->rx_ring;
+        int rv;
+
+        xdma_tstamp_reset(priv);
 
         netif_carrier_on(ndev);
-        netif_start_queue(ndev);
-
-        /* Set the RX descriptor */
-        dma_addr = dma_map_single(
-                        &priv->xdev->pdev->dev,
-                        priv->res,
-                        sizeof(struct xdma_result),
-                        DMA_FROM_DEVICE);
-        priv->rx_desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(dma_addr));
-        priv->rx_desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(dma_addr));
-        rx_desc_set(priv->rx_desc, priv->rx_dma_addr, XDMA_BUFFER_SIZE);
-        spin_lock_irqsave(&priv->rx_lock, flag);
+        netif_tx_start_all_queues(ndev);
+
+        /* Arm the whole RX ring */
+        ring->tail = 0;
+        ring->hw_tail = 0;
+        ring->refill = 0;
+        ring->busy = false;
+        if (!xdma_rx_cyclic(priv))
+                xdma_rx_ring_refill(priv);
+
         ioread32(&priv->rx_engine->regs->status_rc);
 
-        /* RX start */
-        lo = cpu_to_le32(PCI_DMA_L(priv->rx_bus_addr));
-        iowrite32(lo, &priv->rx_engine->sgdma_regs->first_desc_lo);
+        /* RX start, a cyclic ring runs until xdma_netdev_close() */
+        if (!xdma_rx_cyclic(priv)) {
+                xdma_rx_ring_kick(priv);
+        } else {
+                rv = xdma_cyclic_ring_start(&priv->rx_cyclic);
+                if (rv) {
+                        pr_err("rx cyclic ring start failed\n");
+                        netif_tx_stop_all_queues(ndev);
+                        netif_carrier_off(ndev);
+                        return rv;
+                }
+        }
 
-        hi = cpu_to_le32(PCI_DMA_H(priv->rx_bus_addr));
-        iowrite32(hi, &priv->rx_engine->sgdma_regs->first_desc_hi);
+        napi_enable(&priv->napi);
+        channel_interrupts_enable(priv->xdev, priv->rx_engine->irq_bitmask);
 
-        iowrite32(DMA_ENGINE_START, &priv->rx_engine->regs->control);
-        spin_unlock_irqrestore(&priv->rx_lock, flag);
+        schedule_delayed_work(&priv->stats_work, XDMA_STATS_INTERVAL);
 
         return 0;
 }
@@ -87,8 +1014,25 @@ int xdma_netdev_open(struct net_device *ndev)
 int xdma_netdev_close(struct net_device *ndev)
 {
         struct xdma_private *priv = netdev_priv(ndev);
-        iowrite32(DMA_ENGINE_STOP, &priv->rx_engine->regs->control);
-        netif_stop_queue(ndev);
+        unsigned long flag;
+
+        channel_interrupts_disable(priv->xdev, priv->rx_engine->irq_bitmask);
+        napi_disable(&priv->napi);
+        if (xdma_rx_cyclic(priv))
+                xdma_cyclic_ring_stop(&priv->rx_cyclic);
+        else
+                iowrite32(DMA_ENGINE_STOP, &priv->rx_engine->regs->control);
+        priv->rx_ring.busy = false;
+        netif_tx_stop_all_queues(ndev);
+
+        spin_lock_irqsave(&priv->tx_lock, flag);
+        iowrite32(DMA_ENGINE_STOP, &priv->tx_engine->regs->control);
+        xdma_tx_ring_drain(priv);
+        spin_unlock_irqrestore(&priv->tx_lock, flag);
+
+        hrtimer_cancel(&priv->tstamp_timer);
+        xdma_tstamp_flush(priv);
+        cancel_delayed_work_sync(&priv->stats_work);
         pr_info("xdma_netdev_close\n");
         netif_carrier_off(ndev);
         pr_info("netif_carrier_off\n");
@@ -100,86 +1044,92 @@ netdev_tx_t xdma_netdev_start_xmit(struct sk_buff *skb,
 {
         struct xdma_private *priv = netdev_priv(ndev);
         struct xdma_dev *xdev = priv->xdev;
-        u32 w;
+        struct xdma_tx_ring *ring = &priv->tx_ring;
+        struct netdev_queue *txq = skb_get_tx_queue(ndev, skb);
+        struct xdma_tx_queue_stats *stats = &priv->tx_stats[skb_get_queue_mapping(skb)];
+        struct xdma_tx_slot *slot;
+        unsigned long flags;
         sysclock_t sys_count, sys_count_upper, sys_count_lower;
         timestamp_t now;
-        u16 frame_length;
-        dma_addr_t dma_addr;
-        struct tx_buffer* tx_buffer;
+        sysclock_t start_after, wait_until;
+        u32 first, last;
         struct tx_metadata* tx_metadata;
         u32 to_value;
 
-        /* Check desc count */
-        netif_stop_queue(ndev);
         xdma_debug("xdma_netdev_start_xmit(skb->len : %d)\n", skb->len);
-        skb->len = max((unsigned int)ETH_ZLEN, skb->len);
-        if (skb_padto(skb, skb->len)) {
-                pr_err("skb_padto failed\n");
-                netif_wake_queue(ndev);
-                dev_kfree_skb(skb);
+        if (eth_skb_pad(skb)) {
+                pr_err("eth_skb_pad failed\n");
+                xdma_tx_stats_drop(priv, stats);
                 return NETDEV_TX_OK;
         }
 
         /* Jumbo frames not supported */
         if (skb->len > XDMA_BUFFER_SIZE) {
                 pr_err("Jumbo frames not supported\n");
-                netif_wake_queue(ndev);
                 dev_kfree_skb(skb);
+                xdma_tx_stats_drop(priv, stats);
                 return NETDEV_TX_OK;
         }
 
-        /* Store packet length */
-        frame_length = skb->len;
-
-        /* Add metadata to the skb */
-        if (pskb_expand_head(skb, TX_METADATA_SIZE, 0, GFP_ATOMIC) != 0) {
-                pr_err("pskb_expand_head failed\n");
-                netif_wake_queue(ndev);
+        if (skb_shinfo(skb)->nr_frags + 2 > priv->tx_ring.max_desc && skb_linearize(skb)) {
+                pr_err("skb_linearize failed\n");
                 dev_kfree_skb(skb);
+                xdma_tx_stats_drop(priv, stats);
                 return NETDEV_TX_OK;
         }
-        skb_push(skb, TX_METADATA_SIZE);
-        memset(skb->data, 0, TX_METADATA_SIZE);
 
-        xdma_debug("skb->len : %d\n", skb->len);
-        tx_buffer = (struct tx_buffer*)skb->data;
-        /* Fill in the metadata */
-        tx_metadata = (struct tx_metadata*)&tx_buffer->metadata;
-        tx_metadata->frame_length = frame_length;
+        /* tsn_config and the ring are shared by all TX queues */
+        spin_lock_irqsave(&priv->tx_lock, flags);
 
-        sys_count = alinx_get_sys_clock(priv->pdev);
+        if (unlikely(xdma_tx_ring_free_slots(ring) < skb_shinfo(skb)->nr_frags + 2)) {
+                /* Should not happen, the queue is stopped before the ring gets full */
+                netif_tx_stop_queue(txq);
+                xdma_tx_stats_inc(stats, &stats->stopped);
+                spin_unlock_irqrestore(&priv->tx_lock, flags);
+                return NETDEV_TX_BUSY;
+        }
+
+        /* The metadata goes in its own descriptor in front of the frame */
+        first = ring->head & (ring->size - 1);
+        tx_metadata = &ring->meta[first];
+        memset(tx_metadata, 0, TX_METADATA_SIZE);
+        tx_metadata->frame_length = skb->len;
+
+        sys_count = alinx_get_sys_clock_cached(priv->pdev);
         now = alinx_sysclock_to_timestamp(priv->pdev, sys_count);
         sys_count_lower = sys_count & LOWER_29_BITS;
         sys_count_upper = sys_count & ~LOWER_29_BITS;
 
 
+        /* Mapped first, tsn_fill_metadata() spends the shaper credit of the frame */
+        if (xdma_tx_ring_map_skb(priv, skb)) {
+                pr_err("dma mapping failed\n");
+                xdma_tx_stats_inc(stats, &stats->dropped);
+                spin_unlock_irqrestore(&priv->tx_lock, flags);
+                dev_kfree_skb_any(skb);
+                return NETDEV_TX_OK;
+        }
+
         /* Set the fromtick & to_tick values based on the lower 29 bits of the system count */
-        if (tsn_fill_metadata(xdev->pdev, now, skb) == false) {
-                // TODO: Increment SW drop stats
+        if (tsn_fill_metadata(xdev->pdev, now, skb, tx_metadata) == false) {
 #ifdef __LIBXDMA_DEBUG__
                 pr_warn("tsn_fill_metadata failed\n");
 #endif
-                netif_wake_queue(ndev);
+                xdma_tx_ring_unmap_skb(priv, skb);
+                xdma_tx_stats_inc(stats, &stats->busy);
+                spin_unlock_irqrestore(&priv->tx_lock, flags);
                 return NETDEV_TX_BUSY;
         }
 
         xdma_debug("0x%08x  0x%08x  0x%08x  %4d  %1d",
                 sys_count_low, tx_metadata->from.tick, tx_metadata->to.tick,
                 tx_metadata->frame_length, tx_metadata->fail_policy);
-        dump_buffer((unsigned char*)tx_metadata, (int)(sizeof(struct tx_metadata) + skb->len));
-
-        dma_addr = dma_map_single(&xdev->pdev->dev, skb->data, skb->len, DMA_TO_DEVICE);
-        if (unlikely(dma_mapping_error(&xdev->pdev->dev, dma_addr))) {
-                pr_err("dma_map_single failed\n");
-                netif_wake_queue(ndev);
-                return NETDEV_TX_BUSY;
-        }
+        dump_buffer((unsigned char*)tx_metadata, (int)sizeof(struct tx_metadata));
 
         if (skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) {
-                if (priv->tstamp_config.tx_type == HWTSTAMP_TX_ON &&
-                        !test_and_set_bit_lock(tx_metadata->timestamp_id, &priv->state)) {
-                        skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
-                        priv->tx_work_skb[tx_metadata->timestamp_id] = skb_get(skb);
+                if (priv->tstamp_config.tx_type != HWTSTAMP_TX_ON) {
+                        pr_warn("Timestamp skipped: timestamp config is off\n");
+                } else {
                         /*
                          * Even if the driver's intention was sys_count == from,
                          * there might be a slight error caused during conversion (sysclock <-> timestamp)
@@ -187,42 +1137,63 @@ netdev_tx_t xdma_netdev_start_xmit(struct sk_buff *skb,
                          * Adding/Subtracting directly from values can cause another overflow,
                          * so just calculate the difference.
                          */
-                        priv->tx_work_start_after[tx_metadata->timestamp_id] = sys_count_upper | tx_metadata->from.tick;
+                        start_after = sys_count_upper | tx_metadata->from.tick;
                         if (sys_count_lower > tx_metadata->from.tick && sys_count_lower - tx_metadata->from.tick > TX_WORK_OVERFLOW_MARGIN) {
                                 // Overflow
-                                priv->tx_work_start_after[tx_metadata->timestamp_id] += (1 << 29);
+                                start_after += (1 << 29);
                         }
                         to_value = (tx_metadata->fail_policy == TSN_FAIL_POLICY_RETRY ? tx_metadata->delay_to.tick : tx_metadata->to.tick);
-                        priv->tx_work_wait_until[tx_metadata->timestamp_id] = sys_count_upper | to_value;
+                        wait_until = sys_count_upper | to_value;
                         if (sys_count_lower > to_value && sys_count_lower - to_value > TX_WORK_OVERFLOW_MARGIN) {
                                 // Overflow
-                                priv->tx_work_wait_until[tx_metadata->timestamp_id] += (1 << 29);
+                                wait_until += (1 << 29);
+                        }
+                        if (xdma_tstamp_queue(priv, tx_metadata->timestamp_id, skb, start_after, wait_until)) {
+                                skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+                        } else {
+                                pr_warn("Timestamp skipped: too many pending timestamps\n");
                         }
-                        schedule_work(&priv->tx_work[tx_metadata->timestamp_id]);
-                } else if (priv->tstamp_config.tx_type != HWTSTAMP_TX_ON) {
-                        pr_warn("Timestamp skipped: timestamp config is off\n");
-                } else {
-                        pr_warn("Timestamp skipped: driver is waiting for previous packet's timestamp\n");
                 }
-                // TODO: track the number of skipped packets for ethtool stats
         }
 
-        /* netif_wake_queue() will be called in xdma_isr() */
-        priv->tx_dma_addr = dma_addr;
-        priv->tx_skb = skb;
-        tx_desc_set(priv->tx_desc, dma_addr, skb->len);
+        slot = &ring->slots[first];
+        slot->type = XDMA_TX_SLOT_METADATA;
+        tx_desc_set(&ring->desc[first], ring->meta_bus + first * sizeof(struct tx_metadata),
+                    TX_METADATA_SIZE, false);
 
-        w = cpu_to_le32(PCI_DMA_L(priv->tx_bus_addr));
-        iowrite32(w, xdev->bar[1] + DESC_REG_LO);
+        u64_stats_update_begin(&stats->syncp);
+        stats->packets++;
+        stats->bytes += skb->len;
+        u64_stats_update_end(&stats->syncp);
 
-        w = cpu_to_le32(PCI_DMA_H(priv->tx_bus_addr));
-        iowrite32(w, xdev->bar[1] + DESC_REG_HI);
-        iowrite32(0, xdev->bar[1] + DESC_REG_HI + 4);
+        /* The skb is freed along with the last descriptor of the frame */
+        ring->head += skb_shinfo(skb)->nr_frags + 2;
+        last = (ring->head - 1) & (ring->size - 1);
+        ring->slots[last].skb = skb;
+
+        /* Start the engine if idle, otherwise xdma_isr() submits it with the next chain */
+        xdma_tx_ring_kick(priv);
+
+        /* Stopped queues are woken in xdma_tx_ring_clean() */
+        xdma_tx_queues_update(priv);
+
+        spin_unlock_irqrestore(&priv->tx_lock, flags);
 
-        iowrite32(DMA_ENGINE_START, &priv->tx_engine->regs->control);
         return NETDEV_TX_OK;
 }
 
+u16 xdma_netdev_select_queue(struct net_device *ndev, struct sk_buff *skb,
+                             struct net_device *sb_dev)
+{
+        struct xdma_private *priv = netdev_priv(ndev);
+        u16 queue = tsn_select_queue(&priv->xdev->tsn_config, skb);
+
+        if (unlikely(queue >= ndev->real_num_tx_queues))
+                return 0;
+
+        return queue;
+}
+
 static LIST_HEAD(xdma_block_cb_list);
 
 static int xdma_setup_tc_block_cb(enum tc_setup_type type, void *type_data, void *cb_priv) {
@@ -274,84 +1245,252 @@ int xdma_netdev_ioctl(struct net_device *ndev, struct ifreq *ifr, int cmd) {
         }
 }
 
-static void do_tx_work(struct work_struct *work, u16 tstamp_id) {
-        sysclock_t tx_tstamp;
-        struct skb_shared_hwtstamps shhwtstamps;
-        struct xdma_private* priv = container_of(work - tstamp_id, struct xdma_private, tx_work[0]);
-        struct sk_buff* skb = priv->tx_work_skb[tstamp_id];
-        sysclock_t now = alinx_get_sys_clock(priv->xdev->pdev);
+void xdma_stats_init(struct xdma_private *priv)
+{
+        int i;
 
-        if (tstamp_id >= TSN_TIMESTAMP_ID_MAX) {
-                pr_err("Invalid timestamp ID\n");
-                return;
-        }
+        for (i = 0; i < TX_QUEUE_COUNT; i++)
+                u64_stats_init(&priv->tx_stats[i].syncp);
+        u64_stats_init(&priv->rx_stats.syncp);
+        u64_stats_init(&priv->irq_stats.syncp);
+        u64_stats_init(&priv->hw_stats.syncp);
+        INIT_DELAYED_WORK(&priv->stats_work, xdma_stats_work);
+}
 
-        if (!priv->tx_work_skb[tstamp_id]) {
-                goto return_error;
-        }
+/*
+ * Snapshot the ALINX hardware counters, so that queries never touch the device.
+ * TX_PACKETS and TX_DROP_PACKETS are cleared on read and shared with the
+ * buffer tracker of tsn_fill_metadata(), hence tx_lock.
+ */
+void xdma_stats_work(struct work_struct *work)
+{
+        struct xdma_private *priv = container_of(to_delayed_work(work), struct xdma_private, stats_work);
+        struct xdma_hw_stats *hw = &priv->hw_stats;
+        u64 tx_packets, tx_drops, normal_timeouts, to_overflow_popped, to_overflow_timeouts;
+        unsigned long flags;
 
-        if (now < priv->tx_work_start_after[tstamp_id]) {
-                goto retry;
-        }
-        /*
-         * Read TX timestamp several times because
-         * 1. Reading and writing TX timestamp register are not atomic
-         * 2. The work thread might try to read TX timestamp before the register gets updated
-         */
-        tx_tstamp = alinx_read_tx_timestamp(priv->pdev, tstamp_id);
-        if (tx_tstamp == priv->last_tx_tstamp[tstamp_id]) {
-                if (alinx_get_sys_clock(priv->xdev->pdev) < priv->tx_work_wait_until[tstamp_id]) {
-                        /* The packet might have not been sent yet */
-                        goto retry;
-                }
-                /*
-                 * Tx timestamp is not updated. Try again.
-                 * Waiting for it to be updated forever is not desirable,
-                 * so limit the number of retries
-                 */
-                if (++(priv->tstamp_retry[tstamp_id]) >= TX_TSTAMP_MAX_RETRY) {
-                        /* TODO: track the number of skipped packets for ethtool stats */
-                        pr_warn("Failed to get timestamp: timestamp is not getting updated, " \
-                                "the packet might have been dropped\n");
-                        goto return_error;
-                }
-                goto retry;
-        } else if (now - tx_tstamp > TX_TSTAMP_UPDATE_THRESHOLD) {
-                /* Tx timestamp is only partially updated */
-                if (++(priv->tstamp_retry[tstamp_id]) >= TX_TSTAMP_MAX_RETRY) {
-                        /* TODO: track the number of skipped packets for ethtool stats */
-                        pr_err("Failed to get timestamp: timestamp is only partially updated\n");
-			pr_err("%llx %llx %llu\n", now, tx_tstamp, now - tx_tstamp);
-                        goto return_error;
-                }
-                goto retry;
+        spin_lock_irqsave(&priv->tx_lock, flags);
+        tx_packets = alinx_get_tx_packets(priv->pdev);
+        tx_drops = alinx_get_tx_drop_packets(priv->pdev);
+        normal_timeouts = alinx_get_normal_timeout_packets(priv->pdev);
+        to_overflow_popped = alinx_get_to_overflow_popped_packets(priv->pdev);
+        to_overflow_timeouts = alinx_get_to_overflow_timeout_packets(priv->pdev);
+        spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+        u64_stats_update_begin(&hw->syncp);
+        hw->tx_packets = tx_packets;
+        hw->tx_drops = tx_drops;
+        hw->normal_timeouts = normal_timeouts;
+        hw->to_overflow_popped = to_overflow_popped;
+        hw->to_overflow_timeouts = to_overflow_timeouts;
+        u64_stats_update_end(&hw->syncp);
+
+        schedule_delayed_work(&priv->stats_work, XDMA_STATS_INTERVAL);
+}
+
+static void xdma_read_tx_queue_stats(const struct xdma_tx_queue_stats *stats,
+                                     struct xdma_tx_queue_stats *out)
+{
+        unsigned int start;
+
+        do {
+                start = u64_stats_fetch_begin(&stats->syncp);
+                out->packets = stats->packets;
+                out->bytes = stats->bytes;
+                out->busy = stats->busy;
+                out->dropped = stats->dropped;
+                out->stopped = stats->stopped;
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+}
+
+static void xdma_read_rx_stats(const struct xdma_rx_stats *stats, struct xdma_rx_stats *out)
+{
+        unsigned int start;
+
+        do {
+                start = u64_stats_fetch_begin(&stats->syncp);
+                out->packets = stats->packets;
+                out->bytes = stats->bytes;
+                out->length_errors = stats->length_errors;
+                out->dropped = stats->dropped;
+                out->alloc_failed = stats->alloc_failed;
+                out->overruns = stats->overruns;
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+}
+
+static void xdma_read_irq_stats(const struct xdma_irq_stats *stats, struct xdma_irq_stats *out)
+{
+        unsigned int start;
+
+        do {
+                start = u64_stats_fetch_begin(&stats->syncp);
+                out->h2c = stats->h2c;
+                out->c2h = stats->c2h;
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+}
+
+static void xdma_read_hw_stats(const struct xdma_hw_stats *stats, struct xdma_hw_stats *out)
+{
+        unsigned int start;
+
+        do {
+                start = u64_stats_fetch_begin(&stats->syncp);
+                out->tx_packets = stats->tx_packets;
+                out->tx_drops = stats->tx_drops;
+                out->normal_timeouts = stats->normal_timeouts;
+                out->to_overflow_popped = stats->to_overflow_popped;
+                out->to_overflow_timeouts = stats->to_overflow_timeouts;
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+}
+
+void xdma_netdev_get_stats64(struct net_device *ndev, struct rtnl_link_stats64 *stats)
+{
+        struct xdma_private *priv = netdev_priv(ndev);
+        struct xdma_tx_queue_stats tx;
+        struct xdma_rx_stats rx;
+        struct xdma_hw_stats hw;
+        int i;
+
+        for (i = 0; i < TX_QUEUE_COUNT; i++) {
+                xdma_read_tx_queue_stats(&priv->tx_stats[i], &tx);
+                stats->tx_packets += tx.packets;
+                stats->tx_bytes += tx.bytes;
+                stats->tx_dropped += tx.dropped;
         }
-        priv->tstamp_retry[tstamp_id] = 0;
-        shhwtstamps.hwtstamp = ns_to_ktime(alinx_sysclock_to_txtstamp(priv->pdev, tx_tstamp));
-        priv->last_tx_tstamp[tstamp_id] = tx_tstamp;
 
-        priv->tx_work_skb[tstamp_id] = NULL;
-        clear_bit_unlock(tstamp_id, &priv->state);
-        skb_tstamp_tx(skb, &shhwtstamps);
-        dev_kfree_skb_any(skb);
-        return;
+        /* The timeout counters see frames TX_DROP_PACKETS may count too,
+         * so only the latter is a drop and the rest are reported as errors */
+        xdma_read_hw_stats(&priv->hw_stats, &hw);
+        stats->tx_dropped += hw.tx_drops;
+        stats->tx_fifo_errors = hw.to_overflow_popped + hw.to_overflow_timeouts;
+        stats->tx_errors = hw.normal_timeouts + stats->tx_fifo_errors;
+
+        xdma_read_rx_stats(&priv->rx_stats, &rx);
+        stats->rx_packets = rx.packets;
+        stats->rx_bytes = rx.bytes;
+        stats->rx_length_errors = rx.length_errors;
+        stats->rx_over_errors = rx.overruns;
+        stats->rx_errors = rx.length_errors + rx.overruns;
+        stats->rx_dropped = rx.dropped;
+}
+
+static const char xdma_gstrings_stats[][ETH_GSTRING_LEN] = {
+        "rx_packets",
+        "rx_bytes",
+        "rx_length_errors",
+        "rx_dropped",
+        "rx_alloc_failed",
+        "rx_overruns",
+        "irq_h2c",
+        "irq_c2h",
+        "tx_timestamp_skipped",
+        "hw_tx_packets",
+        "hw_tx_drops",
+        "hw_normal_timeouts",
+        "hw_to_overflow_popped",
+        "hw_to_overflow_timeouts",
+        "sysclock_mmio_reads",
+        "sysclock_cached_reads",
+};
 
-return_error:
-	priv->tstamp_retry[tstamp_id] = 0;
-	clear_bit_unlock(tstamp_id, &priv->state);
-	return;
+static const char xdma_gstrings_queue_stats[][ETH_GSTRING_LEN] = {
+        "packets",
+        "bytes",
+        "busy",
+        "dropped",
+        "stopped",
+};
 
-retry:
-	schedule_work(&priv->tx_work[tstamp_id]);
-	return;
+static const char xdma_gstrings_tc_stats[][ETH_GSTRING_LEN] = {
+        "packets",
+        "rejected",
+};
+
+#define XDMA_STATS_LEN \
+        (ARRAY_SIZE(xdma_gstrings_stats) + \
+         TX_QUEUE_COUNT * ARRAY_SIZE(xdma_gstrings_queue_stats) + \
+         TC_COUNT * ARRAY_SIZE(xdma_gstrings_tc_stats))
+
+int xdma_ethtool_get_sset_count(struct net_device *ndev, int sset)
+{
+        switch (sset) {
+        case ETH_SS_STATS:
+                return XDMA_STATS_LEN;
+        default:
+                return -EOPNOTSUPP;
+        }
 }
 
-#define DEFINE_TX_WORK(n) \
-void xdma_tx_work##n(struct work_struct *work) { \
-        do_tx_work(work, n); \
+void xdma_ethtool_get_strings(struct net_device *ndev, u32 sset, u8 *data)
+{
+        int i, j;
+
+        if (sset != ETH_SS_STATS)
+                return;
+
+        memcpy(data, xdma_gstrings_stats, sizeof(xdma_gstrings_stats));
+        data += sizeof(xdma_gstrings_stats);
+
+        for (i = 0; i < TX_QUEUE_COUNT; i++)
+                for (j = 0; j < ARRAY_SIZE(xdma_gstrings_queue_stats); j++)
+                        ethtool_sprintf(&data, "tx_q%d_%s", i, xdma_gstrings_queue_stats[j]);
+
+        for (i = 0; i < TC_COUNT; i++)
+                for (j = 0; j < ARRAY_SIZE(xdma_gstrings_tc_stats); j++)
+                        ethtool_sprintf(&data, "tc%d_%s", i, xdma_gstrings_tc_stats[j]);
 }
 
-DEFINE_TX_WORK(1);
-DEFINE_TX_WORK(2);
-DEFINE_TX_WORK(3);
-DEFINE_TX_WORK(4);
+void xdma_ethtool_get_stats(struct net_device *ndev, struct ethtool_stats *stats, u64 *data)
+{
+        struct xdma_private *priv = netdev_priv(ndev);
+        struct tsn_config *tsn_config = &priv->xdev->tsn_config;
+        struct xdma_tx_queue_stats tx;
+        struct xdma_rx_stats rx;
+        struct xdma_irq_stats irq;
+        struct xdma_hw_stats hw;
+        unsigned long flags;
+        int i;
+
+        xdma_read_rx_stats(&priv->rx_stats, &rx);
+        *data++ = rx.packets;
+        *data++ = rx.bytes;
+        *data++ = rx.length_errors;
+        *data++ = rx.dropped;
+        *data++ = rx.alloc_failed;
+        *data++ = rx.overruns;
+
+        xdma_read_irq_stats(&priv->irq_stats, &irq);
+        *data++ = irq.h2c;
+        *data++ = irq.c2h;
+
+        spin_lock_irqsave(&priv->tstamp_lock, flags);
+        *data++ = priv->tstamp_skipped;
+        spin_unlock_irqrestore(&priv->tstamp_lock, flags);
+
+        xdma_read_hw_stats(&priv->hw_stats, &hw);
+        *data++ = hw.tx_packets;
+        *data++ = hw.tx_drops;
+        *data++ = hw.normal_timeouts;
+        *data++ = hw.to_overflow_popped;
+        *data++ = hw.to_overflow_timeouts;
+
+        *data++ = atomic64_read(&priv->xdev->sysclock_cache.mmio_reads);
+        *data++ = atomic64_read(&priv->xdev->sysclock_cache.cached_reads);
+
+        for (i = 0; i < TX_QUEUE_COUNT; i++) {
+                xdma_read_tx_queue_stats(&priv->tx_stats[i], &tx);
+                *data++ = tx.packets;
+                *data++ = tx.bytes;
+                *data++ = tx.busy;
+                *data++ = tx.dropped;
+                *data++ = tx.stopped;
+        }
+
+        /* Per-TC counters live in tsn_config, which is protected by tx_lock */
+        spin_lock_irqsave(&priv->tx_lock, flags);
+        for (i = 0; i < TC_COUNT; i++) {
+                *data++ = tsn_config->tc_stats[i].packets;
+                *data++ = tsn_config->tc_stats[i].rejected;
+        }
+        spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
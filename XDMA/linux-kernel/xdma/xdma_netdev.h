@@ -5,9 +5,18 @@
 #include <linux/etherdevice.h>
 #include <linux/skbuff.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ethtool.h>
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/net_tstamp.h>
+#include <linux/version.h>
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+#include <net/page_pool/helpers.h>
+#else
+#include <net/page_pool.h>
+#endif
 
 #include "xdma_mod.h"
 
@@ -26,7 +35,107 @@
 
 #define CRC_LEN 4
 
-#define TX_TSTAMP_MAX_RETRY 5
+/*
+ * Pending TX timestamps
+ * Frames waiting for a hardware TX timestamp are queued per timestamp id
+ * and matched against the timestamp registers by a single hrtimer, which
+ * only runs while something is pending.
+ */
+#define XDMA_TSTAMP_FIFO_SIZE 16
+#define XDMA_TSTAMP_POLL_NS 20000
+
+/*
+ * TX descriptor ring
+ * Every frame takes one descriptor for its metadata, one for the linear
+ * part and one per page fragment. The size must be a power of 2 so that
+ * the free running indices can be masked. tx_ring_size=2 falls back to
+ * one frame in flight per interrupt.
+ */
+#define XDMA_TX_RING_SIZE_DEFAULT 256
+#define XDMA_TX_RING_SIZE_MIN 2
+#define XDMA_TX_RING_SIZE_MAX 1024
+#define XDMA_TX_DESC_PER_FRAME_MAX (MAX_SKB_FRAGS + 2)
+/*
+ * Slots best effort frames can't take, so that a full best effort queue
+ * never blocks gPTP/VLAN frames. Only reserved if the ring is big enough.
+ */
+#define XDMA_TX_RING_TSN_RESERVE(ring) \
+        ((ring)->size >= 4 * (ring)->max_desc ? (ring)->size / 4 : 0)
+
+/* The hardware counters are snapshotted at this interval, see xdma_stats_work() */
+#define XDMA_STATS_INTERVAL (HZ)
+
+/*
+ * Counters below are written under tx_lock (TX), by NAPI (RX) or by the
+ * ISR, so there is a single writer each. Readers go through the u64_stats_sync.
+ */
+struct xdma_tx_queue_stats {
+        u64 packets;
+        u64 bytes;
+        u64 busy;               /* Requeued, rejected by tsn_fill_metadata() */
+        u64 dropped;
+        u64 stopped;
+        struct u64_stats_sync syncp;
+};
+
+struct xdma_rx_stats {
+        u64 packets;
+        u64 bytes;
+        u64 length_errors;
+        u64 dropped;
+        u64 alloc_failed;
+        u64 overruns;           /* rx_cyclic=1, overwritten before received */
+        struct u64_stats_sync syncp;
+};
+
+struct xdma_irq_stats {
+        u64 h2c;
+        u64 c2h;
+        struct u64_stats_sync syncp;
+};
+
+struct xdma_hw_stats {
+        u64 tx_packets;
+        u64 tx_drops;
+        u64 normal_timeouts;
+        u64 to_overflow_popped;
+        u64 to_overflow_timeouts;
+        struct u64_stats_sync syncp;
+};
+
+struct xdma_tstamp_entry {
+        struct sk_buff *skb;
+        sysclock_t start_after;         /* Not sent before this */
+        sysclock_t wait_until;          /* Sent or dropped by this */
+};
+
+struct xdma_tstamp_fifo {
+        struct xdma_tstamp_entry entries[XDMA_TSTAMP_FIFO_SIZE];
+        u32 head;
+        u32 tail;
+        sysclock_t last_tstamp;
+};
+
+/*
+ * RX descriptor ring
+ * Consumed slots are re-armed in batches of XDMA_RX_REFILL_BATCH
+ * and handed to the C2H engine whenever it is idle.
+ */
+#define XDMA_RX_RING_SIZE_DEFAULT 256
+#define XDMA_RX_RING_SIZE_MAX 1024
+#define XDMA_RX_REFILL_BATCH 16
+#define XDMA_NAPI_WEIGHT 64
+
+/*
+ * Every RX buffer is one page from the page pool. The engine writes
+ * rx_metadata and the frame behind XDMA_RX_HEADROOM and the skb is
+ * built around the page, so skb_shared_info goes at the end of the page.
+ */
+#define XDMA_RX_HEADROOM NET_SKB_PAD
+#define XDMA_RX_TRUESIZE PAGE_SIZE
+
+/* Upper 16 bits of xdma_result.status once the C2H engine wrote it back */
+#define XDMA_RX_RESULT_MAGIC_SHIFT 16
 
 /**
  * This value is estimated by experiment.
@@ -37,11 +146,58 @@
  */
 #define TX_TSTAMP_UPDATE_THRESHOLD 0xFFFFF
 
-enum xdma_state_t {
-        XDMA_TX1_IN_PROGRESS = 1,
-        XDMA_TX2_IN_PROGRESS = 2,
-        XDMA_TX3_IN_PROGRESS = 3,
-        XDMA_TX4_IN_PROGRESS = 4,
+
+enum xdma_tx_slot_type {
+        XDMA_TX_SLOT_METADATA = 0,
+        XDMA_TX_SLOT_SINGLE,
+        XDMA_TX_SLOT_PAGE,
+};
+
+struct xdma_tx_slot {
+        struct sk_buff *skb;    /* Only on the last descriptor of a frame */
+        dma_addr_t dma_addr;
+        u32 len;
+        u8 type;
+};
+
+/*
+ * Descriptors are linked in a circle once at allocation time.
+ * [tail, hw_head) is owned by the engine, [hw_head, head) is filled
+ * but waits for the running chain to complete.
+ * meta[i] is the tx_metadata of the frame starting at descriptor i.
+ */
+struct xdma_tx_ring {
+        struct xdma_desc *desc;
+        dma_addr_t desc_bus;
+        struct tx_metadata *meta;
+        dma_addr_t meta_bus;
+        struct xdma_tx_slot *slots;
+        u32 size;
+        u32 max_desc;
+        u32 head;
+        u32 hw_head;
+        u32 tail;
+        bool busy;
+};
+
+/*
+ * All descriptors are linked in a circle and every descriptor has its
+ * own writeback result. [tail, hw_tail) is owned by the engine,
+ * [hw_tail, refill) is re-armed and waits for the next chain,
+ * [refill, tail + size) is consumed and waits to be re-armed.
+ */
+struct xdma_rx_ring {
+        struct xdma_desc *desc;
+        dma_addr_t desc_bus;
+        struct xdma_result *res;
+        dma_addr_t res_bus;
+        struct page_pool *page_pool;
+        struct page **pages;
+        u32 size;
+        u32 tail;
+        u32 hw_tail;
+        u32 refill;
+        bool busy;
 };
 
 struct xdma_private {
@@ -51,41 +207,33 @@ struct xdma_private {
 
         struct xdma_engine *tx_engine;
         struct xdma_engine *rx_engine;
-        struct xdma_desc *rx_desc;
-        struct xdma_desc *tx_desc;
-
-        struct xdma_result *res;
-
-        dma_addr_t tx_bus_addr;
-        dma_addr_t tx_dma_addr;
-        dma_addr_t rx_bus_addr;
-        dma_addr_t rx_dma_addr;
-        dma_addr_t res_bus_addr;
-        dma_addr_t res_dma_addr;
+        struct xdma_tx_ring tx_ring;
+        struct xdma_rx_ring rx_ring;
+        /* rx_cyclic=1: allocated instead of rx_ring, see xdma_netdev_poll_cyclic() */
+        struct xdma_cyclic_ring rx_cyclic;
+        struct napi_struct napi;
 
-        struct sk_buff *rx_skb;
-        struct sk_buff *tx_skb;
-        u8 *rx_buffer;
         spinlock_t tx_lock;
-        spinlock_t rx_lock;
         int irq;
-        int rx_count;
 
-        struct work_struct tx_work[TSN_TIMESTAMP_ID_MAX];
-        struct sk_buff *tx_work_skb[TSN_TIMESTAMP_ID_MAX];
-        sysclock_t tx_work_start_after[TSN_TIMESTAMP_ID_MAX];
-        sysclock_t tx_work_wait_until[TSN_TIMESTAMP_ID_MAX];
+        struct xdma_tstamp_fifo tstamp_fifo[TSN_TIMESTAMP_ID_MAX];
+        spinlock_t tstamp_lock;
+        struct hrtimer tstamp_timer;
+        u32 tstamp_count;               /* REG_TX_TIMESTAMP_COUNT at the last poll */
+        u64 tstamp_skipped;
         struct hwtstamp_config tstamp_config;
-        sysclock_t last_tx_tstamp[TSN_TIMESTAMP_ID_MAX];
-        int tstamp_retry[TSN_TIMESTAMP_ID_MAX];
+
+        struct xdma_tx_queue_stats tx_stats[TX_QUEUE_COUNT];
+        struct xdma_rx_stats rx_stats;
+        struct xdma_irq_stats irq_stats;
+        struct xdma_hw_stats hw_stats;
+        struct delayed_work stats_work;
 
         uint64_t total_tx_count;
         uint64_t total_tx_drop_count;
         uint64_t last_normal_timeout;
         uint64_t last_to_overflow_popped;
         uint64_t last_to_overflow_timeout;
-
-        unsigned long state;
 };
 
 #define _DEFAULT_FROM_MARGIN_ (500)
@@ -126,7 +274,47 @@ struct rx_buffer {
 #define RX_METADATA_SIZE (sizeof(struct rx_metadata))
 #define TX_METADATA_SIZE (sizeof(struct tx_metadata))
 
-void rx_desc_set(struct xdma_desc *desc, dma_addr_t addr, u32 len);
+/*
+ * xdma_rx_ring_alloc - Allocate the RX descriptor ring and its page pool,
+ * or the cyclic ring with rx_cyclic=1
+ * @priv: Pointer to the private data of the network device
+ */
+int xdma_rx_ring_alloc(struct xdma_private *priv);
+
+/*
+ * xdma_rx_ring_free - Release the RX descriptor ring and its page pool
+ * @priv: Pointer to the private data of the network device
+ */
+void xdma_rx_ring_free(struct xdma_private *priv);
+
+/*
+ * xdma_netdev_poll - NAPI poll handler
+ * Receives up to @budget frames. The C2H interrupt stays masked
+ * until the ring is drained.
+ * @napi: NAPI context of the network device
+ * @budget: Maximum number of frames to receive
+ */
+int xdma_netdev_poll(struct napi_struct *napi, int budget);
+
+/*
+ * xdma_tx_ring_alloc - Allocate and link the TX descriptor ring
+ * @priv: Pointer to the private data of the network device
+ */
+int xdma_tx_ring_alloc(struct xdma_private *priv);
+
+/*
+ * xdma_tx_ring_free - Release the TX descriptor ring and pending frames
+ * @priv: Pointer to the private data of the network device
+ */
+void xdma_tx_ring_free(struct xdma_private *priv);
+
+/*
+ * xdma_tx_ring_clean - Reclaim completed TX descriptors
+ * Called from the H2C interrupt. Frees sent frames, hands the pending
+ * descriptors to the engine and wakes the queue when there is room.
+ * @priv: Pointer to the private data of the network device
+ */
+void xdma_tx_ring_clean(struct xdma_private *priv);
 
 /*
  * xdma_tx_handler - Transmit packet
@@ -161,6 +349,16 @@ int xdma_netdev_close(struct net_device *netdev);
 netdev_tx_t xdma_netdev_start_xmit(struct sk_buff *skb,
                                    struct net_device *netdev);
 
+/*
+ * xdma_netdev_select_queue - Tx queue selection
+ * Each TX queue maps to one hardware queue priority (see enum tsn_tx_queue)
+ * @netdev: Pointer to the network device
+ * @skb: Pointer to the socket buffer
+ * @sb_dev: Subordinate device, unused
+ */
+u16 xdma_netdev_select_queue(struct net_device *netdev, struct sk_buff *skb,
+                             struct net_device *sb_dev);
+
 /*
  * xdma_netdev_setup_tc - TC config handler
  * @dev: Pointer to the network device
@@ -171,9 +369,21 @@ int xdma_netdev_setup_tc(struct net_device *ndev, enum tc_setup_type type, void
 
 int xdma_netdev_ioctl(struct net_device *ndev, struct ifreq *ifr, int cmd);
 
-void xdma_tx_work1(struct work_struct *work);
-void xdma_tx_work2(struct work_struct *work);
-void xdma_tx_work3(struct work_struct *work);
-void xdma_tx_work4(struct work_struct *work);
+/*
+ * xdma_netdev_get_stats64 - Software counters plus the last hardware snapshot
+ * @netdev: Pointer to the network device
+ * @stats: Output statistics
+ */
+void xdma_netdev_get_stats64(struct net_device *netdev, struct rtnl_link_stats64 *stats);
+
+void xdma_stats_init(struct xdma_private *priv);
+void xdma_stats_work(struct work_struct *work);
+
+int xdma_ethtool_get_sset_count(struct net_device *ndev, int sset);
+void xdma_ethtool_get_strings(struct net_device *ndev, u32 sset, u8 *data);
+void xdma_ethtool_get_stats(struct net_device *ndev, struct ethtool_stats *stats, u64 *data);
+
+enum hrtimer_restart xdma_tstamp_poll(struct hrtimer *timer);
+void xdma_tstamp_flush(struct xdma_private *priv);
 
 #endif
@@ -23,6 +23,10 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/irq.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/topology.h>
 
 
 /* ********************* global variables *********************************** */
@@ -31,6 +35,17 @@ static unsigned int thread_cnt;
 
 
 /* ********************* static function definitions ************************ */
+/* Lock a thread that is not walking its work list */
+static void lock_thread_idle(struct xdma_kthread *thp)
+{
+	lock_thread(thp);
+	while (thp->processing) {
+		unlock_thread(thp);
+		wait_event(thp->idle_waitq, !READ_ONCE(thp->processing));
+		lock_thread(thp);
+	}
+}
+
 static int xdma_thread_cmpl_status_pend(struct list_head *work_item)
 {
 	struct xdma_engine *engine = list_entry(work_item, struct xdma_engine,
@@ -48,14 +63,9 @@ static int xdma_thread_cmpl_status_pend(struct list_head *work_item)
 static int xdma_thread_cmpl_status_proc(struct list_head *work_item)
 {
 	struct xdma_engine *engine;
-	struct xdma_transfer * transfer;
 
 	engine = list_entry(work_item, struct xdma_engine, cmplthp_list);
-	transfer = list_entry(engine->transfer_list.next, struct xdma_transfer,
-			entry);
-	if (transfer)
-		engine_service_poll(engine, transfer->desc_cmpl_th);
-	return 0;
+	return engine_service_drain(engine);
 }
 
 static inline int xthread_work_pending(struct xdma_kthread *thp)
@@ -111,16 +121,30 @@ static int xthread_main(void *data)
 			unlock_thread(thp);
 			xthread_reschedule(thp);
 			lock_thread(thp);
+			thp->wakeups++;
 		}
 		thp->schedule = 0;
 
 		if (thp->work_cnt) {
+			u64 start = ktime_get_ns();
+
 			pr_debug_thread("%s processing %u work items\n",
 					thp->name, thp->work_cnt);
-			/* do work */
+			/*
+			 * do work, without the lock so that the work list
+			 * changes only wait for the end of the walk
+			 */
+			thp->processing = 1;
+			unlock_thread(thp);
 			list_for_each_safe(work_item, next, &thp->work_list) {
-				thp->fproc(work_item);
+				if (thp->fproc(work_item) > 0)
+					thp->services++;
 			}
+			thp->busy_ns += ktime_get_ns() - start;
+			thp->passes++;
+			lock_thread(thp);
+			thp->processing = 0;
+			wake_up(&thp->idle_waitq);
 		}
 		unlock_thread(thp);
 		schedule();
@@ -157,6 +181,8 @@ int xdma_kthread_start(struct xdma_kthread *thp, char *name, int id)
 	spin_lock_init(&thp->lock);
 	INIT_LIST_HEAD(&thp->work_list);
 	init_waitqueue_head(&thp->waitq);
+	init_waitqueue_head(&thp->idle_waitq);
+	thp->start_ns = ktime_get_ns();
 
 	node = cpu_to_node(thp->cpu);
 	pr_debug("node : %d\n", node);
@@ -227,56 +253,99 @@ void xdma_thread_remove_work(struct xdma_engine *engine)
 #endif
 
 	if (cmpl_thread) {
-		lock_thread(cmpl_thread);
+		lock_thread_idle(cmpl_thread);
 		list_del(&engine->cmplthp_list);
 		cmpl_thread->work_cnt--;
 		unlock_thread(cmpl_thread);
 	}
 }
 
+/*
+ * Placement rank of a thread for an engine, lower is better: on a cpu the
+ * engine interrupt is routed to, on the numa node of the device, elsewhere.
+ */
+static int xdma_thread_rank(struct xdma_kthread *thp,
+			    const struct cpumask *irq_mask, int node)
+{
+	if (irq_mask && cpumask_test_cpu(thp->cpu, irq_mask))
+		return 0;
+	if (node == NUMA_NO_NODE || cpu_to_node(thp->cpu) == node)
+		return 1;
+	return 2;
+}
+
+static const struct cpumask *engine_irq_affinity(struct xdma_engine *engine)
+{
+#if KERNEL_VERSION(4, 3, 0) <= LINUX_VERSION_CODE
+	const struct cpumask *mask;
+
+	if (!engine->msix_irq_line)
+		return NULL;
+	mask = irq_get_affinity_mask(engine->msix_irq_line);
+	/* Not set, or the default of all cpus, says nothing */
+	if (!mask || cpumask_subset(cpu_online_mask, mask))
+		return NULL;
+	return mask;
+#else
+	return NULL;
+#endif
+}
+
 void xdma_thread_add_work(struct xdma_engine *engine)
 {
 	struct xdma_kthread *thp = cs_threads;
+	const struct cpumask *irq_mask = engine_irq_affinity(engine);
+	int node = dev_to_node(&engine->xdev->pdev->dev);
 	unsigned int v = 0;
-	int i, idx = thread_cnt;
+	int i, idx = thread_cnt, rank = 3;
 	unsigned long flags;
 
-
-	/* Polled mode only */
+	/* Polled mode only, the least loaded thread of the best rank */
 	for (i = 0; i < thread_cnt; i++, thp++) {
+		int r = xdma_thread_rank(thp, irq_mask, node);
+
 		lock_thread(thp);
-		if (idx == thread_cnt) {
+		if (r < rank || (r == rank && thp->work_cnt < v)) {
+			rank = r;
 			v = thp->work_cnt;
 			idx = i;
-		} else if (!thp->work_cnt) {
-			idx = i;
-			unlock_thread(thp);
-			break;
-		} else if (thp->work_cnt < v)
-			idx = i;
+		}
 		unlock_thread(thp);
 	}
 
+	if (idx == thread_cnt) {
+		pr_err("%s no cmpl status thread.\n", engine->name);
+		return;
+	}
+
 	thp = cs_threads + idx;
-	lock_thread(thp);
+	lock_thread_idle(thp);
 	list_add_tail(&engine->cmplthp_list, &thp->work_list);
-	engine->intr_work_cpu = idx;
+	engine->intr_work_cpu = thp->cpu;
 	thp->work_cnt++;
 	unlock_thread(thp);
 
-	pr_info("%s 0x%p assigned to cmpl status thread %s,%u.\n",
-		engine->name, engine, thp->name, thp->work_cnt);
-
+	pr_info("%s 0x%p assigned to cmpl status thread %s, cpu %u, rank %d, %u.\n",
+		engine->name, engine, thp->name, thp->cpu, rank, thp->work_cnt);
 
 	spin_lock_irqsave(&engine->lock, flags);
 	engine->cmplthp = thp;
 	spin_unlock_irqrestore(&engine->lock, flags);
 }
 
-int xdma_threads_create(unsigned int num_threads)
+static int xdma_thread_start_on(struct xdma_kthread *thp, int cpu)
+{
+	thp->cpu = cpu;
+	thp->timeout = 0;
+	thp->fproc = xdma_thread_cmpl_status_proc;
+	thp->fpending = xdma_thread_cmpl_status_pend;
+	return xdma_kthread_start(thp, "cmpl_status_th", thread_cnt);
+}
+
+int xdma_threads_create(unsigned int num_threads, int node)
 {
 	struct xdma_kthread *thp;
-	int rv;
+	int rv = 0;
 	int cpu;
 
 	if (thread_cnt) {
@@ -284,6 +353,7 @@ int xdma_threads_create(unsigned int num_threads)
 		return 0;
 	}
 
+	num_threads = min(num_threads, num_online_cpus());
 	cs_threads = kzalloc(num_threads * sizeof(struct xdma_kthread),
 					GFP_KERNEL);
 	if (!cs_threads) {
@@ -291,34 +361,67 @@ int xdma_threads_create(unsigned int num_threads)
 		return -ENOMEM;
 	}
 
-	/* N dma writeback monitoring threads */
+	/* N dma writeback monitoring threads, on the device node first */
 	thp = cs_threads;
+	if (node != NUMA_NO_NODE) {
+		for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask) {
+			if (thread_cnt == num_threads)
+				break;
+			pr_debug("index %d cpu %d node %d\n", thread_cnt, cpu,
+				 node);
+			rv = xdma_thread_start_on(thp, cpu);
+			if (rv < 0)
+				goto cleanup_threads;
+			thread_cnt++;
+			thp++;
+		}
+	}
+
 	for_each_online_cpu(cpu) {
+		if (thread_cnt == num_threads)
+			break;
+		if (node != NUMA_NO_NODE && cpu_to_node(cpu) == node)
+			continue;
 		pr_debug("index %d cpu %d online\n", thread_cnt, cpu);
-		thp->cpu = cpu;
-		thp->timeout = 0;
-		thp->fproc = xdma_thread_cmpl_status_proc;
-		thp->fpending = xdma_thread_cmpl_status_pend;
-		rv = xdma_kthread_start(thp, "cmpl_status_th", thread_cnt);
+		rv = xdma_thread_start_on(thp, cpu);
 		if (rv < 0)
 			goto cleanup_threads;
-
 		thread_cnt++;
-		if (thread_cnt == num_threads)
-			break;
 		thp++;
 	}
 
 	return 0;
 
 cleanup_threads:
+	for (thp = cs_threads; thread_cnt; thread_cnt--, thp++)
+		xdma_kthread_stop(thp);
 	kfree(cs_threads);
 	cs_threads = NULL;
-	thread_cnt = 0;
 
 	return rv;
 }
 
+ssize_t xdma_threads_show(char *buf, size_t size)
+{
+	struct xdma_kthread *thp = cs_threads;
+	u64 now = ktime_get_ns();
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < thread_cnt && len < size; i++, thp++) {
+		u64 uptime = max_t(u64, now - thp->start_ns, 1);
+
+		len += scnprintf(buf + len, size - len,
+			"%s cpu %u node %d engines %u wakeups %llu passes %llu services %llu busy_pct %llu\n",
+			thp->name, thp->cpu, cpu_to_node(thp->cpu),
+			thp->work_cnt, thp->wakeups, thp->passes,
+			thp->services,
+			div64_u64(thp->busy_ns * 100, uptime));
+	}
+
+	return len;
+}
+
 void xdma_threads_destroy(void)
 {
 	int i;
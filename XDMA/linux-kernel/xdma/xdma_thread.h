@@ -106,14 +106,34 @@ struct xdma_kthread {
 	int (*fproc)(struct list_head *);
 	/**  thread done handler */
 	int (*fdone)(struct xdma_kthread *);
+	/**  set while the work list is walked without the lock */
+	unsigned int processing;
+	/**  work list changes wait here for the walk to end */
+	wait_queue_head_t idle_waitq;
+	/**  thread start time, ns */
+	u64 start_ns;
+	/**  wakeups from an idle wait */
+	u64 wakeups;
+	/**  walks of the work list */
+	u64 passes;
+	/**  engines serviced */
+	u64 services;
+	/**  time spent walking the work list, ns */
+	u64 busy_ns;
 };
 
 
 /*****************************************************************************/
 /**
- * xdma_threads_create() - create xdma threads
-*********/
-int xdma_threads_create(unsigned int num_threads);
+ * xdma_threads_create() - create xdma threads, on the cpus of a numa node
+ *                         first
+ *
+ * @param[in]	num_threads:	number of threads
+ * @param[in]	node:		numa node of the device, NUMA_NO_NODE for any
+ *
+ * @return	0 on success, < 0 on failure
+ *****************************************************************************/
+int xdma_threads_create(unsigned int num_threads, int node);
 
 /*****************************************************************************/
 /**
@@ -144,4 +164,15 @@ void xdma_thread_remove_work(struct xdma_engine *engine);
  *****************************************************************************/
 void xdma_thread_add_work(struct xdma_engine *engine);
 
+/*****************************************************************************/
+/**
+ * xdma_threads_show() - print the placement and load of the threads
+ *
+ * @param[out]	buf:	output buffer
+ * @param[in]	size:	size of buf
+ *
+ * @return	number of bytes written
+ *****************************************************************************/
+ssize_t xdma_threads_show(char *buf, size_t size);
+
 #endif /* #ifndef __XDMA_KTHREAD_H__ */